@@ -29,13 +29,16 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
+#include <sys/timerfd.h>
 
 #include "tapdisk.h"
 #include "tapdisk-utils.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-server.h"
 #include "tapdisk-interface.h"
+#include "tapdisk-shmcache.h"
 
 #ifdef DEBUG
 #define DBG(_f, _a...) tlog_write(TLOG_DBG, _f, ##_a)
@@ -45,488 +48,325 @@
 
 #define WARN(_f, _a...) tlog_write(TLOG_WARN, _f, ##_a)
 
-#define RADIX_TREE_PAGE_SHIFT           12 /* 4K pages */
-#define RADIX_TREE_PAGE_SIZE            (1 << RADIX_TREE_PAGE_SHIFT)
-
-#define RADIX_TREE_NODE_SHIFT           9 /* 512B nodes */
-#define RADIX_TREE_NODE_SIZE            (1 << RADIX_TREE_NODE_SHIFT)
-#define RADIX_TREE_NODE_MASK            (RADIX_TREE_NODE_SIZE - 1)
-
-#define BLOCK_CACHE_NODES_PER_PAGE      (1 << (RADIX_TREE_PAGE_SHIFT - RADIX_TREE_NODE_SHIFT))
-
-#define BLOCK_CACHE_MAX_SIZE            (10 << 20) /* 100MB cache */
-#define BLOCK_CACHE_REQUESTS            (TAPDISK_DATA_REQUESTS << 3)
-#define BLOCK_CACHE_PAGE_IDLETIME       60
-
-typedef struct radix_tree               radix_tree_t;
-typedef struct radix_tree_node          radix_tree_node_t;
-typedef struct radix_tree_link          radix_tree_link_t;
-typedef struct radix_tree_leaf          radix_tree_leaf_t;
-typedef struct radix_tree_page          radix_tree_page_t;
+#define BLOCK_CACHE_BLOCK_SECS          (TD_SHMCACHE_BLOCK_SIZE >> SECTOR_SHIFT)
+#define BLOCK_CACHE_MAX_BLOCKS          (MAX_SEGMENTS_PER_REQ + 1)
+#define BLOCK_CACHE_REQUESTS            TAPDISK_DATA_REQUESTS
+#define BLOCK_CACHE_WAIT_NSEC           500000 /* poll fills every 0.5ms */
 
 typedef struct block_cache              block_cache_t;
 typedef struct block_cache_request      block_cache_request_t;
 typedef struct block_cache_stats        block_cache_stats_t;
 
-struct radix_tree_page {
-	char                           *buf;
-	size_t                          size;
-	uint64_t                        sec;
-	radix_tree_link_t              *owners[BLOCK_CACHE_NODES_PER_PAGE];
-};
-
-struct radix_tree_leaf {
-	radix_tree_page_t              *page;
-	char                           *buf;
-};
-
-struct radix_tree_link {
-	uint32_t                        time;
-	union {
-		radix_tree_node_t      *next;
-		radix_tree_leaf_t       leaf;
-	} u;
-};
-
-struct radix_tree_node {
-	int                             height;
-	radix_tree_link_t               links[RADIX_TREE_NODE_SIZE];
-};
-
-struct radix_tree {
-	int                             height;
-	uint64_t                        size;
-	uint32_t                        nodes;
-	radix_tree_node_t              *root;
-
-	block_cache_t                  *cache;
-};
-
+/*
+ * A read covers up to BLOCK_CACHE_MAX_BLOCKS cache blocks; each of the
+ * masks below has one bit per block, starting at @first.
+ */
 struct block_cache_request {
 	int                             err;
 	char                           *buf;
-	uint64_t                        secs;
+	uint64_t                        first;
+	int                             blocks;
+	int                             pending;
+	uint32_t                        fill;     /* reserved by us */
+	uint32_t                        wait;     /* filled by others */
+	uint32_t                        read;     /* to read from storage */
 	td_request_t                    treq;
 	block_cache_t                  *cache;
+	struct list_head                next;
 };
 
+/* this process' share of the traffic, in blocks */
 struct block_cache_stats {
 	uint64_t                        reads;
 	uint64_t                        hits;
 	uint64_t                        misses;
-	uint64_t                        prunes;
+	uint64_t                        waits;
+	uint64_t                        bypasses;
 };
 
 struct block_cache {
-	int                             ptype;
 	char                           *name;
 
 	uint64_t                        sectors;
 
+	td_shmcache_t                   shm;
+	td_shmcache_key_t               key;
+
 	block_cache_request_t           requests[BLOCK_CACHE_REQUESTS];
 	block_cache_request_t          *request_free_list[BLOCK_CACHE_REQUESTS];
 	int                             requests_free;
 
-	event_id_t                      timeout_id;
-
-	radix_tree_t                    tree;
+	struct list_head                waiting;
+	int                             timer_fd;
+	int                             timer_armed;
+	event_id_t                      timer_id;
 
 	block_cache_stats_t             stats;
 };
 
-static inline uint64_t
-radix_tree_calculate_size(int height)
-{
-	return (uint64_t)RADIX_TREE_NODE_SIZE <<
-	  (height * RADIX_TREE_NODE_SHIFT);
-}
-
-static inline int
-radix_tree_calculate_height(uint64_t sectors)
-{
-	int height;
-	uint64_t tree_size;
-
-	height = 1;  /* always allocate root node */
-	tree_size = radix_tree_calculate_size(height);
-	while (sectors > tree_size)
-		tree_size = radix_tree_calculate_size(++height);
-
-	return height;
-}
-
-static inline int
-radix_tree_index(radix_tree_node_t *node, uint64_t sector)
-{
-	return ((sector >> (node->height * RADIX_TREE_NODE_SHIFT)) &
-		RADIX_TREE_NODE_MASK);
-}
-
-static inline int
-radix_tree_node_contains_leaves(radix_tree_t *tree, radix_tree_node_t *node)
-{
-	return (node->height == 0);
-}
+static void block_cache_issue(block_cache_request_t *);
 
-static inline int
-radix_tree_node_is_root(radix_tree_t *tree, radix_tree_node_t *node)
+static inline block_cache_request_t *
+block_cache_get_request(block_cache_t *cache)
 {
-	return (node->height == tree->height);
-}
+	if (!cache->requests_free)
+		return NULL;
 
-static inline uint64_t
-radix_tree_size(radix_tree_t *tree)
-{
-	return tree->size + tree->nodes * sizeof(radix_tree_node_t);
+	return cache->request_free_list[--cache->requests_free];
 }
 
 static inline void
-radix_tree_clear_link(radix_tree_link_t *link)
+block_cache_put_request(block_cache_t *cache, block_cache_request_t *breq)
 {
-	if (link)
-		memset(link, 0, sizeof(radix_tree_link_t));
+	free(breq->buf);
+	memset(breq, 0, sizeof(block_cache_request_t));
+	INIT_LIST_HEAD(&breq->next);
+	cache->request_free_list[cache->requests_free++] = breq;
 }
 
-static inline radix_tree_node_t *
-radix_tree_allocate_node(radix_tree_t *tree, int height)
+static void
+block_cache_arm_timer(block_cache_t *cache, int arm)
 {
-	radix_tree_node_t *node;
+	struct itimerspec its;
 
-	node = calloc(1, sizeof(radix_tree_node_t));
-	if (!node)
-		return NULL;
+	if (cache->timer_armed == arm)
+		return;
 
-	node->height = height;
-	tree->nodes++;
+	memset(&its, 0, sizeof(its));
+	if (arm) {
+		its.it_value.tv_nsec    = BLOCK_CACHE_WAIT_NSEC;
+		its.it_interval.tv_nsec = BLOCK_CACHE_WAIT_NSEC;
+	}
 
-	return node;
+	if (!timerfd_settime(cache->timer_fd, 0, &its, NULL))
+		cache->timer_armed = arm;
 }
 
-static inline radix_tree_node_t *
-radix_tree_allocate_child_node(radix_tree_t *tree, radix_tree_node_t *parent)
+static inline char *
+block_cache_block_buf(block_cache_request_t *breq, int i)
 {
-	return radix_tree_allocate_node(tree, parent->height - 1);
+	return breq->buf + (i << TD_SHMCACHE_BLOCK_SHIFT);
 }
 
-void
-radix_tree_free_node(radix_tree_t *tree, radix_tree_node_t *node)
+static void
+block_cache_lookup(block_cache_request_t *breq, int i, int retry)
 {
-	if (!node)
+	int err;
+	uint32_t bit;
+	block_cache_t *cache;
+	td_shmcache_key_t key;
+
+	cache     = breq->cache;
+	bit       = 1U << i;
+	key       = cache->key;
+	key.block = breq->first + i;
+
+	err = tapdisk_shmcache_lookup(&cache->shm, &key,
+				      block_cache_block_buf(breq, i), retry);
+	switch (err) {
+	case 0:
+		if (!retry)
+			cache->stats.hits++;
+		break;
+	case -ENOENT:
+		breq->fill |= bit;
+		breq->read |= bit;
+		cache->stats.misses++;
+		return;
+	case -EINPROGRESS:
+		if (!retry)
+			cache->stats.waits++;
+		breq->wait |= bit;
 		return;
+	default:
+		breq->read |= bit;
+		cache->stats.bypasses++;
+		return;
+	}
 
-	free(node);
-	tree->nodes--;
+	DBG("%s: block cache hit: block 0x%08llx\n", cache->name, key.block);
 }
 
-static inline radix_tree_page_t *
-radix_tree_allocate_page(radix_tree_t *tree,
-			 char *buf, uint64_t sec, size_t size)
+static void
+block_cache_finish(block_cache_request_t *breq)
 {
-	radix_tree_page_t *page;
-
-	page = calloc(1, sizeof(radix_tree_page_t));
-	if (!page)
-		return NULL;
-
-	page->buf   = buf;
-	page->sec   = sec;
-	page->size  = size;
-	tree->size += size;
-
-	return page;
-}
+	block_cache_t *cache;
+	td_request_t treq;
+	off_t off;
 
-static inline void
-radix_tree_free_page(radix_tree_t *tree, radix_tree_page_t *page)
-{
-	int i;
+	cache = breq->cache;
+	treq  = breq->treq;
 
-	for (i = 0; i < page->size >> RADIX_TREE_NODE_SHIFT; i++)
-		DBG("%s: ejecting sector 0x%llx\n",
-		    tree->cache->name, page->sec + i);
+	if (!breq->err) {
+		off = (treq.sec - breq->first * BLOCK_CACHE_BLOCK_SECS) <<
+			SECTOR_SHIFT;
+		memcpy(treq.buf, breq->buf + off, treq.secs << SECTOR_SHIFT);
+	}
 
-	tree->cache->stats.prunes += (page->size >> RADIX_TREE_NODE_SHIFT);
-	tree->size -= page->size;
-	free(page->buf);
-	free(page);
+	td_complete_request(treq, breq->err);
+	block_cache_put_request(cache, breq);
 }
 
 /*
- * remove a leaf and the shared radix_tree_page_t containing its buffer.
- * leaves are deleted, nodes are not; gc will reap the nodes later.
+ * all reads of @breq have completed: publish the blocks we reserved,
+ * then either wait for blocks other processes are reading or finish.
  */
 static void
-radix_tree_remove_page(radix_tree_t *tree, radix_tree_page_t *page)
-{
-	int i;
-
-	if (!page)
-		return;
-
-	for (i = 0; i < BLOCK_CACHE_NODES_PER_PAGE; i++)
-		radix_tree_clear_link(page->owners[i]);
-
-	radix_tree_free_page(tree, page);
-}
-
-static void
-radix_tree_insert_leaf(radix_tree_t *tree, radix_tree_link_t *link,
-		       radix_tree_page_t *page, off_t off)
+block_cache_resolve(block_cache_request_t *breq)
 {
 	int i;
+	block_cache_t *cache;
+	td_shmcache_key_t key;
 
-	if (off + RADIX_TREE_NODE_SIZE > page->size)
-		return;
+	cache = breq->cache;
+	key   = cache->key;
 
-	for (i = 0; i < BLOCK_CACHE_NODES_PER_PAGE; i++) {
-		if (page->owners[i])
+	for (i = 0; i < breq->blocks; i++) {
+		if (!(breq->fill & (1U << i)))
 			continue;
 
-		page->owners[i]   = link;
-		link->u.leaf.page = page;
-		link->u.leaf.buf  = page->buf + off;
-
-		break;
+		key.block = breq->first + i;
+		if (breq->err)
+			tapdisk_shmcache_abort(&cache->shm, &key);
+		else
+			tapdisk_shmcache_fill(&cache->shm, &key,
+					      block_cache_block_buf(breq, i));
 	}
-}
-
-static char *
-radix_tree_find_leaf(radix_tree_t *tree, uint64_t sector)
-{
-	int idx;
-	struct timeval now;
-	radix_tree_link_t *link;
-	radix_tree_node_t *node;
-
-	node = tree->root;
-	gettimeofday(&now, NULL);
-
-	do {
-		idx        = radix_tree_index(node, sector);
-		link       = node->links + idx;
-		link->time = now.tv_sec;
-
-		if (radix_tree_node_contains_leaves(tree, node))
-			return link->u.leaf.buf;
+	breq->fill = 0;
 
-		if (!link->u.next)
-			return NULL;
+	if (breq->wait && !breq->err) {
+		list_add_tail(&breq->next, &cache->waiting);
+		block_cache_arm_timer(cache, 1);
+		return;
+	}
 
-		node = link->u.next;
-	} while (1);
+	block_cache_finish(breq);
 }
 
-static char *
-radix_tree_add_leaf(radix_tree_t *tree, uint64_t sector,
-		    radix_tree_page_t *page, off_t off)
+static void
+block_cache_put_pending(block_cache_request_t *breq)
 {
-	int idx;
-	struct timeval now;
-	radix_tree_link_t *link;
-	radix_tree_node_t *node;
-
-	node = tree->root;
-	gettimeofday(&now, NULL);
-
-	do {
-		idx        = radix_tree_index(node, sector);
-		link       = node->links + idx;
-		link->time = now.tv_sec;
-
-		if (radix_tree_node_contains_leaves(tree, node)) {
-			radix_tree_remove_page(tree, link->u.leaf.page);
-			radix_tree_insert_leaf(tree, link, page, off);
-			return link->u.leaf.buf;
-		}
-
-		if (!link->u.next) {
-			link->u.next = radix_tree_allocate_child_node(tree,
-								      node);
-			if (!link->u.next)
-				return NULL;
-		}
+	if (--breq->pending)
+		return;
 
-		node = link->u.next;
-	} while (1);
+	block_cache_resolve(breq);
 }
 
-static int
-radix_tree_add_leaves(radix_tree_t *tree, char *buf,
-		      uint64_t sector, uint64_t sectors)
+static void
+block_cache_complete_read(td_request_t clone, int err)
 {
-	int i;
-	radix_tree_page_t *page;
-
-	page = radix_tree_allocate_page(tree, buf, sector,
-					sectors << RADIX_TREE_NODE_SHIFT);
-	if (!page)
-		return -ENOMEM;
+	block_cache_request_t *breq;
 
-	for (i = 0; i < sectors; i++)
-		if (!radix_tree_add_leaf(tree, sector + i, 
-					 page, (i << RADIX_TREE_NODE_SHIFT)))
-			goto fail;
+	breq      = (block_cache_request_t *)clone.cb_data;
+	breq->err = (breq->err ? breq->err : err);
 
-	return 0;
-
-fail:
-	page->buf = NULL;
-	radix_tree_remove_page(tree, page);
-	return -ENOMEM;
+	block_cache_put_pending(breq);
 }
 
 static void
-radix_tree_delete_branch(radix_tree_t *tree, radix_tree_node_t *node)
+block_cache_issue(block_cache_request_t *breq)
 {
-	int i;
-	radix_tree_link_t *link;
+	int i, n;
+	td_request_t clone;
 
-	if (!node)
-		return;
+	/* hold a reference, in case a read completes right away */
+	breq->pending++;
 
-	for (i = 0; i < RADIX_TREE_NODE_SIZE; i++) {
-		link = node->links + i;
+	for (i = 0; i < breq->blocks; i += n) {
+		for (n = 0; i + n < breq->blocks; n++)
+			if (!(breq->read & (1U << (i + n))))
+				break;
+		if (!n) {
+			n = 1;
+			continue;
+		}
 
-		if (radix_tree_node_contains_leaves(tree, node))
-			radix_tree_remove_page(tree, link->u.leaf.page);
-		else
-			radix_tree_delete_branch(tree, link->u.next);
+		clone         = breq->treq;
+		clone.sec     = (breq->first + i) * BLOCK_CACHE_BLOCK_SECS;
+		clone.secs    = n * BLOCK_CACHE_BLOCK_SECS;
+		clone.buf     = block_cache_block_buf(breq, i);
+		clone.cb      = block_cache_complete_read;
+		clone.cb_data = breq;
 
-		radix_tree_clear_link(link);
+		breq->pending++;
+		td_forward_request(clone);
 	}
+	breq->read = 0;
 
-	radix_tree_free_node(tree, node);
-}
-
-static inline void
-radix_tree_destroy(radix_tree_t *tree)
-{
-	radix_tree_delete_branch(tree, tree->root);
-	tree->root = NULL;
+	block_cache_put_pending(breq);
 }
 
 /*
- * returns 1 if @node is empty after pruning, 0 otherwise
+ * look again at the blocks other processes were filling.  A fill that
+ * has been abandoned leaves the block to us.
  */
-static int
-radix_tree_prune_branch(radix_tree_t *tree,
-			radix_tree_node_t *node, uint32_t now)
+static void
+block_cache_wait_event(event_id_t id, char mode, void *private)
 {
-	int i, empty;
-	radix_tree_link_t *link;
+	int i;
+	uint64_t ticks;
+	block_cache_t *cache;
+	block_cache_request_t *breq, *tmp;
 
-	empty = 1;
-	if (!node)
-		return empty;
+	cache = (block_cache_t *)private;
 
-	for (i = 0; i < RADIX_TREE_NODE_SIZE; i++) {
-		link = node->links + i;
+	if (read(cache->timer_fd, &ticks, sizeof(ticks)) < 0 &&
+	    errno != EAGAIN)
+		DPRINTF("%s: reading timer failed: %d\n", cache->name, -errno);
 
-		if (now - link->time < BLOCK_CACHE_PAGE_IDLETIME) {
-			if (radix_tree_node_contains_leaves(tree, node)) {
-				empty = 0;
+	list_for_each_entry_safe(breq, tmp, &cache->waiting, next) {
+		for (i = 0; i < breq->blocks; i++) {
+			if (!(breq->wait & (1U << i)))
 				continue;
-			}
-
-			if (radix_tree_prune_branch(tree, link->u.next, now))
-				radix_tree_clear_link(link);
-			else
-				empty = 0;
 
-			continue;
+			breq->wait &= ~(1U << i);
+			block_cache_lookup(breq, i, 1);
 		}
 
-		if (radix_tree_node_contains_leaves(tree, node))
-			radix_tree_remove_page(tree, link->u.leaf.page);
-		else
-			radix_tree_delete_branch(tree, link->u.next);
+		if (breq->wait && !breq->read)
+			continue;
 
-		radix_tree_clear_link(link);
+		list_del_init(&breq->next);
+		block_cache_issue(breq);
 	}
 
-	if (empty && !radix_tree_node_is_root(tree, node))
-		radix_tree_free_node(tree, node);
-
-	return empty;
+	if (list_empty(&cache->waiting))
+		block_cache_arm_timer(cache, 0);
 }
 
-/*
- * walk tree and free any node that has been idle for too long
- */
 static void
-radix_tree_prune(radix_tree_t *tree)
+block_cache_init_key(block_cache_t *cache, td_disk_info_t *info)
 {
-	struct timeval now;
+	static const uint8_t nil[TD_SHMCACHE_UUID_SIZE];
+	uint32_t pid;
 
-	if (!tree->root)
+	memcpy(cache->key.uuid, info->uuid, sizeof(cache->key.uuid));
+	if (memcmp(cache->key.uuid, nil, sizeof(nil)))
 		return;
 
-	DPRINTF("tree %s has %"PRIu64" bytes\n",
-		tree->cache->name, tree->size);
-
-	gettimeofday(&now, NULL);
-	radix_tree_prune_branch(tree, tree->root, now.tv_sec);
-
-	DPRINTF("tree %s now has %"PRIu64" bytes\n",
-		tree->cache->name, tree->size);
-}
-
-static inline int
-radix_tree_initialize(radix_tree_t *tree, uint64_t sectors)
-{
-	tree->height = radix_tree_calculate_height(sectors);
-	tree->root   = radix_tree_allocate_node(tree, tree->height);
-	if (!tree->root)
-		return -ENOMEM;
-
-	return 0;
-}
-
-static inline void
-radix_tree_free(radix_tree_t *tree)
-{
-	radix_tree_destroy(tree);
-}
-
-static void
-block_cache_prune_event(event_id_t id, char mode, void *private)
-{
-	radix_tree_t *tree;
-	block_cache_t *cache;
-
-	cache = (block_cache_t *)private;
-	tree  = &cache->tree;
-
-	radix_tree_prune(tree);
-}
-
-static inline block_cache_request_t *
-block_cache_get_request(block_cache_t *cache)
-{
-	if (!cache->requests_free)
-		return NULL;
-
-	return cache->request_free_list[--cache->requests_free];
-}
+	/*
+	 * without a UUID there is no safe way to share the blocks; key
+	 * them by this cache instance, so only we will find them
+	 */
+	pid = getpid();
+	memcpy(cache->key.uuid, &pid, sizeof(pid));
+	memcpy(cache->key.uuid + 8, &cache, sizeof(cache));
+	cache->key.uuid[4] = 0xff;
 
-static inline void
-block_cache_put_request(block_cache_t *cache, block_cache_request_t *breq)
-{
-	memset(breq, 0, sizeof(block_cache_request_t));
-	cache->request_free_list[cache->requests_free++] = breq;
+	DPRINTF("%s has no uuid, its cache will not be shared\n",
+		cache->name);
 }
 
 static int
 block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 {
 	int i, err;
-	radix_tree_t *tree;
 	block_cache_t *cache;
 
 	if (!td_flag_test(flags, TD_OPEN_RDONLY))
 		return -EINVAL;
 
-	if (driver->info.sector_size != RADIX_TREE_NODE_SIZE)
+	if (driver->info.sector_size != DEFAULT_SECTOR_SIZE)
 		return -EINVAL;
 
 	cache = (block_cache_t *)driver->data;
@@ -534,29 +374,45 @@ block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 	if (err)
 		return -ENOMEM;
 
-	cache->sectors = driver->info.size;
+	cache->sectors  = driver->info.size;
+	cache->timer_fd = -1;
+	cache->timer_id = -1;
+	INIT_LIST_HEAD(&cache->waiting);
 
-	tree = &cache->tree;
-	err  = radix_tree_initialize(tree, cache->sectors);
-	if (err)
+	block_cache_init_key(cache, &driver->info);
+
+	err = tapdisk_shmcache_open(&cache->shm,
+				    TD_SHMCACHE_DEFAULT_SIZE, 0);
+	if (err) {
+		EPRINTF("%s: opening shared cache failed: %d\n", name, err);
 		goto fail;
+	}
 
-	tree->cache = cache;
 	cache->requests_free = BLOCK_CACHE_REQUESTS;
-	for (i = 0; i < BLOCK_CACHE_REQUESTS; i++)
+	for (i = 0; i < BLOCK_CACHE_REQUESTS; i++) {
+		INIT_LIST_HEAD(&cache->requests[i].next);
 		cache->request_free_list[i] = cache->requests + i;
+	}
+
+	cache->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+					 TFD_NONBLOCK | TFD_CLOEXEC);
+	if (cache->timer_fd == -1) {
+		err = -errno;
+		goto fail;
+	}
 
-	cache->timeout_id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
-							  -1, /* dummy fd */
-							  BLOCK_CACHE_PAGE_IDLETIME << 1,
-							  block_cache_prune_event,
-							  cache);
-	if (cache->timeout_id < 0)
+	cache->timer_id = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+							cache->timer_fd, 0,
+							block_cache_wait_event,
+							cache);
+	if (cache->timer_id < 0) {
+		err = cache->timer_id;
 		goto fail;
+	}
 
 	DPRINTF("opening cache for %s, sectors: %"PRIu64", "
-		"tree: %p, height: %d\n",
-		cache->name, cache->sectors, tree, tree->height);
+		"shared blocks: %"PRIu64"\n", cache->name, cache->sectors,
+		tapdisk_shmcache_blocks(&cache->shm));
 
 	if (mlockall(MCL_CURRENT | MCL_FUTURE))
 		DPRINTF("mlockall failed: %d\n", -errno);
@@ -564,171 +420,76 @@ block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 	return 0;
 
 fail:
+	if (cache->timer_fd != -1)
+		close(cache->timer_fd);
+	tapdisk_shmcache_close(&cache->shm);
 	free(cache->name);
-	radix_tree_free(&cache->tree);
 	return err;
 }
 
 static int
 block_cache_close(td_driver_t *driver)
 {
-	radix_tree_t *tree;
 	block_cache_t *cache;
 
 	cache = (block_cache_t *)driver->data;
-	tree  = &cache->tree;
 
 	DPRINTF("closing cache for %s\n", cache->name);
 
-	tapdisk_server_unregister_event(cache->timeout_id);
-	radix_tree_free(tree);
+	tapdisk_server_unregister_event(cache->timer_id);
+	close(cache->timer_fd);
+	tapdisk_shmcache_close(&cache->shm);
 	free(cache->name);
 
 	return 0;
 }
 
-static inline uint64_t
-block_cache_hash(block_cache_t *cache, char *buf)
-{
-	int i, n;
-	uint64_t cksm, *data;
-
-	return 0;
-
-	cksm = 0;
-	data = (uint64_t *)buf;
-	n    = RADIX_TREE_NODE_SIZE / sizeof(uint64_t);
-
-	for (i = 0; i < n; i++)
-		cksm += data[i];
-
-	return ~cksm;
-}
-
-static void
-block_cache_hit(block_cache_t *cache, td_request_t treq, char *iov[])
-{
-	int i;
-	off_t off;
-
-	cache->stats.hits += treq.secs;
-
-	for (i = 0; i < treq.secs; i++) {
-		DBG("%s: block cache hit: sec 0x%08llx, hash: 0x%08llx\n",
-		    cache->name, treq.sec + i, block_cache_hash(cache, iov[i]));
-
-		off = i << RADIX_TREE_NODE_SHIFT;
-		memcpy(treq.buf + off, iov[i], RADIX_TREE_NODE_SIZE);
-	}
-
-	td_complete_request(treq, 0);
-}
-
 static void
-block_cache_populate_cache(td_request_t clone, int err)
+block_cache_queue_read(td_driver_t *driver, td_request_t treq)
 {
 	int i;
-	radix_tree_t *tree;
-	block_cache_t *cache;
-	block_cache_request_t *breq;
-
-	breq        = (block_cache_request_t *)clone.cb_data;
-	cache       = breq->cache;
-	tree        = &cache->tree;
-	breq->secs -= clone.secs;
-	breq->err   = (breq->err ? breq->err : err);
-
-	if (breq->secs)
-		return;
-
-	if (breq->err) {
-		free(breq->buf);
-		goto out;
-	}
-
-	for (i = 0; i < breq->treq.secs; i++) {
-		off_t off = i << RADIX_TREE_NODE_SHIFT;
-		DBG("%s: populating sec 0x%08llx\n",
-		    cache->name, breq->treq.sec + i);
-		memcpy(breq->treq.buf + off,
-		       breq->buf + off, RADIX_TREE_NODE_SIZE);
-	}
-
-	if (radix_tree_add_leaves(tree, breq->buf,
-				  breq->treq.sec, breq->treq.secs))
-		free(breq->buf);
-
-out:
-	td_complete_request(breq->treq, breq->err);
-	block_cache_put_request(cache, breq);
-}
-
-static void
-block_cache_miss(block_cache_t *cache, td_request_t treq)
-{
 	char *buf;
-	size_t size;
-	td_request_t clone;
-	radix_tree_t *tree;
+	uint64_t first, last;
+	block_cache_t *cache;
 	block_cache_request_t *breq;
 
-	DBG("%s: block cache miss: sec 0x%08llx\n", cache->name, treq.sec);
+	cache = (block_cache_t *)driver->data;
 
-	clone = treq;
-	tree  = &cache->tree;
-	size  = treq.secs << RADIX_TREE_NODE_SHIFT;
+	first = treq.sec / BLOCK_CACHE_BLOCK_SECS;
+	last  = (treq.sec + treq.secs - 1) / BLOCK_CACHE_BLOCK_SECS;
 
-	cache->stats.misses += treq.secs;
+	cache->stats.reads += last - first + 1;
 
-	if (radix_tree_size(tree) + size >= BLOCK_CACHE_MAX_SIZE)
-		goto out;
+	/* a partial block at the end of the image is not cached */
+	if (last - first + 1 > BLOCK_CACHE_MAX_BLOCKS ||
+	    (last + 1) * BLOCK_CACHE_BLOCK_SECS > cache->sectors)
+		goto bypass;
 
 	breq = block_cache_get_request(cache);
 	if (!breq)
-		goto out;
+		goto bypass;
 
-	if (posix_memalign((void **)&buf, RADIX_TREE_NODE_SIZE, size)) {
+	if (posix_memalign((void **)&buf, TD_SHMCACHE_BLOCK_SIZE,
+			   (last - first + 1) << TD_SHMCACHE_BLOCK_SHIFT)) {
 		block_cache_put_request(cache, breq);
-		goto out;
+		goto bypass;
 	}
 
-	breq->treq    = treq;
-	breq->secs    = treq.secs;
-	breq->err     = 0;
-	breq->buf     = buf;
-	breq->cache   = cache;
+	breq->treq   = treq;
+	breq->buf    = buf;
+	breq->first  = first;
+	breq->blocks = last - first + 1;
+	breq->cache  = cache;
 
-	clone.buf     = buf;
-	clone.cb      = block_cache_populate_cache;
-	clone.cb_data = breq;
+	for (i = 0; i < breq->blocks; i++)
+		block_cache_lookup(breq, i, 0);
 
-out:
-	td_forward_request(clone);
-}
-
-static void
-block_cache_queue_read(td_driver_t *driver, td_request_t treq)
-{
-	int i;
-	radix_tree_t *tree;
-	block_cache_t *cache;
-	char *iov[BLOCK_CACHE_NODES_PER_PAGE];
+	block_cache_issue(breq);
+	return;
 
-	cache = (block_cache_t *)driver->data;
-	tree  = &cache->tree;
-
-	cache->stats.reads += treq.secs;
-
-	if (treq.secs > BLOCK_CACHE_NODES_PER_PAGE)
-		return td_forward_request(treq);
-
-	for (i = 0; i < treq.secs; i++) {
-		iov[i] = radix_tree_find_leaf(tree, treq.sec + i);
-		if (!iov[i])
-			return block_cache_miss(cache, treq);
-	}
-
-	return block_cache_hit(cache, treq, iov);
+bypass:
+	cache->stats.bypasses += last - first + 1;
+	td_forward_request(treq);
 }
 
 static void
@@ -764,13 +525,24 @@ block_cache_debug(td_driver_t *driver)
 {
 	block_cache_t *cache;
 	block_cache_stats_t *stats;
+	td_shmcache_stats_t shared;
 
 	cache = (block_cache_t *)driver->data;
 	stats = &cache->stats;
 
+	tapdisk_shmcache_get_stats(&cache->shm, &shared);
+
 	WARN("BLOCK CACHE %s\n", cache->name);
-	WARN("reads: %"PRIu64", hits: %"PRIu64", misses: %"PRIu64", prunes: %"PRIu64"\n",
-	     stats->reads, stats->hits, stats->misses, stats->prunes);
+	WARN("reads: %"PRIu64", hits: %"PRIu64", misses: %"PRIu64", "
+	     "waits: %"PRIu64", bypasses: %"PRIu64"\n",
+	     stats->reads, stats->hits, stats->misses,
+	     stats->waits, stats->bypasses);
+	WARN("shared: blocks: %"PRIu64", used: %"PRIu64", "
+	     "lookups: %"PRIu64", hits: %"PRIu64", misses: %"PRIu64", "
+	     "waits: %"PRIu64", evictions: %"PRIu64"\n",
+	     tapdisk_shmcache_blocks(&cache->shm),
+	     tapdisk_shmcache_used(&cache->shm), shared.lookups,
+	     shared.hits, shared.misses, shared.waits, shared.evictions);
 }
 
 struct tap_disk tapdisk_block_cache = {
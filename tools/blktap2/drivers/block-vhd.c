@@ -72,10 +72,10 @@ unsigned int SPB;
 	do {								\
 		DBG(TLOG_DBG, "%s: QUEUED: %" PRIu64 ", COMPLETED: %"	\
 		    PRIu64", RETURNED: %" PRIu64 ", DATA_ALLOCATED: "	\
-		    "%lu, BBLK: 0x%04x\n",				\
+		    "%lu, BAT_ALLOCS: %d\n",				\
 		    s->vhd.file, s->queued, s->completed, s->returned,	\
 		    VHD_REQS_DATA - s->vreq_free_count,			\
-		    s->bat.pbw_blk);					\
+		    s->bat.allocs);					\
 	} while(0)
 
 #define __ASSERT(_p)							\
@@ -110,9 +110,13 @@ unsigned int SPB;
 
 /******VHD DEFINES******/
 #define VHD_CACHE_SIZE               32
+#define VHD_BAT_ALLOCS               16
+#define VHD_BAT_WRITES               4
+#define VHD_BAT_SECTOR_ENTRIES       (VHD_SECTOR_SIZE / sizeof(u32))
 
 #define VHD_REQS_DATA                TAPDISK_DATA_REQUESTS
-#define VHD_REQS_META                (VHD_CACHE_SIZE + 2)
+#define VHD_REQS_META                (VHD_CACHE_SIZE + VHD_BAT_ALLOCS + \
+				      VHD_BAT_WRITES)
 #define VHD_REQS_TOTAL               (VHD_REQS_DATA + VHD_REQS_META)
 
 #define VHD_OP_BAT_WRITE             0
@@ -136,13 +140,16 @@ unsigned int SPB;
 #define VHD_FLAG_OPEN_QUERY          16
 #define VHD_FLAG_OPEN_PREALLOCATE    32
 
-#define VHD_FLAG_BAT_LOCKED          1
-#define VHD_FLAG_BAT_WRITE_STARTED   2
+#define VHD_FLAG_ALLOC_USED          1
+#define VHD_FLAG_ALLOC_ZEROED        2
+#define VHD_FLAG_ALLOC_BAT_WRITE     4
+#define VHD_FLAG_ALLOC_DONE          8
 
 #define VHD_FLAG_BM_UPDATE_BAT       1
 #define VHD_FLAG_BM_WRITE_PENDING    2
 #define VHD_FLAG_BM_READ_PENDING     4
 #define VHD_FLAG_BM_LOCKED           8
+#define VHD_FLAG_BM_DIRTY            16
 
 #define VHD_FLAG_REQ_UPDATE_BAT      1
 #define VHD_FLAG_REQ_UPDATE_BITMAP   2
@@ -182,15 +189,41 @@ struct vhd_request {
 	struct vhd_transaction   *tx;
 };
 
+/* a write of one sector of the bat */
+struct vhd_bat_write {
+	int                       busy;
+	uint32_t                  first;       /* first blk in sector */
+	struct vhd_request        req;
+	char                     *buf;
+};
+
+/*
+ * a block being allocated: its space is reserved at the end of the
+ * file, its bitmap zeroed, and only then its bat entry written.
+ * allocations of different blocks proceed concurrently; the bat
+ * entries of all allocations sharing a bat sector go out in one write.
+ */
+struct vhd_bat_alloc {
+	uint32_t                  blk;         /* blk num of pending write */
+	uint64_t                  offset;      /* file offset of same */
+	uint64_t                  lb_end;      /* next_db before reserving */
+	uint64_t                  seqno;       /* allocation order */
+	vhd_flag_t                status;
+	int                       error;
+	struct vhd_bat_write     *write;       /* bat write carrying entry */
+	struct vhd_transaction   *tx;          /* bitmap transaction waiting
+						* for the bat write */
+	struct vhd_request        zero_req;    /* for initializing bitmap */
+};
+
 struct vhd_bat_state {
 	vhd_bat_t                 bat;
 	vhd_batmap_t              batmap;
-	vhd_flag_t                status;
-	uint32_t                  pbw_blk;     /* blk num of pending write */
-	uint64_t                  pbw_offset;  /* file offset of same */
-	struct vhd_request        req;         /* for writing bat table */
-	struct vhd_request        zero_req;    /* for initializing bitmaps */
-	char                     *bat_buf;
+	int                       allocs;      /* allocations in flight */
+	uint64_t                  seqno;
+	struct vhd_bat_alloc      alloc[VHD_BAT_ALLOCS];
+	struct vhd_bat_write      write[VHD_BAT_WRITES];
+	char                     *bat_buf;     /* for writing bat table */
 };
 
 struct vhd_bitmap {
@@ -248,6 +281,9 @@ struct vhd_state {
 	uint64_t                  read_size;
 	uint64_t                  writes;
 	uint64_t                  write_size;
+	uint64_t                  bat_writes;
+	uint64_t                  bat_entries;
+	uint64_t                  bm_writes_saved;
 };
 
 #define test_vhd_flag(word, flag)  ((word) & (flag))
@@ -436,13 +472,16 @@ vhd_initialize_bat(struct vhd_state *s)
 					s->vhd.file);
 	}
 
-	err = posix_memalign((void **)&s->bat.bat_buf,
-			     VHD_SECTOR_SIZE, VHD_SECTOR_SIZE);
+	err = posix_memalign((void **)&s->bat.bat_buf, VHD_SECTOR_SIZE,
+			     VHD_SECTOR_SIZE * VHD_BAT_WRITES);
 	if (err) {
 		s->bat.bat_buf = NULL;
 		goto fail;
 	}
 
+	for (i = 0; i < VHD_BAT_WRITES; i++)
+		s->bat.write[i].buf = s->bat.bat_buf + i * VHD_SECTOR_SIZE;
+
 	return 0;
 
 fail:
@@ -649,6 +688,8 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 	driver->info.size        = s->vhd.footer.curr_size >> VHD_SECTOR_SHIFT;
 	driver->info.sector_size = VHD_SECTOR_SIZE;
 	driver->info.info        = 0;
+	memcpy(driver->info.uuid, &s->vhd.footer.uuid,
+	       sizeof(driver->info.uuid));
 
         DBG(TLOG_INFO, "vhd_open: done (sz:%"PRIu64", sct:%"PRIu64
             ", inf:%u)\n",
@@ -925,33 +966,49 @@ transaction_completed(struct vhd_transaction *tx)
 	return (tx->started == tx->finished);
 }
 
-static inline void
-init_bat(struct vhd_state *s)
+static inline struct vhd_bat_alloc *
+get_bat_alloc(struct vhd_state *s, uint32_t blk)
 {
-	s->bat.req.tx     = NULL;
-	s->bat.req.next   = NULL;
-	s->bat.req.error  = 0;
-	s->bat.pbw_blk    = 0;
-	s->bat.pbw_offset = 0;
-	s->bat.status     = 0;
+	int i;
+	struct vhd_bat_alloc *alloc;
+
+	if (!s->bat.allocs)
+		return NULL;
+
+	for (i = 0; i < VHD_BAT_ALLOCS; i++) {
+		alloc = s->bat.alloc + i;
+		if (test_vhd_flag(alloc->status, VHD_FLAG_ALLOC_USED) &&
+		    alloc->blk == blk)
+			return alloc;
+	}
+
+	return NULL;
 }
 
-static inline void
-lock_bat(struct vhd_state *s)
+static inline int
+bat_allocs_full(struct vhd_state *s)
 {
-	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
+	return (s->bat.allocs == VHD_BAT_ALLOCS);
 }
 
-static inline void
-unlock_bat(struct vhd_state *s)
+/* bitmap zeroed, bat entry not yet written */
+static inline int
+bat_alloc_ready(struct vhd_bat_alloc *alloc)
 {
-	clear_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
+	return (alloc->status == (VHD_FLAG_ALLOC_USED | VHD_FLAG_ALLOC_ZEROED));
 }
 
-static inline int
-bat_locked(struct vhd_state *s)
+static inline void
+free_bat_alloc(struct vhd_state *s, struct vhd_bat_alloc *alloc)
 {
-	return test_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
+	/* give back the space of a failed allocation
+	 * if no block has been reserved after it */
+	if (alloc->error &&
+	    alloc->offset + s->bm_secs + s->spb == s->next_db)
+		s->next_db = alloc->lb_end;
+
+	memset(alloc, 0, sizeof(struct vhd_bat_alloc));
+	s->bat.allocs--;
 }
 
 static inline void
@@ -968,6 +1025,17 @@ init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 	init_vhd_request(s, &bm->req);
 }
 
+static inline void
+set_shadow_bits(struct vhd_state *s, struct vhd_bitmap *bm,
+		uint32_t sec, uint32_t secs)
+{
+	for (; secs; sec++, secs--)
+		if (!vhd_bitmap_test(&s->vhd, bm->shadow, sec)) {
+			vhd_bitmap_set(&s->vhd, bm->shadow, sec);
+			set_vhd_flag(bm->status, VHD_FLAG_BM_DIRTY);
+		}
+}
+
 static inline struct vhd_bitmap *
 get_bitmap(struct vhd_state *s, uint32_t block)
 {
@@ -1156,7 +1224,7 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 
 	if (bat_entry(s, blk) == DD_BLK_UNUSED) {
 		if (op == VHD_OP_DATA_WRITE &&
-		    s->bat.pbw_blk != blk && bat_locked(s))
+		    bat_allocs_full(s) && !get_bat_alloc(s, blk))
 			return VHD_BM_BAT_LOCKED;
 
 		return VHD_BM_BAT_CLEAR;
@@ -1264,79 +1332,157 @@ aio_write(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
 	TRACE(s);
 }
 
-static inline uint64_t
+static struct vhd_bat_alloc *
 reserve_new_block(struct vhd_state *s, uint32_t blk)
 {
-	int gap = 0;
+	int i, gap = 0;
+	struct vhd_bat_alloc *alloc = NULL;
+
+	for (i = 0; i < VHD_BAT_ALLOCS; i++)
+		if (!test_vhd_flag(s->bat.alloc[i].status,
+				   VHD_FLAG_ALLOC_USED)) {
+			alloc = s->bat.alloc + i;
+			break;
+		}
 
-	ASSERT(!test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+	ASSERT(alloc);
 
 	/* data region of segment should begin on page boundary */
 	if ((s->next_db + s->bm_secs) % s->spp)
 		gap = (s->spp - ((s->next_db + s->bm_secs) % s->spp));
 
-	s->bat.pbw_blk    = blk;
-	s->bat.pbw_offset = s->next_db + gap;
+	alloc->blk    = blk;
+	alloc->lb_end = s->next_db;
+	alloc->offset = s->next_db + gap;
+	alloc->seqno  = ++s->bat.seqno;
+	alloc->status = VHD_FLAG_ALLOC_USED;
+	alloc->error  = 0;
+	alloc->tx     = NULL;
 
-	return s->next_db;
+	/* blocks allocated meanwhile go after this one,
+	 * whether or not its bat entry makes it to disk */
+	s->next_db = alloc->offset + s->bm_secs + s->spb;
+	s->bat.allocs++;
+
+	return alloc;
 }
 
-static int
-schedule_bat_write(struct vhd_state *s)
+static struct vhd_bat_write *
+get_bat_write(struct vhd_state *s, uint32_t blk)
 {
 	int i;
-	u32 blk;
-	char *buf;
-	u64 offset;
-	struct vhd_request *req;
+	struct vhd_bat_write *w;
+
+	for (i = 0; i < VHD_BAT_WRITES; i++) {
+		w = s->bat.write + i;
+		if (w->busy &&
+		    w->first / VHD_BAT_SECTOR_ENTRIES ==
+		    blk / VHD_BAT_SECTOR_ENTRIES)
+			return w;
+	}
 
-	ASSERT(bat_locked(s));
+	return NULL;
+}
+
+/*
+ * write the bat sector of the oldest allocation whose bitmap is on disk,
+ * with the entries of all other such allocations in the same sector.
+ * a sector has only one write in flight at a time; allocations becoming
+ * ready meanwhile are picked up when it completes.
+ */
+static void
+__schedule_bat_write(struct vhd_state *s, struct vhd_bat_write *w,
+		     struct vhd_bat_alloc *next)
+{
+	int i;
+	u64 offset;
+	struct vhd_request *req = &w->req;
+	struct vhd_bat_alloc *alloc;
 
-	req = &s->bat.req;
-	buf = s->bat.bat_buf;
-	blk = s->bat.pbw_blk;
+	w->busy  = 1;
+	w->first = next->blk - (next->blk % VHD_BAT_SECTOR_ENTRIES);
 
 	init_vhd_request(s, req);
-	memcpy(buf, &bat_entry(s, blk - (blk % 128)), 512);
+	memcpy(w->buf, &bat_entry(s, w->first), VHD_SECTOR_SIZE);
+
+	for (i = 0; i < VHD_BAT_ALLOCS; i++) {
+		alloc = s->bat.alloc + i;
+		if (!bat_alloc_ready(alloc) ||
+		    alloc->blk / VHD_BAT_SECTOR_ENTRIES !=
+		    w->first / VHD_BAT_SECTOR_ENTRIES)
+			continue;
+
+		((u32 *)w->buf)[alloc->blk - w->first] = alloc->offset;
+		set_vhd_flag(alloc->status, VHD_FLAG_ALLOC_BAT_WRITE);
+		alloc->write = w;
+		s->bat_entries++;
 
-	((u32 *)buf)[blk % 128] = s->bat.pbw_offset;
+		DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64"\n",
+		    alloc->blk, alloc->offset);
+	}
 
-	for (i = 0; i < 128; i++)
-		BE32_OUT(&((u32 *)buf)[i]);
+	for (i = 0; i < VHD_BAT_SECTOR_ENTRIES; i++)
+		BE32_OUT(&((u32 *)w->buf)[i]);
 
-	offset         = s->vhd.header.table_offset + (blk - (blk % 128)) * 4;
+	offset         = s->vhd.header.table_offset + w->first * sizeof(u32);
 	req->treq.secs = 1;
-	req->treq.buf  = buf;
+	req->treq.buf  = w->buf;
 	req->op        = VHD_OP_BAT_WRITE;
 	req->next      = NULL;
 
 	aio_write(s, req, offset);
-	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED);
+	s->bat_writes++;
 
-	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64", "
-	    "table_offset: 0x%08"PRIx64"\n", blk, s->bat.pbw_offset, offset);
+	DBG(TLOG_DBG, "first: 0x%04x, table_offset: 0x%08"PRIx64"\n",
+	    w->first, offset);
+}
 
-	return 0;
+static void
+schedule_bat_write(struct vhd_state *s)
+{
+	int i, j;
+	struct vhd_bat_write *w;
+	struct vhd_bat_alloc *alloc, *next;
+
+	for (i = 0; i < VHD_BAT_WRITES; i++) {
+		w = s->bat.write + i;
+		if (w->busy)
+			continue;
+
+		next = NULL;
+		for (j = 0; j < VHD_BAT_ALLOCS; j++) {
+			alloc = s->bat.alloc + j;
+			if (bat_alloc_ready(alloc) &&
+			    (!next || alloc->seqno < next->seqno) &&
+			    !get_bat_write(s, alloc->blk))
+				next = alloc;
+		}
+
+		if (!next)
+			return;
+
+		__schedule_bat_write(s, w, next);
+	}
 }
 
 static void
 schedule_zero_bm_write(struct vhd_state *s,
-		       struct vhd_bitmap *bm, uint64_t lb_end)
+		       struct vhd_bitmap *bm, struct vhd_bat_alloc *alloc)
 {
 	uint64_t offset;
-	struct vhd_request *req = &s->bat.zero_req;
+	struct vhd_request *req = &alloc->zero_req;
 
 	init_vhd_request(s, req);
 
-	offset         = vhd_sectors_to_bytes(lb_end);
+	offset         = vhd_sectors_to_bytes(alloc->lb_end);
 	req->op        = VHD_OP_ZERO_BM_WRITE;
-	req->treq.sec  = s->bat.pbw_blk * s->spb;
-	req->treq.secs = (s->bat.pbw_offset - lb_end) + s->bm_secs;
+	req->treq.sec  = alloc->blk * s->spb;
+	req->treq.secs = (alloc->offset - alloc->lb_end) + s->bm_secs;
 	req->treq.buf  = vhd_zeros(vhd_sectors_to_bytes(req->treq.secs));
 	req->next      = NULL;
 
 	DBG(TLOG_DBG, "blk: 0x%04x, writing zero bitmap at 0x%08"PRIx64"\n",
-	    s->bat.pbw_blk, offset);
+	    alloc->blk, offset);
 
 	lock_bitmap(bm);
 	add_to_transaction(&bm->tx, req);
@@ -1344,83 +1490,47 @@ schedule_zero_bm_write(struct vhd_state *s,
 }
 
 static int
-update_bat(struct vhd_state *s, uint32_t blk)
+allocate_block(struct vhd_state *s, struct vhd_bat_alloc *alloc)
 {
 	int err;
-	uint64_t lb_end;
-	struct vhd_bitmap *bm;
+	uint64_t offset, size;
 
-	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
-	
-	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
-		return 0;
-	}
+	offset = vhd_sectors_to_bytes(alloc->lb_end);
+	size   = vhd_sectors_to_bytes(alloc->offset - alloc->lb_end +
+				      s->bm_secs + s->spb);
 
-	/* empty bitmap could already be in
-	 * cache if earlier bat update failed */
-	bm = get_bitmap(s, blk);
-	if (!bm) {
-		/* install empty bitmap in cache */
-		err = alloc_vhd_bitmap(s, &bm, blk);
-		if (err) 
-			return err;
+	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64"\n",
+	    alloc->blk, alloc->offset);
 
-		install_bitmap(s, bm);
+	if (lseek(s->vhd.fd, offset, SEEK_SET) == (off_t)-1) {
+		ERR(errno, "lseek failed\n");
+		return -errno;
 	}
 
-	lock_bat(s);
-	lb_end = reserve_new_block(s, blk);
-	schedule_zero_bm_write(s, bm, lb_end);
-	set_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT);
+	err  = write(s->vhd.fd, vhd_zeros(size), size);
+	if (err != size) {
+		err = (err == -1 ? -errno : -EIO);
+		ERR(err, "write failed");
+		return err;
+	}
 
 	return 0;
 }
 
 static int
-allocate_block(struct vhd_state *s, uint32_t blk)
+update_bat(struct vhd_state *s, uint32_t blk)
 {
-	char *zeros;
-	int err, gap;
-	uint64_t offset, size;
+	int err;
 	struct vhd_bitmap *bm;
+	struct vhd_bat_alloc *alloc;
 
 	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
 
-	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
-		if (s->bat.req.error)
-			return -EBUSY;
+	if (get_bat_alloc(s, blk))
 		return 0;
-	}
-
-	gap            = 0;
-	s->bat.pbw_blk = blk;
-	offset         = vhd_sectors_to_bytes(s->next_db);
-
-	/* data region of segment should begin on page boundary */
-	if ((s->next_db + s->bm_secs) % s->spp) {
-		gap = (s->spp - ((s->next_db + s->bm_secs) % s->spp));
-		s->next_db += gap;
-	}
-
-	s->bat.pbw_offset = s->next_db;
-
-	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64"\n",
-	    blk, s->bat.pbw_offset);
-
-	if (lseek(s->vhd.fd, offset, SEEK_SET) == (off_t)-1) {
-		ERR(errno, "lseek failed\n");
-		return -errno;
-	}
 
-	size = vhd_sectors_to_bytes(s->spb + s->bm_secs + gap);
-	err  = write(s->vhd.fd, vhd_zeros(size), size);
-	if (err != size) {
-		err = (err == -1 ? -errno : -EIO);
-		ERR(err, "write failed");
-		return err;
-	}
+	if (bat_allocs_full(s))
+		return -EBUSY;
 
 	/* empty bitmap could already be in
 	 * cache if earlier bat update failed */
@@ -1434,10 +1544,23 @@ allocate_block(struct vhd_state *s, uint32_t blk)
 		install_bitmap(s, bm);
 	}
 
-	lock_bat(s);
-	lock_bitmap(bm);
-	schedule_bat_write(s);
-	add_to_transaction(&bm->tx, &s->bat.req);
+	alloc = reserve_new_block(s, blk);
+
+	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
+		err = allocate_block(s, alloc);
+		if (err) {
+			alloc->error = err;
+			free_bat_alloc(s, alloc);
+			return err;
+		}
+
+		lock_bitmap(bm);
+		set_vhd_flag(alloc->status, VHD_FLAG_ALLOC_ZEROED);
+		schedule_bat_write(s);
+	} else
+		schedule_zero_bm_write(s, bm, alloc);
+
+	set_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT);
 
 	return 0;
 }
@@ -1505,15 +1628,11 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 	offset = bat_entry(s, blk);
 
 	if (test_vhd_flag(flags, VHD_FLAG_REQ_UPDATE_BAT)) {
-		if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE))
-			err = allocate_block(s, blk);
-		else
-			err = update_bat(s, blk);
-
+		err = update_bat(s, blk);
 		if (err)
 			return err;
 
-		offset = s->bat.pbw_offset;
+		offset = get_bat_alloc(s, blk)->offset;
 	}
 
 	offset += s->bm_secs + sec;
@@ -1599,6 +1718,7 @@ schedule_bitmap_write(struct vhd_state *s, uint32_t blk)
 	u64 offset;
 	struct vhd_bitmap  *bm;
 	struct vhd_request *req;
+	struct vhd_bat_alloc *alloc;
 
 	bm     = get_bitmap(s, blk);
 	offset = bat_entry(s, blk);
@@ -1608,8 +1728,9 @@ schedule_bitmap_write(struct vhd_state *s, uint32_t blk)
 	       !test_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING));
 
 	if (offset == DD_BLK_UNUSED) {
-		ASSERT(bat_locked(s) && s->bat.pbw_blk == blk);
-		offset = s->bat.pbw_offset;
+		alloc = get_bat_alloc(s, blk);
+		ASSERT(alloc);
+		offset = alloc->offset;
 	}
 	
 	offset = vhd_sectors_to_bytes(offset);
@@ -1860,7 +1981,6 @@ signal_completion(struct vhd_request *list, int error)
 static void
 start_new_bitmap_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i, error = 0;
 	struct vhd_transaction *tx;
 	struct vhd_request *r, *next;
 
@@ -1884,12 +2004,9 @@ start_new_bitmap_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 		add_to_transaction(tx, r);
 		if (test_vhd_flag(r->flags, VHD_FLAG_REQ_FINISHED)) {
 			tx->finished++;
-			if (!r->error) {
-				u32 sec = r->treq.sec % s->spb;
-				for (i = 0; i < r->treq.secs; i++)
-					vhd_bitmap_set(&s->vhd,
-						       bm->shadow, sec + i);
-			}
+			if (!r->error)
+				set_shadow_bits(s, bm, r->treq.sec % s->spb,
+						r->treq.secs);
 		}
 		r = next;
 	}
@@ -1903,14 +2020,12 @@ static void
 finish_bat_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 {
 	struct vhd_transaction *tx = &bm->tx;
+	struct vhd_bat_alloc *alloc = get_bat_alloc(s, bm->blk);
 
-	if (!bat_locked(s))
-		return;
-
-	if (s->bat.pbw_blk != bm->blk)
+	if (!alloc || !test_vhd_flag(alloc->status, VHD_FLAG_ALLOC_DONE))
 		return;
 
-	if (!s->bat.req.error)
+	if (!alloc->error)
 		goto release;
 
 	if (!test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE))
@@ -1921,8 +2036,7 @@ finish_bat_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 
  release:
 	DBG(TLOG_DBG, "blk: 0x%04x\n", bm->blk);
-	unlock_bat(s);
-	init_bat(s);
+	free_bat_alloc(s, alloc);
 }
 
 static void
@@ -1930,21 +2044,20 @@ finish_bitmap_transaction(struct vhd_state *s,
 			  struct vhd_bitmap *bm, int error)
 {
 	int map_size;
+	struct vhd_bat_alloc *alloc;
 	struct vhd_transaction *tx = &bm->tx;
 
 	DBG(TLOG_DBG, "blk: 0x%04x, err: %d\n", bm->blk, error);
 	tx->error = (tx->error ? tx->error : error);
 	map_size  = vhd_sectors_to_bytes(s->bm_secs);
 
-	if (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
-		if (test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT)) {
-			/* still waiting for bat write */
-			ASSERT(bm->blk == s->bat.pbw_blk);
-			ASSERT(test_vhd_flag(s->bat.status, 
-					     VHD_FLAG_BAT_WRITE_STARTED));
-			s->bat.req.tx = tx;
-			return;
-		}
+	if (test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT)) {
+		/* still waiting for bat write */
+		alloc = get_bat_alloc(s, bm->blk);
+		ASSERT(alloc &&
+		       !test_vhd_flag(alloc->status, VHD_FLAG_ALLOC_DONE));
+		alloc->tx = tx;
+		return;
 	}
 
 	if (tx->error) {
@@ -1956,6 +2069,7 @@ finish_bitmap_transaction(struct vhd_state *s,
 		if (!test_batmap(s, bm->blk) && bitmap_full(s, bm))
 			set_batmap(s, bm->blk);
 	}
+	clear_vhd_flag(bm->status, VHD_FLAG_BM_DIRTY);
 
 	/* transaction done; signal completions */
 	signal_completion(tx->requests.head, tx->error);
@@ -1977,8 +2091,13 @@ finish_data_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 
 	tx->closed = 1;
 
-	if (!tx->error)
-		return schedule_bitmap_write(s, bm->blk);
+	if (!tx->error) {
+		if (test_vhd_flag(bm->status, VHD_FLAG_BM_DIRTY))
+			return schedule_bitmap_write(s, bm->blk);
+
+		/* no new sectors: the bitmap on disk is up to date */
+		s->bm_writes_saved++;
+	}
 
 	return finish_bitmap_transaction(s, bm, 0);
 }
@@ -1986,42 +2105,65 @@ finish_data_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 static void
 finish_bat_write(struct vhd_request *req)
 {
+	int i, n = 0;
 	struct vhd_bitmap *bm;
 	struct vhd_transaction *tx;
+	struct vhd_bat_alloc *alloc, *done[VHD_BAT_ALLOCS];
 	struct vhd_state *s = req->state;
+	struct vhd_bat_write *w;
 
 	s->returned++;
 	TRACE(s);
 
-	bm = get_bitmap(s, s->bat.pbw_blk);
+	for (i = 0; i < VHD_BAT_WRITES; i++)
+		if (&s->bat.write[i].req == req)
+			break;
 
-	DBG(TLOG_DBG, "blk 0x%04x, pbwo: 0x%08"PRIx64", err %d\n",
-	    s->bat.pbw_blk, s->bat.pbw_offset, req->error);
-	ASSERT(bm && bitmap_valid(bm));
-	ASSERT(bat_locked(s) &&
-	       test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+	ASSERT(i < VHD_BAT_WRITES);
+	w = s->bat.write + i;
+	ASSERT(w->busy);
+	w->busy = 0;
 
-	tx = &bm->tx;
-	ASSERT(test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE));
+	for (i = 0; i < VHD_BAT_ALLOCS; i++) {
+		alloc = s->bat.alloc + i;
+		if (alloc->write != w ||
+		    test_vhd_flag(alloc->status, VHD_FLAG_ALLOC_DONE))
+			continue;
 
-	if (!req->error) {
-		bat_entry(s, s->bat.pbw_blk) = s->bat.pbw_offset;
-		s->next_db = s->bat.pbw_offset + s->spb + s->bm_secs;
-	} else
-		tx->error = req->error;
+		DBG(TLOG_DBG, "blk 0x%04x, pbwo: 0x%08"PRIx64", err %d\n",
+		    alloc->blk, alloc->offset, req->error);
 
-	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
-		tx->finished++;
-		remove_from_req_list(&tx->requests, req);
-		if (transaction_completed(tx))
-			finish_data_transaction(s, bm);
-	} else {
+		if (!req->error)
+			bat_entry(s, alloc->blk) = alloc->offset;
+
+		alloc->error = req->error;
+		set_vhd_flag(alloc->status, VHD_FLAG_ALLOC_DONE);
+		done[n++] = alloc;
+	}
+
+	/* completing a transaction may release other allocations */
+	for (i = 0; i < n; i++) {
+		alloc = done[i];
+		bm    = get_bitmap(s, alloc->blk);
+		ASSERT(bm && bitmap_valid(bm));
+
+		tx = &bm->tx;
 		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
-		if (s->bat.req.tx)
+
+		if (alloc->tx) {
 			finish_bitmap_transaction(s, bm, req->error);
+			continue;
+		}
+
+		if (test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE))
+			tx->error = (tx->error ? tx->error : req->error);
+		else if (!bitmap_in_use(bm))
+			unlock_bitmap(bm);
+
+		finish_bat_transaction(s, bm);
 	}
 
-	finish_bat_transaction(s, bm);
+	schedule_bat_write(s);
 }
 
 static void
@@ -2029,33 +2171,38 @@ finish_zero_bm_write(struct vhd_request *req)
 {
 	u32 blk;
 	struct vhd_bitmap *bm;
+	struct vhd_bat_alloc *alloc;
 	struct vhd_transaction *tx = req->tx;
 	struct vhd_state *s = req->state;
 
 	s->returned++;
 	TRACE(s);
 
-	blk = req->treq.sec / s->spb;
-	bm  = get_bitmap(s, blk);
+	blk   = req->treq.sec / s->spb;
+	bm    = get_bitmap(s, blk);
+	alloc = get_bat_alloc(s, blk);
 
 	DBG(TLOG_DBG, "blk: 0x%04x\n", blk);
-	ASSERT(bat_locked(s));
-	ASSERT(s->bat.pbw_blk == blk);
+	ASSERT(alloc && req == &alloc->zero_req);
 	ASSERT(bm && bitmap_valid(bm) && bitmap_locked(bm));
 
 	tx->finished++;
 	remove_from_req_list(&tx->requests, req);
 
 	if (req->error) {
-		unlock_bat(s);
-		init_bat(s);
+		alloc->error = req->error;
+		set_vhd_flag(alloc->status, VHD_FLAG_ALLOC_DONE);
 		tx->error = req->error;
 		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
-	} else
+	} else {
+		set_vhd_flag(alloc->status, VHD_FLAG_ALLOC_ZEROED);
 		schedule_bat_write(s);
+	}
 
 	if (transaction_completed(tx))
 		finish_data_transaction(s, bm);
+	else if (req->error)
+		finish_bat_transaction(s, bm);
 }
 
 static void
@@ -2149,7 +2296,6 @@ finish_data_read(struct vhd_request *req)
 static void
 finish_data_write(struct vhd_request *req)
 {
-	int i;
 	struct vhd_transaction *tx = req->tx;
 	struct vhd_state *s = (struct vhd_state *)req->state;
 
@@ -2172,8 +2318,7 @@ finish_data_write(struct vhd_request *req)
 		    req->treq.sec / s->spb, tx->started, tx->finished);
 
 		if (!req->error)
-			for (i = 0; i < req->treq.secs; i++)
-				vhd_bitmap_set(&s->vhd, bm->shadow,  sec + i);
+			set_shadow_bits(s, bm, sec, req->treq.secs);
 
 		if (transaction_completed(tx))
 			finish_data_transaction(s, bm);
@@ -2298,9 +2443,20 @@ vhd_debug(td_driver_t *driver)
 		    tx->started, tx->finished, tx->status, tx->requests.head, rnum);
 	}
 
-	DBG(TLOG_WARN, "BAT: status: 0x%08x, pbw_blk: 0x%04x, "
-	    "pbw_off: 0x%08"PRIx64", tx: %p\n", s->bat.status, s->bat.pbw_blk,
-	    s->bat.pbw_offset, s->bat.req.tx);
+	DBG(TLOG_WARN, "BAT: allocs: %d, writes: 0x%08"PRIx64", entries: "
+	    "0x%08"PRIx64", bitmap writes saved: 0x%08"PRIx64"\n",
+	    s->bat.allocs, s->bat_writes, s->bat_entries, s->bm_writes_saved);
+	for (i = 0; i < VHD_BAT_ALLOCS; i++) {
+		struct vhd_bat_alloc *alloc = &s->bat.alloc[i];
+
+		if (!test_vhd_flag(alloc->status, VHD_FLAG_ALLOC_USED))
+			continue;
+
+		DBG(TLOG_WARN, "%d: blk: 0x%04x, pbwo: 0x%08"PRIx64", "
+		    "status: 0x%02x, err: %d, write: %p, tx: %p\n", i,
+		    alloc->blk, alloc->offset, alloc->status, alloc->error,
+		    alloc->write, alloc->tx);
+	}
 
 /*
 	for (i = 0; i < s->hdr.max_bat_size; i++)
@@ -0,0 +1,706 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * tapdisk-bench: issue reads or writes of a fixed size against an image,
+ * through the same vbd and image stack tapdisk2 uses, with a fixed number
+ * of requests in flight, and report throughput and completion latency.
+ *
+ * Writes to a fresh thin image measure the cost of allocating blocks;
+ * running the same job a second time measures the allocated case.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "list.h"
+#include "scheduler.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-server.h"
+#include "tapdisk-disktype.h"
+#include "tapdisk-utils.h"
+
+#define POLL_READ                        0
+#define POLL_WRITE                       1
+
+#define MIN(a, b)                        ((a) < (b) ? (a) : (b))
+
+struct tapdisk_bench_poll {
+	int                              pipe[2];
+	int                              set;
+};
+
+struct tapdisk_bench_request {
+	uint64_t                         sec;
+	uint64_t                         start;
+	blkif_request_t                  blkif_req;
+	struct list_head                 next;
+};
+
+struct tapdisk_bench {
+	td_vbd_t                        *vbd;
+
+	int                              err;
+	int                              write;
+	int                              random;
+	int                              verify;
+	td_flag_t                        flags;
+
+	uint32_t                         secs;      /* per request */
+	uint32_t                         depth;
+	uint64_t                         range;     /* in requests */
+	uint64_t                         cur;
+
+	uint64_t                         count;
+	uint64_t                         started;
+	uint64_t                         completed;
+
+	uint64_t                         begin;
+	uint64_t                         end;
+	uint64_t                        *lat;
+
+	struct tapdisk_bench_poll        poll;
+	event_id_t                       enqueue_event_id;
+
+	struct list_head                 free_list;
+	struct list_head                 pending_list;
+
+	struct tapdisk_bench_request     requests[MAX_REQUESTS];
+};
+
+static void tapdisk_bench_close_image(struct tapdisk_bench *);
+
+static void
+usage(const char *app, int err)
+{
+	printf("usage: %s <-n type:/path/to/image> [-m mode] [-b block size] "
+	       "[-q depth] [-c count] [-s size] [-t storage] [-r seed] [-C] [-V]\n"
+	       "  mode:    read, write, randread or randwrite (default)\n"
+	       "  block size in bytes (default 4096), "
+	       "size of the region used in bytes\n"
+	       "  storage: ext (default), nfs or lvm\n"
+	       "  -C:      read the parent through the shared block cache\n"
+	       "  -V:      stamp written sectors with their number, "
+	       "check the stamps on reads\n",
+	       app);
+	exit(err);
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+static inline void
+tapdisk_bench_poll_initialize(struct tapdisk_bench_poll *p)
+{
+	p->set = 0;
+	p->pipe[POLL_READ] = p->pipe[POLL_WRITE] = -1;
+}
+
+static int
+tapdisk_bench_poll_open(struct tapdisk_bench_poll *p)
+{
+	int err;
+
+	tapdisk_bench_poll_initialize(p);
+
+	err = pipe(p->pipe);
+	if (err)
+		return -errno;
+
+	err = fcntl(p->pipe[POLL_READ], F_SETFL, O_NONBLOCK);
+	if (err)
+		goto out;
+
+	err = fcntl(p->pipe[POLL_WRITE], F_SETFL, O_NONBLOCK);
+	if (err)
+		goto out;
+
+	return 0;
+
+out:
+	close(p->pipe[POLL_READ]);
+	close(p->pipe[POLL_WRITE]);
+	tapdisk_bench_poll_initialize(p);
+	return -errno;
+}
+
+static void
+tapdisk_bench_poll_close(struct tapdisk_bench_poll *p)
+{
+	if (p->pipe[POLL_READ] != -1)
+		close(p->pipe[POLL_READ]);
+	if (p->pipe[POLL_WRITE] != -1)
+		close(p->pipe[POLL_WRITE]);
+	tapdisk_bench_poll_initialize(p);
+}
+
+static inline void
+tapdisk_bench_poll_clear(struct tapdisk_bench_poll *p)
+{
+	int dummy;
+
+	read_exact(p->pipe[POLL_READ], &dummy, sizeof(dummy));
+	p->set = 0;
+}
+
+static inline void
+tapdisk_bench_poll_set(struct tapdisk_bench_poll *p)
+{
+	int dummy = 0;
+
+	if (!p->set) {
+		write_exact(p->pipe[POLL_WRITE], &dummy, sizeof(dummy));
+		p->set = 1;
+	}
+}
+
+static inline int
+tapdisk_bench_stop(struct tapdisk_bench *b)
+{
+	return (list_empty(&b->pending_list) &&
+		(b->started == b->count || b->err));
+}
+
+static inline int
+tapdisk_bench_request_idx(struct tapdisk_bench *b,
+			  struct tapdisk_bench_request *req)
+{
+	return (req - b->requests);
+}
+
+static uint64_t
+tapdisk_bench_next_sector(struct tapdisk_bench *b)
+{
+	uint64_t n;
+
+	if (b->random)
+		n = ((uint64_t)random() << 31 | random()) % b->range;
+	else {
+		n = b->cur++;
+		if (b->cur == b->range)
+			b->cur = 0;
+	}
+
+	return n * b->secs;
+}
+
+static uint64_t *
+tapdisk_bench_stamp(struct tapdisk_bench *b, int idx, uint32_t i)
+{
+	int spp = getpagesize() >> SECTOR_SHIFT;
+
+	return (uint64_t *)(MMAP_VADDR(b->vbd->ring.vstart, idx, i / spp) +
+			    ((i % spp) << SECTOR_SHIFT));
+}
+
+static void
+tapdisk_bench_prepare(struct tapdisk_bench *b,
+		      struct tapdisk_bench_request *breq, int idx)
+{
+	uint32_t i;
+
+	for (i = 0; i < b->secs; i++)
+		*tapdisk_bench_stamp(b, idx, i) =
+			(b->write ? breq->sec + i : ~0ULL);
+}
+
+static int
+tapdisk_bench_check(struct tapdisk_bench *b,
+		    struct tapdisk_bench_request *breq, int idx)
+{
+	uint32_t i;
+
+	for (i = 0; i < b->secs; i++)
+		if (*tapdisk_bench_stamp(b, idx, i) != breq->sec + i) {
+			fprintf(stderr, "data mismatch on sector 0x%"PRIx64
+				"\n", breq->sec + i);
+			return EIO;
+		}
+
+	return 0;
+}
+
+static void
+tapdisk_bench_dequeue(void *arg, blkif_response_t *rsp)
+{
+	struct tapdisk_bench *b = (struct tapdisk_bench *)arg;
+	struct tapdisk_bench_request *breq = b->requests + rsp->id;
+
+	list_del_init(&breq->next);
+	list_add_tail(&breq->next, &b->free_list);
+
+	if (rsp->status != BLKIF_RSP_OKAY) {
+		b->err = EIO;
+		fprintf(stderr, "error on sector 0x%"PRIx64"\n", breq->sec);
+	} else {
+		b->lat[b->completed++] = now_ns() - breq->start;
+		if (b->verify && !b->write && !b->err)
+			b->err = tapdisk_bench_check(b, breq, rsp->id);
+	}
+
+	tapdisk_bench_poll_set(&b->poll);
+}
+
+static void
+tapdisk_bench_enqueue(event_id_t id, char mode, void *arg)
+{
+	td_vbd_t *vbd;
+	int i, idx, psize, spp;
+	struct tapdisk_bench *b = (struct tapdisk_bench *)arg;
+
+	vbd = b->vbd;
+	tapdisk_bench_poll_clear(&b->poll);
+
+	if (tapdisk_bench_stop(b)) {
+		b->end = now_ns();
+		tapdisk_bench_close_image(b);
+		return;
+	}
+
+	psize = getpagesize();
+	spp   = psize >> SECTOR_SHIFT;
+
+	while (b->started < b->count && !b->err) {
+		uint32_t secs;
+		blkif_request_t *req;
+		td_vbd_request_t *vreq;
+		struct tapdisk_bench_request *breq;
+
+		if (list_empty(&b->free_list))
+			break;
+
+		breq = list_entry(b->free_list.next,
+				  struct tapdisk_bench_request, next);
+		list_del_init(&breq->next);
+
+		idx                = tapdisk_bench_request_idx(b, breq);
+		breq->sec          = tapdisk_bench_next_sector(b);
+
+		req                = &breq->blkif_req;
+		req->id            = idx;
+		req->nr_segments   = 0;
+		req->sector_number = breq->sec;
+		req->operation     = (b->write ?
+				      BLKIF_OP_WRITE : BLKIF_OP_READ);
+
+		for (i = 0, secs = b->secs; secs; i++) {
+			struct blkif_request_segment *seg = req->seg + i;
+			uint32_t n = MIN(secs, spp);
+
+			seg->first_sect = 0;
+			seg->last_sect  = n - 1;
+			req->nr_segments++;
+			secs -= n;
+		}
+
+		if (b->verify)
+			tapdisk_bench_prepare(b, breq, idx);
+
+		vreq = vbd->request_list + idx;
+
+		assert(list_empty(&vreq->next));
+		assert(vreq->secs_pending == 0);
+
+		memcpy(&vreq->req, req, sizeof(*req));
+		vbd->received++;
+		vreq->vbd = vbd;
+
+		breq->start = now_ns();
+		b->started++;
+
+		tapdisk_vbd_move_request(vreq, &vbd->new_requests);
+		list_add_tail(&breq->next, &b->pending_list);
+	}
+
+	tapdisk_vbd_issue_requests(vbd);
+}
+
+static int
+tapdisk_bench_open_image(struct tapdisk_bench *b, const char *params,
+			 const char *path, int type, int storage)
+{
+	int err;
+
+	err = tapdisk_server_initialize();
+	if (err)
+		goto out;
+
+	err = tapdisk_vbd_initialize(0);
+	if (err)
+		goto out;
+
+	b->vbd = tapdisk_server_get_vbd(0);
+	if (!b->vbd) {
+		err = ENODEV;
+		goto out;
+	}
+
+	tapdisk_vbd_set_callback(b->vbd, tapdisk_bench_dequeue, b);
+
+	err = tapdisk_vbd_parse_stack(b->vbd, params);
+	if (err)
+		goto out;
+
+	err = tapdisk_vbd_open_vdi(b->vbd, path, type, storage,
+				   b->flags | (b->write ? 0 : TD_OPEN_RDONLY));
+	if (err)
+		goto out;
+
+	b->vbd->reopened = 1;
+	err = 0;
+
+out:
+	if (err)
+		fprintf(stderr, "failed to open %s: %d\n", path, err);
+	return err;
+}
+
+static void
+tapdisk_bench_close_image(struct tapdisk_bench *b)
+{
+	td_vbd_t *vbd;
+
+	vbd = tapdisk_server_get_vbd(0);
+	if (vbd) {
+		tapdisk_vbd_close_vdi(vbd);
+		tapdisk_server_remove_vbd(vbd);
+		free((void *)vbd->ring.vstart);
+		free(vbd->name);
+		free(vbd);
+		b->vbd = NULL;
+	}
+}
+
+static int
+tapdisk_bench_set_range(struct tapdisk_bench *b, uint64_t size)
+{
+	int err;
+	image_t image;
+
+	err = tapdisk_vbd_get_image_info(b->vbd, &image);
+	if (err) {
+		fprintf(stderr, "failed getting image size: %d\n", err);
+		return err;
+	}
+
+	if (!size)
+		size = image.size;
+	else
+		size >>= SECTOR_SHIFT;
+
+	if (size > image.size) {
+		fprintf(stderr, "0x%"PRIx64" past end of image 0x%"PRIx64"\n",
+			size, (uint64_t)image.size);
+		return -EINVAL;
+	}
+
+	b->range = size / b->secs;
+	if (!b->range) {
+		fprintf(stderr, "block size larger than the image\n");
+		return -EINVAL;
+	}
+
+	if (!b->count)
+		b->count = b->range;
+
+	b->lat = calloc(b->count, sizeof(*b->lat));
+	if (!b->lat)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static int
+tapdisk_bench_initialize_requests(struct tapdisk_bench *b)
+{
+	size_t size;
+	td_ring_t *ring;
+	int err, i, psize;
+
+	ring  = &b->vbd->ring;
+	psize = getpagesize();
+	size  = psize * BLKTAP_MMAP_REGION_SIZE;
+
+	/* sneaky -- set up ring->vstart so tapdisk_vbd will use our buffers */
+	err = posix_memalign((void **)&ring->vstart, psize, size);
+	if (err) {
+		fprintf(stderr, "failed to allocate buffers: %d\n", err);
+		ring->vstart = 0;
+		return err;
+	}
+	memset((void *)ring->vstart, 0x5a, size);
+
+	for (i = 0; i < b->depth; i++) {
+		struct tapdisk_bench_request *req = b->requests + i;
+		INIT_LIST_HEAD(&req->next);
+		list_add_tail(&req->next, &b->free_list);
+	}
+
+	return 0;
+}
+
+static int
+tapdisk_bench_register_enqueue_event(struct tapdisk_bench *b)
+{
+	int err;
+	struct tapdisk_bench_poll *p = &b->poll;
+
+	err = tapdisk_bench_poll_open(p);
+	if (err)
+		goto out;
+
+	err = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					    p->pipe[POLL_READ], 0,
+					    tapdisk_bench_enqueue, b);
+	if (err < 0)
+		goto out;
+
+	b->enqueue_event_id = err;
+	err = 0;
+
+out:
+	if (err)
+		fprintf(stderr, "failed to register event: %d\n", err);
+	return err;
+}
+
+static void
+tapdisk_bench_unregister_enqueue_event(struct tapdisk_bench *b)
+{
+	if (b->enqueue_event_id) {
+		tapdisk_server_unregister_event(b->enqueue_event_id);
+		b->enqueue_event_id = 0;
+	}
+	tapdisk_bench_poll_close(&b->poll);
+}
+
+static int
+tapdisk_bench_open(struct tapdisk_bench *b, const char *params,
+		   const char *path, int type, int storage, uint64_t size)
+{
+	int err;
+
+	err = tapdisk_bench_open_image(b, params, path, type, storage);
+	if (err)
+		return err;
+
+	err = tapdisk_bench_set_range(b, size);
+	if (err)
+		return err;
+
+	err = tapdisk_bench_initialize_requests(b);
+	if (err)
+		return err;
+
+	err = tapdisk_bench_register_enqueue_event(b);
+	if (err)
+		return err;
+
+	return 0;
+}
+
+static void
+tapdisk_bench_release(struct tapdisk_bench *b)
+{
+	tapdisk_bench_close_image(b);
+	tapdisk_bench_unregister_enqueue_event(b);
+	free(b->lat);
+}
+
+static int
+tapdisk_bench_cmp_lat(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+tapdisk_bench_report(struct tapdisk_bench *b)
+{
+	uint64_t i, n = b->completed, sum = 0, ns = b->end - b->begin;
+
+	printf("%s%s: bs=%u iodepth=%u ios=%"PRIu64"\n",
+	       (b->random ? "rand" : ""), (b->write ? "write" : "read"),
+	       b->secs << SECTOR_SHIFT, b->depth, n);
+
+	if (!n || !ns)
+		return;
+
+	qsort(b->lat, n, sizeof(*b->lat), tapdisk_bench_cmp_lat);
+	for (i = 0; i < n; i++)
+		sum += b->lat[i];
+
+	printf("  time %.3f s, %.0f IOPS, %.1f MB/s\n", ns / 1e9,
+	       n * 1e9 / ns, (double)n * (b->secs << SECTOR_SHIFT) * 1e3 / ns);
+	printf("  lat (usec): min=%.1f, avg=%.1f, max=%.1f\n",
+	       b->lat[0] / 1e3, (double)sum / n / 1e3, b->lat[n - 1] / 1e3);
+	printf("  lat (usec): p50=%.1f, p90=%.1f, p99=%.1f, p99.9=%.1f\n",
+	       b->lat[n * 50 / 100] / 1e3, b->lat[n * 90 / 100] / 1e3,
+	       b->lat[n * 99 / 100] / 1e3, b->lat[n * 999 / 1000] / 1e3);
+}
+
+static int
+tapdisk_bench_run(struct tapdisk_bench *b)
+{
+	int err;
+
+	b->begin = now_ns();
+	tapdisk_bench_enqueue(b->enqueue_event_id, SCHEDULER_POLL_READ_FD, b);
+
+	err = tapdisk_server_run();
+	if (err) {
+		fprintf(stderr, "failed to run tapdisk server: %d\n", err);
+		return err;
+	}
+
+	if (!b->end)
+		b->end = now_ns();
+	return b->err;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int c, err, type, storage;
+	const char *params, *mode, *path;
+	uint64_t bs, size;
+	struct tapdisk_bench bench;
+
+	err     = 0;
+	bs      = 4096;
+	size    = 0;
+	params  = NULL;
+	mode    = "randwrite";
+	storage = TAPDISK_STORAGE_TYPE_DEFAULT;
+
+	memset(&bench, 0, sizeof(bench));
+	INIT_LIST_HEAD(&bench.free_list);
+	INIT_LIST_HEAD(&bench.pending_list);
+	bench.depth = 32;
+
+	while ((c = getopt(argc, argv, "n:m:b:q:c:s:t:r:CVh")) != -1) {
+		switch (c) {
+		case 'n':
+			params = optarg;
+			break;
+		case 'm':
+			mode = optarg;
+			break;
+		case 'b':
+			bs = strtoull(optarg, NULL, 10);
+			break;
+		case 'q':
+			bench.depth = strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			bench.count = strtoull(optarg, NULL, 10);
+			break;
+		case 's':
+			size = strtoull(optarg, NULL, 10);
+			break;
+		case 't':
+			if (!strcmp(optarg, "nfs"))
+				storage = TAPDISK_STORAGE_TYPE_NFS;
+			else if (!strcmp(optarg, "lvm"))
+				storage = TAPDISK_STORAGE_TYPE_LVM;
+			else if (!strcmp(optarg, "ext"))
+				storage = TAPDISK_STORAGE_TYPE_EXT;
+			else
+				usage(argv[0], EINVAL);
+			break;
+		case 'r':
+			srandom(strtoul(optarg, NULL, 10));
+			break;
+		case 'C':
+			bench.flags |= TD_OPEN_ADD_CACHE;
+			break;
+		case 'V':
+			bench.verify = 1;
+			break;
+		default:
+			err = EINVAL;
+		case 'h':
+			usage(argv[0], err);
+		}
+	}
+
+	if (!params)
+		usage(argv[0], EINVAL);
+
+	if (!strcmp(mode, "read") || !strcmp(mode, "randread"))
+		bench.write = 0;
+	else if (!strcmp(mode, "write") || !strcmp(mode, "randwrite"))
+		bench.write = 1;
+	else
+		usage(argv[0], EINVAL);
+	bench.random = !strncmp(mode, "rand", 4);
+
+	if (!bs || bs % (1 << SECTOR_SHIFT) ||
+	    bs > BLKIF_MAX_SEGMENTS_PER_REQUEST * getpagesize()) {
+		fprintf(stderr, "invalid block size %"PRIu64"\n", bs);
+		return EINVAL;
+	}
+	bench.secs = bs >> SECTOR_SHIFT;
+
+	if (!bench.depth || bench.depth > MAX_REQUESTS) {
+		fprintf(stderr, "depth must be between 1 and %d\n",
+			(int)MAX_REQUESTS);
+		return EINVAL;
+	}
+
+	type = tapdisk_disktype_parse_params(params, &path);
+	if (type < 0) {
+		err = type;
+		fprintf(stderr, "invalid argument %s: %d\n", params, err);
+		return err;
+	}
+
+	tapdisk_start_logging("tapdisk-bench");
+
+	err = tapdisk_bench_open(&bench, params, path, type, storage, size);
+	if (err)
+		goto out;
+
+	err = tapdisk_bench_run(&bench);
+	if (err >= 0)
+		tapdisk_bench_report(&bench);
+
+out:
+	tapdisk_bench_release(&bench);
+	tapdisk_stop_logging();
+	return err;
+}
@@ -0,0 +1,501 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tapdisk.h"
+#include "tapdisk-shmcache.h"
+
+#define TD_SHMCACHE_MAGIC              0x74647363 /* "tdsc" */
+#define TD_SHMCACHE_VERSION            1
+#define TD_SHMCACHE_WAYS               8
+#define TD_SHMCACHE_FILL_TIMEOUT       10 /* seconds */
+
+#define TD_SHMCACHE_EMPTY              0
+#define TD_SHMCACHE_FILLING            1
+#define TD_SHMCACHE_VALID              2
+
+typedef struct td_shmcache_entry       td_shmcache_entry_t;
+typedef struct td_shmcache_set         td_shmcache_set_t;
+
+struct td_shmcache_entry {
+	td_shmcache_key_t               key;
+	uint32_t                        state;
+	uint32_t                        ref;
+	pid_t                           owner;
+	uint32_t                        stamp;
+};
+
+struct td_shmcache_set {
+	pthread_mutex_t                 lock;
+	uint32_t                        hand;
+	td_shmcache_entry_t             entries[TD_SHMCACHE_WAYS];
+};
+
+struct td_shmcache_header {
+	uint32_t                        magic;
+	uint32_t                        version;
+	uint64_t                        size;
+	uint64_t                        sets;
+	uint64_t                        data;
+	uint64_t                        used;
+	td_shmcache_stats_t             stats;
+	td_shmcache_set_t               set[0];
+};
+
+#define shmcache_stat(_c, _f)						\
+	__sync_fetch_and_add(&(_c)->hdr->stats._f, 1)
+
+static inline uint32_t
+shmcache_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static inline td_shmcache_set_t *
+shmcache_set(td_shmcache_t *cache, const td_shmcache_key_t *key)
+{
+	uint64_t h, u[2];
+
+	memcpy(u, key->uuid, sizeof(u));
+
+	h  = u[0] ^ (u[1] * 0x9e3779b97f4a7c15ULL) ^ key->block;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+
+	return cache->hdr->set + h % cache->hdr->sets;
+}
+
+static inline char *
+shmcache_block(td_shmcache_t *cache,
+	       td_shmcache_set_t *set, td_shmcache_entry_t *entry)
+{
+	uint64_t idx;
+
+	idx = (set - cache->hdr->set) * TD_SHMCACHE_WAYS +
+		(entry - set->entries);
+
+	return (char *)cache->hdr + cache->hdr->data +
+		(idx << TD_SHMCACHE_BLOCK_SHIFT);
+}
+
+static void
+shmcache_clear_set(td_shmcache_t *cache, td_shmcache_set_t *set)
+{
+	int i;
+	td_shmcache_entry_t *entry;
+
+	for (i = 0; i < TD_SHMCACHE_WAYS; i++) {
+		entry = set->entries + i;
+		if (entry->state == TD_SHMCACHE_VALID)
+			__sync_fetch_and_sub(&cache->hdr->used, 1);
+		memset(entry, 0, sizeof(*entry));
+	}
+}
+
+static int
+shmcache_lock(td_shmcache_t *cache, td_shmcache_set_t *set)
+{
+	int err;
+
+	err = pthread_mutex_lock(&set->lock);
+	if (err == EOWNERDEAD) {
+		/* the owner died holding the lock; trust nothing in the set */
+		shmcache_clear_set(cache, set);
+		err = pthread_mutex_consistent(&set->lock);
+	}
+
+	return -err;
+}
+
+static inline void
+shmcache_unlock(td_shmcache_set_t *set)
+{
+	pthread_mutex_unlock(&set->lock);
+}
+
+/*
+ * a fill is abandoned if its owner has gone away, or is taking so long
+ * that reading the block again is the better bet
+ */
+static int
+shmcache_fill_stale(td_shmcache_entry_t *entry)
+{
+	if (shmcache_now() - entry->stamp >= TD_SHMCACHE_FILL_TIMEOUT)
+		return 1;
+
+	return (kill(entry->owner, 0) == -1 && errno == ESRCH);
+}
+
+static td_shmcache_entry_t *
+shmcache_find(td_shmcache_set_t *set, const td_shmcache_key_t *key)
+{
+	int i;
+	td_shmcache_entry_t *entry;
+
+	for (i = 0; i < TD_SHMCACHE_WAYS; i++) {
+		entry = set->entries + i;
+		if (entry->state != TD_SHMCACHE_EMPTY &&
+		    entry->key.block == key->block &&
+		    !memcmp(entry->key.uuid, key->uuid, sizeof(key->uuid)))
+			return entry;
+	}
+
+	return NULL;
+}
+
+static td_shmcache_entry_t *
+shmcache_find_reserved(td_shmcache_set_t *set, const td_shmcache_key_t *key)
+{
+	td_shmcache_entry_t *entry;
+
+	entry = shmcache_find(set, key);
+	if (!entry || entry->state != TD_SHMCACHE_FILLING ||
+	    entry->owner != getpid())
+		return NULL;
+
+	return entry;
+}
+
+/*
+ * CLOCK replacement: a block that was read since the hand last passed
+ * it gets another round.  Blocks being filled are skipped.
+ */
+static td_shmcache_entry_t *
+shmcache_victim(td_shmcache_set_t *set)
+{
+	int i;
+	td_shmcache_entry_t *entry;
+
+	for (i = 0; i < TD_SHMCACHE_WAYS; i++)
+		if (set->entries[i].state == TD_SHMCACHE_EMPTY)
+			return set->entries + i;
+
+	for (i = 0; i < 2 * TD_SHMCACHE_WAYS; i++) {
+		entry     = set->entries + set->hand;
+		set->hand = (set->hand + 1) % TD_SHMCACHE_WAYS;
+
+		if (entry->state == TD_SHMCACHE_FILLING) {
+			if (shmcache_fill_stale(entry))
+				return entry;
+			continue;
+		}
+
+		if (entry->ref) {
+			entry->ref = 0;
+			continue;
+		}
+
+		return entry;
+	}
+
+	return NULL;
+}
+
+int
+tapdisk_shmcache_lookup(td_shmcache_t *cache,
+			const td_shmcache_key_t *key, char *buf, int retry)
+{
+	int err;
+	td_shmcache_set_t *set;
+	td_shmcache_entry_t *entry;
+
+	if (!retry)
+		shmcache_stat(cache, lookups);
+
+	set = shmcache_set(cache, key);
+	err = shmcache_lock(cache, set);
+	if (err) {
+		shmcache_stat(cache, bypasses);
+		return -EBUSY;
+	}
+
+	entry = shmcache_find(set, key);
+	if (entry && entry->state == TD_SHMCACHE_VALID) {
+		memcpy(buf, shmcache_block(cache, set, entry),
+		       TD_SHMCACHE_BLOCK_SIZE);
+		entry->ref = 1;
+		if (!retry)
+			shmcache_stat(cache, hits);
+		err = 0;
+		goto out;
+	}
+
+	if (entry && !shmcache_fill_stale(entry)) {
+		if (!retry)
+			shmcache_stat(cache, waits);
+		err = -EINPROGRESS;
+		goto out;
+	}
+
+	if (!entry) {
+		entry = shmcache_victim(set);
+		if (!entry) {
+			shmcache_stat(cache, bypasses);
+			err = -EBUSY;
+			goto out;
+		}
+	}
+
+	if (entry->state == TD_SHMCACHE_VALID) {
+		__sync_fetch_and_sub(&cache->hdr->used, 1);
+		shmcache_stat(cache, evictions);
+	}
+
+	entry->key   = *key;
+	entry->state = TD_SHMCACHE_FILLING;
+	entry->ref   = 0;
+	entry->owner = getpid();
+	entry->stamp = shmcache_now();
+
+	shmcache_stat(cache, misses);
+	err = -ENOENT;
+
+out:
+	shmcache_unlock(set);
+	return err;
+}
+
+void
+tapdisk_shmcache_fill(td_shmcache_t *cache,
+		      const td_shmcache_key_t *key, const char *buf)
+{
+	td_shmcache_set_t *set;
+	td_shmcache_entry_t *entry;
+
+	set = shmcache_set(cache, key);
+	if (shmcache_lock(cache, set))
+		return;
+
+	/* the reservation is gone if the cache was flushed meanwhile */
+	entry = shmcache_find_reserved(set, key);
+	if (entry) {
+		memcpy(shmcache_block(cache, set, entry), buf,
+		       TD_SHMCACHE_BLOCK_SIZE);
+		entry->state = TD_SHMCACHE_VALID;
+		entry->ref   = 1;
+		__sync_fetch_and_add(&cache->hdr->used, 1);
+		shmcache_stat(cache, fills);
+	}
+
+	shmcache_unlock(set);
+}
+
+void
+tapdisk_shmcache_abort(td_shmcache_t *cache, const td_shmcache_key_t *key)
+{
+	td_shmcache_set_t *set;
+	td_shmcache_entry_t *entry;
+
+	set = shmcache_set(cache, key);
+	if (shmcache_lock(cache, set))
+		return;
+
+	entry = shmcache_find_reserved(set, key);
+	if (entry)
+		memset(entry, 0, sizeof(*entry));
+
+	shmcache_unlock(set);
+}
+
+void
+tapdisk_shmcache_flush(td_shmcache_t *cache)
+{
+	uint64_t i;
+	td_shmcache_set_t *set;
+
+	for (i = 0; i < cache->hdr->sets; i++) {
+		set = cache->hdr->set + i;
+		if (shmcache_lock(cache, set))
+			continue;
+		shmcache_clear_set(cache, set);
+		shmcache_unlock(set);
+	}
+}
+
+void
+tapdisk_shmcache_get_stats(td_shmcache_t *cache, td_shmcache_stats_t *stats)
+{
+	*stats = cache->hdr->stats;
+}
+
+void
+tapdisk_shmcache_reset_stats(td_shmcache_t *cache)
+{
+	memset(&cache->hdr->stats, 0, sizeof(cache->hdr->stats));
+}
+
+uint64_t
+tapdisk_shmcache_blocks(td_shmcache_t *cache)
+{
+	return cache->hdr->sets * TD_SHMCACHE_WAYS;
+}
+
+uint64_t
+tapdisk_shmcache_used(td_shmcache_t *cache)
+{
+	return cache->hdr->used;
+}
+
+static int
+shmcache_initialize(td_shmcache_header_t *hdr, uint64_t size)
+{
+	int err;
+	uint64_t i, sets, meta;
+	pthread_mutexattr_t attr;
+
+	sets = size / (sizeof(td_shmcache_set_t) +
+		       TD_SHMCACHE_WAYS * TD_SHMCACHE_BLOCK_SIZE);
+	for (; sets; sets--) {
+		meta = sizeof(*hdr) + sets * sizeof(td_shmcache_set_t);
+		meta = (meta + TD_SHMCACHE_BLOCK_SIZE - 1) &
+			~(uint64_t)(TD_SHMCACHE_BLOCK_SIZE - 1);
+		if (meta + sets * TD_SHMCACHE_WAYS *
+		    TD_SHMCACHE_BLOCK_SIZE <= size)
+			break;
+	}
+	if (!sets)
+		return -EINVAL;
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->size = size;
+	hdr->sets = sets;
+	hdr->data = meta;
+
+	err = pthread_mutexattr_init(&attr);
+	if (err)
+		return -err;
+
+	err = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	if (!err)
+		err = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+
+	for (i = 0; !err && i < sets; i++) {
+		memset(hdr->set + i, 0, sizeof(td_shmcache_set_t));
+		err = pthread_mutex_init(&hdr->set[i].lock, &attr);
+	}
+
+	pthread_mutexattr_destroy(&attr);
+	if (err)
+		return -err;
+
+	hdr->version = TD_SHMCACHE_VERSION;
+	hdr->magic   = TD_SHMCACHE_MAGIC;
+
+	return 0;
+}
+
+int
+tapdisk_shmcache_open(td_shmcache_t *cache, uint64_t size, int reset)
+{
+	int err, fd;
+	void *base;
+	struct stat st;
+	td_shmcache_header_t *hdr;
+
+	memset(cache, 0, sizeof(*cache));
+	cache->fd = -1;
+
+	if (reset)
+		shm_unlink(TD_SHMCACHE_NAME);
+
+	fd = shm_open(TD_SHMCACHE_NAME, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+	if (fd == -1)
+		return -errno;
+
+	/* whoever creates the segment initializes it under the lock */
+	if (flock(fd, LOCK_EX) || fstat(fd, &st)) {
+		err = -errno;
+		goto fail;
+	}
+
+	if (!st.st_size) {
+		if (ftruncate(fd, size)) {
+			err = -errno;
+			goto fail;
+		}
+		st.st_size = size;
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		err = -errno;
+		goto fail;
+	}
+
+	hdr = base;
+	if (hdr->magic != TD_SHMCACHE_MAGIC) {
+		/* new, or its creator died before initializing it */
+		err = shmcache_initialize(hdr, st.st_size);
+		if (err)
+			goto fail_map;
+	} else if (hdr->version != TD_SHMCACHE_VERSION ||
+		   hdr->size != st.st_size) {
+		EPRINTF("%s: incompatible cache segment (version %u)\n",
+			TD_SHMCACHE_NAME, hdr->version);
+		err = -EINVAL;
+		goto fail_map;
+	}
+
+	flock(fd, LOCK_UN);
+
+	cache->fd   = fd;
+	cache->size = st.st_size;
+	cache->hdr  = hdr;
+
+	return 0;
+
+fail_map:
+	munmap(base, st.st_size);
+fail:
+	close(fd);
+	return err;
+}
+
+void
+tapdisk_shmcache_close(td_shmcache_t *cache)
+{
+	if (cache->hdr)
+		munmap(cache->hdr, cache->size);
+	if (cache->fd != -1)
+		close(cache->fd);
+
+	memset(cache, 0, sizeof(*cache));
+	cache->fd = -1;
+}
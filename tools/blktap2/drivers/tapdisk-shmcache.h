@@ -0,0 +1,114 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _TAPDISK_SHMCACHE_H_
+#define _TAPDISK_SHMCACHE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Host-wide cache of read-only image blocks in a POSIX shared memory
+ * segment, which every tapdisk process on the host maps.  Blocks are
+ * keyed by the UUID of the image they belong to and their index, so
+ * that all VMs sharing a parent image share its cached blocks.
+ *
+ * The cache is set associative; each set is protected by a robust,
+ * process shared mutex and replaces its blocks in CLOCK order.  A
+ * process that misses a block reserves its entry while reading it from
+ * storage, and others looking for the same block wait for that fill
+ * instead of reading it themselves.
+ */
+
+#define TD_SHMCACHE_NAME               "/tapdisk-block-cache"
+#define TD_SHMCACHE_BLOCK_SHIFT        12 /* 4K blocks */
+#define TD_SHMCACHE_BLOCK_SIZE         (1 << TD_SHMCACHE_BLOCK_SHIFT)
+#define TD_SHMCACHE_DEFAULT_SIZE       (128ULL << 20)
+#define TD_SHMCACHE_UUID_SIZE          16
+
+typedef struct td_shmcache             td_shmcache_t;
+typedef struct td_shmcache_key         td_shmcache_key_t;
+typedef struct td_shmcache_stats       td_shmcache_stats_t;
+typedef struct td_shmcache_header      td_shmcache_header_t;
+
+struct td_shmcache_key {
+	uint8_t                         uuid[TD_SHMCACHE_UUID_SIZE];
+	uint64_t                        block;
+};
+
+/*
+ * Host-wide counters, in blocks.  Every read is a lookup, and is then
+ * either a hit, a miss (read from storage to fill the cache), a wait
+ * (for another process to fill the block) or a bypass.
+ */
+struct td_shmcache_stats {
+	uint64_t                        lookups;
+	uint64_t                        hits;
+	uint64_t                        misses;
+	uint64_t                        waits;
+	uint64_t                        fills;
+	uint64_t                        evictions;
+	uint64_t                        bypasses;
+};
+
+struct td_shmcache {
+	int                             fd;
+	size_t                          size;
+	td_shmcache_header_t           *hdr;
+};
+
+/*
+ * Map the cache segment, creating it with @size bytes if it does not
+ * exist yet.  If @reset is set, an existing segment is replaced by a
+ * new one; processes which mapped the old one keep using it until
+ * they reopen the cache.
+ */
+int tapdisk_shmcache_open(td_shmcache_t *, uint64_t size, int reset);
+void tapdisk_shmcache_close(td_shmcache_t *);
+
+/*
+ * Look up a block.  @retry is set when looking up a block again after
+ * -EINPROGRESS, so that each read is only counted once.  Returns:
+ *   0             hit, the block has been copied to @buf
+ *   -ENOENT       miss, the entry is reserved for the caller, who must
+ *                 either fill it with tapdisk_shmcache_fill() or drop it
+ *                 with tapdisk_shmcache_abort()
+ *   -EINPROGRESS  another process is filling the block; try again later
+ *   -EBUSY        the block cannot be cached right now
+ */
+int tapdisk_shmcache_lookup(td_shmcache_t *,
+			    const td_shmcache_key_t *, char *buf, int retry);
+void tapdisk_shmcache_fill(td_shmcache_t *,
+			   const td_shmcache_key_t *, const char *buf);
+void tapdisk_shmcache_abort(td_shmcache_t *, const td_shmcache_key_t *);
+
+/* drop every cached block, e.g. after an image has been modified */
+void tapdisk_shmcache_flush(td_shmcache_t *);
+
+void tapdisk_shmcache_get_stats(td_shmcache_t *, td_shmcache_stats_t *);
+void tapdisk_shmcache_reset_stats(td_shmcache_t *);
+uint64_t tapdisk_shmcache_blocks(td_shmcache_t *);
+uint64_t tapdisk_shmcache_used(td_shmcache_t *);
+
+#endif
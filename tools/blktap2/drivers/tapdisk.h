@@ -120,6 +120,7 @@ struct td_disk_info {
 	td_sector_t                  size;
         uint64_t                     sector_size;
 	uint32_t                     info;
+	uint8_t                      uuid[16]; /* zero if unknown */
 };
 
 struct td_request {
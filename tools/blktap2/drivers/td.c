@@ -39,6 +39,7 @@
 #include "libvhd.h"
 #include "vhd-util.h"
 #include "tapdisk-utils.h"
+#include "tapdisk-shmcache.h"
 
 #if 1
 #define DFPRINTF(_f, _a...) fprintf ( stdout, _f , ## _a )
@@ -67,6 +68,7 @@ typedef enum {
 	TD_CMD_QUERY,
 /* 	TD_CMD_RESIZE,         */
 	TD_CMD_SET,
+	TD_CMD_CACHE,
 /*	TD_CMD_REPAIR,         */
 /*	TD_CMD_FILL,           */
 /*	TD_CMD_READ,           */
@@ -86,6 +88,7 @@ struct command commands[TD_CMD_INVALID] = {
 	{ .id =	TD_CMD_QUERY,    .name = "query",    .needs_type = 1 },
 /*	{ .id =	TD_CMD_RESIZE,   .name = "resize",   .needs_type = 1 },    */
 	{ .id = TD_CMD_SET,      .name = "set",      .needs_type = 1 },
+	{ .id = TD_CMD_CACHE,    .name = "cache",    .needs_type = 0 },
 /*	{ .id = TD_CMD_REPAIR,   .name = "repair",   .needs_type = 1 },    */
 /*	{ .id = TD_CMD_FILL,     .name = "fill",     .needs_type = 1 },    */
 /*	{ .id = TD_CMD_READ,     .name = "read",     .needs_type = 1 },    */
@@ -595,6 +598,74 @@ td_set_field(int type, int argc, char *argv[])
 	return EINVAL;
 }
 
+int
+td_cache(int argc, char *argv[])
+{
+	int c, reset = 0, flush = 0, zero = 0, err;
+	uint64_t size = TD_SHMCACHE_DEFAULT_SIZE;
+	td_shmcache_stats_t stats;
+	td_shmcache_t cache;
+
+	while ((c = getopt(argc, argv, "hs:fz")) != -1) {
+		switch(c) {
+		case 's':
+			size  = strtoull(optarg, NULL, 10) << 20;
+			reset = 1;
+			break;
+		case 'f':
+			flush = 1;
+			break;
+		case 'z':
+			zero = 1;
+			break;
+		case 'h':
+			err = 0;
+			goto usage;
+		default:
+			err = EINVAL;
+			goto usage;
+		}
+	}
+
+	if (optind != argc || (reset && !size)) {
+		err = EINVAL;
+		goto usage;
+	}
+
+	err = tapdisk_shmcache_open(&cache, size, reset);
+	if (err) {
+		fprintf(stderr, "failed opening %s: %d\n",
+			TD_SHMCACHE_NAME, err);
+		return -err;
+	}
+
+	if (flush)
+		tapdisk_shmcache_flush(&cache);
+
+	tapdisk_shmcache_get_stats(&cache, &stats);
+	if (zero)
+		tapdisk_shmcache_reset_stats(&cache);
+
+	printf("size: %"PRIu64" MB\n", (uint64_t)cache.size >> 20);
+	printf("blocks: %"PRIu64"\n", tapdisk_shmcache_blocks(&cache));
+	printf("used: %"PRIu64"\n", tapdisk_shmcache_used(&cache));
+	printf("lookups: %"PRIu64"\n", stats.lookups);
+	printf("hits: %"PRIu64"\n", stats.hits);
+	printf("misses: %"PRIu64"\n", stats.misses);
+	printf("waits: %"PRIu64"\n", stats.waits);
+	printf("fills: %"PRIu64"\n", stats.fills);
+	printf("evictions: %"PRIu64"\n", stats.evictions);
+	printf("bypasses: %"PRIu64"\n", stats.bypasses);
+
+	tapdisk_shmcache_close(&cache);
+	return 0;
+
+ usage:
+	fprintf(stderr, "usage: td-util cache [-h help] [-s size (MB), "
+		"recreates the cache] [-f flush] [-z zero counters]\n");
+	return err;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -668,6 +739,9 @@ main(int argc, char *argv[])
 	case TD_CMD_SET:
 		ret = td_set_field(type, cargc, cargv);
 		break;
+	case TD_CMD_CACHE:
+		ret = td_cache(cargc, cargv);
+		break;
 /*
 	case TD_CMD_REPAIR:
 		ret = td_repair(type, cargc, cargv);
@@ -110,6 +110,102 @@ static inline int send_notify(struct libxenvchan *ctrl, uint8_t bit)
 		return 0;
 }
 
+/*
+ * Notify the peer of size more bytes written (VCHAN_NOTIFY_WRITE) or read
+ * (VCHAN_NOTIFY_READ), unless less than the notification threshold has
+ * accumulated since the last notification.
+ */
+static inline int notify_after(struct libxenvchan *ctrl, uint8_t bit, size_t size)
+{
+	size_t *pending = (bit == VCHAN_NOTIFY_WRITE) ?
+		&ctrl->write_pending : &ctrl->read_pending;
+
+	*pending += size;
+	if (*pending < ctrl->notify_threshold)
+		return 0;
+	*pending = 0;
+	return send_notify(ctrl, bit);
+}
+
+void libxenvchan_set_notify_threshold(struct libxenvchan *ctrl, size_t threshold)
+{
+	ctrl->notify_threshold = threshold;
+}
+
+int libxenvchan_flush(struct libxenvchan *ctrl)
+{
+	int ret = 0;
+
+	if (ctrl->write_pending) {
+		ctrl->write_pending = 0;
+		ret |= send_notify(ctrl, VCHAN_NOTIFY_WRITE);
+	}
+	if (ctrl->read_pending) {
+		ctrl->read_pending = 0;
+		ret |= send_notify(ctrl, VCHAN_NOTIFY_READ);
+	}
+	return ret ? -1 : 0;
+}
+
+/*
+ * Describe size bytes of a ring, starting at index idx; the second part is
+ * only used if the region wraps around the end of the ring.
+ */
+static inline void ring_region(void *ring, uint32_t ring_size, uint32_t idx,
+			       size_t size, struct iovec region[2])
+{
+	uint32_t real_idx = idx & (ring_size - 1);
+	size_t avail_contig = ring_size - real_idx;
+	if (avail_contig > size)
+		avail_contig = size;
+	region[0].iov_base = ring + real_idx;
+	region[0].iov_len = avail_contig;
+	region[1].iov_base = ring;
+	region[1].iov_len = size - avail_contig;
+}
+
+/*
+ * Copy len bytes from src to dst, skipping the first sskip bytes of src and
+ * the first dskip bytes of dst.  Both must be large enough.
+ */
+static void iov_copy(const struct iovec *dst, size_t dskip,
+		     const struct iovec *src, size_t sskip, size_t len)
+{
+	size_t n;
+
+	while (len) {
+		while (dskip >= dst->iov_len) {
+			dskip -= dst->iov_len;
+			dst++;
+		}
+		while (sskip >= src->iov_len) {
+			sskip -= src->iov_len;
+			src++;
+		}
+		n = dst->iov_len - dskip;
+		if (n > src->iov_len - sskip)
+			n = src->iov_len - sskip;
+		if (n > len)
+			n = len;
+		memcpy(dst->iov_base + dskip, src->iov_base + sskip, n);
+		dskip += n;
+		sskip += n;
+		len -= n;
+	}
+}
+
+static inline ssize_t iov_length(const struct iovec *iov, int iovcnt)
+{
+	size_t size = 0;
+	int i;
+
+	if (iovcnt < 0)
+		return -1;
+	for (i = 0; i < iovcnt; i++)
+		size += iov[i].iov_len;
+	return size;
+}
+
 /*
  * Get the amount of buffer space available, and do nothing about
  * notifications.
@@ -196,7 +292,12 @@ int libxenvchan_buffer_space(struct libxenvchan *ctrl)
 
 int libxenvchan_wait(struct libxenvchan *ctrl)
 {
-	int ret = xenevtchn_pending(ctrl->event);
+	int ret;
+
+	/* The peer may be waiting for a notification we held back. */
+	if (libxenvchan_flush(ctrl))
+		return -1;
+	ret = xenevtchn_pending(ctrl->event);
 	if (ret < 0)
 		return -1;
 	xenevtchn_unmask(ctrl->event, ret);
@@ -223,7 +324,7 @@ static int do_send(struct libxenvchan *ctrl, const void *data, size_t size)
 	}
 	xen_wmb(); /* write data /then/ notify */
 	wr_prod(ctrl) += size;
-	if (send_notify(ctrl, VCHAN_NOTIFY_WRITE))
+	if (notify_after(ctrl, VCHAN_NOTIFY_WRITE, size))
 		return -1;
 	return size;
 }
@@ -299,7 +400,7 @@ static int do_recv(struct libxenvchan *ctrl, void *data, size_t size)
 	}
 	xen_mb(); /* consume /then/ notify */
 	rd_cons(ctrl) += size;
-	if (send_notify(ctrl, VCHAN_NOTIFY_READ))
+	if (notify_after(ctrl, VCHAN_NOTIFY_READ, size))
 		return -1;
 	return size;
 }
@@ -342,6 +443,143 @@ int libxenvchan_read(struct libxenvchan *ctrl, void *data, size_t size)
 	}
 }
 
+int libxenvchan_writev(struct libxenvchan *ctrl, const struct iovec *iov, int iovcnt)
+{
+	struct iovec region[2];
+	ssize_t len = iov_length(iov, iovcnt);
+	size_t size = len, pos = 0;
+	int avail;
+
+	if (len < 0 || !libxenvchan_is_open(ctrl))
+		return -1;
+	while (1) {
+		avail = fast_get_buffer_space(ctrl, size - pos);
+		if (pos + avail > size)
+			avail = size - pos;
+		if (avail) {
+			ring_region(wr_ring(ctrl), wr_ring_size(ctrl),
+				    wr_prod(ctrl), avail, region);
+			xen_mb(); /* read indexes /then/ write data */
+			iov_copy(region, 0, iov, pos, avail);
+			xen_wmb(); /* write data /then/ notify */
+			wr_prod(ctrl) += avail;
+			ctrl->write_pending += avail;
+			pos += avail;
+		}
+		if (pos == size || !ctrl->blocking)
+			break;
+		if (libxenvchan_wait(ctrl))
+			return -1;
+		if (!libxenvchan_is_open(ctrl))
+			return -1;
+	}
+	/* One notification for everything written by this call */
+	if (pos && notify_after(ctrl, VCHAN_NOTIFY_WRITE, 0))
+		return -1;
+	return pos;
+}
+
+int libxenvchan_readv(struct libxenvchan *ctrl, const struct iovec *iov, int iovcnt)
+{
+	struct iovec region[2];
+	ssize_t len = iov_length(iov, iovcnt);
+	size_t size = len;
+
+	if (len < 0)
+		return -1;
+	while (1) {
+		int avail = fast_get_data_ready(ctrl, size);
+		if (avail && size > avail)
+			size = avail;
+		if (avail) {
+			ring_region((void *)rd_ring(ctrl), rd_ring_size(ctrl),
+				    rd_cons(ctrl), size, region);
+			xen_rmb(); /* data read must happen /after/ rd_cons read */
+			iov_copy(iov, 0, region, 0, size);
+			xen_mb(); /* consume /then/ notify */
+			rd_cons(ctrl) += size;
+			if (notify_after(ctrl, VCHAN_NOTIFY_READ, size))
+				return -1;
+			return size;
+		}
+		if (!libxenvchan_is_open(ctrl))
+			return -1;
+		if (!ctrl->blocking)
+			return 0;
+		if (libxenvchan_wait(ctrl))
+			return -1;
+	}
+}
+
+int libxenvchan_write_reserve(struct libxenvchan *ctrl, struct iovec iov[2], size_t size)
+{
+	int avail;
+	while (1) {
+		if (!libxenvchan_is_open(ctrl))
+			return -1;
+		avail = fast_get_buffer_space(ctrl, size);
+		if (size <= avail) {
+			ring_region(wr_ring(ctrl), wr_ring_size(ctrl),
+				    wr_prod(ctrl), size, iov);
+			xen_mb(); /* read indexes /then/ write data */
+			ctrl->write_reserved = size;
+			return size;
+		}
+		if (!ctrl->blocking)
+			return 0;
+		if (size > wr_ring_size(ctrl))
+			return -1;
+		if (libxenvchan_wait(ctrl))
+			return -1;
+	}
+}
+
+int libxenvchan_write_commit(struct libxenvchan *ctrl, size_t size)
+{
+	if (size > ctrl->write_reserved)
+		return -1;
+	ctrl->write_reserved = 0;
+	xen_wmb(); /* write data /then/ notify */
+	wr_prod(ctrl) += size;
+	if (notify_after(ctrl, VCHAN_NOTIFY_WRITE, size))
+		return -1;
+	return size;
+}
+
+int libxenvchan_read_peek(struct libxenvchan *ctrl, struct iovec iov[2], size_t size)
+{
+	while (1) {
+		int avail = fast_get_data_ready(ctrl, size);
+		if (avail && size > avail)
+			size = avail;
+		if (avail) {
+			ring_region((void *)rd_ring(ctrl), rd_ring_size(ctrl),
+				    rd_cons(ctrl), size, iov);
+			xen_rmb(); /* data read must happen /after/ rd_cons read */
+			ctrl->read_peeked = size;
+			return size;
+		}
+		if (!libxenvchan_is_open(ctrl))
+			return -1;
+		if (!ctrl->blocking)
+			return 0;
+		if (libxenvchan_wait(ctrl))
+			return -1;
+	}
+}
+
+int libxenvchan_read_release(struct libxenvchan *ctrl, size_t size)
+{
+	if (size > ctrl->read_peeked)
+		return -1;
+	ctrl->read_peeked = 0;
+	xen_mb(); /* consume /then/ notify */
+	rd_cons(ctrl) += size;
+	if (notify_after(ctrl, VCHAN_NOTIFY_READ, size))
+		return -1;
+	return size;
+}
+
 int libxenvchan_is_open(struct libxenvchan* ctrl)
 {
 	if (ctrl->is_server)
@@ -373,6 +611,8 @@ void libxenvchan_close(struct libxenvchan *ctrl)
 		}
 	}
 	if (ctrl->event) {
+		/* The unconditional notify below also covers anything held
+		 * back by the notification threshold. */
 		if (ctrl->ring)
 			xenevtchn_notify(ctrl->event, ctrl->event_port);
 		xenevtchn_close(ctrl->event);
@@ -42,6 +42,7 @@
  *  compile time, so the macros in ring.h cannot be used to access the rings.
  */
 
+#include <sys/uio.h>
 #include <xen/io/libxenvchan.h>
 #include <xen/sys/evtchn.h>
 #include <xenevtchn.h>
@@ -85,6 +86,12 @@ struct libxenvchan {
 	int blocking:1;
 	/* communication rings */
 	struct libxenvchan_ring read, write;
+	/* bytes moved before the peer is notified; 0 notifies on every call */
+	size_t notify_threshold;
+	/* bytes written/read since the peer was last notified */
+	size_t write_pending, read_pending;
+	/* size of the region handed out by the last reserve/peek call */
+	size_t write_reserved, read_peeked;
 };
 
 /**
@@ -152,6 +159,66 @@ int libxenvchan_send(struct libxenvchan *ctrl, const void *data, size_t size);
  *         the vchan is nonblocking)
  */
 int libxenvchan_write(struct libxenvchan *ctrl, const void *data, size_t size);
+/**
+ * Stream-based scatter-gather send: like libxenvchan_write(), for the data
+ * described by an array of iovecs.  The peer is notified once per call.
+ */
+int libxenvchan_writev(struct libxenvchan *ctrl, const struct iovec *iov, int iovcnt);
+/**
+ * Stream-based scatter-gather receive: like libxenvchan_read(), into the
+ * buffers described by an array of iovecs.
+ */
+int libxenvchan_readv(struct libxenvchan *ctrl, const struct iovec *iov, int iovcnt);
+/**
+ * In-place send, first step: get the free space of the send ring for
+ * writing $size bytes directly into the ring.  As the ring wraps around,
+ * the space is described by two iovecs, the second of which may be empty.
+ * The data is not visible to the peer until libxenvchan_write_commit().
+ * @param ctrl The vchan control structure
+ * @param iov Filled with the location of the space
+ * @param size Amount of space needed
+ * @return -1 on error, 0 if nonblocking and insufficient space is available, or $size
+ */
+int libxenvchan_write_reserve(struct libxenvchan *ctrl, struct iovec iov[2], size_t size);
+/**
+ * In-place send, second step: pass the first $size bytes of the space got
+ * from libxenvchan_write_reserve() to the peer.
+ * @return -1 on error (including $size exceeding the reserved space), or $size
+ */
+int libxenvchan_write_commit(struct libxenvchan *ctrl, size_t size);
+/**
+ * In-place receive, first step: get the location of up to $size bytes of
+ * data in the receive ring, described by two iovecs like for
+ * libxenvchan_write_reserve().  The data stays in the ring until
+ * libxenvchan_read_release().  Note that the peer is able to modify the
+ * data while it is being accessed in place.
+ * @param ctrl The vchan control structure
+ * @param iov Filled with the location of the data
+ * @param size Maximum amount of data wanted
+ * @return -1 on error, otherwise the amount of data available (which may be
+ *         zero if the vchan is nonblocking)
+ */
+int libxenvchan_read_peek(struct libxenvchan *ctrl, struct iovec iov[2], size_t size);
+/**
+ * In-place receive, second step: hand the first $size bytes of the data got
+ * from libxenvchan_read_peek() back to the peer.
+ * @return -1 on error (including $size exceeding the data peeked at), or $size
+ */
+int libxenvchan_read_release(struct libxenvchan *ctrl, size_t size);
+/**
+ * Coalesce notifications: only notify the peer of sent or consumed data
+ * once at least $threshold bytes have accumulated, instead of on every
+ * call.  The default of 0 notifies on every call.  Notifications still
+ * pending are sent by libxenvchan_flush(), and before blocking in any
+ * libxenvchan call.  Callers who wait on libxenvchan_fd_for_select()
+ * themselves must call libxenvchan_flush() before doing so.
+ */
+void libxenvchan_set_notify_threshold(struct libxenvchan *ctrl, size_t threshold);
+/**
+ * Send any notification held back by the notification threshold.
+ * @return -1 on error, 0 on success
+ */
+int libxenvchan_flush(struct libxenvchan *ctrl);
 /**
  * Waits for reads or writes to unblock, or for a close
  */
@@ -0,0 +1,273 @@
+/**
+ * @file
+ * @section LICENSE
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ *
+ *  Throughput and latency benchmark for libxenvchan.  The server and the
+ *  client run as two processes of the same domain, connected through a
+ *  vchan to that domain.  Messages are streamed from the server to the
+ *  client, first copied through the ring with libxenvchan_send() and
+ *  libxenvchan_read(), then written and read in place; afterwards small
+ *  messages are bounced between the two to measure the round trip time.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include <libxenvchan.h>
+
+static size_t msg_size = 4096;
+static unsigned long count = 100000;
+static size_t ring_size = 65536;
+static size_t threshold;
+static unsigned long pings = 10000;
+
+static char *buf;
+
+static void usage(char **argv)
+{
+	fprintf(stderr, "usage:\n"
+		"%s [-s msg_size] [-n count] [-r ring_size] [-t notify_threshold]\n"
+		"   [-p pings] domid nodepath\n"
+		"domid must be the domain running the benchmark.\n", argv[0]);
+	exit(1);
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+static void writer_copy(struct libxenvchan *ctrl)
+{
+	unsigned long i;
+
+	for (i = 0; i < count; i++) {
+		memset(buf, i, msg_size);
+		if (libxenvchan_send(ctrl, buf, msg_size) != msg_size)
+			die("libxenvchan_send");
+	}
+}
+
+static void writer_inplace(struct libxenvchan *ctrl)
+{
+	struct iovec iov[2];
+	unsigned long i;
+
+	for (i = 0; i < count; i++) {
+		if (libxenvchan_write_reserve(ctrl, iov, msg_size) != msg_size)
+			die("libxenvchan_write_reserve");
+		memset(iov[0].iov_base, i, iov[0].iov_len);
+		memset(iov[1].iov_base, i, iov[1].iov_len);
+		if (libxenvchan_write_commit(ctrl, msg_size) != msg_size)
+			die("libxenvchan_write_commit");
+	}
+}
+
+static void reader_copy(struct libxenvchan *ctrl)
+{
+	size_t total = msg_size * count, got = 0, len;
+	int ret;
+
+	while (got < total) {
+		len = total - got < msg_size ? total - got : msg_size;
+		ret = libxenvchan_read(ctrl, buf, len);
+		if (ret <= 0)
+			die("libxenvchan_read");
+		got += ret;
+	}
+}
+
+static void reader_inplace(struct libxenvchan *ctrl)
+{
+	size_t total = msg_size * count, got = 0;
+	struct iovec iov[2];
+	int ret;
+
+	while (got < total) {
+		ret = libxenvchan_read_peek(ctrl, iov, total - got);
+		if (ret <= 0)
+			die("libxenvchan_read_peek");
+		if (libxenvchan_read_release(ctrl, ret) != ret)
+			die("libxenvchan_read_release");
+		got += ret;
+	}
+}
+
+/* The client acknowledges each run, so that it is timed until all data
+ * has been consumed. */
+static void sync_send(struct libxenvchan *ctrl)
+{
+	char c = 0;
+
+	if (libxenvchan_send(ctrl, &c, 1) != 1)
+		die("libxenvchan_send");
+	if (libxenvchan_flush(ctrl))
+		die("libxenvchan_flush");
+}
+
+static void sync_recv(struct libxenvchan *ctrl)
+{
+	char c;
+
+	if (libxenvchan_recv(ctrl, &c, 1) != 1)
+		die("libxenvchan_recv");
+}
+
+static void report(const char *what, uint64_t ns)
+{
+	printf("%-10s %10.1f MB/s %10.1f ns/msg\n", what,
+	       (double)msg_size * count * 1000 / ns, (double)ns / count);
+}
+
+static void server(struct libxenvchan *ctrl)
+{
+	unsigned long i;
+	uint64_t t;
+
+	/* Wait for the client to connect */
+	sync_recv(ctrl);
+
+	t = now_ns();
+	writer_copy(ctrl);
+	sync_recv(ctrl);
+	report("copy", now_ns() - t);
+
+	t = now_ns();
+	writer_inplace(ctrl);
+	sync_recv(ctrl);
+	report("in place", now_ns() - t);
+
+	libxenvchan_set_notify_threshold(ctrl, 0);
+	t = now_ns();
+	for (i = 0; i < pings; i++) {
+		if (libxenvchan_send(ctrl, buf, 64) != 64 ||
+		    libxenvchan_recv(ctrl, buf, 64) != 64)
+			die("ping");
+	}
+	t = now_ns() - t;
+	if (pings)
+		printf("%-10s %10.1f us round trip\n", "ping",
+		       (double)t / pings / 1000);
+}
+
+static void client(struct libxenvchan *ctrl)
+{
+	unsigned long i;
+
+	sync_send(ctrl);
+
+	reader_copy(ctrl);
+	sync_send(ctrl);
+
+	reader_inplace(ctrl);
+	sync_send(ctrl);
+
+	libxenvchan_set_notify_threshold(ctrl, 0);
+	for (i = 0; i < pings; i++) {
+		if (libxenvchan_recv(ctrl, buf, 64) != 64 ||
+		    libxenvchan_send(ctrl, buf, 64) != 64)
+			die("pong");
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct libxenvchan *ctrl;
+	int opt, domid, status;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "s:n:r:t:p:")) != -1) {
+		switch (opt) {
+		case 's':
+			msg_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			ring_size = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			threshold = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			pings = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv);
+		}
+	}
+	if (argc != optind + 2 || !msg_size || !count)
+		usage(argv);
+	domid = atoi(argv[optind]);
+
+	buf = malloc(msg_size < 64 ? 64 : msg_size);
+	if (!buf)
+		die("malloc");
+
+	ctrl = libxenvchan_server_init(NULL, domid, argv[optind + 1],
+				       ring_size, ring_size);
+	if (!ctrl)
+		die("libxenvchan_server_init");
+	ctrl->blocking = 1;
+	if (msg_size > libxenvchan_buffer_space(ctrl)) {
+		fprintf(stderr, "messages do not fit into the ring\n");
+		exit(1);
+	}
+
+	printf("%zu byte messages, %zu byte rings, notify threshold %zu\n",
+	       msg_size, ring_size, threshold);
+
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0)
+		die("fork");
+	if (pid == 0) {
+		ctrl = libxenvchan_client_init(NULL, domid, argv[optind + 1]);
+		if (!ctrl)
+			die("libxenvchan_client_init");
+		ctrl->blocking = 1;
+		libxenvchan_set_notify_threshold(ctrl, threshold);
+		client(ctrl);
+		libxenvchan_close(ctrl);
+		exit(0);
+	}
+
+	libxenvchan_set_notify_threshold(ctrl, threshold);
+	server(ctrl);
+
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status))
+		fprintf(stderr, "client failed\n");
+	libxenvchan_close(ctrl);
+	return 0;
+}
@@ -2053,6 +2053,28 @@ int xc_memshr_control(xc_interface *xch,
                       domid_t domid,
                       int enable);
 
+/* Turn domid into a fork of pdomid.
+ *
+ * domid must be a newly created HVM domain with HAP, paused, without any
+ * memory and with the same number of vcpus as pdomid, which must be paused
+ * too.  The vcpu and HVM context of the parent are copied, and the fork's
+ * memory is populated from the parent's as the fork accesses it: shared
+ * copy-on-write on reads, copied on writes.  The parent stays paused until
+ * all of its forks have been destroyed.  Event channels, grant tables and
+ * device model state are not copied.
+ *
+ * May fail with:
+ *  EINVAL if either domain is not suitable, or is already a fork
+ *  EBUSY if either domain is not paused, the fork already has memory, or
+ *        the parent has populate-on-demand or paged out memory
+ *  EXDEV if either domain has had a PCI device assigned
+ * If the call fails after the fork has been set up partially, the fork
+ * should be destroyed.
+ */
+int xc_memshr_fork(xc_interface *xch,
+                   domid_t pdomid,
+                   domid_t domid);
+
 /* Create a communication ring in which the hypervisor will place ENOMEM
  * notifications.
  *
@@ -29,6 +29,9 @@
 #define XCFLAGS_HVM       (1 << 2)
 #define XCFLAGS_STDVGA    (1 << 3)
 #define XCFLAGS_CHECKPOINT_COMPRESS    (1 << 4)
+#define XCFLAGS_PARALLEL  (1 << 5) /* map/normalise/write pages on a thread pool */
+#define XCFLAGS_STREAM_COMPRESS (1 << 6) /* elide zero pages, LZ4 page data */
+#define XCFLAGS_THROTTLE  (1 << 7) /* cap vcpus if pre-copy fails to converge */
 
 #define X86_64_B_SIZE   64 
 #define X86_32_B_SIZE   32
@@ -96,12 +99,17 @@ typedef enum {
  * @parm xch a handle to an open hypervisor interface
  * @parm fd the file descriptor to save a domain to
  * @parm dom the id of the domain
+ * @parm max_downtime_ms target downtime for a live save, in milliseconds.
+ *       Pre-copy iterates until the predicted time to send the remaining
+ *       dirty pages is within the target, rather than for a fixed number of
+ *       iterations.  0 selects the fixed policy.
  * @param stream_type XC_MIG_STREAM_NONE if the far end of the stream
  *        doesn't use checkpointing
  * @return 0 on success, -1 on failure
  */
 int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iters,
-                   uint32_t max_factor, uint32_t flags /* XCFLAGS_xxx */,
+                   uint32_t max_factor, uint32_t max_downtime_ms,
+                   uint32_t flags /* XCFLAGS_xxx */,
                    struct save_callbacks* callbacks, int hvm,
                    xc_migration_stream_t stream_type, int recv_fd);
 
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <unistd.h>
 
 #include "xc_sr_common.h"
 
@@ -38,6 +39,8 @@ static const char *mandatory_rec_types[] =
     [REC_TYPE_VERIFY]                       = "Verify",
     [REC_TYPE_CHECKPOINT]                   = "Checkpoint",
     [REC_TYPE_CHECKPOINT_DIRTY_PFN_LIST]    = "Checkpoint dirty pfn list",
+    [REC_TYPE_ZERO_PAGES]                   = "Zero pages",
+    [REC_TYPE_PAGE_DATA_LZ4]                = "Page data LZ4",
 };
 
 const char *rec_type_to_str(uint32_t type)
@@ -140,6 +143,17 @@ int read_record(struct xc_sr_context *ctx, int fd, struct xc_sr_record *rec)
     return 0;
 };
 
+unsigned int sr_nr_workers(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    /* Leave one cpu for the thread driving the stream. */
+    if ( cpus <= 2 )
+        return 0;
+
+    return min_t(long, cpus - 1, SR_MAX_WORKERS);
+}
+
 static void __attribute__((unused)) build_assertions(void)
 {
     BUILD_BUG_ON(sizeof(struct xc_sr_ihdr) != 24);
@@ -147,6 +161,8 @@ static void __attribute__((unused)) build_assertions(void)
     BUILD_BUG_ON(sizeof(struct xc_sr_rhdr) != 8);
 
     BUILD_BUG_ON(sizeof(struct xc_sr_rec_page_data_header)  != 8);
+    BUILD_BUG_ON(sizeof(struct xc_sr_rec_zero_pages_run)    != 16);
+    BUILD_BUG_ON(sizeof(struct xc_sr_rec_zero_pages)        != 8);
     BUILD_BUG_ON(sizeof(struct xc_sr_rec_x86_pv_info)       != 8);
     BUILD_BUG_ON(sizeof(struct xc_sr_rec_x86_pv_p2m_frames) != 8);
     BUILD_BUG_ON(sizeof(struct xc_sr_rec_x86_pv_vcpu_hdr)   != 8);
@@ -18,6 +18,39 @@ const char *rec_type_to_str(uint32_t type);
 
 struct xc_sr_context;
 struct xc_sr_record;
+struct xc_sr_batch;
+struct xc_sr_save_pool;
+struct xc_sr_restore_pool;
+
+/*
+ * Upper bound on the number of worker threads used for page transmission
+ * (save) and page copying (restore).
+ */
+#define SR_MAX_WORKERS 8
+
+/*
+ * Number of worker threads to use, based on the number of online cpus, or 0
+ * if threading is not worthwhile on this host.
+ */
+unsigned int sr_nr_workers(void);
+
+/*
+ * LZ4 block compression of single pages, for the PAGE_DATA_LZ4 record.
+ *
+ * sr_lz4_compress_page() compresses PAGE_SIZE bytes from @page into @buf,
+ * returning the compressed length, or 0 if the result does not fit within
+ * @buf_size bytes.  @table is scratch space of SR_LZ4_TABLE_SIZE entries,
+ * which need not be initialised.
+ *
+ * sr_lz4_decompress_page() returns 0 if @buf decompresses to exactly
+ * PAGE_SIZE bytes at @page, or -1 if it is malformed.
+ */
+#define SR_LZ4_HASH_LOG   12
+#define SR_LZ4_TABLE_SIZE (1U << SR_LZ4_HASH_LOG)
+
+size_t sr_lz4_compress_page(const void *page, void *buf, size_t buf_size,
+                            uint16_t *table);
+int sr_lz4_decompress_page(const void *buf, size_t len, void *page);
 
 /**
  * Save operations.  To be implemented for each type of guest, for use by the
@@ -202,6 +235,17 @@ struct xc_sr_context
             unsigned max_iterations;
             unsigned dirty_threshold;
 
+            /*
+             * Adaptive pre-copy.  With a non-zero downtime target, pre-copy
+             * stops once the remaining dirty pages are predicted to take no
+             * longer than the target to send, and the guest's vcpus may be
+             * capped if it dirties memory faster than it can be sent.
+             */
+            unsigned max_downtime_ms;
+            bool throttle;
+            bool throttled;
+            struct xen_domctl_sched_credit sched; /* Valid if throttled. */
+
             unsigned long p2m_size;
 
             xen_pfn_t *batch_pfns;
@@ -209,6 +253,37 @@ struct xc_sr_context
             unsigned long *deferred_pages;
             unsigned long nr_deferred_pages;
             xc_hypercall_buffer_t dirty_bitmap_hbuf;
+
+            /*
+             * Dirty pfns are retrieved as a list (XEN_DOMCTL_SHADOW_OP_
+             * CLEAN_LIST) while Xen supports it, falling back to the bitmap
+             * for rounds in which Xen couldn't track them all.  The buffer
+             * holds dirty_list_size uint64_t entries; a size of 0 means the
+             * list is not in use.
+             */
+            unsigned long dirty_list_size;
+            xc_hypercall_buffer_t dirty_list_hbuf;
+
+            /* Serial path: scratch state for the batch being written. */
+            struct xc_sr_batch *batch;
+
+            /*
+             * Parallel path: batches are mapped and normalised by a pool of
+             * worker threads, and written into the stream by a dedicated
+             * writer thread.  NULL if not in use.
+             */
+            unsigned nr_workers;
+            struct xc_sr_save_pool *pool;
+
+            /*
+             * Send ZERO_PAGES and PAGE_DATA_LZ4 records in place of
+             * PAGE_DATA.  Statistics are maintained by whichever thread
+             * writes batches into the stream.
+             */
+            bool compress;
+            unsigned long nr_zero_pages;
+            unsigned long nr_data_pages;
+            uint64_t data_bytes;
         } save;
 
         struct /* Restore data. */
@@ -260,6 +335,9 @@ struct xc_sr_context
 
             /* Sender has invoked verify mode on the stream. */
             bool verify;
+
+            /* Worker threads for copying page data.  NULL if not in use. */
+            struct xc_sr_restore_pool *pool;
         } restore;
     };
 
@@ -0,0 +1,240 @@
+#include "xc_sr_common.h"
+
+/*
+ * Page compression for the migration stream, using the LZ4 block format.
+ *
+ * The compressor is a simple greedy variant of the reference LZ4 "fast"
+ * algorithm, specialised for single pages.  As a page is smaller than the
+ * 64k window, all offsets fit in 16 bits and the hash table can hold page
+ * offsets rather than pointers.  Stale entries left over from a previous
+ * page are harmless, as every candidate match is verified before use.
+ */
+
+#define LZ4_MINMATCH     4
+#define LZ4_LASTLITERALS 5   /* The last 5 bytes of a block are literals. */
+#define LZ4_MFLIMIT      12  /* No match may start in the last 12 bytes. */
+#define LZ4_ML_BITS      4
+#define LZ4_ML_MASK      ((1U << LZ4_ML_BITS) - 1)
+#define LZ4_RUN_MASK     ((1U << (8 - LZ4_ML_BITS)) - 1)
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline unsigned int lz4_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - SR_LZ4_HASH_LOG);
+}
+
+/* Encode the extension bytes of a literal or match length. */
+static inline uint8_t *put_length(uint8_t *op, size_t len)
+{
+    for ( ; len >= 255; len -= 255 )
+        *op++ = 255;
+    *op++ = len;
+
+    return op;
+}
+
+/* Worst case number of bytes needed to encode a run of literals. */
+static inline size_t literals_bound(size_t len)
+{
+    return 1 + len + (len + 255 - LZ4_RUN_MASK) / 255;
+}
+
+size_t sr_lz4_compress_page(const void *page, void *buf, size_t buf_size,
+                            uint16_t *table)
+{
+    const uint8_t *const src = page, *const iend = src + PAGE_SIZE;
+    const uint8_t *const mflimit = iend - LZ4_MFLIMIT;
+    const uint8_t *const matchlimit = iend - LZ4_LASTLITERALS;
+    const uint8_t *ip = src, *anchor = src, *ref, *start;
+    uint8_t *op = buf, *const oend = op + buf_size, *token;
+    size_t lit, ml;
+    unsigned int h;
+
+    table[lz4_hash(read32(ip))] = 0;
+    ++ip;
+
+    while ( ip < mflimit )
+    {
+        uint32_t seq = read32(ip);
+
+        h = lz4_hash(seq);
+        ref = src + table[h];
+        table[h] = ip - src;
+
+        if ( ref >= ip || read32(ref) != seq )
+        {
+            /* Skip faster through incompressible data. */
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        /* Extend the match backwards into the pending literals. */
+        while ( ip > anchor && ref > src && ip[-1] == ref[-1] )
+        {
+            --ip;
+            --ref;
+        }
+
+        lit = ip - anchor;
+        if ( literals_bound(lit) + 2 + LZ4_LASTLITERALS + 1 > oend - op )
+            return 0;
+
+        token = op++;
+        if ( lit >= LZ4_RUN_MASK )
+        {
+            *token = LZ4_RUN_MASK << LZ4_ML_BITS;
+            op = put_length(op, lit - LZ4_RUN_MASK);
+        }
+        else
+            *token = lit << LZ4_ML_BITS;
+
+        memcpy(op, anchor, lit);
+        op += lit;
+
+        *op++ = (ip - ref) & 0xff;
+        *op++ = (ip - ref) >> 8;
+
+        ip += LZ4_MINMATCH;
+        ref += LZ4_MINMATCH;
+        start = ip;
+        while ( ip < matchlimit && *ip == *ref )
+        {
+            ++ip;
+            ++ref;
+        }
+        ml = ip - start;
+
+        if ( 1 + ml / 255 + LZ4_LASTLITERALS + 1 > oend - op )
+            return 0;
+
+        if ( ml >= LZ4_ML_MASK )
+        {
+            *token |= LZ4_ML_MASK;
+            op = put_length(op, ml - LZ4_ML_MASK);
+        }
+        else
+            *token |= ml;
+
+        anchor = ip;
+
+        if ( ip < mflimit )
+            table[lz4_hash(read32(ip - 2))] = ip - 2 - src;
+    }
+
+    /* Last literals. */
+    lit = iend - anchor;
+    if ( literals_bound(lit) > oend - op )
+        return 0;
+
+    token = op++;
+    if ( lit >= LZ4_RUN_MASK )
+    {
+        *token = LZ4_RUN_MASK << LZ4_ML_BITS;
+        op = put_length(op, lit - LZ4_RUN_MASK);
+    }
+    else
+        *token = lit << LZ4_ML_BITS;
+
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    return op - (uint8_t *)buf;
+}
+
+/* Decode the extension bytes of a literal or match length. */
+static inline int get_length(const uint8_t **ipp, const uint8_t *iend,
+                             size_t *len)
+{
+    const uint8_t *ip = *ipp;
+    uint8_t s;
+
+    do {
+        if ( ip >= iend )
+            return -1;
+        s = *ip++;
+        *len += s;
+    } while ( s == 255 );
+
+    *ipp = ip;
+    return 0;
+}
+
+int sr_lz4_decompress_page(const void *buf, size_t len, void *page)
+{
+    const uint8_t *ip = buf, *const iend = ip + len, *ref;
+    uint8_t *const dst = page, *op = dst, *const oend = op + PAGE_SIZE;
+    size_t lit, ml, off;
+    uint8_t token;
+
+    for ( ;; )
+    {
+        if ( ip >= iend )
+            return -1;
+
+        token = *ip++;
+
+        lit = token >> LZ4_ML_BITS;
+        if ( lit == LZ4_RUN_MASK && get_length(&ip, iend, &lit) )
+            return -1;
+
+        if ( lit > iend - ip || lit > oend - op )
+            return -1;
+
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+
+        /* The last sequence consists of literals only. */
+        if ( ip == iend )
+            break;
+
+        if ( iend - ip < 2 )
+            return -1;
+
+        off = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        if ( off == 0 || off > op - dst )
+            return -1;
+
+        ml = token & LZ4_ML_MASK;
+        if ( ml == LZ4_ML_MASK && get_length(&ip, iend, &ml) )
+            return -1;
+        ml += LZ4_MINMATCH;
+
+        if ( ml > oend - op )
+            return -1;
+
+        ref = op - off;
+        if ( off >= ml )
+        {
+            memcpy(op, ref, ml);
+            op += ml;
+        }
+        else
+        {
+            /* Overlapping match: replicate the pattern byte by byte. */
+            while ( ml-- )
+                *op++ = *ref++;
+        }
+    }
+
+    return op == oend ? 0 : -1;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -1,4 +1,5 @@
 #include <arpa/inet.h>
+#include <pthread.h>
 
 #include <assert.h>
 
@@ -194,10 +195,186 @@ int populate_pfns(struct xc_sr_context *ctx, unsigned count,
     return rc;
 }
 
+/*
+ * Worker pool for copying page data into the guest.  Each copy request is
+ * split into slices which are picked up by the workers and by the calling
+ * thread, which then waits for all slices to complete.
+ */
+struct xc_sr_restore_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;  /* Signalled when a new request is posted. */
+    pthread_cond_t done_cond;  /* Signalled when the last slice completes. */
+
+    /* Current request. */
+    void *dst;
+    const void *src;
+    unsigned long nr_pages;
+    unsigned next_slice, nr_slices, done_slices;
+    bool quit;
+
+    unsigned nr_threads;
+    pthread_t threads[SR_MAX_WORKERS];
+};
+
+/* Requests smaller than this are copied on the calling thread. */
+#define MIN_PARALLEL_COPY_PAGES 64
+
+/*
+ * Take and copy one slice of the current request.  Called with the lock
+ * held; returns false if there was nothing left to take.
+ */
+static bool copy_one_slice(struct xc_sr_restore_pool *pool)
+{
+    unsigned long first, last;
+    unsigned slice;
+
+    if ( pool->next_slice >= pool->nr_slices )
+        return false;
+
+    slice = pool->next_slice++;
+    first = (pool->nr_pages * slice) / pool->nr_slices;
+    last = (pool->nr_pages * (slice + 1)) / pool->nr_slices;
+    pthread_mutex_unlock(&pool->lock);
+
+    memcpy(pool->dst + first * PAGE_SIZE, pool->src + first * PAGE_SIZE,
+           (last - first) * PAGE_SIZE);
+
+    pthread_mutex_lock(&pool->lock);
+    if ( ++pool->done_slices == pool->nr_slices )
+        pthread_cond_signal(&pool->done_cond);
+
+    return true;
+}
+
+static void *copy_worker(void *arg)
+{
+    struct xc_sr_restore_pool *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while ( !pool->quit )
+    {
+        if ( !copy_one_slice(pool) )
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/*
+ * Copy nr_pages of contiguous page data into a contiguous guest mapping,
+ * using the worker pool if available.
+ */
+static void copy_pages(struct xc_sr_context *ctx, void *dst, const void *src,
+                       unsigned long nr_pages)
+{
+    struct xc_sr_restore_pool *pool = ctx->restore.pool;
+
+    if ( !pool || nr_pages < MIN_PARALLEL_COPY_PAGES )
+    {
+        memcpy(dst, src, nr_pages * PAGE_SIZE);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->dst = dst;
+    pool->src = src;
+    pool->nr_pages = nr_pages;
+    pool->nr_slices = pool->nr_threads + 1;
+    pool->next_slice = pool->done_slices = 0;
+    pthread_cond_broadcast(&pool->work_cond);
+
+    while ( copy_one_slice(pool) )
+        ;
+    while ( pool->done_slices != pool->nr_slices )
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+
+    /* Prevent late workers picking up stale slices. */
+    pool->nr_slices = 0;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void destroy_pool(struct xc_sr_context *ctx)
+{
+    struct xc_sr_restore_pool *pool = ctx->restore.pool;
+    unsigned i;
+
+    if ( !pool )
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for ( i = 0; i < pool->nr_threads; ++i )
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->lock);
+
+    free(pool);
+    ctx->restore.pool = NULL;
+}
+
+/*
+ * Start the copy workers.  Failure is not fatal; page data is then copied
+ * on the calling thread.
+ */
+static void setup_pool(struct xc_sr_context *ctx, unsigned nr_workers)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_pool *pool;
+    unsigned i;
+
+    if ( !nr_workers )
+        return;
+
+    pool = calloc(1, sizeof(*pool));
+    if ( !pool )
+        return;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    ctx->restore.pool = pool;
+
+    for ( i = 0; i < nr_workers; ++i )
+    {
+        if ( pthread_create(&pool->threads[i], NULL, copy_worker, pool) )
+            break;
+        pool->nr_threads++;
+    }
+
+    if ( !pool->nr_threads )
+    {
+        destroy_pool(ctx);
+        return;
+    }
+
+    DPRINTF("Using %u worker threads for page data", pool->nr_threads);
+}
+
+/* Is every byte of this page zero? */
+static bool page_is_zero(const void *page)
+{
+    const uint64_t *p = page;
+    unsigned i;
+
+    for ( i = 0; i < PAGE_SIZE / sizeof(*p); ++i )
+        if ( p[i] )
+            return false;
+
+    return true;
+}
+
 /*
  * Given a list of pfns, their types, and a block of page data from the
  * stream, populate and record their types, map the relevant subset and copy
- * the data into the guest.
+ * the data into the guest.  A NULL page_data means that every page with data
+ * is entirely zero (ZERO_PAGES record).
  */
 static int process_page_data(struct xc_sr_context *ctx, unsigned count,
                              xen_pfn_t *pfns, uint32_t *types, void *page_data)
@@ -285,6 +462,19 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned count,
             goto err;
         }
 
+        if ( !page_data )
+        {
+            if ( !ctx->restore.verify )
+                memset(guest_page, 0, PAGE_SIZE);
+            else if ( !page_is_zero(guest_page) )
+                ERROR("verify pfn %#"PRIpfn" failed (type %#"PRIx32")",
+                      pfns[i], types[i] >> XEN_DOMCTL_PFINFO_LTAB_SHIFT);
+
+            ++j;
+            guest_page += PAGE_SIZE;
+            continue;
+        }
+
         /* Undo page normalisation done by the saver. */
         rc = ctx->restore.ops.localise_page(ctx, types[i], page_data);
         if ( rc )
@@ -301,17 +491,20 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned count,
                 ERROR("verify pfn %#"PRIpfn" failed (type %#"PRIx32")",
                       pfns[i], types[i] >> XEN_DOMCTL_PFINFO_LTAB_SHIFT);
         }
-        else
-        {
-            /* Regular mode - copy incoming data into place. */
-            memcpy(guest_page, page_data, PAGE_SIZE);
-        }
 
         ++j;
         guest_page += PAGE_SIZE;
         page_data += PAGE_SIZE;
     }
 
+    /*
+     * Regular mode - copy incoming data into place.  The mapping and the
+     * page data are both contiguous and in the same order, so all pages can
+     * be copied in one go once they have been localised.
+     */
+    if ( !ctx->restore.verify && page_data )
+        copy_pages(ctx, mapping, page_data - (j * PAGE_SIZE), j);
+
  done:
     rc = 0;
 
@@ -326,34 +519,40 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned count,
 }
 
 /*
- * Validate a PAGE_DATA record from the stream, and pass the results to
- * process_page_data() to actually perform the legwork.
+ * Validate the header and pfn list of a PAGE_DATA or PAGE_DATA_LZ4 record,
+ * returning the pfns and types in newly allocated arrays, and the number of
+ * pages of data which should follow.
  */
-static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
+static int parse_page_data_header(struct xc_sr_context *ctx,
+                                  struct xc_sr_record *rec,
+                                  xen_pfn_t **pfnsp, uint32_t **typesp,
+                                  unsigned *pages_of_data)
 {
     xc_interface *xch = ctx->xch;
     struct xc_sr_rec_page_data_header *pages = rec->data;
-    unsigned i, pages_of_data = 0;
-    int rc = -1;
+    const char *name = rec_type_to_str(rec->type);
+    unsigned i;
 
     xen_pfn_t *pfns = NULL, pfn;
     uint32_t *types = NULL, type;
 
+    *pages_of_data = 0;
+
     if ( rec->length < sizeof(*pages) )
     {
-        ERROR("PAGE_DATA record truncated: length %u, min %zu",
-              rec->length, sizeof(*pages));
+        ERROR("%s record truncated: length %u, min %zu",
+              name, rec->length, sizeof(*pages));
         goto err;
     }
     else if ( pages->count < 1 )
     {
-        ERROR("Expected at least 1 pfn in PAGE_DATA record");
+        ERROR("Expected at least 1 pfn in %s record", name);
         goto err;
     }
     else if ( rec->length < sizeof(*pages) + (pages->count * sizeof(uint64_t)) )
     {
-        ERROR("PAGE_DATA record (length %u) too short to contain %u"
-              " pfns worth of information", rec->length, pages->count);
+        ERROR("%s record (length %u) too short to contain %u"
+              " pfns worth of information", name, rec->length, pages->count);
         goto err;
     }
 
@@ -386,12 +585,41 @@ static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         else if ( type < XEN_DOMCTL_PFINFO_BROKEN )
             /* NOTAB and all L1 through L4 tables (including pinned) should
              * have a page worth of data in the record. */
-            pages_of_data++;
+            (*pages_of_data)++;
 
         pfns[i] = pfn;
         types[i] = type;
     }
 
+    *pfnsp = pfns;
+    *typesp = types;
+
+    return 0;
+
+ err:
+    free(types);
+    free(pfns);
+
+    return -1;
+}
+
+/*
+ * Validate a PAGE_DATA record from the stream, and pass the results to
+ * process_page_data() to actually perform the legwork.
+ */
+static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_page_data_header *pages = rec->data;
+    unsigned pages_of_data;
+    int rc = -1;
+
+    xen_pfn_t *pfns = NULL;
+    uint32_t *types = NULL;
+
+    if ( parse_page_data_header(ctx, rec, &pfns, &types, &pages_of_data) )
+        return -1;
+
     if ( rec->length != (sizeof(*pages) +
                          (sizeof(uint64_t) * pages->count) +
                          (PAGE_SIZE * pages_of_data)) )
@@ -411,6 +639,160 @@ static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
     return rc;
 }
 
+/*
+ * Validate a PAGE_DATA_LZ4 record from the stream, decompress its page data
+ * and pass the results to process_page_data().
+ */
+static int handle_page_data_lz4(struct xc_sr_context *ctx,
+                                struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_page_data_header *pages = rec->data;
+    unsigned i, pages_of_data;
+    int rc = -1;
+
+    xen_pfn_t *pfns = NULL;
+    uint32_t *types = NULL, len;
+    const uint8_t *ptr, *end = rec->data + rec->length;
+    uint8_t *page_data = NULL;
+
+    if ( parse_page_data_header(ctx, rec, &pfns, &types, &pages_of_data) )
+        return -1;
+
+    if ( pages_of_data )
+    {
+        page_data = malloc(pages_of_data * PAGE_SIZE);
+        if ( !page_data )
+        {
+            ERROR("Unable to allocate %lu bytes for page data",
+                  pages_of_data * PAGE_SIZE);
+            goto err;
+        }
+    }
+
+    ptr = (const uint8_t *)&pages->pfn[pages->count];
+    for ( i = 0; i < pages_of_data; ++i )
+    {
+        if ( end - ptr < sizeof(len) )
+        {
+            ERROR("PAGE_DATA_LZ4 record truncated at page %u of %u",
+                  i, pages_of_data);
+            goto err;
+        }
+
+        memcpy(&len, ptr, sizeof(len));
+        ptr += sizeof(len);
+
+        if ( len == 0 || len > PAGE_SIZE || end - ptr < len )
+        {
+            ERROR("Bad length %u for page %u in PAGE_DATA_LZ4 record",
+                  len, i);
+            goto err;
+        }
+
+        if ( len == PAGE_SIZE )
+            memcpy(page_data + i * PAGE_SIZE, ptr, PAGE_SIZE);
+        else if ( sr_lz4_decompress_page(ptr, len, page_data + i * PAGE_SIZE) )
+        {
+            ERROR("Failed to decompress page %u in PAGE_DATA_LZ4 record", i);
+            goto err;
+        }
+
+        ptr += len;
+    }
+
+    if ( ptr != end )
+    {
+        ERROR("PAGE_DATA_LZ4 record wrong size: length %u, %zu bytes unused",
+              rec->length, (size_t)(end - ptr));
+        goto err;
+    }
+
+    rc = process_page_data(ctx, pages->count, pfns, types, page_data);
+ err:
+    free(page_data);
+    free(types);
+    free(pfns);
+
+    return rc;
+}
+
+/*
+ * Validate a ZERO_PAGES record from the stream, and pass each run of zero
+ * pages to process_page_data() in batches.
+ */
+static int handle_zero_pages(struct xc_sr_context *ctx,
+                             struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_zero_pages *zero = rec->data;
+    struct xc_sr_rec_zero_pages_run *run;
+    unsigned i, j, nr = 0;
+    int rc = -1;
+
+    xen_pfn_t *pfns = NULL;
+    uint32_t *types = NULL;
+
+    if ( rec->length < sizeof(*zero) )
+    {
+        ERROR("ZERO_PAGES record truncated: length %u, min %zu",
+              rec->length, sizeof(*zero));
+        goto err;
+    }
+    else if ( zero->count < 1 ||
+              rec->length != sizeof(*zero) + zero->count * sizeof(*run) )
+    {
+        ERROR("ZERO_PAGES record (length %u) inconsistent with %u runs",
+              rec->length, zero->count);
+        goto err;
+    }
+
+    pfns = malloc(MAX_BATCH_SIZE * sizeof(*pfns));
+    types = malloc(MAX_BATCH_SIZE * sizeof(*types));
+    if ( !pfns || !types )
+    {
+        ERROR("Unable to allocate memory for zero pages");
+        goto err;
+    }
+
+    for ( i = 0; i < zero->count; ++i )
+    {
+        run = &zero->run[i];
+
+        if ( run->count < 1 || (run->pfn & ~PAGE_DATA_PFN_MASK) ||
+             !ctx->restore.ops.pfn_is_valid(ctx, run->pfn) ||
+             !ctx->restore.ops.pfn_is_valid(ctx, run->pfn + run->count - 1) )
+        {
+            ERROR("Invalid run %u of %u pages from pfn %#"PRIx64,
+                  i, run->count, run->pfn);
+            goto err;
+        }
+
+        for ( j = 0; j < run->count; ++j )
+        {
+            pfns[nr] = run->pfn + j;
+            types[nr] = XEN_DOMCTL_PFINFO_NOTAB;
+
+            if ( ++nr == MAX_BATCH_SIZE )
+            {
+                rc = process_page_data(ctx, nr, pfns, types, NULL);
+                if ( rc )
+                    goto err;
+                rc = -1;
+                nr = 0;
+            }
+        }
+    }
+
+    rc = nr ? process_page_data(ctx, nr, pfns, types, NULL) : 0;
+
+ err:
+    free(types);
+    free(pfns);
+
+    return rc;
+}
+
 /*
  * Send checkpoint dirty pfn list to primary.
  */
@@ -640,6 +1022,14 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         rc = handle_page_data(ctx, rec);
         break;
 
+    case REC_TYPE_PAGE_DATA_LZ4:
+        rc = handle_page_data_lz4(ctx, rec);
+        break;
+
+    case REC_TYPE_ZERO_PAGES:
+        rc = handle_zero_pages(ctx, rec);
+        break;
+
     case REC_TYPE_VERIFY:
         DPRINTF("Verify mode enabled");
         ctx->restore.verify = true;
@@ -704,6 +1094,8 @@ static int setup(struct xc_sr_context *ctx)
     }
     ctx->restore.allocated_rec_num = DEFAULT_BUF_RECORDS;
 
+    setup_pool(ctx, sr_nr_workers());
+
  err:
     return rc;
 }
@@ -715,6 +1107,8 @@ static void cleanup(struct xc_sr_context *ctx)
     DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
                                     &ctx->restore.dirty_bitmap_hbuf);
 
+    destroy_pool(ctx);
+
     for ( i = 0; i < ctx->restore.buffered_rec_num; i++ )
         free(ctx->restore.buffered_records[i].data);
 
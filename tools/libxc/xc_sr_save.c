@@ -1,8 +1,15 @@
 #include <assert.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 
 #include "xc_sr_common.h"
 
+/*
+ * Maximum number of entries in the dirty pfn list.  Xen keeps track of this
+ * many dirty pfns between rounds, at most.
+ */
+#define DIRTY_LIST_MAX (1UL << 17)
+
 /*
  * Writes an Image header and Domain header into the stream.
  */
@@ -67,67 +74,395 @@ static int write_checkpoint_record(struct xc_sr_context *ctx)
 }
 
 /*
- * Writes a batch of memory as a PAGE_DATA record into the stream.  The batch
- * is constructed in ctx->save.batch_pfns.
- *
- * This function:
- * - gets the types for each pfn in the batch.
- * - for each pfn with real data:
- *   - maps and attempts to localise the pages.
- * - construct and writes a PAGE_DATA record into the stream.
+ * State for one batch of pages on its way into the stream.  All arrays are
+ * sized for MAX_BATCH_SIZE pfns, and are reused between batches.
  */
-static int write_batch(struct xc_sr_context *ctx)
+struct xc_sr_batch
 {
-    xc_interface *xch = ctx->xch;
-    xen_pfn_t *mfns = NULL, *types = NULL;
-    void *guest_mapping = NULL;
-    void **guest_data = NULL;
-    void **local_pages = NULL;
-    int *errors = NULL, rc = -1;
-    unsigned i, p, nr_pages = 0, nr_pages_mapped = 0;
-    unsigned nr_pfns = ctx->save.nr_batch_pfns;
-    void *page, *orig_page;
-    uint64_t *rec_pfns = NULL;
-    struct iovec *iov = NULL; int iovcnt = 0;
-    struct xc_sr_rec_page_data_header hdr = { 0 };
-    struct xc_sr_record rec =
-    {
-        .type = REC_TYPE_PAGE_DATA,
-    };
+    struct xc_sr_batch *next;
 
-    assert(nr_pfns != 0);
+    /* The pfns in the batch. */
+    xen_pfn_t *pfns;
+    unsigned nr_pfns;
 
     /* Mfns of the batch pfns. */
-    mfns = malloc(nr_pfns * sizeof(*mfns));
+    xen_pfn_t *mfns;
     /* Types of the batch pfns. */
-    types = malloc(nr_pfns * sizeof(*types));
+    xen_pfn_t *types;
     /* Errors from attempting to map the gfns. */
-    errors = malloc(nr_pfns * sizeof(*errors));
+    int *errors;
     /* Pointers to page data to send.  Mapped gfns or local allocations. */
-    guest_data = calloc(nr_pfns, sizeof(*guest_data));
+    void **guest_data;
     /* Pointers to locally allocated pages.  Need freeing. */
-    local_pages = calloc(nr_pfns, sizeof(*local_pages));
+    void **local_pages;
+    /* Pfn and type information for the record. */
+    uint64_t *rec_pfns;
     /* iovec[] for writev(). */
-    iov = malloc((nr_pfns + 4) * sizeof(*iov));
+    struct iovec *iov;
+    int iovcnt;
 
-    if ( !mfns || !types || !errors || !guest_data || !local_pages || !iov )
+    void *guest_mapping;
+    unsigned nr_pages_mapped;
+
+    struct xc_sr_rec_page_data_header hdr;
+    struct xc_sr_record rec;
+
+    /*
+     * Compressed streams only.  Runs of zero pages for the ZERO_PAGES
+     * record, and a staging area for the length-prefixed page data of the
+     * PAGE_DATA_LZ4 record.
+     */
+    struct xc_sr_rec_zero_pages zhdr;
+    struct xc_sr_record zrec;
+    struct xc_sr_rec_zero_pages_run *runs;
+    uint8_t *cbuf;
+    uint16_t *lz4_table;
+    unsigned nr_zero_pages, nr_data_pages;
+};
+
+/*
+ * Compressed streams need up to two records per batch, and up to two iovs
+ * per page of data.
+ */
+#define BATCH_IOV_MAX(compress) \
+    ((compress) ? (2 * MAX_BATCH_SIZE + 9) : (MAX_BATCH_SIZE + 4))
+
+/* Staging area for the PAGE_DATA_LZ4 record: a length and a page per pfn. */
+#define BATCH_CBUF_SIZE (MAX_BATCH_SIZE * (sizeof(uint32_t) + PAGE_SIZE))
+
+static void free_batch(struct xc_sr_batch *b)
+{
+    if ( !b )
+        return;
+
+    free(b->lz4_table);
+    free(b->cbuf);
+    free(b->runs);
+    free(b->iov);
+    free(b->rec_pfns);
+    free(b->local_pages);
+    free(b->guest_data);
+    free(b->errors);
+    free(b->types);
+    free(b->mfns);
+    free(b->pfns);
+    free(b);
+}
+
+static struct xc_sr_batch *alloc_batch(bool compress)
+{
+    struct xc_sr_batch *b = calloc(1, sizeof(*b));
+
+    if ( !b )
+        return NULL;
+
+    b->pfns = malloc(MAX_BATCH_SIZE * sizeof(*b->pfns));
+    b->mfns = malloc(MAX_BATCH_SIZE * sizeof(*b->mfns));
+    b->types = malloc(MAX_BATCH_SIZE * sizeof(*b->types));
+    b->errors = malloc(MAX_BATCH_SIZE * sizeof(*b->errors));
+    b->guest_data = malloc(MAX_BATCH_SIZE * sizeof(*b->guest_data));
+    b->local_pages = calloc(MAX_BATCH_SIZE, sizeof(*b->local_pages));
+    b->rec_pfns = malloc(MAX_BATCH_SIZE * sizeof(*b->rec_pfns));
+    b->iov = malloc(BATCH_IOV_MAX(compress) * sizeof(*b->iov));
+
+    if ( !b->pfns || !b->mfns || !b->types || !b->errors || !b->guest_data ||
+         !b->local_pages || !b->rec_pfns || !b->iov )
     {
-        ERROR("Unable to allocate arrays for a batch of %u pages",
-              nr_pfns);
-        goto err;
+        free_batch(b);
+        return NULL;
+    }
+
+    if ( compress )
+    {
+        b->runs = malloc(MAX_BATCH_SIZE * sizeof(*b->runs));
+        b->cbuf = malloc(BATCH_CBUF_SIZE);
+        b->lz4_table = malloc(SR_LZ4_TABLE_SIZE * sizeof(*b->lz4_table));
+
+        if ( !b->runs || !b->cbuf || !b->lz4_table )
+        {
+            free_batch(b);
+            return NULL;
+        }
+    }
+
+    return b;
+}
+
+/*
+ * Worker pool for the parallel path.  Batches cycle through three lists:
+ * free -> pending (waiting for a worker to map and normalise them) -> ready
+ * (waiting for the writer thread) -> free.  The number of batches in
+ * circulation bounds the amount of guest memory mapped at any one time.
+ */
+struct xc_sr_save_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;  /* Signalled when a batch becomes pending. */
+    pthread_cond_t write_cond; /* Signalled when a batch becomes ready. */
+    pthread_cond_t done_cond;  /* Signalled when a batch becomes free. */
+
+    struct xc_sr_batch *free, *pending, **pending_tail, *ready, **ready_tail;
+    unsigned in_flight;
+
+    /* First error encountered by a worker or the writer. */
+    int rc, err;
+    bool quit;
+
+    struct xc_sr_context *ctx;
+    unsigned nr_threads;
+    pthread_t threads[SR_MAX_WORKERS + 1];
+};
+
+/*
+ * Record that a pfn needs resending at a later point.  Called from the
+ * worker threads in the parallel path.
+ */
+static void defer_pfn(struct xc_sr_context *ctx, xen_pfn_t pfn)
+{
+    struct xc_sr_save_pool *pool = ctx->save.pool;
+
+    if ( pool )
+        pthread_mutex_lock(&pool->lock);
+
+    set_bit(pfn, ctx->save.deferred_pages);
+    ++ctx->save.nr_deferred_pages;
+
+    if ( pool )
+        pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Release the guest mappings and local pages held by a batch.
+ */
+static void release_batch(struct xc_sr_context *ctx, struct xc_sr_batch *b)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned i;
+
+    if ( b->guest_mapping )
+        xenforeignmemory_unmap(xch->fmem, b->guest_mapping,
+                               b->nr_pages_mapped);
+    b->guest_mapping = NULL;
+    b->nr_pages_mapped = 0;
+
+    for ( i = 0; i < b->nr_pfns; ++i )
+    {
+        free(b->local_pages[i]);
+        b->local_pages[i] = NULL;
     }
+}
+
+/*
+ * Construct the iovec[] for a PAGE_DATA record covering the whole batch.
+ */
+static void build_page_data_record(struct xc_sr_batch *b, unsigned nr_pages)
+{
+    unsigned i, nr_pfns = b->nr_pfns;
+
+    b->rec.type = REC_TYPE_PAGE_DATA;
+    b->hdr.count = nr_pfns;
+
+    b->rec.length = sizeof(b->hdr);
+    b->rec.length += nr_pfns * sizeof(*b->rec_pfns);
+    b->rec.length += nr_pages * PAGE_SIZE;
 
     for ( i = 0; i < nr_pfns; ++i )
+        b->rec_pfns[i] = ((uint64_t)(b->types[i]) << 32) | b->pfns[i];
+
+    b->iov[0].iov_base = &b->rec.type;
+    b->iov[0].iov_len = sizeof(b->rec.type);
+
+    b->iov[1].iov_base = &b->rec.length;
+    b->iov[1].iov_len = sizeof(b->rec.length);
+
+    b->iov[2].iov_base = &b->hdr;
+    b->iov[2].iov_len = sizeof(b->hdr);
+
+    b->iov[3].iov_base = b->rec_pfns;
+    b->iov[3].iov_len = nr_pfns * sizeof(*b->rec_pfns);
+
+    b->iovcnt = 4;
+
+    if ( nr_pages )
     {
-        types[i] = mfns[i] = ctx->save.ops.pfn_to_gfn(ctx,
-                                                      ctx->save.batch_pfns[i]);
+        for ( i = 0; i < nr_pfns; ++i )
+        {
+            if ( b->guest_data[i] )
+            {
+                b->iov[b->iovcnt].iov_base = b->guest_data[i];
+                b->iov[b->iovcnt].iov_len = PAGE_SIZE;
+                b->iovcnt++;
+                --nr_pages;
+            }
+        }
+    }
 
-        /* Likely a ballooned page. */
-        if ( mfns[i] == INVALID_MFN )
+    /* Sanity check we are going to send all the pages we expected to. */
+    assert(nr_pages == 0);
+
+    b->nr_data_pages = b->iovcnt - 4;
+}
+
+static bool page_is_zero(const void *page)
+{
+    const uint64_t *p = page;
+    unsigned i;
+
+    for ( i = 0; i < PAGE_SIZE / sizeof(*p); ++i )
+        if ( p[i] )
+            return false;
+
+    return true;
+}
+
+static void add_iov(struct xc_sr_batch *b, void *base, size_t len)
+{
+    b->iov[b->iovcnt].iov_base = base;
+    b->iov[b->iovcnt].iov_len = len;
+    b->iovcnt++;
+}
+
+/*
+ * Construct the iovec[] for a ZERO_PAGES record covering the batch's
+ * all-zero data pages, followed by a PAGE_DATA_LZ4 record for the rest.
+ * Either record is omitted if it would be empty.
+ */
+static void build_compressed_records(struct xc_sr_batch *b)
+{
+    static const uint8_t zero_pad[(1U << REC_ALIGN_ORDER) - 1];
+    struct xc_sr_rec_zero_pages_run *run = NULL;
+    unsigned i, nr_pfns = b->nr_pfns, nr_rec_pfns = 0, nr_runs = 0;
+    uint8_t *pos = b->cbuf, *seg = b->cbuf;
+    uint32_t len;
+    size_t clen;
+
+    b->nr_zero_pages = b->nr_data_pages = 0;
+    b->iovcnt = 0;
+
+    /*
+     * Pull all-zero data pages out of the batch.  Pagetables are never
+     * elided, as the restorer must see their type.
+     */
+    for ( i = 0; i < nr_pfns; ++i )
+    {
+        if ( b->types[i] == XEN_DOMCTL_PFINFO_NOTAB && b->guest_data[i] &&
+             page_is_zero(b->guest_data[i]) )
+        {
+            if ( run && run->pfn + run->count == b->pfns[i] )
+                run->count++;
+            else
+            {
+                run = &b->runs[nr_runs++];
+                run->pfn = b->pfns[i];
+                run->count = 1;
+                run->_res1 = 0;
+            }
+            b->guest_data[i] = NULL;
+            b->nr_zero_pages++;
+            continue;
+        }
+
+        b->rec_pfns[nr_rec_pfns++] =
+            ((uint64_t)(b->types[i]) << 32) | b->pfns[i];
+    }
+
+    if ( nr_runs )
+    {
+        b->zrec.type = REC_TYPE_ZERO_PAGES;
+        b->zrec.length = sizeof(b->zhdr) + nr_runs * sizeof(*b->runs);
+        b->zhdr.count = nr_runs;
+        b->zhdr._res1 = 0;
+
+        add_iov(b, &b->zrec.type, sizeof(b->zrec.type));
+        add_iov(b, &b->zrec.length, sizeof(b->zrec.length));
+        add_iov(b, &b->zhdr, sizeof(b->zhdr));
+        add_iov(b, b->runs, nr_runs * sizeof(*b->runs));
+    }
+
+    if ( !nr_rec_pfns )
+        return;
+
+    b->rec.type = REC_TYPE_PAGE_DATA_LZ4;
+    b->hdr.count = nr_rec_pfns;
+    b->hdr._res1 = 0;
+
+    add_iov(b, &b->rec.type, sizeof(b->rec.type));
+    add_iov(b, &b->rec.length, sizeof(b->rec.length));
+    add_iov(b, &b->hdr, sizeof(b->hdr));
+    add_iov(b, b->rec_pfns, nr_rec_pfns * sizeof(*b->rec_pfns));
+
+    b->rec.length = sizeof(b->hdr) + nr_rec_pfns * sizeof(*b->rec_pfns);
+
+    /*
+     * Lay out each page as a length followed by its data.  Compressed pages
+     * are staged in cbuf, and consecutive ones are sent with a single iov.
+     * Pages which don't compress are sent from their original location.
+     */
+    for ( i = 0; i < nr_pfns; ++i )
+    {
+        if ( !b->guest_data[i] )
+            continue;
+
+        clen = sr_lz4_compress_page(b->guest_data[i], pos + sizeof(len),
+                                    PAGE_SIZE - 1, b->lz4_table);
+        len = clen ?: PAGE_SIZE;
+        memcpy(pos, &len, sizeof(len));
+        pos += sizeof(len) + clen;
+
+        if ( !clen )
         {
-            set_bit(ctx->save.batch_pfns[i], ctx->save.deferred_pages);
-            ++ctx->save.nr_deferred_pages;
+            add_iov(b, seg, pos - seg);
+            add_iov(b, b->guest_data[i], PAGE_SIZE);
+            seg = pos;
         }
+
+        b->rec.length += sizeof(len) + len;
+        b->nr_data_pages++;
+    }
+
+    if ( pos != seg )
+        add_iov(b, seg, pos - seg);
+
+    if ( ROUNDUP(b->rec.length, REC_ALIGN_ORDER) != b->rec.length )
+        add_iov(b, (void *)zero_pad,
+                ROUNDUP(b->rec.length, REC_ALIGN_ORDER) - b->rec.length);
+
+    assert(b->iovcnt <= BATCH_IOV_MAX(true));
+    assert(pos - b->cbuf <= BATCH_CBUF_SIZE);
+}
+
+/*
+ * Prepare a batch of memory as records for the stream.
+ *
+ * This function:
+ * - gets the types for each pfn in the batch.
+ * - for each pfn with real data:
+ *   - maps and attempts to localise the pages.
+ * - constructs the iovec[] for the PAGE_DATA record, or for the ZERO_PAGES
+ *   and PAGE_DATA_LZ4 records in a compressed stream.
+ *
+ * The mappings are retained until release_batch().
+ */
+static int prepare_batch(struct xc_sr_context *ctx, struct xc_sr_batch *b)
+{
+    xc_interface *xch = ctx->xch;
+    xen_pfn_t *mfns = b->mfns, *types = b->types;
+    int *errors = b->errors, rc = -1;
+    unsigned i, p, nr_pages = 0;
+    unsigned nr_pfns = b->nr_pfns;
+    void *page, *orig_page;
+
+    assert(nr_pfns != 0);
+
+    memset(b->guest_data, 0, nr_pfns * sizeof(*b->guest_data));
+
+    for ( i = 0; i < nr_pfns; ++i )
+    {
+        types[i] = mfns[i] = ctx->save.ops.pfn_to_gfn(ctx, b->pfns[i]);
+
+        /* Likely a ballooned page. */
+        if ( mfns[i] == INVALID_MFN )
+            defer_pfn(ctx, b->pfns[i]);
     }
 
     rc = xc_get_pfn_type_batch(xch, ctx->domid, nr_pfns, types);
@@ -153,14 +488,14 @@ static int write_batch(struct xc_sr_context *ctx)
 
     if ( nr_pages > 0 )
     {
-        guest_mapping = xenforeignmemory_map(xch->fmem,
+        b->guest_mapping = xenforeignmemory_map(xch->fmem,
             ctx->domid, PROT_READ, nr_pages, mfns, errors);
-        if ( !guest_mapping )
+        if ( !b->guest_mapping )
         {
             PERROR("Failed to map guest pages");
             goto err;
         }
-        nr_pages_mapped = nr_pages;
+        b->nr_pages_mapped = nr_pages;
 
         for ( i = 0, p = 0; i < nr_pfns; ++i )
         {
@@ -175,22 +510,21 @@ static int write_batch(struct xc_sr_context *ctx)
             if ( errors[p] )
             {
                 ERROR("Mapping of pfn %#"PRIpfn" (mfn %#"PRIpfn") failed %d",
-                      ctx->save.batch_pfns[i], mfns[p], errors[p]);
+                      b->pfns[i], mfns[p], errors[p]);
                 goto err;
             }
 
-            orig_page = page = guest_mapping + (p * PAGE_SIZE);
+            orig_page = page = b->guest_mapping + (p * PAGE_SIZE);
             rc = ctx->save.ops.normalise_page(ctx, types[i], &page);
 
             if ( orig_page != page )
-                local_pages[i] = page;
+                b->local_pages[i] = page;
 
             if ( rc )
             {
                 if ( rc == -1 && errno == EAGAIN )
                 {
-                    set_bit(ctx->save.batch_pfns[i], ctx->save.deferred_pages);
-                    ++ctx->save.nr_deferred_pages;
+                    defer_pfn(ctx, b->pfns[i]);
                     types[i] = XEN_DOMCTL_PFINFO_XTAB;
                     --nr_pages;
                 }
@@ -198,86 +532,361 @@ static int write_batch(struct xc_sr_context *ctx)
                     goto err;
             }
             else
-                guest_data[i] = page;
+                b->guest_data[i] = page;
 
             rc = -1;
             ++p;
         }
     }
 
-    rec_pfns = malloc(nr_pfns * sizeof(*rec_pfns));
-    if ( !rec_pfns )
+    if ( ctx->save.compress )
+        build_compressed_records(b);
+    else
+        build_page_data_record(b, nr_pages);
+    rc = 0;
+
+ err:
+    return rc;
+}
+
+/*
+ * Write a prepared batch into the stream.
+ */
+static int send_batch(struct xc_sr_context *ctx, struct xc_sr_batch *b)
+{
+    xc_interface *xch = ctx->xch;
+
+    if ( writev_exact(ctx->fd, b->iov, b->iovcnt) )
     {
-        ERROR("Unable to allocate %zu bytes of memory for page data pfn list",
-              nr_pfns * sizeof(*rec_pfns));
-        goto err;
+        PERROR("Failed to write page data to stream");
+        return -1;
     }
 
-    hdr.count = nr_pfns;
+    if ( ctx->save.compress )
+    {
+        ctx->save.nr_zero_pages += b->nr_zero_pages;
+        ctx->save.nr_data_pages += b->nr_data_pages;
+        if ( b->nr_data_pages )
+            ctx->save.data_bytes += b->rec.length;
+    }
+
+    return 0;
+}
+
+/*
+ * Writes a batch of memory as a PAGE_DATA record into the stream, on the
+ * calling thread.  The batch is constructed in ctx->save.batch_pfns.
+ */
+static int write_batch(struct xc_sr_context *ctx)
+{
+    struct xc_sr_batch *b = ctx->save.batch;
+    int rc;
 
-    rec.length = sizeof(hdr);
-    rec.length += nr_pfns * sizeof(*rec_pfns);
-    rec.length += nr_pages * PAGE_SIZE;
+    assert(b->pfns == ctx->save.batch_pfns);
+    b->nr_pfns = ctx->save.nr_batch_pfns;
 
-    for ( i = 0; i < nr_pfns; ++i )
-        rec_pfns[i] = ((uint64_t)(types[i]) << 32) | ctx->save.batch_pfns[i];
+    rc = prepare_batch(ctx, b);
+    if ( !rc )
+        rc = send_batch(ctx, b);
 
-    iov[0].iov_base = &rec.type;
-    iov[0].iov_len = sizeof(rec.type);
+    release_batch(ctx, b);
 
-    iov[1].iov_base = &rec.length;
-    iov[1].iov_len = sizeof(rec.length);
+    if ( !rc )
+        ctx->save.nr_batch_pfns = 0;
 
-    iov[2].iov_base = &hdr;
-    iov[2].iov_len = sizeof(hdr);
+    return rc;
+}
+
+static void pool_set_error(struct xc_sr_save_pool *pool, int rc)
+{
+    if ( !pool->rc )
+    {
+        pool->rc = rc;
+        pool->err = errno;
+    }
+}
 
-    iov[3].iov_base = rec_pfns;
-    iov[3].iov_len = nr_pfns * sizeof(*rec_pfns);
+static void pool_put_free(struct xc_sr_save_pool *pool, struct xc_sr_batch *b)
+{
+    b->next = pool->free;
+    pool->free = b;
+    --pool->in_flight;
+    pthread_cond_broadcast(&pool->done_cond);
+}
 
-    iovcnt = 4;
+/*
+ * Worker thread: map and normalise pending batches.
+ */
+static void *pool_worker(void *arg)
+{
+    struct xc_sr_save_pool *pool = arg;
+    struct xc_sr_context *ctx = pool->ctx;
+    struct xc_sr_batch *b;
+    int rc;
 
-    if ( nr_pages )
+    pthread_mutex_lock(&pool->lock);
+    for ( ;; )
     {
-        for ( i = 0; i < nr_pfns; ++i )
+        while ( !pool->quit && !pool->pending )
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+
+        if ( pool->quit )
+            break;
+
+        b = pool->pending;
+        pool->pending = b->next;
+        if ( !pool->pending )
+            pool->pending_tail = &pool->pending;
+
+        /* Don't bother doing further work after an error. */
+        rc = pool->rc;
+        pthread_mutex_unlock(&pool->lock);
+
+        if ( !rc )
+            rc = prepare_batch(ctx, b);
+        if ( rc )
+            release_batch(ctx, b);
+
+        pthread_mutex_lock(&pool->lock);
+        if ( rc )
         {
-            if ( guest_data[i] )
-            {
-                iov[iovcnt].iov_base = guest_data[i];
-                iov[iovcnt].iov_len = PAGE_SIZE;
-                iovcnt++;
-                --nr_pages;
-            }
+            pool_set_error(pool, rc);
+            pool_put_free(pool, b);
+        }
+        else
+        {
+            b->next = NULL;
+            *pool->ready_tail = b;
+            pool->ready_tail = &b->next;
+            pthread_cond_signal(&pool->write_cond);
         }
     }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
 
-    if ( writev_exact(ctx->fd, iov, iovcnt) )
+/*
+ * Writer thread: write ready batches into the stream.  There is a single
+ * writer, so records are never interleaved.
+ */
+static void *pool_writer(void *arg)
+{
+    struct xc_sr_save_pool *pool = arg;
+    struct xc_sr_context *ctx = pool->ctx;
+    struct xc_sr_batch *b;
+    int rc;
+
+    pthread_mutex_lock(&pool->lock);
+    for ( ;; )
     {
-        PERROR("Failed to write page data to stream");
-        goto err;
+        while ( !pool->quit && !pool->ready )
+            pthread_cond_wait(&pool->write_cond, &pool->lock);
+
+        if ( pool->quit )
+            break;
+
+        b = pool->ready;
+        pool->ready = b->next;
+        if ( !pool->ready )
+            pool->ready_tail = &pool->ready;
+
+        rc = pool->rc;
+        pthread_mutex_unlock(&pool->lock);
+
+        if ( !rc )
+            rc = send_batch(ctx, b);
+        release_batch(ctx, b);
+
+        pthread_mutex_lock(&pool->lock);
+        if ( rc )
+            pool_set_error(pool, rc);
+        pool_put_free(pool, b);
     }
+    pthread_mutex_unlock(&pool->lock);
 
-    /* Sanity check we have sent all the pages we expected to. */
-    assert(nr_pages == 0);
-    rc = ctx->save.nr_batch_pfns = 0;
+    return NULL;
+}
+
+static void destroy_pool(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_pool *pool = ctx->save.pool;
+    struct xc_sr_batch *b;
+    unsigned i;
+
+    if ( !pool )
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_cond_broadcast(&pool->write_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for ( i = 0; i < pool->nr_threads; ++i )
+        pthread_join(pool->threads[i], NULL);
+
+    /* Batches abandoned mid-flight still hold mappings. */
+    while ( (b = pool->pending) )
+    {
+        pool->pending = b->next;
+        free_batch(b);
+    }
+    while ( (b = pool->ready) )
+    {
+        pool->ready = b->next;
+        release_batch(ctx, b);
+        free_batch(b);
+    }
+    while ( (b = pool->free) )
+    {
+        pool->free = b->next;
+        free_batch(b);
+    }
+
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->write_cond);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->lock);
+
+    free(pool);
+    ctx->save.pool = NULL;
+}
+
+/*
+ * Start nr_workers mapping threads and one writer thread.  Two batches per
+ * worker are kept in circulation, so the workers can fill the next batch
+ * while the previous one is being written.
+ */
+static int setup_pool(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_save_pool *pool;
+    struct xc_sr_batch *b;
+    unsigned i, nr_workers = ctx->save.nr_workers;
+
+    assert(nr_workers > 0 && nr_workers <= SR_MAX_WORKERS);
+
+    pool = calloc(1, sizeof(*pool));
+    if ( !pool )
+    {
+        ERROR("Unable to allocate memory for worker pool");
+        return -1;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->write_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    pool->pending_tail = &pool->pending;
+    pool->ready_tail = &pool->ready;
+    pool->ctx = ctx;
+    ctx->save.pool = pool;
+
+    for ( i = 0; i < nr_workers * 2; ++i )
+    {
+        b = alloc_batch(ctx->save.compress);
+        if ( !b )
+        {
+            ERROR("Unable to allocate memory for worker pool batches");
+            goto err;
+        }
+
+        b->next = pool->free;
+        pool->free = b;
+    }
+
+    for ( i = 0; i <= nr_workers; ++i )
+    {
+        errno = pthread_create(&pool->threads[i], NULL,
+                               i ? pool_worker : pool_writer, pool);
+        if ( errno )
+        {
+            PERROR("Unable to create worker thread");
+            goto err;
+        }
+        pool->nr_threads++;
+    }
+
+    DPRINTF("Using %u worker threads for page transmission", nr_workers);
+
+    return 0;
 
  err:
-    free(rec_pfns);
-    if ( guest_mapping )
-        xenforeignmemory_unmap(xch->fmem, guest_mapping, nr_pages_mapped);
-    for ( i = 0; local_pages && i < nr_pfns; ++i )
-        free(local_pages[i]);
-    free(iov);
-    free(local_pages);
-    free(guest_data);
-    free(errors);
-    free(types);
-    free(mfns);
+    destroy_pool(ctx);
+    return -1;
+}
+
+/*
+ * Wait for all batches handed to the worker pool to be written into the
+ * stream.  Must be called before anything else is written, and before the
+ * deferred pages are consumed.
+ */
+static int sync_batches(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_pool *pool = ctx->save.pool;
+    int rc;
+
+    if ( !pool )
+        return 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while ( pool->in_flight )
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    rc = pool->rc;
+    if ( rc )
+        errno = pool->err;
+    pthread_mutex_unlock(&pool->lock);
 
     return rc;
 }
 
 /*
- * Flush a batch of pfns into the stream.
+ * Hand the batch in ctx->save.batch_pfns to the worker pool, waiting for a
+ * free batch if all are in flight.
+ */
+static int queue_batch(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_pool *pool = ctx->save.pool;
+    struct xc_sr_batch *b;
+    int rc;
+
+    pthread_mutex_lock(&pool->lock);
+    while ( !pool->free && !pool->rc )
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+
+    rc = pool->rc;
+    if ( rc )
+    {
+        errno = pool->err;
+        pthread_mutex_unlock(&pool->lock);
+        return rc;
+    }
+
+    b = pool->free;
+    pool->free = b->next;
+    ++pool->in_flight;
+    pthread_mutex_unlock(&pool->lock);
+
+    memcpy(b->pfns, ctx->save.batch_pfns,
+           ctx->save.nr_batch_pfns * sizeof(*b->pfns));
+    b->nr_pfns = ctx->save.nr_batch_pfns;
+    b->next = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    *pool->pending_tail = b;
+    pool->pending_tail = &b->next;
+    pthread_cond_signal(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    ctx->save.nr_batch_pfns = 0;
+
+    return 0;
+}
+
+/*
+ * Flush a batch of pfns into the stream.  With a worker pool, the batch is
+ * only guaranteed to have been written after sync_batches().
  */
 static int flush_batch(struct xc_sr_context *ctx)
 {
@@ -286,7 +895,10 @@ static int flush_batch(struct xc_sr_context *ctx)
     if ( ctx->save.nr_batch_pfns == 0 )
         return rc;
 
-    rc = write_batch(ctx);
+    if ( ctx->save.pool )
+        rc = queue_batch(ctx);
+    else
+        rc = write_batch(ctx);
 
     if ( !rc )
     {
@@ -372,6 +984,13 @@ static int send_dirty_pages(struct xc_sr_context *ctx,
 
     for ( p = 0, written = 0; p < ctx->save.p2m_size; ++p )
     {
+        /* Skip clean words at a time; most of the bitmap is empty late on. */
+        if ( !(p % BITS_PER_LONG) && !dirty_bitmap[p / BITS_PER_LONG] )
+        {
+            p += BITS_PER_LONG - 1;
+            continue;
+        }
+
         if ( !test_bit(p, dirty_bitmap) )
             continue;
 
@@ -390,6 +1009,10 @@ static int send_dirty_pages(struct xc_sr_context *ctx,
     if ( rc )
         return rc;
 
+    rc = sync_batches(ctx);
+    if ( rc )
+        return rc;
+
     if ( written > entries )
         DPRINTF("Bitmap contained more entries than expected...");
 
@@ -412,6 +1035,126 @@ static int send_all_pages(struct xc_sr_context *ctx)
     return send_dirty_pages(ctx, ctx->save.p2m_size);
 }
 
+static int compare_pfns(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Retrieve and clean the list of pfns dirtied since the last round.  Returns
+ * the number of pfns in the dirty list, or -1 if the caller needs to use the
+ * dirty bitmap for this round instead.  If Xen doesn't support the list, it
+ * is abandoned for the rest of the save.
+ */
+static int clean_dirty_list(struct xc_sr_context *ctx, uint32_t mode,
+                            xc_shadow_op_stats_t *stats)
+{
+    xc_interface *xch = ctx->xch;
+    int rc;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(uint64_t, dirty_list,
+                                    &ctx->save.dirty_list_hbuf);
+
+    if ( !ctx->save.dirty_list_size )
+        return -1;
+
+    rc = xc_shadow_control(xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_CLEAN_LIST,
+                           HYPERCALL_BUFFER(dirty_list),
+                           ctx->save.dirty_list_size, NULL, mode, stats);
+    if ( rc < 0 && errno != ENOBUFS )
+    {
+        DPRINTF("Dirty pfn list not available (errno %d), using bitmaps",
+                errno);
+        xc_hypercall_buffer_free_pages(
+            xch, dirty_list,
+            NRPAGES(ctx->save.dirty_list_size * sizeof(*dirty_list)));
+        ctx->save.dirty_list_size = 0;
+    }
+
+    return rc;
+}
+
+/*
+ * Send the pages in the dirty list, as retrieved by clean_dirty_list().  The
+ * list is sorted first, so neighbouring pfns end up in the same batch.
+ */
+static int send_dirty_list(struct xc_sr_context *ctx, unsigned long entries)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned long i, written;
+    int rc;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(uint64_t, dirty_list,
+                                    &ctx->save.dirty_list_hbuf);
+
+    qsort(dirty_list, entries, sizeof(*dirty_list), compare_pfns);
+
+    for ( i = 0, written = 0; i < entries; ++i )
+    {
+        if ( dirty_list[i] >= ctx->save.p2m_size )
+            continue;
+
+        rc = add_to_batch(ctx, dirty_list[i]);
+        if ( rc )
+            return rc;
+
+        /* Update progress every 4MB worth of memory sent. */
+        if ( (written & ((1U << (22 - 12)) - 1)) == 0 )
+            xc_report_progress_step(xch, written, entries);
+
+        ++written;
+    }
+
+    rc = flush_batch(ctx);
+    if ( rc )
+        return rc;
+
+    rc = sync_batches(ctx);
+    if ( rc )
+        return rc;
+
+    xc_report_progress_step(xch, entries, entries);
+
+    return ctx->save.ops.check_vm_state(ctx);
+}
+
+/*
+ * Retrieve and clean the dirty pages into the dirty bitmap, from the dirty
+ * list if possible.
+ */
+static int clean_dirty_bitmap(struct xc_sr_context *ctx, uint32_t mode,
+                              xc_shadow_op_stats_t *stats)
+{
+    xc_interface *xch = ctx->xch;
+    int i, nr;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+    DECLARE_HYPERCALL_BUFFER_SHADOW(uint64_t, dirty_list,
+                                    &ctx->save.dirty_list_hbuf);
+
+    nr = clean_dirty_list(ctx, mode, stats);
+    if ( nr >= 0 )
+    {
+        bitmap_clear(dirty_bitmap, ctx->save.p2m_size);
+        for ( i = 0; i < nr; ++i )
+            if ( dirty_list[i] < ctx->save.p2m_size )
+                set_bit(dirty_list[i], dirty_bitmap);
+
+        return 0;
+    }
+
+    if ( xc_shadow_control(
+             xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
+             HYPERCALL_BUFFER(dirty_bitmap), ctx->save.p2m_size,
+             NULL, mode, stats) != ctx->save.p2m_size )
+    {
+        PERROR("Failed to retrieve logdirty bitmap");
+        return -1;
+    }
+
+    return 0;
+}
+
 static int enable_logdirty(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
@@ -466,6 +1209,133 @@ static int update_progress_string(struct xc_sr_context *ctx,
     return 0;
 }
 
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Lower bound of the vcpu cap when throttling, in percent of a pcpu. */
+#define THROTTLE_MIN_CAP_PER_VCPU 10
+
+/*
+ * Halve the cpu time available to the guest, so it dirties memory more
+ * slowly.  The original scheduler parameters are restored by
+ * unthrottle_guest().  Only the credit scheduler supports caps; on failure
+ * throttling is disabled for the rest of the save.
+ */
+static void throttle_guest(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xen_domctl_sched_credit sdom;
+    unsigned nr_vcpus = ctx->dominfo.max_vcpu_id + 1;
+    unsigned cap, min_cap = nr_vcpus * THROTTLE_MIN_CAP_PER_VCPU;
+
+    if ( !ctx->save.throttled )
+    {
+        if ( xc_sched_credit_domain_get(xch, ctx->domid, &ctx->save.sched) )
+        {
+            PERROR("Unable to throttle guest, continuing without");
+            ctx->save.throttle = false;
+            return;
+        }
+        sdom = ctx->save.sched;
+    }
+    else if ( xc_sched_credit_domain_get(xch, ctx->domid, &sdom) )
+    {
+        PERROR("Unable to get scheduler parameters");
+        return;
+    }
+
+    cap = sdom.cap ?: nr_vcpus * 100;
+    if ( cap <= min_cap )
+    {
+        IPRINTF("Guest already throttled to %u%%", cap);
+        return;
+    }
+
+    cap = max(cap / 2, min_cap);
+    sdom.cap = min(cap, 65535U);
+
+    if ( xc_sched_credit_domain_set(xch, ctx->domid, &sdom) )
+    {
+        PERROR("Unable to throttle guest, continuing without");
+        ctx->save.throttle = false;
+        return;
+    }
+
+    ctx->save.throttled = true;
+    IPRINTF("Throttled guest to a cap of %u%%", sdom.cap);
+}
+
+static void unthrottle_guest(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+
+    if ( !ctx->save.throttled )
+        return;
+
+    if ( xc_sched_credit_domain_set(xch, ctx->domid, &ctx->save.sched) )
+        PERROR("Unable to restore scheduler parameters");
+    else
+        ctx->save.throttled = false;
+}
+
+/*
+ * Decide whether another pre-copy iteration is worthwhile, given the time
+ * since the dirty bitmap was last cleaned, and the rate at which the last
+ * iteration was transmitted (in pages per second).  The dirty count is
+ * peeked, so the bitmap is left intact for the final iteration.
+ *
+ * Sets *stop once the predicted downtime is within the target, or when
+ * memory is being dirtied faster than it can be sent and throttling is not
+ * available.
+ */
+static int precopy_policy(struct xc_sr_context *ctx, unsigned iter,
+                          uint64_t dirty_us, uint64_t tx_rate, bool *stop)
+{
+    xc_interface *xch = ctx->xch;
+    xc_shadow_op_stats_t stats;
+    uint64_t dirty_rate, downtime_ms;
+
+    if ( xc_shadow_control(xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_PEEK,
+                           NULL, ctx->save.p2m_size, NULL, 0, &stats) < 0 )
+    {
+        PERROR("Failed to peek logdirty stats");
+        return -1;
+    }
+
+    dirty_rate = stats.dirty_count * 1000000ULL / (dirty_us ?: 1);
+    downtime_ms = stats.dirty_count * 1000ULL / (tx_rate ?: 1);
+
+    IPRINTF("Iteration %u: %u pages dirty, dirty rate %"PRIu64" pages/s, "
+            "send rate %"PRIu64" pages/s, predicted downtime %"PRIu64"ms "
+            "(target %ums)", iter, stats.dirty_count, dirty_rate, tx_rate,
+            downtime_ms, ctx->save.max_downtime_ms);
+
+    *stop = false;
+
+    if ( downtime_ms <= ctx->save.max_downtime_ms )
+    {
+        IPRINTF("Downtime target met, stopping pre-copy");
+        *stop = true;
+    }
+    else if ( dirty_rate >= tx_rate )
+    {
+        if ( ctx->save.throttle )
+            throttle_guest(ctx);
+        else
+        {
+            IPRINTF("Pre-copy not converging, stopping");
+            *stop = true;
+        }
+    }
+
+    return 0;
+}
+
 /*
  * Send memory while guest is running.
  */
@@ -474,22 +1344,40 @@ static int send_memory_live(struct xc_sr_context *ctx)
     xc_interface *xch = ctx->xch;
     xc_shadow_op_stats_t stats = { 0, ctx->save.p2m_size };
     char *progress_str = NULL;
+    uint64_t t_clean, t_send, tx_rate;
     unsigned x;
-    int rc;
+    bool stop;
+    int nr_list, rc;
 
     rc = update_progress_string(ctx, &progress_str, 0);
     if ( rc )
         goto out;
 
+    /* Logdirty was enabled just before the first iteration. */
+    t_clean = t_send = now_us();
+
     rc = send_all_pages(ctx);
     if ( rc )
         goto out;
 
+    tx_rate = ctx->save.p2m_size * 1000000ULL / ((now_us() - t_send) ?: 1);
+
     for ( x = 1;
           ((x < ctx->save.max_iterations) &&
            (stats.dirty_count > ctx->save.dirty_threshold)); ++x )
     {
-        if ( xc_shadow_control(
+        if ( ctx->save.max_downtime_ms )
+        {
+            rc = precopy_policy(ctx, x, now_us() - t_clean, tx_rate, &stop);
+            if ( rc )
+                goto out;
+            if ( stop )
+                break;
+        }
+
+        nr_list = clean_dirty_list(ctx, 0, &stats);
+        if ( nr_list < 0 &&
+             xc_shadow_control(
                  xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
                  &ctx->save.dirty_bitmap_hbuf, ctx->save.p2m_size,
                  NULL, 0, &stats) != ctx->save.p2m_size )
@@ -498,6 +1386,7 @@ static int send_memory_live(struct xc_sr_context *ctx)
             rc = -1;
             goto out;
         }
+        t_clean = t_send = now_us();
 
         if ( stats.dirty_count == 0 )
             break;
@@ -506,11 +1395,20 @@ static int send_memory_live(struct xc_sr_context *ctx)
         if ( rc )
             goto out;
 
-        rc = send_dirty_pages(ctx, stats.dirty_count);
+        if ( nr_list >= 0 )
+            rc = send_dirty_list(ctx, nr_list);
+        else
+            rc = send_dirty_pages(ctx, stats.dirty_count);
         if ( rc )
             goto out;
+
+        tx_rate = stats.dirty_count * 1000000ULL /
+            ((now_us() - t_send) ?: 1);
     }
 
+    if ( ctx->save.max_downtime_ms && x == ctx->save.max_iterations )
+        IPRINTF("Pre-copy iteration limit reached");
+
  out:
     xc_set_progress_prefix(xch, NULL);
     free(progress_str);
@@ -587,16 +1485,9 @@ static int suspend_and_send_dirty(struct xc_sr_context *ctx)
     if ( rc )
         goto out;
 
-    if ( xc_shadow_control(
-             xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
-             HYPERCALL_BUFFER(dirty_bitmap), ctx->save.p2m_size,
-             NULL, XEN_DOMCTL_SHADOW_LOGDIRTY_FINAL, &stats) !=
-         ctx->save.p2m_size )
-    {
-        PERROR("Failed to retrieve logdirty bitmap");
-        rc = -1;
+    rc = clean_dirty_bitmap(ctx, XEN_DOMCTL_SHADOW_LOGDIRTY_FINAL, &stats);
+    if ( rc )
         goto out;
-    }
 
     if ( ctx->save.live )
     {
@@ -739,6 +1630,8 @@ static int setup(struct xc_sr_context *ctx)
     int rc;
     DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
                                     &ctx->save.dirty_bitmap_hbuf);
+    DECLARE_HYPERCALL_BUFFER_SHADOW(uint64_t, dirty_list,
+                                    &ctx->save.dirty_list_hbuf);
 
     rc = ctx->save.ops.setup(ctx);
     if ( rc )
@@ -746,11 +1639,18 @@ static int setup(struct xc_sr_context *ctx)
 
     dirty_bitmap = xc_hypercall_buffer_alloc_pages(
                    xch, dirty_bitmap, NRPAGES(bitmap_size(ctx->save.p2m_size)));
-    ctx->save.batch_pfns = malloc(MAX_BATCH_SIZE *
-                                  sizeof(*ctx->save.batch_pfns));
+
+    /* Not fatal: without the list, the bitmap is used for every round. */
+    ctx->save.dirty_list_size = min(ctx->save.p2m_size, DIRTY_LIST_MAX);
+    dirty_list = xc_hypercall_buffer_alloc_pages(
+                 xch, dirty_list,
+                 NRPAGES(ctx->save.dirty_list_size * sizeof(*dirty_list)));
+    if ( !dirty_list )
+        ctx->save.dirty_list_size = 0;
+    ctx->save.batch = alloc_batch(ctx->save.compress);
     ctx->save.deferred_pages = calloc(1, bitmap_size(ctx->save.p2m_size));
 
-    if ( !ctx->save.batch_pfns || !dirty_bitmap || !ctx->save.deferred_pages )
+    if ( !ctx->save.batch || !dirty_bitmap || !ctx->save.deferred_pages )
     {
         ERROR("Unable to allocate memory for dirty bitmaps, batch pfns and"
               " deferred pages");
@@ -759,6 +1659,15 @@ static int setup(struct xc_sr_context *ctx)
         goto err;
     }
 
+    ctx->save.batch_pfns = ctx->save.batch->pfns;
+
+    if ( ctx->save.nr_workers )
+    {
+        rc = setup_pool(ctx);
+        if ( rc )
+            goto err;
+    }
+
     rc = 0;
 
  err:
@@ -770,18 +1679,32 @@ static void cleanup(struct xc_sr_context *ctx)
     xc_interface *xch = ctx->xch;
     DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
                                     &ctx->save.dirty_bitmap_hbuf);
+    DECLARE_HYPERCALL_BUFFER_SHADOW(uint64_t, dirty_list,
+                                    &ctx->save.dirty_list_hbuf);
 
 
     xc_shadow_control(xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_OFF,
                       NULL, 0, NULL, 0, NULL);
 
+    destroy_pool(ctx);
+    unthrottle_guest(ctx);
+
+    if ( ctx->save.compress )
+        DPRINTF("Sent %lu zero pages as runs, and %lu pages in %"PRIu64
+                " bytes of compressed page data", ctx->save.nr_zero_pages,
+                ctx->save.nr_data_pages, ctx->save.data_bytes);
+
     if ( ctx->save.ops.cleanup(ctx) )
         PERROR("Failed to clean up");
 
     xc_hypercall_buffer_free_pages(xch, dirty_bitmap,
                                    NRPAGES(bitmap_size(ctx->save.p2m_size)));
+    if ( ctx->save.dirty_list_size )
+        xc_hypercall_buffer_free_pages(
+            xch, dirty_list,
+            NRPAGES(ctx->save.dirty_list_size * sizeof(*dirty_list)));
     free(ctx->save.deferred_pages);
-    free(ctx->save.batch_pfns);
+    free_batch(ctx->save.batch);
 }
 
 /*
@@ -916,7 +1839,8 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
 };
 
 int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
-                   uint32_t max_iters, uint32_t max_factor, uint32_t flags,
+                   uint32_t max_iters, uint32_t max_factor,
+                   uint32_t max_downtime_ms, uint32_t flags,
                    struct save_callbacks* callbacks, int hvm,
                    xc_migration_stream_t stream_type, int recv_fd)
 {
@@ -932,6 +1856,9 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
     ctx.save.debug = !!(flags & XCFLAGS_DEBUG);
     ctx.save.checkpointed = stream_type;
     ctx.save.recv_fd = recv_fd;
+    if ( flags & XCFLAGS_PARALLEL )
+        ctx.save.nr_workers = sr_nr_workers();
+    ctx.save.compress = !!(flags & XCFLAGS_STREAM_COMPRESS);
 
     /* If altering migration_stream update this assert too. */
     assert(stream_type == XC_MIG_STREAM_NONE ||
@@ -947,6 +1874,18 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
     ctx.save.max_iterations = 5;
     ctx.save.dirty_threshold = 50;
 
+    /*
+     * With a downtime target, the number of iterations is decided by
+     * precopy_policy(), and only bounded here.
+     */
+    if ( ctx.save.live && max_downtime_ms )
+    {
+        ctx.save.max_downtime_ms = max_downtime_ms;
+        ctx.save.throttle = !!(flags & XCFLAGS_THROTTLE);
+        ctx.save.max_iterations = 30;
+        ctx.save.dirty_threshold = 0;
+    }
+
     /* Sanity checks for callbacks. */
     if ( hvm )
         assert(callbacks->switch_qemu_logdirty);
@@ -955,8 +1894,9 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
     if ( ctx.save.checkpointed == XC_MIG_STREAM_COLO )
         assert(callbacks->wait_checkpoint);
 
-    DPRINTF("fd %d, dom %u, max_iters %u, max_factor %u, flags %u, hvm %d",
-            io_fd, dom, max_iters, max_factor, flags, hvm);
+    DPRINTF("fd %d, dom %u, max_iters %u, max_factor %u, max_downtime %ums, "
+            "flags %u, hvm %d", io_fd, dom, max_iters, max_factor,
+            max_downtime_ms, flags, hvm);
 
     if ( xc_domain_getinfo(xch, dom, 1, &ctx.dominfo) != 1 )
     {
@@ -76,6 +76,8 @@ struct xc_sr_rhdr
 #define REC_TYPE_VERIFY                     0x0000000dU
 #define REC_TYPE_CHECKPOINT                 0x0000000eU
 #define REC_TYPE_CHECKPOINT_DIRTY_PFN_LIST  0x0000000fU
+#define REC_TYPE_ZERO_PAGES                 0x00000010U
+#define REC_TYPE_PAGE_DATA_LZ4              0x00000011U
 
 #define REC_TYPE_OPTIONAL             0x80000000U
 
@@ -90,6 +92,26 @@ struct xc_sr_rec_page_data_header
 #define PAGE_DATA_PFN_MASK  0x000fffffffffffffULL
 #define PAGE_DATA_TYPE_MASK 0xf000000000000000ULL
 
+/* ZERO_PAGES */
+struct xc_sr_rec_zero_pages_run
+{
+    uint64_t pfn;
+    uint32_t count;
+    uint32_t _res1;
+};
+
+struct xc_sr_rec_zero_pages
+{
+    uint32_t count;
+    uint32_t _res1;
+    struct xc_sr_rec_zero_pages_run run[0];
+};
+
+/*
+ * PAGE_DATA_LZ4 uses the PAGE_DATA header.  Each page of data is preceded
+ * by its length; a length of PAGE_SIZE means the page is uncompressed.
+ */
+
 /* X86_PV_INFO */
 struct xc_sr_rec_x86_pv_info
 {
@@ -51,7 +51,8 @@ int libxl_ctx_alloc(libxl_ctx **pctx, int version,
     LIBXL_LIST_INIT(&ctx->pollers_fds_changed);
 
     LIBXL_LIST_INIT(&ctx->efds);
-    LIBXL_TAILQ_INIT(&ctx->etimes);
+    ctx->etimes = 0;
+    ctx->etimes_used = ctx->etimes_allocd = 0;
 
     ctx->watch_slots = 0;
     LIBXL_SLIST_INIT(&ctx->watch_freeslots);
@@ -165,7 +166,7 @@ int libxl_ctx_free(libxl_ctx *ctx)
     /* Now there should be no more events requested from the application: */
 
     assert(LIBXL_LIST_EMPTY(&ctx->efds));
-    assert(LIBXL_TAILQ_EMPTY(&ctx->etimes));
+    assert(!ctx->etimes_used);
     assert(LIBXL_LIST_EMPTY(&ctx->evtchns_waiting));
     assert(LIBXL_LIST_EMPTY(&ctx->aos_inprogress));
 
@@ -185,6 +186,7 @@ int libxl_ctx_free(libxl_ctx *ctx)
     }
 
     free(ctx->watch_slots);
+    free(ctx->etimes);
 
     discard_events(&ctx->occurred);
 
@@ -1019,6 +1019,31 @@ void libxl_mac_copy(libxl_ctx *ctx, libxl_mac *dst, const libxl_mac *src);
  */
 #define LIBXL_HAVE_QED 1
 
+/*
+ * LIBXL_HAVE_DOMAIN_SUSPEND_PARAMS
+ *
+ * If this is defined, libxl_domain_suspend() takes a
+ * libxl_domain_suspend_params, which may be NULL.  For a live suspend,
+ * max_downtime_ms sets the target downtime; pre-copy continues until the
+ * remaining dirty memory is predicted to be sendable within the target,
+ * and with throttle set, the guest's vcpus are capped if it dirties memory
+ * faster than it can be sent.  The decisions taken are logged.  With
+ * parallel set, guest memory is mapped and written out by a pool of
+ * threads rather than by the save helper's main thread alone.  With
+ * compress set, zero pages are elided and page data is LZ4 compressed;
+ * such a stream can only be restored by a libxl which also defines
+ * LIBXL_HAVE_DOMAIN_SUSPEND_PARAMS.
+ */
+#define LIBXL_HAVE_DOMAIN_SUSPEND_PARAMS 1
+
+/*
+ * LIBXL_HAVE_DOMAIN_FORK
+ *
+ * If this is defined, libxl_domain_fork() is available to create forks of
+ * a paused HVM domain, which share its memory copy-on-write.
+ */
+#define LIBXL_HAVE_DOMAIN_FORK 1
+
 typedef char **libxl_string_list;
 void libxl_string_list_dispose(libxl_string_list *sl);
 int libxl_string_list_length(const libxl_string_list *sl);
@@ -1364,11 +1389,26 @@ int libxl_retrieve_domain_configuration(libxl_ctx *ctx, uint32_t domid,
 
 int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd,
                          int flags, /* LIBXL_SUSPEND_* */
+                         const libxl_domain_suspend_params *params,
                          const libxl_asyncop_how *ao_how)
                          LIBXL_EXTERNAL_CALLERS_ONLY;
 #define LIBXL_SUSPEND_DEBUG 1
 #define LIBXL_SUSPEND_LIVE 2
 
+#if defined(LIBXL_API_VERSION) && LIBXL_API_VERSION < 0x040900
+
+static inline int libxl_domain_suspend_0x040200(
+    libxl_ctx *ctx, uint32_t domid, int fd, int flags,
+    const libxl_asyncop_how *ao_how)
+    LIBXL_EXTERNAL_CALLERS_ONLY
+{
+    return libxl_domain_suspend(ctx, domid, fd, flags, NULL, ao_how);
+}
+
+#define libxl_domain_suspend libxl_domain_suspend_0x040200
+
+#endif
+
 /* @param suspend_cancel [from xenctrl.h:xc_domain_resume( @param fast )]
  *   If this parameter is true, use co-operative resume. The guest
  *   must support this.
@@ -1418,6 +1458,19 @@ int libxl_domain_rename(libxl_ctx *ctx, uint32_t domid,
 int libxl_domain_pause(libxl_ctx *ctx, uint32_t domid);
 int libxl_domain_unpause(libxl_ctx *ctx, uint32_t domid);
 
+/*
+ * Create a fork of the paused HVM domain pdomid and return its domid.  The
+ * fork starts with the parent's vcpu state, and its memory is populated
+ * from the parent's as it runs, sharing pages until either writes to them.
+ * The parent stays paused until all of its forks have been destroyed.
+ *
+ * The fork is created paused and has no devices, device model, console or
+ * xenstore connection of its own; it is named "<parent>-fork<domid>".
+ * Unpause it with libxl_domain_unpause() and destroy it with
+ * libxl_domain_destroy().
+ */
+int libxl_domain_fork(libxl_ctx *ctx, uint32_t pdomid, uint32_t *domid_out);
+
 int libxl_domain_core_dump(libxl_ctx *ctx, uint32_t domid,
                            const char *filename,
                            const libxl_asyncop_how *ao_how)
@@ -376,7 +376,14 @@ void libxl__domain_save(libxl__egc *egc, libxl__domain_save_state *dss)
 
     dss->xcflags = (live ? XCFLAGS_LIVE : 0)
           | (debug ? XCFLAGS_DEBUG : 0)
-          | (dss->hvm ? XCFLAGS_HVM : 0);
+          | (dss->hvm ? XCFLAGS_HVM : 0)
+          | (dss->throttle ? XCFLAGS_THROTTLE : 0)
+          | (dss->parallel ? XCFLAGS_PARALLEL : 0)
+          | (dss->compress ? XCFLAGS_STREAM_COMPRESS : 0);
+
+    if (live && dss->max_downtime_ms)
+        LOGD(INFO, domid, "Live save with a downtime target of %ums%s",
+             dss->max_downtime_ms, dss->throttle ? ", throttling" : "");
 
     /* Disallow saving a guest with vNUMA configured because migration
      * stream does not preserve node information.
@@ -487,6 +487,7 @@ static void domain_suspend_cb(libxl__egc *egc,
 }
 
 int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
+                         const libxl_domain_suspend_params *params,
                          const libxl_asyncop_how *ao_how)
 {
     AO_CREATE(ctx, domid, ao_how);
@@ -510,6 +511,15 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
     dss->live = flags & LIBXL_SUSPEND_LIVE;
     dss->debug = flags & LIBXL_SUSPEND_DEBUG;
     dss->checkpointed_stream = LIBXL_CHECKPOINTED_STREAM_NONE;
+    if (params) {
+        dss->max_downtime_ms = params->max_downtime_ms;
+        dss->throttle = libxl_defbool_is_default(params->throttle) ? false :
+            libxl_defbool_val(params->throttle);
+        dss->parallel = libxl_defbool_is_default(params->parallel) ? false :
+            libxl_defbool_val(params->parallel);
+        dss->compress = libxl_defbool_is_default(params->compress) ? false :
+            libxl_defbool_val(params->compress);
+    }
 
     rc = libxl__fd_flags_modify_save(gc, dss->fd,
                                      ~(O_NONBLOCK|O_NDELAY), 0,
@@ -591,6 +601,96 @@ int libxl_domain_unpause(libxl_ctx *ctx, uint32_t domid)
     return rc;
 }
 
+int libxl_domain_fork(libxl_ctx *ctx, uint32_t pdomid, uint32_t *domid_out)
+{
+    GC_INIT(ctx);
+    xc_domain_configuration_t xc_config = {};
+    xc_dominfo_t info;
+    libxl_uuid uuid;
+    unsigned long shadow_mb = 0;
+    uint32_t domid = INVALID_DOMID;
+    const char *dom_path, *libxl_path, *name;
+    int ret, rc;
+
+    ret = xc_domain_getinfo(ctx->xch, pdomid, 1, &info);
+    if (ret != 1 || info.domid != pdomid) {
+        LOGD(ERROR, pdomid, "Unable to get domain info");
+        rc = ERROR_INVAL;
+        goto out;
+    }
+    if (!info.hvm || !info.hap || !info.paused) {
+        LOGD(ERROR, pdomid, "Only paused HVM domains using HAP can be forked");
+        rc = ERROR_INVAL;
+        goto out;
+    }
+
+#if defined(__i386__) || defined(__x86_64__)
+    xc_config.emulation_flags = XEN_X86_EMU_ALL;
+#endif
+    libxl_uuid_generate(&uuid);
+    ret = xc_domain_create(ctx->xch, info.ssidref,
+                           libxl_uuid_bytearray(&uuid),
+                           XEN_DOMCTL_CDF_hvm_guest | XEN_DOMCTL_CDF_hap,
+                           &domid, &xc_config);
+    if (ret < 0) {
+        LOGED(ERROR, pdomid, "Creating fork");
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    if (xc_domain_max_vcpus(ctx->xch, domid, info.max_vcpu_id + 1)) {
+        LOGED(ERROR, domid, "Setting vcpus of fork");
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    /* The fork's p2m can grow as large as its parent's. */
+    if (xc_shadow_control(ctx->xch, pdomid,
+                          XEN_DOMCTL_SHADOW_OP_GET_ALLOCATION,
+                          NULL, 0, &shadow_mb, 0, NULL) ||
+        xc_shadow_control(ctx->xch, domid,
+                          XEN_DOMCTL_SHADOW_OP_SET_ALLOCATION,
+                          NULL, 0, &shadow_mb, 0, NULL)) {
+        LOGED(ERROR, domid, "Setting paging allocation of fork");
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    if (xc_memshr_fork(ctx->xch, pdomid, domid)) {
+        LOGED(ERROR, domid, "Forking domain %u", pdomid);
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    /*
+     * Just enough xenstore state for the fork to be named, unpaused and
+     * destroyed like any other domain.
+     */
+    name = libxl__domid_to_name(gc, pdomid);
+    dom_path = libxl__xs_get_dompath(gc, domid);
+    libxl_path = libxl__xs_libxl_path(gc, domid);
+    if (!dom_path || !libxl_path ||
+        libxl__xs_printf(gc, XBT_NULL, GCSPRINTF("%s/name", dom_path),
+                         "%s-fork%u", name ? name : "Domain", domid) ||
+        libxl__xs_printf(gc, XBT_NULL, GCSPRINTF("%s/domid", dom_path),
+                         "%u", domid) ||
+        libxl__xs_printf(gc, XBT_NULL, GCSPRINTF("%s/dm-version", libxl_path),
+                         "%s", libxl_device_model_version_to_string(
+                             LIBXL_DEVICE_MODEL_VERSION_NONE))) {
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    *domid_out = domid;
+    rc = 0;
+
+ out:
+    if (rc && domid != INVALID_DOMID)
+        xc_domain_destroy(ctx->xch, domid);
+    GC_FREE;
+    return rc;
+}
+
 int libxl__domain_pvcontrol_available(libxl__gc *gc, uint32_t domid)
 {
     libxl_ctx *ctx = libxl__gc_owner(gc);
@@ -35,6 +35,8 @@ static libxl__ao *ao_nested_root(libxl__ao *ao);
 
 static void ao__check_destroy(libxl_ctx *ctx, libxl__ao *ao);
 
+static void epoll_fd_changed(libxl__gc *gc, int fd);
+
 
 /*
  * The counter osevent_in_hook is used to ensure that the application
@@ -194,6 +196,7 @@ int libxl__ev_fd_register(libxl__gc *gc, libxl__ev_fd *ev,
     ev->func = func;
 
     LIBXL_LIST_INSERT_HEAD(&CTX->efds, ev, entry);
+    epoll_fd_changed(gc, fd);
 
     rc = 0;
 
@@ -215,6 +218,7 @@ int libxl__ev_fd_modify(libxl__gc *gc, libxl__ev_fd *ev, short events)
     if (rc) goto out;
 
     ev->events = events;
+    epoll_fd_changed(gc, ev->fd);
 
     rc = 0;
  out:
@@ -236,6 +240,7 @@ void libxl__ev_fd_deregister(libxl__gc *gc, libxl__ev_fd *ev)
 
     OSEVENT_HOOK_VOID(fd,deregister, release, ev->fd, ev->nexus->for_app_reg);
     LIBXL_LIST_REMOVE(ev, entry);
+    epoll_fd_changed(gc, ev->fd);
     ev->fd = -1;
 
     LIBXL_LIST_FOREACH(poller, &CTX->pollers_fds_changed, fds_changed_entry)
@@ -299,11 +304,95 @@ static int time_rel_to_abs(libxl__gc *gc, int ms, struct timeval *abs_out)
     return 0;
 }
 
+/*
+ * Finite timeouts are kept in CTX->etimes, a binary min-heap ordered
+ * by expiry time and then by registration order, so that timeouts
+ * which expire at the same time occur in the order they were
+ * registered.  Each timeout records its position in the heap in
+ * heap_index, so that it can be removed without searching for it.
+ */
+
+static bool time_before(const libxl__ev_time *a, const libxl__ev_time *b)
+{
+    if (timercmp(&a->abs, &b->abs, !=))
+        return timercmp(&a->abs, &b->abs, <);
+    return a->seq < b->seq;
+}
+
+static void time_heap_set(libxl__gc *gc, int i, libxl__ev_time *ev)
+{
+    CTX->etimes[i] = ev;
+    ev->heap_index = i;
+}
+
+/* Moves the entry at i up or down the heap, to where it belongs. */
+static void time_heap_sift(libxl__gc *gc, int i)
+{
+    libxl__ev_time *ev = CTX->etimes[i];
+    int parent, child;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (!time_before(ev, CTX->etimes[parent]))
+            break;
+        time_heap_set(gc, i, CTX->etimes[parent]);
+        i = parent;
+    }
+
+    for (;;) {
+        child = 2 * i + 1;
+        if (child >= CTX->etimes_used)
+            break;
+        if (child + 1 < CTX->etimes_used &&
+            time_before(CTX->etimes[child + 1], CTX->etimes[child]))
+            child++;
+        if (!time_before(CTX->etimes[child], ev))
+            break;
+        time_heap_set(gc, i, CTX->etimes[child]);
+        i = child;
+    }
+
+    time_heap_set(gc, i, ev);
+}
+
+static void time_heap_insert(libxl__gc *gc, libxl__ev_time *ev)
+{
+    if (CTX->etimes_used == CTX->etimes_allocd) {
+        int allocd = CTX->etimes_allocd ? CTX->etimes_allocd * 2 : 16;
+        assert(ARRAY_SIZE_OK(CTX->etimes, allocd));
+        CTX->etimes = libxl__realloc(NOGC, CTX->etimes,
+                                     allocd * sizeof(*CTX->etimes));
+        CTX->etimes_allocd = allocd;
+    }
+
+    ev->seq = CTX->etimes_seq++;
+    time_heap_set(gc, CTX->etimes_used++, ev);
+    time_heap_sift(gc, ev->heap_index);
+}
+
+static void time_heap_remove(libxl__gc *gc, libxl__ev_time *ev)
+{
+    int i = ev->heap_index;
+    libxl__ev_time *last;
+
+    assert(i < CTX->etimes_used && CTX->etimes[i] == ev);
+
+    last = CTX->etimes[--CTX->etimes_used];
+    if (last != ev) {
+        time_heap_set(gc, i, last);
+        time_heap_sift(gc, i);
+    }
+}
+
+static libxl__ev_time *time_heap_first(libxl__gc *gc)
+{
+    return CTX->etimes_used ? CTX->etimes[0] : NULL;
+}
+
 static int time_register_finite(libxl__gc *gc, libxl__ev_time *ev,
                                 struct timeval absolute)
 {
     int rc;
-    libxl__ev_time *evsearch;
 
     rc = OSEVENT_HOOK(timeout,register, alloc, &ev->nexus->for_app_reg,
                       absolute, ev->nexus);
@@ -311,8 +400,7 @@ static int time_register_finite(libxl__gc *gc, libxl__ev_time *ev,
 
     ev->infinite = 0;
     ev->abs = absolute;
-    LIBXL_TAILQ_INSERT_SORTED(&CTX->etimes, entry, ev, evsearch, /*empty*/,
-                              timercmp(&ev->abs, &evsearch->abs, >));
+    time_heap_insert(gc, ev);
 
     return 0;
 }
@@ -328,7 +416,7 @@ static void time_deregister(libxl__gc *gc, libxl__ev_time *ev)
         OSEVENT_HOOK_VOID(timeout,modify,
                           noop /* release nexus in _occurred_ */,
                           &ev->nexus->for_app_reg, right_away);
-        LIBXL_TAILQ_REMOVE(&CTX->etimes, ev, entry);
+        time_heap_remove(gc, ev);
     }
 }
 
@@ -1004,6 +1092,46 @@ int libxl__domaindeathcheck_start(libxl__ao *ao,
  * osevent poll
  */
 
+static void poller_rindices_ensure(libxl__gc *gc, libxl__poller *poller,
+                                   int maxfd)
+{
+    /* make sure fd_rindices has an entry for each fd below maxfd */
+    if (poller->fd_rindices_allocd < maxfd) {
+        assert(ARRAY_SIZE_OK(poller->fd_rindices, maxfd));
+        poller->fd_rindices =
+            libxl__realloc(NOGC, poller->fd_rindices,
+                           maxfd * sizeof(*poller->fd_rindices));
+        memset(poller->fd_rindices + poller->fd_rindices_allocd,
+               0,
+               (maxfd - poller->fd_rindices_allocd)
+                 * sizeof(*poller->fd_rindices));
+        poller->fd_rindices_allocd = maxfd;
+    }
+}
+
+static void beforepoll_timeout(libxl__gc *gc, int *timeout_upd,
+                               struct timeval now)
+{
+    libxl__ev_time *etime = time_heap_first(gc);
+    if (etime) {
+        int our_timeout;
+        struct timeval rel;
+        static struct timeval zero;
+
+        timersub(&etime->abs, &now, &rel);
+
+        if (timercmp(&rel, &zero, <)) {
+            our_timeout = 0;
+        } else if (rel.tv_sec >= 2000000) {
+            our_timeout = 2000000000;
+        } else {
+            our_timeout = rel.tv_sec * 1000 + (rel.tv_usec + 999) / 1000;
+        }
+        if (*timeout_upd < 0 || our_timeout < *timeout_upd)
+            *timeout_upd = our_timeout;
+    }
+}
+
 static int beforepoll_internal(libxl__gc *gc, libxl__poller *poller,
                                int *nfds_io, struct pollfd *fds,
                                int *timeout_upd, struct timeval now)
@@ -1075,18 +1203,7 @@ static int beforepoll_internal(libxl__gc *gc, libxl__poller *poller,
                 maxfd = req_fd + 1;
         });
 
-        /* make sure our array is as big as *nfds_io */
-        if (poller->fd_rindices_allocd < maxfd) {
-            assert(ARRAY_SIZE_OK(poller->fd_rindices, maxfd));
-            poller->fd_rindices =
-                libxl__realloc(NOGC, poller->fd_rindices,
-                               maxfd * sizeof(*poller->fd_rindices));
-            memset(poller->fd_rindices + poller->fd_rindices_allocd,
-                   0,
-                   (maxfd - poller->fd_rindices_allocd)
-                     * sizeof(*poller->fd_rindices));
-            poller->fd_rindices_allocd = maxfd;
-        }
+        poller_rindices_ensure(gc, poller, maxfd);
     }
 
     int used = 0;
@@ -1110,24 +1227,7 @@ static int beforepoll_internal(libxl__gc *gc, libxl__poller *poller,
 
     poller->fds_changed = 0;
 
-    libxl__ev_time *etime = LIBXL_TAILQ_FIRST(&CTX->etimes);
-    if (etime) {
-        int our_timeout;
-        struct timeval rel;
-        static struct timeval zero;
-
-        timersub(&etime->abs, &now, &rel);
-
-        if (timercmp(&rel, &zero, <)) {
-            our_timeout = 0;
-        } else if (rel.tv_sec >= 2000000) {
-            our_timeout = 2000000000;
-        } else {
-            our_timeout = rel.tv_sec * 1000 + (rel.tv_usec + 999) / 1000;
-        }
-        if (*timeout_upd < 0 || our_timeout < *timeout_upd)
-            *timeout_upd = our_timeout;
-    }
+    beforepoll_timeout(gc, timeout_upd, now);
 
     return rc;
 }
@@ -1271,7 +1371,7 @@ static void afterpoll_internal(libxl__egc *egc, libxl__poller *poller,
     }
 
     for (;;) {
-        libxl__ev_time *etime = LIBXL_TAILQ_FIRST(&CTX->etimes);
+        libxl__ev_time *etime = time_heap_first(gc);
         if (!etime)
             break;
 
@@ -1307,7 +1407,7 @@ void libxl_osevent_register_hooks(libxl_ctx *ctx,
     GC_INIT(ctx);
     CTX_LOCK;
     assert(LIBXL_LIST_EMPTY(&ctx->efds));
-    assert(LIBXL_TAILQ_EMPTY(&ctx->etimes));
+    assert(!ctx->etimes_used);
     ctx->osevent_hooks = hooks;
     ctx->osevent_user = user;
     CTX_UNLOCK;
@@ -1347,7 +1447,7 @@ void libxl_osevent_occurred_timeout(libxl_ctx *ctx, void *for_libxl)
     if (!ev) goto out;
     assert(!ev->infinite);
 
-    LIBXL_TAILQ_REMOVE(&CTX->etimes, ev, entry);
+    time_heap_remove(gc, ev);
 
     time_occurs(egc, ev, ERROR_TIMEDOUT);
 
@@ -1603,6 +1703,11 @@ int libxl__poller_init(libxl__gc *gc, libxl__poller *p)
     p->fd_polls = 0;
     p->fd_rindices = 0;
     p->fds_changed = 0;
+#ifdef LIBXL__USE_EPOLL
+    p->epoll_fd = -1;
+    p->epoll_failed = 0;
+    p->epoll_events = 0;
+#endif
 
     rc = libxl__pipe_nonblock(CTX, p->wakeup_pipe);
     if (rc) goto out;
@@ -1619,6 +1724,11 @@ void libxl__poller_dispose(libxl__poller *p)
     libxl__pipe_close(p->wakeup_pipe);
     free(p->fd_polls);
     free(p->fd_rindices);
+#ifdef LIBXL__USE_EPOLL
+    if (p->epoll_fd >= 0)
+        close(p->epoll_fd);
+    free(p->epoll_events);
+#endif
 }
 
 libxl__poller *libxl__poller_get(libxl__gc *gc)
@@ -1629,6 +1739,9 @@ libxl__poller *libxl__poller_get(libxl__gc *gc)
     libxl__poller *p = LIBXL_LIST_FIRST(&CTX->pollers_idle);
     if (p) {
         LIBXL_LIST_REMOVE(p, entry);
+#ifdef LIBXL__USE_EPOLL
+        p->epoll_failed = 0; /* try again */
+#endif
     } else {
         p = libxl__zalloc(NOGC, sizeof(*p));
 
@@ -1657,6 +1770,210 @@ void libxl__poller_wakeup(libxl__egc *egc, libxl__poller *p)
     if (e) LIBXL__EVENT_DISASTER(egc, "cannot poke watch pipe", e, 0);
 }
 
+/*
+ * epoll backend for eventloop_iteration
+ *
+ * Each poller which is used with eventloop_iteration has an epoll set
+ * containing its wakeup pipe and every registered fd event, which is
+ * updated whenever an fd event is registered, modified or
+ * deregistered.  (Pollers used by the application via
+ * libxl_osevent_beforepoll, or with its own osevent hooks, are not
+ * affected.)  Since the same fd may be registered by more than one
+ * libxl__ev_fd, for different events, the epoll set waits for the
+ * union of the events they want.
+ */
+
+#ifdef LIBXL__USE_EPOLL
+
+#define EPOLL_MAX_EVENTS 64
+
+/* POLLIN etc. have the same values as EPOLLIN etc. */
+
+static short epoll_fd_events(libxl__gc *gc, int fd)
+{
+    libxl__ev_fd *efd;
+    short events = 0;
+
+    LIBXL_LIST_FOREACH(efd, &CTX->efds, entry)
+        if (efd->fd == fd)
+            events |= efd->events;
+
+    return events;
+}
+
+static void poller_epoll_disable(libxl__gc *gc, libxl__poller *poller)
+{
+    close(poller->epoll_fd);
+    poller->epoll_fd = -1;
+    poller->epoll_failed = 1;
+}
+
+static int poller_epoll_ctl(libxl__gc *gc, libxl__poller *poller,
+                            int fd, short events)
+{
+    struct epoll_event ev;
+    int r;
+
+    if (!events) {
+        r = epoll_ctl(poller->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+        /* the fd may not have been in the set, or already be closed */
+        if (r && errno != ENOENT && errno != EBADF) goto fail;
+        return 0;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = (unsigned short)events;
+    ev.data.fd = fd;
+
+    r = epoll_ctl(poller->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    if (r && errno == EEXIST)
+        r = epoll_ctl(poller->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+    if (r) goto fail;
+
+    return 0;
+
+ fail:
+    /* EPERM means that the fd is one, such as a regular file, which
+     * epoll does not support but poll reports as always ready. */
+    LOGE(DEBUG, "poller %p: epoll_ctl fd=%d events=%#x failed,"
+         " falling back to poll", poller, fd, events);
+    poller_epoll_disable(gc, poller);
+    return ERROR_FAIL;
+}
+
+static void epoll_fd_changed(libxl__gc *gc, int fd)
+{
+    /* must be called with ctx locked, after the events wanted on fd
+     * by some libxl__ev_fd have changed */
+    libxl__poller *poller;
+    int events = -1; /* not yet computed */
+
+#define POLLER_EPOLL_UPDATE(poller) do{                         \
+        if ((poller)->epoll_fd < 0)                             \
+            break;                                              \
+        if (events < 0)                                         \
+            events = epoll_fd_events(gc, fd);                   \
+        poller_epoll_ctl(gc, (poller), fd, events);             \
+    }while(0)
+
+    LIBXL_LIST_FOREACH(poller, &CTX->pollers_fds_changed, fds_changed_entry)
+        POLLER_EPOLL_UPDATE(poller);
+    LIBXL_LIST_FOREACH(poller, &CTX->pollers_idle, entry)
+        POLLER_EPOLL_UPDATE(poller);
+
+#undef POLLER_EPOLL_UPDATE
+}
+
+static bool poller_epoll_setup(libxl__gc *gc, libxl__poller *poller)
+{
+    /* Returns true if poller can wait with epoll, setting up its epoll
+     * set if this is the first time it is used that way. */
+    libxl__ev_fd *efd;
+    int nfds = EPOLL_MAX_EVENTS * 3;
+
+    if (poller->epoll_fd >= 0)
+        return true;
+    if (poller->epoll_failed)
+        return false;
+
+    poller->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (poller->epoll_fd < 0) {
+        LOGE(DEBUG, "poller %p: epoll_create1 failed, falling back to poll",
+             poller);
+        poller->epoll_failed = 1;
+        return false;
+    }
+
+    if (!poller->epoll_events)
+        poller->epoll_events =
+            libxl__calloc(NOGC, EPOLL_MAX_EVENTS,
+                          sizeof(*poller->epoll_events));
+
+    /* see eventloop_iteration_epoll */
+    if (poller->fd_polls_allocd < nfds) {
+        poller->fd_polls = libxl__realloc(NOGC, poller->fd_polls,
+                                          sizeof(*poller->fd_polls) * nfds);
+        poller->fd_polls_allocd = nfds;
+    }
+
+    if (poller_epoll_ctl(gc, poller, poller->wakeup_pipe[0], POLLIN))
+        return false;
+
+    LIBXL_LIST_FOREACH(efd, &CTX->efds, entry) {
+        if (!efd->events)
+            continue;
+        if (poller_epoll_ctl(gc, poller, efd->fd, epoll_fd_events(gc, efd->fd)))
+            return false;
+    }
+
+    return true;
+}
+
+static int eventloop_iteration_epoll(libxl__egc *egc, libxl__poller *poller,
+                                     struct timeval now)
+{
+    /* As eventloop_iteration, but waits with epoll.  The ready fds are
+     * presented to afterpoll_internal as if they had come from poll,
+     * with a separate pollfd for each of POLLIN, POLLPRI and POLLOUT
+     * (so each of them can be claimed by a different libxl__ev_fd),
+     * so that their callbacks are made in the same way. */
+    EGC_GC;
+    static const short kinds[3] = { POLLIN, POLLPRI, POLLOUT };
+    struct pollfd *fds = poller->fd_polls;
+    int rc, i, j, nready, nfds = 0, timeout = -1;
+
+    poller->fds_changed = 0;
+    beforepoll_timeout(gc, &timeout, now);
+
+    CTX_UNLOCK;
+    nready = epoll_wait(poller->epoll_fd, poller->epoll_events,
+                        EPOLL_MAX_EVENTS, timeout);
+    CTX_LOCK;
+
+    if (nready < 0) {
+        if (errno == EINTR)
+            return 0; /* will go round again if caller requires */
+
+        LOGEV(ERROR, errno, "epoll_wait failed");
+        rc = ERROR_FAIL;
+        goto out;
+    }
+
+    for (i = 0; i < nready; i++) {
+        int fd = poller->epoll_events[i].data.fd;
+        short revents = poller->epoll_events[i].events;
+
+        poller_rindices_ensure(gc, poller, fd + 1);
+        for (j = 0; j < 3; j++) {
+            short kind_revents = revents & (kinds[j] | POLLERR | POLLHUP);
+
+            if (!kind_revents) {
+                poller->fd_rindices[fd][j] = INT_MAX;
+                continue;
+            }
+            fds[nfds].fd = fd;
+            fds[nfds].events = kinds[j];
+            fds[nfds].revents = kind_revents;
+            poller->fd_rindices[fd][j] = nfds++;
+        }
+    }
+
+    rc = libxl__gettimeofday(gc, &now);
+    if (rc) goto out;
+
+    afterpoll_internal(egc, poller, nfds, fds, now);
+
+    rc = 0;
+ out:
+    return rc;
+}
+
+#else /* !LIBXL__USE_EPOLL */
+
+static void epoll_fd_changed(libxl__gc *gc, int fd) { }
+
+#endif
+
 /*
  * Main event loop iteration
  */
@@ -1672,6 +1989,11 @@ static int eventloop_iteration(libxl__egc *egc, libxl__poller *poller) {
     rc = libxl__gettimeofday(gc, &now);
     if (rc) goto out;
 
+#ifdef LIBXL__USE_EPOLL
+    if (poller_epoll_setup(gc, poller))
+        return eventloop_iteration_epoll(egc, poller, now);
+#endif
+
     int timeout;
 
     for (;;) {
@@ -287,8 +287,9 @@ struct libxl__ev_time {
     /* read-only for caller, who may read only when registered: */
     libxl__ev_time_callback *func;
     /* remainder is private for libxl__ev_time... */
-    int infinite; /* not registered in list or with app if infinite */
-    LIBXL_TAILQ_ENTRY(libxl__ev_time) entry;
+    int infinite; /* not registered in heap or with app if infinite */
+    int heap_index; /* position in CTX->etimes */
+    uint64_t seq; /* registration order, for timeouts with equal abs */
     struct timeval abs;
     libxl__osevent_hook_nexus *nexus;
     libxl__ao_abortable abrt;
@@ -412,6 +413,22 @@ struct libxl__poller {
 
     int wakeup_pipe[2]; /* 0 means no fd allocated */
 
+#ifdef LIBXL__USE_EPOLL
+    /*
+     * A poller which is used by eventloop_iteration waits with epoll
+     * rather than poll.  epoll_fd is set up the first time the poller
+     * is used that way, and then kept up to date as fd events are
+     * (de)registered, rather than having their pollfds rebuilt for
+     * every iteration.  If epoll cannot be used (for example, because
+     * an fd for a regular file is registered) epoll_fd is closed and
+     * epoll_failed set, so that this poller uses poll until it is next
+     * obtained with libxl__poller_get.
+     */
+    int epoll_fd; /* -1 means not set up */
+    bool epoll_failed;
+    struct epoll_event *epoll_events;
+#endif
+
     /*
      * We also use the poller to record whether any fds have been
      * deregistered since we entered poll.  Each poller which is not
@@ -469,7 +486,9 @@ struct libxl__ctx {
     LIBXL_SLIST_HEAD(libxl__osevent_hook_nexi, libxl__osevent_hook_nexus)
         hook_fd_nexi_idle, hook_timeout_nexi_idle;
     LIBXL_LIST_HEAD(, libxl__ev_fd) efds;
-    LIBXL_TAILQ_HEAD(, libxl__ev_time) etimes;
+    libxl__ev_time **etimes; /* binary heap, see libxl_event.c */
+    int etimes_used, etimes_allocd;
+    uint64_t etimes_seq;
 
     libxl__ev_watch_slot *watch_slots;
     int watch_nslots, nwatches;
@@ -3292,6 +3311,10 @@ struct libxl__domain_save_state {
     int debug;
     int checkpointed_stream;
     const libxl_domain_remus_info *remus;
+    uint32_t max_downtime_ms; /* 0 for the default pre-copy policy */
+    bool throttle;
+    bool parallel;
+    bool compress;
     /* private */
     int rc;
     int hvm;
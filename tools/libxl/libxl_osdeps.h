@@ -40,8 +40,10 @@
 #define SYSFS_PCIBACK_DRIVER   "/sys/bus/pci/drivers/pciback"
 #define NETBACK_NIC_NAME       "vif%u.%d"
 #include <sys/sysmacros.h>
+#include <sys/epoll.h>
 #include <pty.h>
 #include <uuid/uuid.h>
+#define LIBXL__USE_EPOLL 1
 #elif defined(__sun__)
 #include <stropts.h>
 #elif defined(__FreeBSD__)
@@ -0,0 +1,680 @@
+/******************************************************************************
+ * memshr-scan.c
+ *
+ * xen-memshrd: merge identical pages of HVM guests by content.
+ *
+ * The daemon walks the memory of the HVM guests on the host, a batch of
+ * pages at a time, through read-only foreign mappings, and hashes each
+ * page.  A page is only a candidate once its hash has not changed between
+ * two passes, so that pages the guest is busy writing are left alone.
+ * Candidates are looked up by hash in a table of pages seen before; on a
+ * hit both pages are nominated, compared byte by byte (nominated pages
+ * cannot change without their handle being invalidated) and shared.
+ *
+ * The daemon sleeps between batches so that it is busy at most a given
+ * percentage of the time, and reports what it did together with the
+ * host-wide number of frames saved by sharing.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <xenctrl.h>
+#include <xenforeignmemory.h>
+
+#define PAGE_SIZE           XC_PAGE_SIZE
+#define BITS_PER_LONG       (sizeof(unsigned long) * 8)
+
+#define DEFAULT_BATCH       256
+#define DEFAULT_BUDGET      5       /* % of one CPU */
+#define DEFAULT_TABLE_ORDER 20      /* 1M pages */
+#define DEFAULT_INTERVAL    60      /* s between reports */
+#define MAX_PROBE           8
+
+struct scan_domain {
+    domid_t domid;
+    xen_pfn_t max_gpfn;
+    xen_pfn_t cursor;
+    /*
+     * Hash of each page on the previous pass (0 if not seen yet), and
+     * whether it was shared then and has not changed since.
+     */
+    uint32_t *sums;
+    unsigned long *shared;
+    unsigned long passes;
+    int present;
+};
+
+/* A page seen before, by content hash. */
+struct page_entry {
+    uint64_t hash;
+    xen_pfn_t gfn;
+    domid_t domid;
+    int valid;
+};
+
+struct scan_stats {
+    uint64_t scanned;     /* pages hashed */
+    uint64_t unmapped;    /* pages that could not be mapped (holes etc) */
+    uint64_t unstable;    /* pages that changed since the last pass */
+    uint64_t candidates;  /* stable pages matching one seen before */
+    uint64_t shared;      /* pages shared */
+    uint64_t mismatched;  /* hash collisions */
+    uint64_t busy;        /* pages that could not be nominated */
+    uint64_t failed;      /* sharing that failed otherwise */
+};
+
+static xc_interface *xch;
+static xenforeignmemory_handle *fmem;
+
+static struct scan_domain *domains;
+static unsigned int nr_domains;
+
+static struct page_entry *table;
+static unsigned long table_mask;
+
+static struct scan_stats stats;
+
+static unsigned int batch = DEFAULT_BATCH;
+static unsigned int budget = DEFAULT_BUDGET;
+static unsigned int interval = DEFAULT_INTERVAL;
+static domid_t *only_domids;
+static unsigned int nr_only_domids;
+static int foreground;
+
+static volatile sig_atomic_t interrupted;
+
+static void usage(int ret)
+{
+    FILE *out = ret ? stderr : stdout;
+
+    fprintf(out, "usage: xen-memshrd [<options>]\n");
+    fprintf(out, "  <options> are:\n");
+    fprintf(out, "  -d|--domain <domid>   only scan this domain (repeatable;\n");
+    fprintf(out, "                        default all HVM domains using HAP)\n");
+    fprintf(out, "  -c|--cpu <percent>    CPU budget (default %u%%)\n",
+            DEFAULT_BUDGET);
+    fprintf(out, "  -b|--batch <pages>    pages scanned per batch (default %u)\n",
+            DEFAULT_BATCH);
+    fprintf(out, "  -t|--table <order>    remember 2^order pages (default %u)\n",
+            DEFAULT_TABLE_ORDER);
+    fprintf(out, "  -i|--interval <secs>  seconds between reports (default %u)\n",
+            DEFAULT_INTERVAL);
+    fprintf(out, "  -f|--foreground       do not daemonize, report to stderr\n");
+    fprintf(out, "  -h|--help             print this usage information\n");
+    exit(ret);
+}
+
+static void logmsg(int prio, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    if ( foreground )
+    {
+        vfprintf(stderr, fmt, ap);
+        fputc('\n', stderr);
+    }
+    else
+        vsyslog(prio, fmt, ap);
+    va_end(ap);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+static void sleep_ns(uint64_t ns)
+{
+    struct timespec ts = { ns / 1000000000ULL, ns % 1000000000ULL };
+
+    while ( nanosleep(&ts, &ts) && errno == EINTR && !interrupted )
+        ;
+}
+
+/* 64-bit FNV-1a over the words of a page. */
+static uint64_t page_hash(const void *page)
+{
+    const uint64_t *p = page;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    unsigned int i;
+
+    for ( i = 0; i < PAGE_SIZE / sizeof(*p); i++ )
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+
+    return h ^ (h >> 32);
+}
+
+static struct page_entry *table_lookup(uint64_t hash)
+{
+    unsigned long i, idx;
+
+    for ( i = 0; i < MAX_PROBE; i++ )
+    {
+        idx = (hash + i) & table_mask;
+        if ( !table[idx].valid )
+            return NULL;
+        if ( table[idx].hash == hash )
+            return &table[idx];
+    }
+
+    return NULL;
+}
+
+/* Remember a page, replacing the one in its home slot if needs be. */
+static void table_insert(uint64_t hash, domid_t domid, xen_pfn_t gfn)
+{
+    struct page_entry *e = &table[hash & table_mask];
+    unsigned long i;
+
+    for ( i = 0; i < MAX_PROBE; i++ )
+    {
+        struct page_entry *p = &table[(hash + i) & table_mask];
+
+        if ( !p->valid || p->hash == hash )
+        {
+            e = p;
+            break;
+        }
+    }
+
+    e->hash = hash;
+    e->domid = domid;
+    e->gfn = gfn;
+    e->valid = 1;
+}
+
+static int test_bit(const unsigned long *map, xen_pfn_t bit)
+{
+    return !!(map[bit / BITS_PER_LONG] & (1UL << (bit % BITS_PER_LONG)));
+}
+
+static void assign_bit(unsigned long *map, xen_pfn_t bit, int val)
+{
+    unsigned long mask = 1UL << (bit % BITS_PER_LONG);
+
+    if ( val )
+        map[bit / BITS_PER_LONG] |= mask;
+    else
+        map[bit / BITS_PER_LONG] &= ~mask;
+}
+
+/* Return whether the content of the two pages is identical. */
+static int pages_equal(domid_t d1, xen_pfn_t gfn1, domid_t d2, xen_pfn_t gfn2)
+{
+    void *p1, *p2;
+    int err, equal = 0;
+
+    p1 = xenforeignmemory_map(fmem, d1, PROT_READ, 1, &gfn1, &err);
+    if ( !p1 )
+        return 0;
+    if ( err )
+        goto out1;
+
+    p2 = xenforeignmemory_map(fmem, d2, PROT_READ, 1, &gfn2, &err);
+    if ( !p2 )
+        goto out1;
+    if ( !err )
+        equal = !memcmp(p1, p2, PAGE_SIZE);
+
+    xenforeignmemory_unmap(fmem, p2, 1);
+ out1:
+    xenforeignmemory_unmap(fmem, p1, 1);
+    return equal;
+}
+
+/*
+ * Share a page with the one seen before with the same content.  Returns
+ * 1 if the page has been shared, and 0 if not, in which case the page has
+ * replaced the old one in the table if that one is gone or has changed.
+ */
+static int try_share(struct scan_domain *d, xen_pfn_t gfn, uint64_t hash,
+                     struct page_entry *e)
+{
+    uint64_t sh, ch;
+    int rc;
+
+    stats.candidates++;
+
+    if ( xc_memshr_nominate_gfn(xch, d->domid, gfn, &ch) )
+    {
+        stats.busy++;
+        return 0;
+    }
+
+    if ( xc_memshr_nominate_gfn(xch, e->domid, e->gfn, &sh) )
+    {
+        stats.busy++;
+        goto replace;
+    }
+
+    if ( !pages_equal(e->domid, e->gfn, d->domid, gfn) )
+    {
+        stats.mismatched++;
+        goto replace;
+    }
+
+    rc = xc_memshr_share_gfns(xch, e->domid, e->gfn, sh, d->domid, gfn, ch);
+    if ( !rc )
+    {
+        stats.shared++;
+        return 1;
+    }
+
+    stats.failed++;
+    /* The client page is the one that changed: keep the source. */
+    if ( errno == -XENMEM_SHARING_OP_C_HANDLE_INVALID )
+        return 0;
+
+ replace:
+    table_insert(hash, d->domid, gfn);
+    return 0;
+}
+
+/* Follow the domain's memory growing, e.g. by ballooning up. */
+static void resize_domain(struct scan_domain *d)
+{
+    xen_pfn_t max_gpfn;
+    uint32_t *sums;
+    unsigned long *shared;
+    size_t old_words, new_words;
+
+    if ( xc_domain_maximum_gpfn(xch, d->domid, &max_gpfn) < 0 ||
+         max_gpfn <= d->max_gpfn )
+        return;
+
+    old_words = (d->max_gpfn + BITS_PER_LONG) / BITS_PER_LONG;
+    new_words = (max_gpfn + BITS_PER_LONG) / BITS_PER_LONG;
+
+    sums = realloc(d->sums, (max_gpfn + 1) * sizeof(*sums));
+    if ( !sums )
+        return;
+    d->sums = sums;
+    memset(&sums[d->max_gpfn + 1], 0,
+           (max_gpfn - d->max_gpfn) * sizeof(*sums));
+
+    shared = realloc(d->shared, new_words * sizeof(*shared));
+    if ( !shared )
+        return;
+    d->shared = shared;
+    memset(&shared[old_words], 0, (new_words - old_words) * sizeof(*shared));
+
+    d->max_gpfn = max_gpfn;
+}
+
+/* Scan the next batch of pages of a domain. */
+static void scan_batch(struct scan_domain *d)
+{
+    xen_pfn_t gfns[batch];
+    int errs[batch];
+    uint64_t hashes[batch];
+    unsigned int i, n;
+    void *mapping;
+
+    for ( n = 0; n < batch && d->cursor <= d->max_gpfn; n++ )
+        gfns[n] = d->cursor++;
+
+    if ( d->cursor > d->max_gpfn )
+    {
+        d->cursor = 0;
+        d->passes++;
+        resize_domain(d);
+    }
+
+    /* Hash the batch first: nominating pages requires them unmapped. */
+    mapping = xenforeignmemory_map(fmem, d->domid, PROT_READ, n, gfns, errs);
+    if ( !mapping )
+    {
+        if ( errno == ESRCH )
+            d->present = 0;
+        stats.unmapped += n;
+        return;
+    }
+
+    for ( i = 0; i < n; i++ )
+        if ( !errs[i] )
+            hashes[i] = page_hash((char *)mapping + i * PAGE_SIZE);
+
+    xenforeignmemory_unmap(fmem, mapping, n);
+
+    for ( i = 0; i < n; i++ )
+    {
+        xen_pfn_t gfn = gfns[i];
+        uint32_t sum;
+        struct page_entry *e;
+
+        if ( errs[i] )
+        {
+            stats.unmapped++;
+            d->sums[gfn] = 0;
+            assign_bit(d->shared, gfn, 0);
+            continue;
+        }
+
+        stats.scanned++;
+        sum = (uint32_t)hashes[i] | 1;
+
+        if ( d->sums[gfn] != sum )
+        {
+            /* New or changed since the last pass: wait for it to settle. */
+            stats.unstable += !!d->sums[gfn];
+            d->sums[gfn] = sum;
+            assign_bit(d->shared, gfn, 0);
+            continue;
+        }
+
+        /* Shared on an earlier pass, and not written to since. */
+        if ( test_bit(d->shared, gfn) )
+            continue;
+
+        e = table_lookup(hashes[i]);
+        if ( !e )
+            table_insert(hashes[i], d->domid, gfn);
+        else if ( e->domid != d->domid || e->gfn != gfn )
+            assign_bit(d->shared, gfn, try_share(d, gfn, hashes[i], e));
+    }
+}
+
+static struct scan_domain *find_domain(domid_t domid)
+{
+    unsigned int i;
+
+    for ( i = 0; i < nr_domains; i++ )
+        if ( domains[i].domid == domid )
+            return &domains[i];
+
+    return NULL;
+}
+
+static void free_domain(struct scan_domain *d)
+{
+    free(d->sums);
+    free(d->shared);
+    *d = domains[--nr_domains];
+}
+
+static int wanted(const xc_domaininfo_t *info)
+{
+    unsigned int i;
+
+    if ( !(info->flags & XEN_DOMINF_hvm_guest) ||
+         !(info->flags & XEN_DOMINF_hap) ||
+         (info->flags & (XEN_DOMINF_dying | XEN_DOMINF_shutdown)) ||
+         info->domain == 0 )
+        return 0;
+
+    if ( !nr_only_domids )
+        return 1;
+
+    for ( i = 0; i < nr_only_domids; i++ )
+        if ( only_domids[i] == info->domain )
+            return 1;
+
+    return 0;
+}
+
+static void add_domain(domid_t domid)
+{
+    struct scan_domain *d, *tmp;
+    xen_pfn_t max_gpfn;
+
+    if ( xc_domain_maximum_gpfn(xch, domid, &max_gpfn) < 0 )
+        return;
+
+    /* Fails e.g. for domains with passed through devices. */
+    if ( xc_memshr_control(xch, domid, 1) )
+        return;
+
+    tmp = realloc(domains, (nr_domains + 1) * sizeof(*domains));
+    if ( !tmp )
+        return;
+    domains = tmp;
+
+    d = &domains[nr_domains];
+    memset(d, 0, sizeof(*d));
+    d->domid = domid;
+    d->max_gpfn = max_gpfn;
+    d->present = 1;
+    d->sums = calloc(max_gpfn + 1, sizeof(*d->sums));
+    d->shared = calloc((max_gpfn + BITS_PER_LONG) / BITS_PER_LONG,
+                       sizeof(*d->shared));
+    if ( !d->sums || !d->shared )
+    {
+        free(d->sums);
+        free(d->shared);
+        return;
+    }
+
+    nr_domains++;
+    logmsg(LOG_INFO, "scanning domain %u, %"PRI_xen_pfn" pages",
+           domid, max_gpfn + 1);
+}
+
+/* Pick up new domains and drop the ones which have gone away. */
+static void refresh_domains(void)
+{
+    xc_domaininfo_t info[64];
+    domid_t next = 0;
+    unsigned int i;
+    int n;
+
+    for ( i = 0; i < nr_domains; i++ )
+        domains[i].present = 0;
+
+    while ( (n = xc_domain_getinfolist(xch, next, 64, info)) > 0 )
+    {
+        for ( i = 0; i < n; i++ )
+        {
+            struct scan_domain *d;
+
+            if ( !wanted(&info[i]) )
+                continue;
+
+            d = find_domain(info[i].domain);
+            if ( d )
+                d->present = 1;
+            else
+                add_domain(info[i].domain);
+        }
+        next = info[n - 1].domain + 1;
+    }
+
+    for ( i = 0; i < nr_domains; )
+    {
+        if ( domains[i].present )
+        {
+            i++;
+            continue;
+        }
+        logmsg(LOG_INFO, "domain %u gone", domains[i].domid);
+        free_domain(&domains[i]);
+    }
+}
+
+static void report(void)
+{
+    logmsg(LOG_INFO,
+           "scanned %"PRIu64" unmapped %"PRIu64" unstable %"PRIu64
+           " candidates %"PRIu64" shared %"PRIu64" mismatched %"PRIu64
+           " busy %"PRIu64" failed %"PRIu64,
+           stats.scanned, stats.unmapped, stats.unstable, stats.candidates,
+           stats.shared, stats.mismatched, stats.busy, stats.failed);
+    logmsg(LOG_INFO, "host: %ld frames saved, %ld shared frames in use",
+           xc_sharing_freed_pages(xch), xc_sharing_used_frames(xch));
+}
+
+static void handle_signal(int sig)
+{
+    interrupted = 1;
+}
+
+static struct option options[] = {
+    { "domain", 1, NULL, 'd' },
+    { "cpu", 1, NULL, 'c' },
+    { "batch", 1, NULL, 'b' },
+    { "table", 1, NULL, 't' },
+    { "interval", 1, NULL, 'i' },
+    { "foreground", 0, NULL, 'f' },
+    { "help", 0, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+int main(int argc, char *argv[])
+{
+    struct sigaction act = { .sa_handler = handle_signal };
+    unsigned int table_order = DEFAULT_TABLE_ORDER, next = 0;
+    uint64_t start, busy, last_report, last_refresh;
+    int opt, ret = 1;
+
+    while ( (opt = getopt_long(argc, argv, "d:c:b:t:i:fh", options,
+                               NULL)) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'd':
+            only_domids = realloc(only_domids,
+                                  (nr_only_domids + 1) * sizeof(domid_t));
+            if ( !only_domids )
+                exit(1);
+            only_domids[nr_only_domids++] = strtoul(optarg, NULL, 0);
+            break;
+        case 'c':
+            budget = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            batch = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            table_order = strtoul(optarg, NULL, 0);
+            break;
+        case 'i':
+            interval = strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            foreground = 1;
+            break;
+        case 'h':
+            usage(0);
+            break;
+        default:
+            usage(1);
+        }
+    }
+    if ( optind != argc || !budget || budget > 100 || !batch ||
+         batch > 4096 || table_order > 30 )
+        usage(1);
+
+    if ( !foreground )
+    {
+        openlog("xen-memshrd", LOG_PID, LOG_DAEMON);
+        if ( daemon(0, 0) )
+        {
+            perror("daemon");
+            exit(1);
+        }
+    }
+
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+
+    table_mask = (1UL << table_order) - 1;
+    table = calloc(table_mask + 1, sizeof(*table));
+    if ( !table )
+    {
+        logmsg(LOG_ERR, "cannot allocate page table");
+        exit(1);
+    }
+
+    xch = xc_interface_open(NULL, NULL, 0);
+    fmem = xenforeignmemory_open(NULL, 0);
+    if ( !xch || !fmem )
+    {
+        logmsg(LOG_ERR, "cannot open xen interfaces");
+        goto out;
+    }
+
+    last_report = last_refresh = now_ns();
+    refresh_domains();
+
+    while ( !interrupted )
+    {
+        start = now_ns();
+
+        if ( start - last_refresh >= 1000000000ULL )
+        {
+            refresh_domains();
+            last_refresh = start;
+        }
+
+        if ( interval && start - last_report >= interval * 1000000000ULL )
+        {
+            report();
+            last_report = start;
+        }
+
+        if ( !nr_domains )
+        {
+            sleep_ns(1000000000ULL);
+            continue;
+        }
+
+        if ( next >= nr_domains )
+            next = 0;
+        scan_batch(&domains[next++]);
+
+        /* Sleep long enough for the time spent busy to be within budget. */
+        busy = now_ns() - start;
+        sleep_ns(busy * (100 - budget) / budget);
+    }
+
+    report();
+    ret = 0;
+
+ out:
+    while ( nr_domains )
+        free_domain(&domains[0]);
+    if ( fmem )
+        xenforeignmemory_close(fmem);
+    if ( xch )
+        xc_interface_close(xch);
+    free(table);
+    free(only_domids);
+
+    return ret;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -65,6 +65,8 @@ REC_TYPE_x86_pv_vcpu_msrs           = 0x0000000c
 REC_TYPE_verify                     = 0x0000000d
 REC_TYPE_checkpoint                 = 0x0000000e
 REC_TYPE_checkpoint_dirty_pfn_list  = 0x0000000f
+REC_TYPE_zero_pages                 = 0x00000010
+REC_TYPE_page_data_lz4              = 0x00000011
 
 rec_type_to_str = {
     REC_TYPE_end                        : "End",
@@ -82,7 +84,9 @@ rec_type_to_str = {
     REC_TYPE_x86_pv_vcpu_msrs           : "x86 PV vcpu msrs",
     REC_TYPE_verify                     : "Verify",
     REC_TYPE_checkpoint                 : "Checkpoint",
-    REC_TYPE_checkpoint_dirty_pfn_list  : "Checkpoint dirty pfn list"
+    REC_TYPE_checkpoint_dirty_pfn_list  : "Checkpoint dirty pfn list",
+    REC_TYPE_zero_pages                 : "Zero pages",
+    REC_TYPE_page_data_lz4              : "Page data LZ4",
 }
 
 # page_data
@@ -105,6 +109,13 @@ PAGE_DATA_TYPE_BROKEN        = (long(0xd) << PAGE_DATA_TYPE_SHIFT) # Broken
 PAGE_DATA_TYPE_XALLOC        = (long(0xe) << PAGE_DATA_TYPE_SHIFT) # Allocate-only
 PAGE_DATA_TYPE_XTAB          = (long(0xf) << PAGE_DATA_TYPE_SHIFT) # Invalid
 
+# zero_pages
+ZERO_PAGES_FORMAT            = "II"
+ZERO_PAGES_RUN_FORMAT        = "QII"
+
+# page_data_lz4
+PAGE_DATA_LZ4_LENGTH_FORMAT  = "I"
+
 # x86_pv_info
 X86_PV_INFO_FORMAT        = "BBHI"
 
@@ -242,24 +253,25 @@ class VerifyLibxc(VerifyBase):
             raise RecordError("End record with non-zero length")
 
 
-    def verify_record_page_data(self, content):
-        """ Page Data record """
+    def verify_page_data_pfns(self, name, content):
+        """ Common header and pfn list of the page data records.  Returns the
+        size of the header and pfn list, and the number of pages with data """
         minsz = calcsize(PAGE_DATA_FORMAT)
 
         if len(content) <= minsz:
-            raise RecordError("PAGE_DATA record must be at least %d bytes long"
-                              % (minsz, ))
+            raise RecordError("%s record must be at least %d bytes long"
+                              % (name, minsz))
 
         count, res1 = unpack(PAGE_DATA_FORMAT, content[:minsz])
 
         if res1 != 0:
-            raise StreamError("Reserved bits set in PAGE_DATA record 0x%04x"
-                              % (res1, ))
+            raise StreamError("Reserved bits set in %s record 0x%04x"
+                              % (name, res1))
 
         pfnsz = count * 8
         if (len(content) - minsz) < pfnsz:
-            raise RecordError("PAGE_DATA record must contain a pfn record for "
-                              "each count")
+            raise RecordError("%s record must contain a pfn record for "
+                              "each count" % (name, ))
 
         pfns = list(unpack("=%dQ" % (count,), content[minsz:minsz + pfnsz]))
 
@@ -279,10 +291,68 @@ class VerifyLibxc(VerifyBase):
                     <= PAGE_DATA_TYPE_L4TAB:
                 nr_pages += 1
 
+        return minsz + pfnsz, nr_pages
+
+    def verify_record_page_data(self, content):
+        """ Page Data record """
+        hdrsz, nr_pages = self.verify_page_data_pfns("PAGE_DATA", content)
+
         pagesz = nr_pages * 4096
-        if len(content) != minsz + pfnsz + pagesz:
-            raise RecordError("Expected %u + %u + %u, got %u"
-                              % (minsz, pfnsz, pagesz, len(content)))
+        if len(content) != hdrsz + pagesz:
+            raise RecordError("Expected %u + %u, got %u"
+                              % (hdrsz, pagesz, len(content)))
+
+    def verify_record_zero_pages(self, content):
+        """ Zero pages record """
+        minsz = calcsize(ZERO_PAGES_FORMAT)
+        runsz = calcsize(ZERO_PAGES_RUN_FORMAT)
+
+        if len(content) <= minsz:
+            raise RecordError("ZERO_PAGES record must be at least %d bytes "
+                              "long" % (minsz, ))
+
+        count, res1 = unpack(ZERO_PAGES_FORMAT, content[:minsz])
+
+        if res1 != 0:
+            raise StreamError("Reserved bits set in ZERO_PAGES record 0x%04x"
+                              % (res1, ))
+
+        if count == 0 or len(content) != minsz + count * runsz:
+            raise RecordError("ZERO_PAGES record length %u inconsistent with "
+                              "%u runs" % (len(content), count))
+
+        for idx in range(count):
+            off = minsz + idx * runsz
+            pfn, nr, res1 = unpack(ZERO_PAGES_RUN_FORMAT,
+                                   content[off:off + runsz])
+
+            if pfn & ~PAGE_DATA_PFN_MASK or res1 != 0:
+                raise RecordError("Reserved bits set in run[%d]" % (idx, ))
+
+            if nr == 0:
+                raise RecordError("Empty run[%d]" % (idx, ))
+
+    def verify_record_page_data_lz4(self, content):
+        """ Page Data LZ4 record """
+        off, nr_pages = self.verify_page_data_pfns("PAGE_DATA_LZ4", content)
+        lensz = calcsize(PAGE_DATA_LZ4_LENGTH_FORMAT)
+
+        for idx in range(nr_pages):
+            if len(content) < off + lensz:
+                raise RecordError("PAGE_DATA_LZ4 record truncated at page %d"
+                                  % (idx, ))
+
+            length, = unpack(PAGE_DATA_LZ4_LENGTH_FORMAT,
+                             content[off:off + lensz])
+
+            if length == 0 or length > 4096:
+                raise RecordError("Invalid length %u for page %d"
+                                  % (length, idx))
+
+            off += lensz + length
+
+        if len(content) != off:
+            raise RecordError("Expected %u, got %u" % (off, len(content)))
 
 
     def verify_record_x86_pv_info(self, content):
@@ -455,4 +525,8 @@ record_verifiers = {
         VerifyLibxc.verify_record_checkpoint,
     REC_TYPE_checkpoint_dirty_pfn_list:
         VerifyLibxc.verify_record_checkpoint_dirty_pfn_list,
+    REC_TYPE_zero_pages:
+        VerifyLibxc.verify_record_zero_pages,
+    REC_TYPE_page_data_lz4:
+        VerifyLibxc.verify_record_page_data_lz4,
     }
@@ -0,0 +1,198 @@
+/*
+ * evtchn-alloc-bench.c
+ *
+ * Bind a large number of unbound event channel ports in the calling
+ * domain and report how long each batch of binds takes.  With a free port
+ * search which does not depend on the number of ports already in use, the
+ * time per batch stays flat as the domain fills up.  Afterwards every other
+ * port is unbound and bound again, to time the reuse of holes.
+ *
+ * The calling domain needs to be using the FIFO event channel ABI to get
+ * beyond 4096 ports.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <xenevtchn.h>
+
+static struct option options[] = {
+    { "ports", 1, NULL, 'n' },
+    { "batch", 1, NULL, 'b' },
+    { "remote", 1, NULL, 'r' },
+    { "help", 0, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+static void usage(int ret)
+{
+    FILE *out;
+
+    out = ret ? stderr : stdout;
+
+    fprintf(out, "usage: evtchn-alloc-bench [<options>]\n");
+    fprintf(out, "  <options> are:\n");
+    fprintf(out, "  -n|--ports <n>       number of ports to bind (default 100000)\n");
+    fprintf(out, "  -b|--batch <b>       ports per reported batch (default 10000)\n");
+    fprintf(out, "  -r|--remote <domid>  remote end of the ports (default 0)\n");
+    fprintf(out, "  -h|--help            print this usage information\n");
+    exit(ret);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+static void report(const char *what, unsigned int first, unsigned int nr,
+                   uint64_t nsec)
+{
+    printf("%-8s %8u - %8u %12.1f us %10.0f ns/port\n", what,
+           first, first + nr - 1, nsec / 1e3, (double)nsec / nr);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, ret = 0;
+    unsigned int nr_ports = 100000, batch = 10000, remote = 0;
+    unsigned int bound = 0, i, j, n;
+    xenevtchn_handle *xce;
+    xenevtchn_port_or_error_t *ports;
+    uint64_t t, total = 0;
+
+    while ( (opt = getopt_long(argc, argv, "n:b:r:h", options, NULL)) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'n':
+            nr_ports = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            batch = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            remote = strtoul(optarg, NULL, 0);
+            break;
+        case 'h':
+            usage(0);
+            break;
+        default:
+            usage(1);
+        }
+    }
+    if ( optind != argc || !nr_ports || !batch )
+        usage(1);
+
+    ports = calloc(nr_ports, sizeof(*ports));
+    if ( !ports )
+    {
+        perror("calloc");
+        exit(2);
+    }
+
+    xce = xenevtchn_open(NULL, 0);
+    if ( !xce )
+    {
+        perror("xenevtchn_open");
+        exit(2);
+    }
+
+    printf("binding %u ports, remote domain %u\n", nr_ports, remote);
+
+    for ( i = 0; i < nr_ports; i += n )
+    {
+        n = nr_ports - i < batch ? nr_ports - i : batch;
+
+        t = now_ns();
+        for ( j = 0; j < n; j++ )
+        {
+            ports[i + j] = xenevtchn_bind_unbound_port(xce, remote);
+            if ( ports[i + j] < 0 )
+                break;
+        }
+        t = now_ns() - t;
+        bound += j;
+        total += t;
+
+        if ( j < n )
+        {
+            fprintf(stderr, "binding port %u failed: %s\n", i + j,
+                    strerror(errno));
+            ret = 1;
+            break;
+        }
+
+        report("bind", i, n, t);
+    }
+
+    if ( bound )
+        printf("bound %u ports in %.1f ms, %.0f ns/port\n",
+               bound, total / 1e6, (double)total / bound);
+
+    /* Punch holes into the allocated range and fill them again. */
+    if ( !ret )
+    {
+        t = now_ns();
+        for ( i = 0; i < bound; i += 2 )
+        {
+            if ( xenevtchn_unbind(xce, ports[i]) )
+            {
+                perror("xenevtchn_unbind");
+                ret = 1;
+            }
+            ports[i] = -1;
+        }
+        report("unbind", 0, (bound + 1) / 2, now_ns() - t);
+
+        t = now_ns();
+        for ( i = 0; !ret && i < bound; i += 2 )
+        {
+            ports[i] = xenevtchn_bind_unbound_port(xce, remote);
+            if ( ports[i] < 0 )
+            {
+                fprintf(stderr, "rebinding port failed: %s\n",
+                        strerror(errno));
+                ret = 1;
+            }
+        }
+        if ( !ret )
+            report("rebind", 0, (bound + 1) / 2, now_ns() - t);
+    }
+
+    for ( i = 0; i < bound; i++ )
+        if ( ports[i] >= 0 )
+            xenevtchn_unbind(xce, ports[i]);
+
+    xenevtchn_close(xce);
+    free(ports);
+
+    return ret;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
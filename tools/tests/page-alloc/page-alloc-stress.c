@@ -0,0 +1,285 @@
+/*
+ * page-alloc-stress.c
+ *
+ * Stress the hypervisor's heap allocator by allocating and freeing memory
+ * for a scratch domain from many threads at once, each pinned to its own
+ * (v)CPU, and report the achieved rate.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <xenctrl.h>
+
+struct worker {
+    pthread_t thread;
+    unsigned int cpu;
+    xen_pfn_t *pfns;
+    uint64_t batches;
+    int err;
+};
+
+static uint32_t domid;
+static unsigned int batch = 64, order;
+static volatile bool stop;
+
+static struct option options[] = {
+    { "threads", 1, NULL, 't' },
+    { "batch", 1, NULL, 'n' },
+    { "order", 1, NULL, 'o' },
+    { "duration", 1, NULL, 'd' },
+    { "help", 0, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+static void usage(int ret)
+{
+    FILE *out;
+
+    out = ret ? stderr : stdout;
+
+    fprintf(out, "usage: page-alloc-stress [<options>]\n");
+    fprintf(out, "  <options> are:\n");
+    fprintf(out, "  -t|--threads <t>     number of threads (default: online CPUs)\n");
+    fprintf(out, "  -n|--batch <n>       extents per hypercall (default 64)\n");
+    fprintf(out, "  -o|--order <o>       extent order (default 0)\n");
+    fprintf(out, "  -d|--duration <s>    run for <s> seconds (default 10)\n");
+    fprintf(out, "  -h|--help            print this usage information\n");
+    exit(ret);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+/*
+ * Populate and release a batch of extents of the scratch domain in a loop.
+ * Each worker uses its own range of guest frames.  Any page handed out
+ * twice by the allocator makes the decrease fail or leaves pages behind.
+ */
+static void *worker_fn(void *arg)
+{
+    struct worker *w = arg;
+    xc_interface *xch;
+    xen_pfn_t base = (xen_pfn_t)w->cpu * batch << order;
+    cpu_set_t set;
+    unsigned int i;
+
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+    xch = xc_interface_open(NULL, NULL, 0);
+    if ( !xch )
+    {
+        w->err = errno;
+        return NULL;
+    }
+
+    while ( !stop )
+    {
+        for ( i = 0; i < batch; i++ )
+            w->pfns[i] = base + ((xen_pfn_t)i << order);
+
+        /* For a PV guest, this returns the machine frames in pfns[]. */
+        if ( xc_domain_populate_physmap_exact(xch, domid, batch, order, 0,
+                                              w->pfns) )
+        {
+            w->err = errno;
+            break;
+        }
+
+        if ( xc_domain_decrease_reservation_exact(xch, domid, batch, order,
+                                                  w->pfns) )
+        {
+            w->err = errno;
+            break;
+        }
+
+        w->batches++;
+    }
+
+    xc_interface_close(xch);
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, ret = 0;
+    unsigned int nr_threads = 0, duration = 10, i;
+    xen_domain_handle_t handle = { 0 };
+    struct worker *workers;
+    xc_physinfo_t before = { 0 }, after = { 0 };
+    xc_dominfo_t info;
+    xc_interface *xch;
+    uint64_t start, nsec, batches = 0;
+
+    while ( (opt = getopt_long(argc, argv, "t:n:o:d:h", options,
+                               NULL)) != -1 )
+    {
+        switch ( opt )
+        {
+        case 't':
+            nr_threads = atoi(optarg);
+            break;
+        case 'n':
+            batch = atoi(optarg);
+            break;
+        case 'o':
+            order = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'h':
+            usage(0);
+            break;
+        default:
+            usage(1);
+        }
+    }
+    if ( optind != argc || !batch || !duration )
+        usage(1);
+
+    if ( !nr_threads )
+        nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    workers = calloc(nr_threads, sizeof(*workers));
+    if ( !workers )
+    {
+        perror("calloc");
+        exit(2);
+    }
+
+    xch = xc_interface_open(NULL, NULL, 0);
+    if ( !xch )
+    {
+        perror("xc_interface_open");
+        exit(2);
+    }
+
+    if ( xc_physinfo(xch, &before) )
+    {
+        perror("xc_physinfo");
+        exit(2);
+    }
+
+    if ( xc_domain_create(xch, 0, handle, 0, &domid, NULL) )
+    {
+        perror("xc_domain_create");
+        exit(2);
+    }
+
+    if ( xc_domain_setmaxmem(xch, domid,
+                             (uint64_t)nr_threads * batch << order <<
+                             (XC_PAGE_SHIFT - 10)) )
+    {
+        perror("xc_domain_setmaxmem");
+        ret = 2;
+        goto out;
+    }
+
+    printf("%u threads, %u extents of order %u per batch, %u seconds\n",
+           nr_threads, batch, order, duration);
+
+    start = now_ns();
+    for ( i = 0; i < nr_threads; i++ )
+    {
+        workers[i].cpu = i;
+        workers[i].pfns = calloc(batch, sizeof(*workers[i].pfns));
+        if ( !workers[i].pfns ||
+             pthread_create(&workers[i].thread, NULL, worker_fn, &workers[i]) )
+        {
+            fprintf(stderr, "could not start thread %u\n", i);
+            stop = true;
+            nr_threads = i;
+            ret = 2;
+            break;
+        }
+    }
+
+    if ( !stop )
+        sleep(duration);
+    stop = true;
+
+    for ( i = 0; i < nr_threads; i++ )
+    {
+        pthread_join(workers[i].thread, NULL);
+        if ( workers[i].err )
+        {
+            fprintf(stderr, "thread %u failed: %s\n", i,
+                    strerror(workers[i].err));
+            ret = 1;
+        }
+        batches += workers[i].batches;
+        free(workers[i].pfns);
+    }
+    nsec = now_ns() - start;
+
+    printf("%"PRIu64" pages allocated and freed, %.0f pages/s\n",
+           batches * batch << order,
+           (batches * batch << order) * 1e9 / (nsec ? nsec : 1));
+
+    if ( xc_domain_getinfo(xch, domid, 1, &info) != 1 ||
+         info.domid != domid )
+    {
+        perror("xc_domain_getinfo");
+        ret = 2;
+    }
+    else if ( info.nr_pages )
+    {
+        fprintf(stderr, "domain still owns %lu pages\n", info.nr_pages);
+        ret = 1;
+    }
+
+ out:
+    xc_domain_destroy(xch, domid);
+
+    /*
+     * Some of the memory may legitimately remain in per-CPU caches of the
+     * hypervisor, so only report the difference.
+     */
+    if ( !xc_physinfo(xch, &after) )
+        printf("free memory: %"PRIu64" pages before, %"PRIu64" after\n",
+               before.free_pages, after.free_pages);
+
+    xc_interface_close(xch);
+    free(workers);
+
+    return ret;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,109 @@
+/*
+ * Environment for building xen/common/rangeset.c and xen/common/rbtree.c
+ * as part of a user space test.
+ *
+ * This file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2 (GPLv2)
+ * as published by the Free Software Foundation.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details. <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HARNESS_H__
+#define __HARNESS_H__
+
+#include <assert.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef int bool_t;
+typedef uint16_t domid_t;
+
+#define __must_check __attribute__((__warn_unused_result__))
+
+#define ASSERT(p) assert(p)
+#define BUG_ON(p) assert(!(p))
+
+#define EXPORT_SYMBOL(sym)
+
+#define container_of(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define min(x, y) ((x) < (y) ? (x) : (y))
+#define max(x, y) ((x) > (y) ? (x) : (y))
+
+#define xmalloc(type) ((type *)malloc(sizeof(type)))
+#define xfree(p) free(p)
+
+#define safe_strcpy(d, s) snprintf(d, sizeof(d), "%s", s)
+#define printk printf
+
+/* The tests are single threaded. */
+typedef int rwlock_t;
+#define rwlock_init(l) (*(l) = 0)
+#define read_lock(l) ((void)(l))
+#define read_unlock(l) ((void)(l))
+#define write_lock(l) ((void)(l))
+#define write_unlock(l) ((void)(l))
+
+typedef int spinlock_t;
+#define spin_lock_init(l) (*(l) = 0)
+#define spin_lock(l) ((void)(l))
+#define spin_unlock(l) ((void)(l))
+
+struct list_head {
+    struct list_head *next, *prev;
+};
+
+#define LIST_HEAD_INIT(name) { &(name), &(name) }
+#define LIST_HEAD(name) struct list_head name = LIST_HEAD_INIT(name)
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+    list->next = list;
+    list->prev = list;
+}
+
+static inline int list_empty(const struct list_head *head)
+{
+    return head->next == head;
+}
+
+static inline void list_add(struct list_head *new, struct list_head *head)
+{
+    new->next = head->next;
+    new->prev = head;
+    head->next->prev = new;
+    head->next = new;
+}
+
+static inline void list_del(struct list_head *entry)
+{
+    entry->next->prev = entry->prev;
+    entry->prev->next = entry->next;
+}
+
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+
+#define list_for_each_entry(pos, head, member)                          \
+    for ( pos = list_entry((head)->next, typeof(*pos), member);         \
+          &pos->member != (head);                                       \
+          pos = list_entry(pos->member.next, typeof(*pos), member) )
+
+struct domain {
+    domid_t          domain_id;
+    struct list_head rangesets;
+    spinlock_t       rangesets_lock;
+};
+
+#include "rbtree.h"
+#include "rangeset.h"
+
+#endif /* __HARNESS_H__ */
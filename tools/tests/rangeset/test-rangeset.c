@@ -0,0 +1,278 @@
+/*
+ * Functional test and microbenchmark for xen/common/rangeset.c.
+ *
+ * The functional part checks random operations against a bitmap.  The
+ * benchmark measures the cost of lookups and updates as the number of
+ * ranges in a set grows.
+ *
+ * This file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2 (GPLv2)
+ * as published by the Free Software Foundation.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details. <http://www.gnu.org/licenses/>.
+ */
+
+#include <time.h>
+#include "harness.h"
+
+#define UNIVERSE 1024
+#define NR_OPS   200000
+
+static unsigned char ref[UNIVERSE];
+
+static uint64_t now_ns(void)
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+struct report_state {
+    unsigned long next;       /* Lowest number a reported range may start at. */
+    unsigned long last_e;     /* End of previous range, to check coalescing. */
+    unsigned int nr;
+};
+
+static int check_range(unsigned long s, unsigned long e, void *ctxt)
+{
+    struct report_state *st = ctxt;
+    unsigned long i;
+
+    if ( s > e || s < st->next )
+        return -1;
+    /* Adjacent ranges must have been merged. */
+    if ( st->nr && st->last_e + 1 >= s )
+        return -1;
+
+    for ( ; st->next < s; st->next++ )
+        if ( ref[st->next] )
+            return -1;
+    for ( i = s; i <= e; i++ )
+        if ( !ref[i] )
+            return -1;
+
+    st->next = e + 1;
+    st->last_e = e;
+    st->nr++;
+
+    return 0;
+}
+
+static int check_set(struct rangeset *r)
+{
+    struct report_state st = { 0 };
+
+    if ( rangeset_report_ranges(r, 0, UNIVERSE - 1, check_range, &st) )
+        return -1;
+    for ( ; st.next < UNIVERSE; st.next++ )
+        if ( ref[st.next] )
+            return -1;
+
+    return (rangeset_is_empty(r) == !st.nr) ? 0 : -1;
+}
+
+static int test_random(void)
+{
+    struct rangeset *r = rangeset_new(NULL, "test", 0);
+    unsigned int op;
+    unsigned long s, e, i;
+    bool_t all, any;
+
+    if ( !r )
+        return -1;
+
+    memset(ref, 0, sizeof(ref));
+
+    for ( op = 0; op < NR_OPS; op++ )
+    {
+        s = random() % UNIVERSE;
+        e = s + random() % (op & 1 ? 4 : 64);
+        if ( e >= UNIVERSE )
+            e = UNIVERSE - 1;
+
+        all = 1;
+        any = 0;
+        for ( i = s; i <= e; i++ )
+        {
+            all &= ref[i];
+            any |= ref[i];
+        }
+
+        switch ( random() % 4 )
+        {
+        case 0:
+            if ( rangeset_add_range(r, s, e) )
+                goto fail;
+            memset(&ref[s], 1, e - s + 1);
+            break;
+        case 1:
+            if ( rangeset_remove_range(r, s, e) )
+                goto fail;
+            memset(&ref[s], 0, e - s + 1);
+            break;
+        case 2:
+            if ( rangeset_contains_range(r, s, e) != all )
+                goto fail;
+            break;
+        case 3:
+            if ( rangeset_overlaps_range(r, s, e) != any )
+                goto fail;
+            break;
+        }
+
+        if ( !(op % 64) && check_set(r) )
+            goto fail;
+    }
+
+    if ( check_set(r) )
+        goto fail;
+
+    rangeset_destroy(r);
+    return 0;
+
+ fail:
+    printf("mismatch after %u operations, [%lu, %lu]\n", op, s, e);
+    rangeset_printk(r);
+    printf("\n");
+    rangeset_destroy(r);
+    return -1;
+}
+
+static int test_limit_and_swap(void)
+{
+    struct rangeset *a = rangeset_new(NULL, "a", 0);
+    struct rangeset *b = rangeset_new(NULL, "b", 0);
+    int rc = -1;
+
+    if ( !a || !b )
+        goto out;
+
+    rangeset_limit(a, 2);
+    if ( rangeset_add_range(a, 0, 1) || rangeset_add_range(a, 4, 5) ||
+         rangeset_add_range(a, 8, 9) != -ENOMEM ||
+         /* Merging frees a range. */
+         rangeset_add_range(a, 2, 3) ||
+         rangeset_add_range(a, 8, 9) ||
+         /* Splitting needs one. */
+         rangeset_remove_singleton(a, 2) != -ENOMEM ||
+         rangeset_remove_range(a, 8, 9) ||
+         rangeset_remove_singleton(a, 2) )
+        goto out;
+
+    if ( rangeset_add_singleton(b, 100) )
+        goto out;
+    rangeset_swap(a, b);
+    if ( !rangeset_contains_singleton(a, 100) ||
+         rangeset_contains_singleton(a, 0) ||
+         !rangeset_contains_range(b, 3, 5) ||
+         rangeset_contains_singleton(b, 2) ||
+         rangeset_overlaps_range(b, 6, 99) )
+        goto out;
+
+    rc = 0;
+
+ out:
+    if ( rc )
+        printf("limit/swap test failed\n");
+    rangeset_destroy(a);
+    rangeset_destroy(b);
+    return rc;
+}
+
+/*
+ * Set up nr ranges [4i, 4i + 1], then time lookups of random numbers,
+ * half of them inside a range, and updates which merge two neighbouring
+ * ranges and split them again.
+ */
+static int bench(unsigned int nr, unsigned int iters)
+{
+    struct rangeset *r = rangeset_new(NULL, "bench", 0);
+    unsigned long *keys;
+    unsigned int i, hits = 0;
+    uint64_t t, lookup_ns, update_ns;
+
+    keys = malloc(iters * sizeof(*keys));
+    if ( !r || !keys )
+        return -1;
+
+    for ( i = 0; i < nr; i++ )
+        if ( rangeset_add_range(r, 4UL * i, 4UL * i + 1) )
+            return -1;
+    for ( i = 0; i < iters; i++ )
+        keys[i] = 4UL * (random() % nr) + (random() & 3);
+
+    t = now_ns();
+    for ( i = 0; i < iters; i++ )
+        hits += rangeset_contains_singleton(r, keys[i]);
+    lookup_ns = now_ns() - t;
+
+    t = now_ns();
+    for ( i = 0; i < iters; i++ )
+    {
+        unsigned long k = (keys[i] & ~3UL) | 2;
+
+        if ( rangeset_add_range(r, k, k + 1) ||
+             rangeset_remove_range(r, k, k + 1) )
+            return -1;
+    }
+    update_ns = now_ns() - t;
+
+    printf("%10u %14.1f %14.1f %10u\n", nr, (double)lookup_ns / iters,
+           (double)update_ns / iters, hits);
+
+    rangeset_destroy(r);
+    free(keys);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int nr, max_nr = 1U << 16;
+    int rc = 0;
+
+    if ( argc > 1 )
+        max_nr = strtoul(argv[1], NULL, 0);
+
+    srandom(1);
+
+    printf("%-40s", "Testing random operations...");
+    if ( test_random() )
+        rc = 1;
+    else
+        printf("okay\n");
+
+    printf("%-40s", "Testing limits and swapping...");
+    if ( test_limit_and_swap() )
+        rc = 1;
+    else
+        printf("okay\n");
+
+    if ( rc )
+        return rc;
+
+    printf("\n%10s %14s %14s %10s\n", "ranges", "ns/lookup", "ns/update",
+           "hits");
+    for ( nr = 16; nr <= max_nr; nr <<= 2 )
+        if ( bench(nr, 200000) )
+        {
+            printf("benchmark with %u ranges failed\n", nr);
+            return 1;
+        }
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
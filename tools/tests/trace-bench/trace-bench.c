@@ -0,0 +1,263 @@
+/*
+ * trace-bench.c
+ *
+ * Measure the cost of tracing in Xen.  A cheap hypercall is issued in a
+ * loop, first with tracing disabled and then with only the PV hypercall
+ * events enabled, which makes Xen write one record per iteration.  The
+ * trace buffers are drained (without copying anything) between batches of
+ * hypercalls, outside of the timed sections.  Reported are the number of
+ * records written per second and the cost of each record, i.e. the
+ * difference in time per hypercall.
+ *
+ * Hypercall events are only traced for PV guests, so this needs to run in
+ * a PV control domain.  Tracing is left disabled on exit.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#define XC_WANT_COMPAT_MAP_FOREIGN_API
+#include <xenctrl.h>
+#include <xen/trace.h>
+
+static struct option options[] = {
+    { "iterations", 1, NULL, 'n' },
+    { "batch", 1, NULL, 'b' },
+    { "size", 1, NULL, 'S' },
+    { "help", 0, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+static void usage(int ret)
+{
+    FILE *out;
+
+    out = ret ? stderr : stdout;
+
+    fprintf(out, "usage: trace-bench [<options>]\n");
+    fprintf(out, "  <options> are:\n");
+    fprintf(out, "  -n|--iterations <n>  hypercalls per run (default 10000000)\n");
+    fprintf(out, "  -b|--batch <b>       hypercalls between draining the buffers\n");
+    fprintf(out, "                       (default 1000)\n");
+    fprintf(out, "  -S|--size <pages>    trace buffer size per CPU, if not yet set\n");
+    fprintf(out, "                       (default 32)\n");
+    fprintf(out, "  -h|--help            print this usage information\n");
+    exit(ret);
+}
+
+static xc_interface *xch;
+static unsigned int nr_cpus;
+static struct t_buf **meta;
+static unsigned long data_size;
+
+static uint64_t events, lost;
+
+static uint64_t now_ns(void)
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+static int map_tbufs(unsigned long tbufs_mfn, unsigned long tinfo_size)
+{
+    const struct t_info *t_info;
+    unsigned int i, j;
+
+    t_info = xc_map_foreign_range(xch, DOMID_XEN, tinfo_size, PROT_READ,
+                                  tbufs_mfn);
+    if ( !t_info || !t_info->tbuf_size )
+        return -1;
+
+    data_size = t_info->tbuf_size * XC_PAGE_SIZE - sizeof(struct t_buf);
+
+    meta = calloc(nr_cpus, sizeof(*meta));
+    if ( !meta )
+        return -1;
+
+    for ( i = 0; i < nr_cpus; i++ )
+    {
+        const uint32_t *mfn_list = (const uint32_t *)t_info +
+                                   t_info->mfn_offset[i];
+        xen_pfn_t pfn_list[t_info->tbuf_size];
+
+        for ( j = 0; j < t_info->tbuf_size; j++ )
+            pfn_list[j] = mfn_list[j];
+
+        meta[i] = xc_map_foreign_pages(xch, DOMID_XEN,
+                                       PROT_READ | PROT_WRITE,
+                                       pfn_list, t_info->tbuf_size);
+        if ( !meta[i] )
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Count the records in all buffers and hand the space back to Xen. */
+static void drain(int count)
+{
+    unsigned int i;
+
+    for ( i = 0; i < nr_cpus; i++ )
+    {
+        const unsigned char *data = (const unsigned char *)(meta[i] + 1);
+        uint32_t cons = meta[i]->cons, prod = meta[i]->prod;
+
+        xen_rmb(); /* read prod, then read records. */
+
+        while ( count && cons != prod )
+        {
+            const struct t_rec *rec =
+                (const struct t_rec *)(data + cons % data_size);
+
+            if ( rec->event == TRC_LOST_RECORDS )
+                lost += rec->u.cycles.extra_u32[0];
+            else if ( rec->event == TRC_PV_HYPERCALL_V2 )
+                events++;
+
+            cons += 4 + (rec->cycles_included ? 8 : 0) + rec->extra_u32 * 4;
+            if ( cons >= 2 * data_size )
+                cons -= 2 * data_size;
+        }
+
+        xen_mb(); /* read records, then update cons. */
+        meta[i]->cons = prod;
+    }
+}
+
+/* Issue nr hypercalls, draining every batch of them; return the time taken. */
+static uint64_t run(unsigned long nr, unsigned long batch, int count)
+{
+    unsigned long i, n;
+    uint64_t t, total = 0;
+
+    for ( i = 0; i < nr; i += batch )
+    {
+        n = nr - i < batch ? nr - i : batch;
+
+        t = now_ns();
+        while ( n-- )
+            xc_version(xch, XENVER_version, NULL);
+        total += now_ns() - t;
+
+        drain(count);
+    }
+
+    return total;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, ret = 1;
+    unsigned long nr = 10000000, batch = 1000, pages = 32;
+    unsigned long tbufs_mfn, tinfo_size;
+    uint64_t base_ns, traced_ns;
+
+    while ( (opt = getopt_long(argc, argv, "n:b:S:h", options, NULL)) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'n':
+            nr = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            batch = strtoul(optarg, NULL, 0);
+            break;
+        case 'S':
+            pages = strtoul(optarg, NULL, 0);
+            break;
+        case 'h':
+            usage(0);
+            break;
+        default:
+            usage(1);
+        }
+    }
+    if ( optind != argc || !nr || !batch )
+        usage(1);
+
+    xch = xc_interface_open(NULL, NULL, 0);
+    if ( !xch )
+    {
+        perror("xc_interface_open");
+        exit(2);
+    }
+
+    nr_cpus = xc_get_max_cpus(xch);
+
+    if ( xc_tbuf_set_evt_mask(xch, TRC_PV_HYPERCALL_V2) ||
+         xc_tbuf_enable(xch, pages, &tbufs_mfn, &tinfo_size) )
+    {
+        perror("enabling trace buffers");
+        goto out;
+    }
+
+    if ( map_tbufs(tbufs_mfn, tinfo_size) )
+    {
+        perror("mapping trace buffers");
+        goto out;
+    }
+
+    /* Warm up and empty the buffers. */
+    run(batch, batch, 0);
+
+    if ( xc_tbuf_disable(xch) )
+    {
+        perror("xc_tbuf_disable");
+        goto out;
+    }
+    base_ns = run(nr, batch, 0);
+
+    if ( xc_tbuf_enable(xch, pages, &tbufs_mfn, &tinfo_size) )
+    {
+        perror("xc_tbuf_enable");
+        goto out;
+    }
+    drain(0);
+    traced_ns = run(nr, batch, 1);
+
+    printf("untraced: %10.1f ns/hypercall\n", (double)base_ns / nr);
+    printf("traced:   %10.1f ns/hypercall\n", (double)traced_ns / nr);
+    printf("records:  %10"PRIu64" written, %"PRIu64" lost\n", events, lost);
+    if ( events )
+        printf("%.0f records/s, %.1f ns/record\n",
+               events * 1e9 / traced_ns,
+               ((double)traced_ns - base_ns) / events);
+
+    ret = 0;
+
+ out:
+    xc_tbuf_disable(xch);
+    xc_interface_close(xch);
+
+    return ret;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,163 @@
+/*
+ * xenstat-bench.c
+ *
+ * Measure how long libxenstat takes to collect the statistics of a node.
+ * The first sample taken through a handle has to look everything up; the
+ * following ones can reuse what the handle has cached (domain names,
+ * interface mappings).  Reported are the time of the first sample and the
+ * average time of the following ones, also per domain, and the cost of
+ * finding each domain of a sample in the previous one.
+ *
+ * Run it with different numbers of domains on the host to see how the
+ * collection time scales with the domain count.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <xenstat.h>
+
+static struct option options[] = {
+    { "iterations", 1, NULL, 'n' },
+    { "flags", 1, NULL, 'f' },
+    { "help", 0, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+static void usage(int ret)
+{
+    FILE *out;
+
+    out = ret ? stderr : stdout;
+
+    fprintf(out, "usage: xenstat-bench [<options>]\n");
+    fprintf(out, "  <options> are:\n");
+    fprintf(out, "  -n|--iterations <n>  samples to take (default 100)\n");
+    fprintf(out, "  -f|--flags <flags>   XENSTAT_* flags of what to collect\n");
+    fprintf(out, "                       (default XENSTAT_ALL)\n");
+    fprintf(out, "  -h|--help            print this usage information\n");
+    exit(ret);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+static void report(const char *what, uint64_t nsec, unsigned int nr_domains)
+{
+    printf("%-12s %12.1f us %10.1f us/domain\n", what, nsec / 1e3,
+           nr_domains ? nsec / 1e3 / nr_domains : 0.0);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, ret = 1;
+    unsigned int iterations = 100, flags = XENSTAT_ALL;
+    unsigned int i, j, nr_domains, found = 0;
+    uint64_t t, first, total = 0, lookup = 0;
+    xenstat_handle *xhandle;
+    xenstat_node *node, *prev;
+
+    while ( (opt = getopt_long(argc, argv, "n:f:h", options, NULL)) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'n':
+            iterations = strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            flags = strtoul(optarg, NULL, 0);
+            break;
+        case 'h':
+            usage(0);
+            break;
+        default:
+            usage(1);
+        }
+    }
+    if ( optind != argc || iterations < 2 )
+        usage(1);
+
+    xhandle = xenstat_init();
+    if ( !xhandle )
+    {
+        fprintf(stderr, "xenstat_init failed\n");
+        exit(2);
+    }
+
+    t = now_ns();
+    prev = xenstat_get_node(xhandle, flags);
+    first = now_ns() - t;
+    if ( !prev )
+    {
+        fprintf(stderr, "xenstat_get_node failed\n");
+        goto out;
+    }
+
+    for ( i = 1; i < iterations; i++ )
+    {
+        t = now_ns();
+        node = xenstat_get_node(xhandle, flags);
+        total += now_ns() - t;
+        if ( !node )
+        {
+            fprintf(stderr, "xenstat_get_node failed\n");
+            xenstat_free_node(prev);
+            goto out;
+        }
+
+        nr_domains = xenstat_node_num_domains(node);
+        t = now_ns();
+        for ( j = 0; j < nr_domains; j++ )
+            found += !!xenstat_node_domain_prev(
+                prev, xenstat_node_domain_by_index(node, j));
+        lookup += now_ns() - t;
+
+        xenstat_free_node(prev);
+        prev = node;
+    }
+
+    nr_domains = xenstat_node_num_domains(prev);
+    printf("%u domains, flags %#x, %u samples\n", nr_domains, flags,
+           iterations);
+    report("first", first, nr_domains);
+    report("following", total / (iterations - 1), nr_domains);
+    printf("%-12s %12.1f ns/domain, %u found\n", "lookup",
+           found ? (double)lookup / found : 0.0, found);
+
+    xenstat_free_node(prev);
+    ret = 0;
+
+ out:
+    xenstat_uninit(xhandle);
+
+    return ret;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
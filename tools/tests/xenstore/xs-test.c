@@ -403,6 +403,61 @@ static int test_ta3_deinit(uintptr_t par)
     return verify_node(paths[0], "b", 1);
 }
 
+static int test_ta4_init(uintptr_t par)
+{
+    if ( !xs_write(xsh, XBT_NULL, paths[0], write_buffers[0], 1) ||
+         !xs_write(xsh, XBT_NULL, paths[1], write_buffers[0], 1) )
+        return errno;
+    return 0;
+}
+
+static int test_ta4(uintptr_t par)
+{
+    xs_transaction_t t1, t2 = XBT_NULL;
+    char *buf;
+    unsigned int len;
+    int ret;
+
+    t1 = xs_transaction_start(xsh);
+    if ( t1 == XBT_NULL )
+        return errno;
+    t2 = xs_transaction_start(xsh);
+    if ( t2 == XBT_NULL )
+        goto out;
+    buf = xs_read(xsh, t1, paths[0], &len);
+    if ( !buf )
+        goto out;
+    free(buf);
+    buf = xs_read(xsh, t2, paths[1], &len);
+    if ( !buf )
+        goto out;
+    free(buf);
+    if ( !xs_write(xsh, t1, paths[0], "b", 1) ||
+         !xs_write(xsh, t2, paths[1], "c", 1) )
+        goto out;
+    /* Neither transaction touched the other's node, so both commit. */
+    if ( !xs_transaction_end(xsh, t2, false) )
+    {
+        t2 = XBT_NULL;
+        goto out;
+    }
+    return xs_transaction_end(xsh, t1, false) ? 0 : errno;
+
+ out:
+    ret = errno;
+    if ( t2 != XBT_NULL )
+        xs_transaction_end(xsh, t2, true);
+    xs_transaction_end(xsh, t1, true);
+    return ret;
+}
+
+static int test_ta4_deinit(uintptr_t par)
+{
+    int ret = verify_node(paths[0], "b", 1);
+
+    return ret ? ret : verify_node(paths[1], "c", 1);
+}
+
 #define TEST(s, f, p, l) { s, f ## _init, f, f ## _deinit, (uintptr_t)(p), l }
 struct test tests[] = {
 TEST("read 1", test_read, 1, "Read node with 1 byte data"),
@@ -417,6 +472,7 @@ TEST("ta empty x", test_ta1, 1, "Empty transaction abort"),
 TEST("ta rmw", test_ta2, 0, "Read-modify-write transaction"),
 TEST("ta rmw x", test_ta2, 1, "Read-modify-write transaction abort"),
 TEST("ta err", test_ta3, 0, "Transaction with conflict"),
+TEST("ta disj", test_ta4, 0, "Concurrent transactions on disjoint nodes"),
 };
 
 static void cleanup(void)
@@ -0,0 +1,202 @@
+/*
+ * xs-watch-bench.c
+ *
+ * Measure Xenstore write throughput depending on the number of watches
+ * registered.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <xenstore.h>
+
+#define TEST_PATH "xenstore-test"
+
+static struct xs_handle *xsh, *xsh_watch;
+static char *path;
+
+static struct option options[] = {
+    { "writes", 1, NULL, 'n' },
+    { "max-watches", 1, NULL, 'w' },
+    { "hit", 0, NULL, 'H' },
+    { "help", 0, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+static void usage(int ret)
+{
+    FILE *out;
+
+    out = ret ? stderr : stdout;
+
+    fprintf(out, "usage: xs-watch-bench [<options>]\n");
+    fprintf(out, "  <options> are:\n");
+    fprintf(out, "  -n|--writes <n>        writes per measurement (default 10000)\n");
+    fprintf(out, "  -w|--max-watches <w>   stop after <w> watches (default 16384)\n");
+    fprintf(out, "  -H|--hit               write a node covered by one watch\n");
+    fprintf(out, "  -h|--help              print this usage information\n");
+    exit(ret);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+/*
+ * Watches are set on "<path>/<i>/device" of distinct subtrees, similar
+ * to backends watching the frontend directories of many domains.
+ */
+static int add_watches(unsigned int from, unsigned int to)
+{
+    char node[64], token[16];
+    unsigned int i;
+
+    for ( i = from; i < to; i++ )
+    {
+        snprintf(node, sizeof(node), "%s/%u/device", path, i);
+        snprintf(token, sizeof(token), "%u", i);
+        if ( !xs_watch(xsh_watch, node, token) )
+            return errno;
+    }
+
+    return 0;
+}
+
+static int do_writes(const char *node, unsigned int writes, uint64_t *nsec)
+{
+    uint64_t start;
+    unsigned int i;
+
+    start = now_ns();
+    for ( i = 0; i < writes; i++ )
+        if ( !xs_write(xsh, XBT_NULL, node, "x", 1) )
+            return errno;
+    *nsec = now_ns() - start;
+
+    return 0;
+}
+
+/* Drop events queued for the watch handle, we are not interested in them. */
+static void drain_events(void)
+{
+    char **vec;
+
+    while ( (vec = xs_check_watch(xsh_watch)) )
+        free(vec);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, ret = 0;
+    unsigned int writes = 10000, max_watches = 16384, watches, next;
+    bool hit = false;
+    char *node;
+    uint64_t nsec;
+
+    while ( (opt = getopt_long(argc, argv, "n:w:Hh", options,
+                               NULL)) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'n':
+            writes = atoi(optarg);
+            break;
+        case 'w':
+            max_watches = atoi(optarg);
+            break;
+        case 'H':
+            hit = true;
+            break;
+        case 'h':
+            usage(0);
+            break;
+        default:
+            usage(1);
+        }
+    }
+    if ( optind != argc || !writes )
+        usage(1);
+
+    asprintf(&path, "%s/%u", TEST_PATH, getpid());
+    if ( hit )
+        asprintf(&node, "%s/0/device/state", path);
+    else
+        asprintf(&node, "%s/unwatched", path);
+
+    xsh = xs_open(0);
+    xsh_watch = xs_open(0);
+    if ( !xsh || !xsh_watch )
+    {
+        fprintf(stderr, "could not connect to xenstore\n");
+        exit(2);
+    }
+
+    xs_rm(xsh, XBT_NULL, path);
+    if ( !xs_write(xsh, XBT_NULL, node, "", 0) )
+    {
+        perror("could not create test node");
+        exit(2);
+    }
+
+    printf("%10s %12s %10s\n", "watches", "writes/s", "ns/write");
+    for ( watches = 0; ; watches = next )
+    {
+        ret = do_writes(node, writes, &nsec);
+        if ( ret )
+            break;
+        printf("%10u %12.0f %10"PRIu64"\n", watches,
+               writes * 1e9 / (nsec ? nsec : 1), nsec / writes);
+        drain_events();
+
+        if ( watches >= max_watches )
+            break;
+        next = watches ? watches * 2 : 1;
+        if ( next > max_watches )
+            next = max_watches;
+        ret = add_watches(watches, next);
+        if ( ret )
+            break;
+    }
+
+    if ( ret )
+        fprintf(stderr, "failed: %s\n", strerror(ret));
+
+    /* Closing the watch handle drops all of its watches. */
+    xs_close(xsh_watch);
+    xs_rm(xsh, XBT_NULL, path);
+    xs_close(xsh);
+
+    return ret ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -21,21 +21,30 @@
 
 #include <unistd.h>
 #include <xc_private.h>
+#include "file_ops.h"
 
-static int file_op(int fd, void *page, int i,
-                   ssize_t (*fn)(int, void *, size_t))
-{
-    off_t offset = i;
-    int total = 0;
-    int bytes;
+/*
+ * A page-in reads a run of slots following the requested one, so that
+ * pages which were written out together (see evict_pages) and are paged
+ * in together are read with a single request.
+ */
+#define READAHEAD_PAGES 32
 
-    offset = lseek(fd, offset << PAGE_SHIFT, SEEK_SET);
-    if ( offset == (off_t)-1 )
-        return -1;
+static void *readahead;
+static int readahead_first;
+static int readahead_num;
+static unsigned long readahead_hits;
 
-    while ( total < PAGE_SIZE )
+static int file_op(int fd, void *buf, int i, int nr,
+                   ssize_t (*fn)(int, void *, size_t, off_t))
+{
+    off_t offset = (off_t)i << PAGE_SHIFT;
+    size_t total = 0, size = (size_t)nr << PAGE_SHIFT;
+    ssize_t bytes;
+
+    while ( total < size )
     {
-        bytes = fn(fd, page + total, PAGE_SIZE - total);
+        bytes = fn(fd, buf + total, size - total, offset + total);
         if ( bytes <= 0 )
             return -1;
 
@@ -45,19 +54,79 @@ static int file_op(int fd, void *page, int i,
     return 0;
 }
 
-static ssize_t my_write(int fd, void *buf, size_t count)
+static ssize_t my_pwrite(int fd, void *buf, size_t count, off_t offset)
 {
-    return write(fd, buf, count);
+    return pwrite(fd, buf, count, offset);
+}
+
+static int read_ahead(int fd, int i)
+{
+    size_t total = 0, size = READAHEAD_PAGES << PAGE_SHIFT;
+    ssize_t bytes;
+
+    if ( !readahead &&
+         posix_memalign(&readahead, PAGE_SIZE, READAHEAD_PAGES << PAGE_SHIFT) )
+    {
+        readahead = NULL;
+        return -1;
+    }
+
+    readahead_num = 0;
+
+    /* Slots beyond the end of the file are never read */
+    while ( total < size )
+    {
+        bytes = pread(fd, readahead + total, size - total,
+                      ((off_t)i << PAGE_SHIFT) + total);
+        if ( bytes < 0 )
+            return -1;
+        if ( bytes == 0 )
+            break;
+
+        total += bytes;
+    }
+
+    if ( total < PAGE_SIZE )
+        return -1;
+
+    readahead_first = i;
+    readahead_num = total >> PAGE_SHIFT;
+
+    return 0;
 }
 
 int read_page(int fd, void *page, int i)
 {
-    return file_op(fd, page, i, &read);
+    if ( readahead_num && i >= readahead_first &&
+         i < readahead_first + readahead_num )
+        readahead_hits++;
+    else if ( read_ahead(fd, i) )
+        return file_op(fd, page, i, 1, &pread);
+
+    memcpy(page, readahead + ((i - readahead_first) << PAGE_SHIFT),
+           PAGE_SIZE);
+
+    return 0;
+}
+
+int write_pages(int fd, void *pages, int i, int nr)
+{
+    /* Drop read ahead slots which are overwritten */
+    if ( readahead_num && i < readahead_first + readahead_num &&
+         i + nr > readahead_first )
+        readahead_num = 0;
+
+    return file_op(fd, pages, i, nr, &my_pwrite);
 }
 
 int write_page(int fd, void *page, int i)
 {
-    return file_op(fd, page, i, &my_write);
+    return write_pages(fd, page, i, 1);
+}
+
+unsigned long read_page_readahead_hits(void)
+{
+    return readahead_hits;
 }
 
 
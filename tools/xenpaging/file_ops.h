@@ -26,6 +26,10 @@
 
 int read_page(int fd, void *page, int i);
 int write_page(int fd, void *page, int i);
+/* Write nr contiguous pages to the nr slots starting at slot i */
+int write_pages(int fd, void *pages, int i, int nr);
+/* Number of pages read_page found in its read ahead buffer */
+unsigned long read_page_readahead_hits(void);
 
 
 #endif
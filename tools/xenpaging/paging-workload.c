@@ -0,0 +1,166 @@
+/******************************************************************************
+ * tools/xenpaging/paging-workload.c
+ *
+ * Guest memory workload, to compare xenpaging policies.
+ *
+ * Run it inside an HVM guest whose memory xenpaging is paging.  It touches
+ * all pages of a buffer once, then keeps writing to pages of it: a given
+ * share of the accesses goes to a hot set at the start of the buffer, and
+ * the others are spread over the whole buffer.  Every second it reports
+ * how many accesses it made and how many of them were slow, which is what
+ * an access to a paged-out page looks like from the guest.  The number of
+ * pages paged in on the other side is reported by xenpaging -s.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define PAGE_SIZE 4096
+
+static unsigned long size_mb = 256;
+static unsigned int hot_percent = 10;
+static unsigned int hot_access_percent = 90;
+static unsigned int seconds = 60;
+static unsigned int slow_us = 100;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-m <MiB>] [-w <hot set %%>] [-p <hot accesses %%>]"
+            " [-t <seconds>] [-l <slow access us>]\n", prog);
+    exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift64, cheap enough not to disturb the measurement */
+static uint64_t next_random(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long nr_pages, hot_pages, page, accesses, slow, total_slow = 0;
+    uint64_t rnd = 0x2545f4914f6cdd1dULL, start, second, t, max_ns;
+    unsigned int elapsed = 0;
+    char *buf;
+    int opt;
+
+    while ( (opt = getopt(argc, argv, "m:w:p:t:l:")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'm':
+            size_mb = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            hot_percent = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            hot_access_percent = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            seconds = strtoul(optarg, NULL, 0);
+            break;
+        case 'l':
+            slow_us = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if ( !size_mb || hot_percent > 100 || hot_access_percent > 100 )
+        usage(argv[0]);
+
+    nr_pages = (size_mb << 20) / PAGE_SIZE;
+    hot_pages = nr_pages * hot_percent / 100 ?: 1;
+
+    buf = mmap(NULL, nr_pages * PAGE_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ( buf == MAP_FAILED )
+    {
+        perror("mmap");
+        return 1;
+    }
+    for ( page = 0; page < nr_pages; page++ )
+        buf[page * PAGE_SIZE] = 1;
+
+    printf("%lu pages, %lu hot, %u%% of accesses hot\n",
+           nr_pages, hot_pages, hot_access_percent);
+
+    start = now_ns();
+    while ( elapsed < seconds )
+    {
+        accesses = slow = max_ns = 0;
+        second = now_ns();
+
+        do {
+            uint64_t r = next_random(&rnd);
+
+            if ( r % 100 < hot_access_percent )
+                page = (r >> 8) % hot_pages;
+            else
+                page = (r >> 8) % nr_pages;
+
+            t = now_ns();
+            buf[page * PAGE_SIZE + (r >> 40) % PAGE_SIZE]++;
+            t = now_ns() - t;
+
+            accesses++;
+            if ( t >= slow_us * 1000ULL )
+                slow++;
+            if ( t > max_ns )
+                max_ns = t;
+        } while ( now_ns() - second < 1000000000ULL );
+
+        elapsed++;
+        total_slow += slow;
+        printf("%4u s: %10lu accesses, %6lu slow, max %8lu us\n", elapsed,
+               accesses, slow, (unsigned long)(max_ns / 1000));
+        fflush(stdout);
+    }
+
+    printf("%lu slow accesses in %.1f s\n", total_slow,
+           (now_ns() - start) / 1e9);
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
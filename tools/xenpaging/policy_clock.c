@@ -0,0 +1,322 @@
+/******************************************************************************
+ *
+ * Xen domain paging CLOCK policy.
+ *
+ * Victims are chosen by two hands sweeping over the gfns of the guest.
+ * The front hand clears the referenced bit of a window of gfns at a time,
+ * and restricts their access to XENMEM_access_n2rwx: the first access of
+ * the guest to such a gfn lifts the restriction again and sends an
+ * asynchronous mem_access event, which sets the referenced bit.  The back
+ * hand follows at a distance and chooses the gfns which were not
+ * referenced in between, so that the pages the guest is using stay in
+ * memory.
+ *
+ * If mem_access events are not available (another monitor is attached to
+ * the guest, or the hardware does not support it), only page-ins set the
+ * referenced bit.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "xc_bitops.h"
+#include "policy.h"
+
+
+#define DEFAULT_MRU_SIZE (1024 * 16)
+/* Number of gfns the front hand arms at once */
+#define CLOCK_WINDOW 512
+/* Maximum distance between the hands, in gfns */
+#define CLOCK_DISTANCE (1024 * 256)
+
+
+static unsigned long *bitmap;
+static unsigned long *unconsumed;
+static unsigned long *referenced;
+static unsigned int unconsumed_cleared;
+static unsigned long back_hand;
+static unsigned long front_hand;
+static unsigned long window;
+static unsigned long distance;
+static unsigned long max_pages;
+
+/* mem_access events */
+static int tracking;
+static struct vm_event monitor;
+
+
+static void tracking_init(struct xenpaging *paging)
+{
+    xc_interface *xch = paging->xc_handle;
+    domid_t domain_id = paging->vm_event.domain_id;
+    int rc;
+
+    monitor.domain_id = domain_id;
+    monitor.xce_handle = paging->vm_event.xce_handle;
+    monitor.ring_page = xc_monitor_enable(xch, domain_id,
+                                          &monitor.evtchn_port);
+    if ( !monitor.ring_page )
+    {
+        DPRINTF("mem_access not available (%d), tracking page-ins only\n",
+                errno);
+        return;
+    }
+
+    /* Use the event channel handle of the paging ring for both */
+    rc = xenevtchn_bind_interdomain(monitor.xce_handle, domain_id,
+                                    monitor.evtchn_port);
+    if ( rc < 0 )
+    {
+        PERROR("Failed to bind mem_access event channel");
+        xc_monitor_disable(xch, domain_id);
+        munmap(monitor.ring_page, PAGE_SIZE);
+        return;
+    }
+    monitor.port = rc;
+
+    SHARED_RING_INIT((vm_event_sring_t *)monitor.ring_page);
+    BACK_RING_INIT(&monitor.back_ring,
+                   (vm_event_sring_t *)monitor.ring_page,
+                   PAGE_SIZE);
+
+    tracking = 1;
+}
+
+static void tracking_teardown(struct xenpaging *paging, int reset)
+{
+    xc_interface *xch = paging->xc_handle;
+    domid_t domain_id = paging->vm_event.domain_id;
+
+    if ( !tracking )
+        return;
+
+    /* Lift all restrictions, then answer the events still on the ring */
+    if ( reset &&
+         xc_set_mem_access(xch, domain_id, XENMEM_access_rwx, 0, max_pages) )
+        PERROR("Error resetting mem_access of the guest");
+    policy_poll(paging);
+    tracking = 0;
+
+    if ( xc_monitor_disable(xch, domain_id) )
+        PERROR("Error disabling mem_access");
+    if ( xenevtchn_unbind(monitor.xce_handle, monitor.port) )
+        PERROR("Error unbinding mem_access event channel");
+    munmap(monitor.ring_page, PAGE_SIZE);
+}
+
+/* Clear the referenced bits of the next window and arm it */
+static void arm_window(struct xenpaging *paging)
+{
+    xc_interface *xch = paging->xc_handle;
+    unsigned long gfn, nr = window;
+
+    if ( front_hand + nr > max_pages )
+        nr = max_pages - front_hand;
+
+    for ( gfn = front_hand; gfn < front_hand + nr; gfn++ )
+        clear_bit(gfn, referenced);
+
+    if ( tracking &&
+         xc_set_mem_access(xch, paging->vm_event.domain_id,
+                           XENMEM_access_n2rwx, front_hand, nr) )
+    {
+        DPRINTF("Error arming gfns %lx-%lx (%d), tracking page-ins only\n",
+                front_hand, front_hand + nr - 1, errno);
+        tracking_teardown(paging, 0);
+    }
+
+    front_hand += nr;
+    if ( front_hand >= max_pages )
+        front_hand = 0;
+}
+
+static void advance_back_hand(struct xenpaging *paging, unsigned long nr)
+{
+    back_hand += nr;
+    if ( back_hand >= max_pages )
+        back_hand = 0;
+
+    while ( (front_hand + max_pages - back_hand) % max_pages < distance )
+        arm_window(paging);
+}
+
+int policy_init(struct xenpaging *paging)
+{
+    int rc = -ENOMEM;
+
+    max_pages = paging->max_pages;
+
+    /* Allocate bitmap for pages not to page out */
+    bitmap = bitmap_alloc(max_pages);
+    if ( !bitmap )
+        goto out;
+    /* Allocate bitmap to track unusable pages */
+    unconsumed = bitmap_alloc(max_pages);
+    if ( !unconsumed )
+        goto out;
+    /* Allocate bitmap to track recently used pages */
+    referenced = bitmap_alloc(max_pages);
+    if ( !referenced )
+        goto out;
+
+    /* Only used by xenpaging.c with this policy */
+    if ( paging->policy_mru_size <= 0 )
+        paging->policy_mru_size = DEFAULT_MRU_SIZE;
+
+    /*
+     * The hands must stay less than half of the gfns apart, so that
+     * arming a window never makes the front hand pass the back hand.
+     */
+    window = CLOCK_WINDOW;
+    if ( window > max_pages / 4 )
+        window = max_pages / 4 ?: 1;
+    distance = max_pages / 4;
+    if ( distance > CLOCK_DISTANCE )
+        distance = CLOCK_DISTANCE;
+
+    /* Don't page out page 0 */
+    set_bit(0, bitmap);
+
+    tracking_init(paging);
+
+    /* Start in the middle to avoid paging during BIOS startup */
+    back_hand = front_hand = (max_pages / 2) & ~(BITS_PER_LONG - 1);
+    advance_back_hand(paging, 0);
+
+    rc = 0;
+ out:
+    return rc;
+}
+
+void policy_teardown(struct xenpaging *paging)
+{
+    tracking_teardown(paging, 1);
+}
+
+void policy_poll(struct xenpaging *paging)
+{
+    vm_event_request_t req;
+    vm_event_response_t rsp;
+    int num = 0;
+
+    if ( !tracking )
+        return;
+
+    while ( RING_HAS_UNCONSUMED_REQUESTS(&monitor.back_ring) )
+    {
+        get_request(&monitor, &req);
+
+        if ( req.reason == VM_EVENT_REASON_MEM_ACCESS &&
+             req.u.mem_access.gfn < max_pages )
+            set_bit(req.u.mem_access.gfn, referenced);
+
+        memset(&rsp, 0, sizeof(rsp));
+        rsp.version = VM_EVENT_INTERFACE_VERSION;
+        rsp.vcpu_id = req.vcpu_id;
+        rsp.flags = req.flags & VM_EVENT_FLAG_VCPU_PAUSED;
+        rsp.reason = req.reason;
+        put_response(&monitor, &rsp);
+        num++;
+    }
+
+    if ( num )
+        xenevtchn_notify(monitor.xce_handle, monitor.port);
+}
+
+unsigned long policy_choose_victim(struct xenpaging *paging)
+{
+    xc_interface *xch = paging->xc_handle;
+    unsigned long i, gfn;
+
+    /* One iteration over all possible gfns */
+    for ( i = 0; i < max_pages; i++ )
+    {
+        gfn = back_hand;
+
+        if ( (gfn & (BITS_PER_LONG - 1)) == 0 &&
+             gfn + BITS_PER_LONG <= max_pages )
+        {
+            /* All gfns busy, or recently used */
+            if ( ~bitmap[gfn >> ORDER_LONG] == 0 ||
+                 ~unconsumed[gfn >> ORDER_LONG] == 0 ||
+                 ~referenced[gfn >> ORDER_LONG] == 0 )
+            {
+                advance_back_hand(paging, BITS_PER_LONG);
+                i += BITS_PER_LONG - 1;
+                continue;
+            }
+        }
+
+        advance_back_hand(paging, 1);
+
+        /* gfn busy, already tested, or used since the front hand passed */
+        if ( test_bit(gfn, bitmap) || test_bit(gfn, unconsumed) ||
+             test_bit(gfn, referenced) )
+            continue;
+
+        /* gfn found */
+        set_bit(gfn, unconsumed);
+        return gfn;
+    }
+
+    /* Could not nominate any gfn */
+
+    /* No more pages, wait in poll */
+    paging->use_poll_timeout = 1;
+    /* Count wrap arounds */
+    unconsumed_cleared++;
+    /* Force retry every few seconds (depends on poll() timeout) */
+    if ( unconsumed_cleared > 123 )
+    {
+        /* Force retry of unconsumed gfns on next call */
+        bitmap_clear(unconsumed, max_pages);
+        unconsumed_cleared = 0;
+        DPRINTF("clearing unconsumed, back_hand %lx", back_hand);
+    }
+    return INVALID_MFN;
+}
+
+void policy_notify_paged_out(unsigned long gfn)
+{
+    set_bit(gfn, bitmap);
+    clear_bit(gfn, unconsumed);
+}
+
+void policy_notify_paged_in(unsigned long gfn)
+{
+    /* The guest is using the page, give it another round */
+    clear_bit(gfn, bitmap);
+    set_bit(gfn, referenced);
+}
+
+void policy_notify_paged_in_nomru(unsigned long gfn)
+{
+    clear_bit(gfn, bitmap);
+}
+
+void policy_notify_dropped(unsigned long gfn)
+{
+    clear_bit(gfn, bitmap);
+}
+
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -208,6 +208,7 @@ static void usage(void)
     printf(" -f <file>      --pagefile=<file>        pagefile to use. This option is required.\n");
     printf(" -m <max_memkb> --max_memkb=<max_memkb>  maximum amount of memory to handle.\n");
     printf(" -r <num>       --mru_size=<num>         number of paged-in pages to keep in memory.\n");
+    printf(" -s <secs>      --stats=<secs>           print paging statistics every <secs> seconds.\n");
     printf(" -v             --verbose                enable debug output.\n");
     printf(" -h             --help                   this output.\n");
 }
@@ -215,13 +216,15 @@ static void usage(void)
 static int xenpaging_getopts(struct xenpaging *paging, int argc, char *argv[])
 {
     int ch;
-    static const char sopts[] = "hvd:f:m:r:";
+    static const char sopts[] = "hvd:f:m:r:s:";
     static const struct option lopts[] = {
         {"help", 0, NULL, 'h'},
         {"verbose", 0, NULL, 'v'},
         {"domain", 1, NULL, 'd'},
         {"pagefile", 1, NULL, 'f'},
-        {"mru_size", 1, NULL, 'm'},
+        {"max_memkb", 1, NULL, 'm'},
+        {"mru_size", 1, NULL, 'r'},
+        {"stats", 1, NULL, 's'},
         { }
     };
 
@@ -242,6 +245,9 @@ static int xenpaging_getopts(struct xenpaging *paging, int argc, char *argv[])
         case 'r':
             paging->policy_mru_size = atoi(optarg);
             break;
+        case 's':
+            paging->stats_interval = atoi(optarg);
+            break;
         case 'v':
             paging->debug = 1;
             break;
@@ -489,7 +495,10 @@ static struct xenpaging *xenpaging_init(int argc, char *argv[])
         if ( paging->xs_handle )
             xs_close(paging->xs_handle);
         if ( xch )
+        {
+            policy_teardown(paging);
             xc_interface_close(xch);
+        }
         if ( paging->paging_buffer )
         {
             munlock(paging->paging_buffer, PAGE_SIZE);
@@ -521,6 +530,8 @@ static void xenpaging_teardown(struct xenpaging *paging)
     xs_unwatch(paging->xs_handle, watch_target_tot_pages, "");
     xs_unwatch(paging->xs_handle, "@releaseDomain", watch_token);
 
+    policy_teardown(paging);
+
     paging->xc_handle = NULL;
     /* Tear down domain paging in Xen */
     munmap(paging->vm_event.ring_page, PAGE_SIZE);
@@ -553,7 +564,7 @@ static void xenpaging_teardown(struct xenpaging *paging)
     xc_interface_close(xch);
 }
 
-static void get_request(struct vm_event *vm_event, vm_event_request_t *req)
+void get_request(struct vm_event *vm_event, vm_event_request_t *req)
 {
     vm_event_back_ring_t *back_ring;
     RING_IDX req_cons;
@@ -570,7 +581,7 @@ static void get_request(struct vm_event *vm_event, vm_event_request_t *req)
     back_ring->sring->req_event = req_cons + 1;
 }
 
-static void put_response(struct vm_event *vm_event, vm_event_response_t *rsp)
+void put_response(struct vm_event *vm_event, vm_event_response_t *rsp)
 {
     vm_event_back_ring_t *back_ring;
     RING_IDX rsp_prod;
@@ -587,85 +598,6 @@ static void put_response(struct vm_event *vm_event, vm_event_response_t *rsp)
     RING_PUSH_RESPONSES(back_ring);
 }
 
-/* Evict a given gfn
- * Returns < 0 on fatal error
- * Returns 0 on successful evict
- * Returns > 0 if gfn can not be evicted
- */
-static int xenpaging_evict_page(struct xenpaging *paging, unsigned long gfn, int slot)
-{
-    xc_interface *xch = paging->xc_handle;
-    void *page;
-    xen_pfn_t victim = gfn;
-    int ret;
-
-    DECLARE_DOMCTL;
-
-    /* Nominate page */
-    ret = xc_mem_paging_nominate(xch, paging->vm_event.domain_id, gfn);
-    if ( ret < 0 )
-    {
-        /* unpageable gfn is indicated by EBUSY */
-        if ( errno == EBUSY )
-            ret = 1;
-        else
-            PERROR("Error nominating page %lx", gfn);
-        goto out;
-    }
-
-    /* Map page */
-    page = xc_map_foreign_pages(xch, paging->vm_event.domain_id, PROT_READ, &victim, 1);
-    if ( page == NULL )
-    {
-        PERROR("Error mapping page %lx", gfn);
-        ret = -1;
-        goto out;
-    }
-
-    /* Copy page */
-    ret = write_page(paging->fd, page, slot);
-    if ( ret < 0 )
-    {
-        PERROR("Error copying page %lx", gfn);
-        munmap(page, PAGE_SIZE);
-        ret = -1;
-        goto out;
-    }
-
-    /* Release page */
-    munmap(page, PAGE_SIZE);
-
-    /* Tell Xen to evict page */
-    ret = xc_mem_paging_evict(xch, paging->vm_event.domain_id, gfn);
-    if ( ret < 0 )
-    {
-        /* A gfn in use is indicated by EBUSY */
-        if ( errno == EBUSY )
-        {
-                ret = 1;
-                DPRINTF("Nominated page %lx busy", gfn);
-        } else
-            PERROR("Error evicting page %lx", gfn);
-        goto out;
-    }
-
-    DPRINTF("evict_page > gfn %lx pageslot %d\n", gfn, slot);
-    /* Notify policy of page being paged out */
-    policy_notify_paged_out(gfn);
-
-    /* Update index */
-    paging->slot_to_gfn[slot] = gfn;
-    paging->gfn_to_slot[gfn] = slot;
-
-    /* Record number of evicted pages */
-    paging->num_paged_out++;
-
-    ret = 0;
-
- out:
-    return ret;
-}
-
 static int xenpaging_resume_page(struct xenpaging *paging, vm_event_response_t *rsp, int notify_policy)
 {
     /* Put the page info on the ring */
@@ -727,6 +659,9 @@ static int xenpaging_populate_page(struct xenpaging *paging, unsigned long gfn,
     }
     while ( ret && !interrupted );
 
+    if ( ret == 0 )
+        paging->num_populated++;
+
 
  out:
     return ret;
@@ -753,12 +688,12 @@ static void resume_pages(struct xenpaging *paging, int num_pages)
         page_in_trigger();
 }
 
-/* Evict one gfn and write it to the given slot
+/* Nominate a gfn chosen by the policy for eviction
  * Returns < 0 on fatal error
- * Returns 0 on successful evict
- * Returns > 0 if no gfn can be evicted
+ * Returns 0 on successful nomination
+ * Returns > 0 if no gfn can be nominated
  */
-static int evict_victim(struct xenpaging *paging, int slot)
+static int nominate_victim(struct xenpaging *paging, unsigned long *gfn_r)
 {
     xc_interface *xch = paging->xc_handle;
     unsigned long gfn;
@@ -791,22 +726,59 @@ static int evict_victim(struct xenpaging *paging, int slot)
             goto out;
         }
 
-        ret = xenpaging_evict_page(paging, gfn, slot);
+        ret = xc_mem_paging_nominate(xch, paging->vm_event.domain_id, gfn);
         if ( ret < 0 )
-            goto out;
+        {
+            /* unpageable gfn is indicated by EBUSY */
+            if ( errno != EBUSY )
+            {
+                PERROR("Error nominating page %lx", gfn);
+                goto out;
+            }
+            ret = 1;
+        }
     }
     while ( ret );
 
-    if ( test_and_set_bit(gfn, paging->bitmap) )
-        ERROR("Page %lx has been evicted before", gfn);
-
-    ret = 0;
+    *gfn_r = gfn;
 
  out:
     return ret;
 }
 
-/* Evict a batch of pages and write them to a free slot in the paging file
+static int compare_slots(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+/* Find nr free slots in the paging file, and sort them so that pages are
+ * written to consecutive slots where possible */
+static void get_free_slots(struct xenpaging *paging, int *slots, int nr)
+{
+    int i, slot, num = 0;
+
+    /* Reuse known free slots */
+    while ( paging->stack_count > 0 && num < nr )
+        slots[num++] = paging->free_slot_stack[--paging->stack_count];
+
+    /* Scan all slots for remainders, skipping those taken from the stack */
+    for ( slot = 0; slot < paging->max_pages && num < nr; slot++ )
+    {
+        /* Slot is allocated */
+        if ( paging->slot_to_gfn[slot] )
+            continue;
+
+        for ( i = 0; i < num; i++ )
+            if ( slots[i] == slot )
+                break;
+        if ( i == num )
+            slots[num++] = slot;
+    }
+
+    qsort(slots, num, sizeof(*slots), compare_slots);
+}
+
+/* Evict a batch of pages and write them to free slots in the paging file
  * Returns < 0 on fatal error
  * Returns 0 if no gfn can be evicted
  * Returns > 0 on successful evict
@@ -814,40 +786,108 @@ static int evict_victim(struct xenpaging *paging, int slot)
 static int evict_pages(struct xenpaging *paging, int num_pages)
 {
     xc_interface *xch = paging->xc_handle;
-    int rc, slot, num = 0;
+    xen_pfn_t gfns[XENPAGING_EVICT_BATCH];
+    int slots[XENPAGING_EVICT_BATCH];
+    unsigned long gfn;
+    void *pages;
+    int i, j, rc, nr = 0, num = 0;
 
-    /* Reuse known free slots */
-    while ( paging->stack_count > 0 && num < num_pages )
+    if ( num_pages > XENPAGING_EVICT_BATCH )
+        num_pages = XENPAGING_EVICT_BATCH;
+
+    /* Nominate a batch of pages */
+    while ( nr < num_pages )
+    {
+        rc = nominate_victim(paging, &gfn);
+        if ( rc < 0 )
+            return -1;
+        if ( rc > 0 )
+            break;
+        gfns[nr++] = gfn;
+    }
+    if ( !nr )
+        return 0;
+
+    /* Map them all at once */
+    pages = xc_map_foreign_pages(xch, paging->vm_event.domain_id, PROT_READ,
+                                 gfns, nr);
+    if ( pages == NULL )
+    {
+        PERROR("Error mapping %d pages", nr);
+        return -1;
+    }
+
+    /* Copy them, with one write for each run of consecutive slots */
+    get_free_slots(paging, slots, nr);
+    for ( i = 0; i < nr; i = j )
     {
-        slot = paging->free_slot_stack[--paging->stack_count];
-        rc = evict_victim(paging, slot);
-        if ( rc )
+        for ( j = i + 1; j < nr && slots[j] == slots[j - 1] + 1; j++ )
+            ;
+
+        if ( write_pages(paging->fd, pages + ((size_t)i << PAGE_SHIFT),
+                         slots[i], j - i) < 0 )
         {
-            num = rc < 0 ? -1 : num;
-            return num;
+            PERROR("Error copying pages to slots %d-%d", slots[i], slots[j - 1]);
+            munmap(pages, (size_t)nr << PAGE_SHIFT);
+            return -1;
         }
-        num++;
     }
 
-    /* Scan all slots slots for remainders */
-    for ( slot = 0; slot < paging->max_pages && num < num_pages; slot++ )
+    /* Release pages */
+    munmap(pages, (size_t)nr << PAGE_SHIFT);
+
+    for ( i = 0; i < nr; i++ )
     {
-        /* Slot is allocated */
-        if ( paging->slot_to_gfn[slot] )
-            continue;
+        gfn = gfns[i];
 
-        rc = evict_victim(paging, slot);
-        if ( rc )
+        /* Tell Xen to evict page */
+        rc = xc_mem_paging_evict(xch, paging->vm_event.domain_id, gfn);
+        if ( rc < 0 )
         {
-            num = rc < 0 ? -1 : num;
-            break;
+            /* A gfn in use is indicated by EBUSY */
+            if ( errno != EBUSY )
+            {
+                PERROR("Error evicting page %lx", gfn);
+                return -1;
+            }
+            DPRINTF("Nominated page %lx busy", gfn);
+
+            /* Record this free slot */
+            paging->free_slot_stack[paging->stack_count++] = slots[i];
+            continue;
         }
 
+        DPRINTF("evict_page > gfn %lx pageslot %d\n", gfn, slots[i]);
+        /* Notify policy of page being paged out */
+        policy_notify_paged_out(gfn);
+
+        /* Update index */
+        paging->slot_to_gfn[slots[i]] = gfn;
+        paging->gfn_to_slot[gfn] = slots[i];
+
+        /* Record number of evicted pages */
+        paging->num_paged_out++;
+        paging->num_evicted++;
+
+        if ( test_and_set_bit(gfn, paging->bitmap) )
+            ERROR("Page %lx has been evicted before", gfn);
+
         num++;
     }
+
     return num;
 }
 
+static void print_stats(struct xenpaging *paging)
+{
+    printf("domain %u: %d pages paged out, %lu evicted, %lu paged in"
+           " (%lu from read ahead)\n",
+           paging->vm_event.domain_id, paging->num_paged_out,
+           paging->num_evicted, paging->num_populated,
+           read_page_readahead_hits());
+    fflush(stdout);
+}
+
 int main(int argc, char *argv[])
 {
     struct sigaction act;
@@ -858,6 +898,7 @@ int main(int argc, char *argv[])
     int slot;
     int tot_pages;
     int rc;
+    time_t stats_time = time(NULL);
     xc_interface *xch;
 
     /* Initialise domain paging */
@@ -899,6 +940,16 @@ int main(int argc, char *argv[])
             DPRINTF("Got event from Xen\n");
         }
 
+        /* Let the policy handle its own events */
+        policy_poll(paging);
+
+        if ( paging->stats_interval > 0 &&
+             time(NULL) - stats_time >= paging->stats_interval )
+        {
+            print_stats(paging);
+            stats_time = time(NULL);
+        }
+
         while ( RING_HAS_UNCONSUMED_REQUESTS(&paging->vm_event.back_ring) )
         {
             /* Indicate possible error */
@@ -945,6 +996,9 @@ int main(int argc, char *argv[])
                 }
 
                 /* Prepare the response */
+                memset(&rsp, 0, sizeof(rsp));
+                rsp.version = VM_EVENT_INTERFACE_VERSION;
+                rsp.reason = req.reason;
                 rsp.u.mem_paging.gfn = req.u.mem_paging.gfn;
                 rsp.vcpu_id = req.vcpu_id;
                 rsp.flags = req.flags;
@@ -975,6 +1029,9 @@ int main(int argc, char *argv[])
                     ( req.u.mem_paging.flags & MEM_PAGING_EVICT_FAIL ))
                 {
                     /* Prepare the response */
+                    memset(&rsp, 0, sizeof(rsp));
+                    rsp.version = VM_EVENT_INTERFACE_VERSION;
+                    rsp.reason = req.reason;
                     rsp.u.mem_paging.gfn = req.u.mem_paging.gfn;
                     rsp.vcpu_id = req.vcpu_id;
                     rsp.flags = req.flags;
@@ -1030,10 +1087,10 @@ int main(int argc, char *argv[])
                 prev_num = num;
             }
             /* Limit the number of evicts to be able to process page-in requests */
-            if ( num > 42 )
+            if ( num > XENPAGING_EVICT_BATCH )
             {
                 paging->use_poll_timeout = 0;
-                num = 42;
+                num = XENPAGING_EVICT_BATCH;
             }
             if ( evict_pages(paging, num) < 0 )
                 goto out;
@@ -1063,6 +1120,9 @@ int main(int argc, char *argv[])
     DPRINTF("xenpaging got signal %d\n", interrupted);
 
  out:
+    if ( paging->stats_interval > 0 )
+        print_stats(paging);
+
     close(paging->fd);
     unlink_pagefile();
 
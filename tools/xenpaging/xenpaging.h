@@ -32,6 +32,8 @@
 #include <xen/vm_event.h>
 
 #define XENPAGING_PAGEIN_QUEUE_SIZE 64
+/* Maximum number of pages evicted at once */
+#define XENPAGING_EVICT_BATCH 64
 
 struct vm_event {
     domid_t domain_id;
@@ -65,8 +67,14 @@ struct xenpaging {
     int stack_count;
     int *free_slot_stack;
     unsigned long pagein_queue[XENPAGING_PAGEIN_QUEUE_SIZE];
+    int stats_interval;
+    unsigned long num_evicted;
+    unsigned long num_populated;
 };
 
+void get_request(struct vm_event *vm_event, vm_event_request_t *req);
+void put_response(struct vm_event *vm_event, vm_event_response_t *rsp);
+
 extern void create_page_in_thread(struct xenpaging *paging);
 extern void page_in_trigger(void);
 
@@ -20,6 +20,7 @@
  * Use is subject to license terms.
  */
 
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -60,7 +61,9 @@ static void xenstat_free_xen_version(xenstat_node * node);
 static void xenstat_free_vbds(xenstat_node * node);
 static void xenstat_uninit_vcpus(xenstat_handle * handle);
 static void xenstat_uninit_xen_version(xenstat_handle * handle);
-static char *xenstat_get_domain_name(xenstat_handle * handle, unsigned int domain_id);
+static void xenstat_check_names(xenstat_handle * handle);
+static void xenstat_drop_name(xenstat_handle * handle,
+			      struct xenstat_name_cache * entry);
 static void xenstat_prune_domain(xenstat_node *node, unsigned int entry);
 
 static xenstat_collector collectors[] = {
@@ -124,6 +127,9 @@ void xenstat_uninit(xenstat_handle * handle)
 	if (handle) {
 		for (i = 0; i < NUM_COLLECTORS; i++)
 			collectors[i].uninit(handle);
+		for (i = 0; i < handle->num_names; i++)
+			xenstat_drop_name(handle, &handle->names[i]);
+		free(handle->names);
 		xc_interface_close(handle->xc_handle);
 		xs_daemon_close(handle->xshandle);
 		free(handle->priv);
@@ -158,15 +164,169 @@ void domain_get_tmem_stats(xenstat_handle * handle, xenstat_domain * domain)
 	domain->tmem_stats.succ_pers_gets = parse(buffer,"Gp");
 }
 
+/*
+ * Domain names
+ *
+ * The names are kept in the handle between samples, in an array sorted by
+ * domain ID, and a xenstore watch on each name tells which of them have to
+ * be read again.  Sampling an unchanged set of domains therefore does not
+ * need any xenstore reads.  Each sample builds a new array while walking
+ * the (sorted) domain list, taking over the entries of the old one.
+ */
+#define NAME_WATCH_TOKEN "xenstat-name"
+
+struct name_sweep {
+	struct xenstat_name_cache *old;
+	unsigned int num_old;
+	unsigned int next;		/* First entry of old not yet taken over */
+	unsigned int max_names;		/* Size of the new array */
+};
+
+static void xenstat_name_path(char *path, size_t len, unsigned int domid)
+{
+	snprintf(path, len, "/local/domain/%u/name", domid);
+}
+
+static void xenstat_drop_name(xenstat_handle * handle,
+			      struct xenstat_name_cache * entry)
+{
+	char path[80];
+
+	if (entry->watched) {
+		xenstat_name_path(path, sizeof(path), entry->domid);
+		xs_unwatch(handle->xshandle, path, NAME_WATCH_TOKEN);
+	}
+	free(entry->name);
+}
+
+/* Mark the names which have been written since the last sample as stale */
+static void xenstat_check_names(xenstat_handle * handle)
+{
+	struct xenstat_name_cache *names = handle->names;
+	unsigned int domid, lo, hi, mid;
+	char **vec;
+
+	while ((vec = xs_check_watch(handle->xshandle)) != NULL) {
+		if (strcmp(vec[XS_WATCH_TOKEN], NAME_WATCH_TOKEN) == 0 &&
+		    sscanf(vec[XS_WATCH_PATH], "/local/domain/%u/name",
+			   &domid) == 1) {
+			lo = 0;
+			hi = handle->num_names;
+			while (lo < hi) {
+				mid = lo + (hi - lo) / 2;
+				if (names[mid].domid < domid)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			if (lo < handle->num_names && names[lo].domid == domid)
+				names[lo].stale = 1;
+		}
+		free(vec);
+	}
+}
+
+static void xenstat_start_name_sweep(xenstat_handle * handle,
+				     struct name_sweep * sweep)
+{
+	xenstat_check_names(handle);
+
+	sweep->old = handle->names;
+	sweep->num_old = handle->num_names;
+	sweep->next = 0;
+	sweep->max_names = 0;
+	handle->names = NULL;
+	handle->num_names = 0;
+}
+
+/* Forget the domains which have not been found in this sample */
+static void xenstat_end_name_sweep(xenstat_handle * handle,
+				   struct name_sweep * sweep)
+{
+	while (sweep->next < sweep->num_old)
+		xenstat_drop_name(handle, &sweep->old[sweep->next++]);
+	free(sweep->old);
+	sweep->old = NULL;
+	sweep->num_old = 0;
+}
+
+/* Get a copy of the name of a domain, from the cache if it is up to date.
+ * Has to be called in order of domain IDs. */
+static char *xenstat_get_domain_name(xenstat_handle * handle,
+				     const xc_domaininfo_t * info,
+				     struct name_sweep * sweep)
+{
+	struct xenstat_name_cache *entry, *old, *tmp;
+	char path[80];
+	int err;
+
+	/* Domains before this one in the old array have gone away */
+	while (sweep->next < sweep->num_old &&
+	       sweep->old[sweep->next].domid < info->domain)
+		xenstat_drop_name(handle, &sweep->old[sweep->next++]);
+
+	if (handle->num_names == sweep->max_names) {
+		sweep->max_names = sweep->max_names ? 2 * sweep->max_names
+			: sweep->num_old + 16;
+		tmp = realloc(handle->names,
+			      sweep->max_names * sizeof(*handle->names));
+		if (tmp == NULL)
+			return NULL;
+		handle->names = tmp;
+	}
+
+	xenstat_name_path(path, sizeof(path), info->domain);
+	entry = &handle->names[handle->num_names];
+	old = sweep->next < sweep->num_old ? &sweep->old[sweep->next] : NULL;
+
+	if (old != NULL && old->domid == info->domain &&
+	    memcmp(old->uuid, info->handle, sizeof(old->uuid)) == 0) {
+		*entry = *old;
+		sweep->next++;
+	} else {
+		/* A new domain, possibly reusing the ID of an old one */
+		if (old != NULL && old->domid == info->domain) {
+			xenstat_drop_name(handle, old);
+			sweep->next++;
+		}
+		memset(entry, 0, sizeof(*entry));
+		entry->domid = info->domain;
+		memcpy(entry->uuid, info->handle, sizeof(entry->uuid));
+		/* The watch fires once when set, which makes the next
+		 * sample read the name again.  That is harmless. */
+		entry->watched = xs_watch(handle->xshandle, path,
+					  NAME_WATCH_TOKEN);
+	}
+
+	/* Without a watch the name has to be read every time */
+	if (entry->name == NULL || entry->stale || !entry->watched) {
+		free(entry->name);
+		entry->stale = 0;
+		entry->name = xs_read(handle->xshandle, XBT_NULL, path, NULL);
+		if (entry->name == NULL) {
+			err = errno;
+			xenstat_drop_name(handle, entry);
+			errno = err;
+			return NULL;
+		}
+	}
+
+	handle->num_names++;
+
+	return strdup(entry->name);
+}
+
 xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 {
 #define DOMAIN_CHUNK_SIZE 256
 	xenstat_node *node;
 	xc_physinfo_t physinfo = { 0 };
 	xc_domaininfo_t domaininfo[DOMAIN_CHUNK_SIZE];
+	struct name_sweep sweep;
+	unsigned int next_domid = 0;
 	int new_domains;
 	unsigned int i;
-	int rc;
+	int rc = -1;
 
 	/* Create the node */
 	node = (xenstat_node *) calloc(1, sizeof(xenstat_node));
@@ -190,8 +350,15 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 	node->free_mem = ((unsigned long long)physinfo.free_pages)
 	    * handle->page_size;
 
-	rc = xc_tmem_control(handle->xc_handle, -1,
-                         XEN_SYSCTL_TMEM_OP_QUERY_FREEABLE_MB, -1, 0, 0, NULL);
+	/* Without tmem in the hypervisor there is no point in asking for the
+	 * tmem statistics of each domain. */
+	if (!handle->no_tmem) {
+		rc = xc_tmem_control(handle->xc_handle, -1,
+				     XEN_SYSCTL_TMEM_OP_QUERY_FREEABLE_MB,
+				     -1, 0, 0, NULL);
+		if (rc < 0 && errno == ENOSYS)
+			handle->no_tmem = 1;
+	}
 	node->freeable_mb = (rc < 0) ? 0 : rc;
 	/* malloc(0) is not portable, so allocate a single domain.  This will
 	 * be resized below. */
@@ -202,15 +369,20 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 	}
 
 	node->num_domains = 0;
+	xenstat_start_name_sweep(handle, &sweep);
 	do {
 		xenstat_domain *domain, *tmp;
 
+		/* Domain IDs are not contiguous, so continue after the last
+		 * one found.  This keeps the domains sorted by ID. */
 		new_domains = xc_domain_getinfolist(handle->xc_handle,
-						    node->num_domains, 
-						    DOMAIN_CHUNK_SIZE, 
+						    next_domid,
+						    DOMAIN_CHUNK_SIZE,
 						    domaininfo);
 		if (new_domains < 0)
 			goto err;
+		if (new_domains > 0)
+			next_domid = domaininfo[new_domains - 1].domain + 1;
 
 		tmp = realloc(node->domains,
 			      (node->num_domains + new_domains)
@@ -228,11 +400,15 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 		for (i = 0; i < new_domains; i++) {
 			/* Fill in domain using domaininfo[i] */
 			domain->id = domaininfo[i].domain;
-			domain->name = xenstat_get_domain_name(handle, 
-							       domain->id);
+			memcpy(domain->uuid, domaininfo[i].handle,
+			       sizeof(domain->uuid));
+			domain->name = xenstat_get_domain_name(handle,
+							       &domaininfo[i],
+							       &sweep);
 			if (domain->name == NULL) {
 				if (errno == ENOMEM) {
 					/* fatal error */
+					xenstat_end_name_sweep(handle, &sweep);
 					xenstat_free_node(node);
 					return NULL;
 				}
@@ -260,13 +436,15 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 			domain->networks = NULL;
 			domain->num_vbds = 0;
 			domain->vbds = NULL;
-			domain_get_tmem_stats(handle,domain);
+			if (!handle->no_tmem)
+				domain_get_tmem_stats(handle,domain);
 
 			domain++;
 			node->num_domains++;
 		}
 	} while (new_domains == DOMAIN_CHUNK_SIZE);
 
+	xenstat_end_name_sweep(handle, &sweep);
 
 	/* Run all the extra data collectors requested */
 	node->flags = 0;
@@ -282,6 +460,9 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 
 	return node;
 err:
+	xenstat_end_name_sweep(handle, &sweep);
+	for (i = 0; i < node->num_domains; i++)
+		free(node->domains[i].name);
 	free(node->domains);
 	free(node);
 	return NULL;
@@ -308,17 +489,32 @@ void xenstat_free_node(xenstat_node * node)
 
 xenstat_domain *xenstat_node_domain(xenstat_node * node, unsigned int domid)
 {
-	unsigned int i;
+	unsigned int lo = 0, hi = node->num_domains, mid;
 
-	/* FIXME: binary search */
-	/* Find the appropriate domain entry in the node struct. */
-	for (i = 0; i < node->num_domains; i++) {
-		if (node->domains[i].id == domid)
-			return &(node->domains[i]);
+	/* The domains are sorted by ID, as returned by the hypervisor. */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (node->domains[mid].id < domid)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
+	if (lo < node->num_domains && node->domains[lo].id == domid)
+		return &(node->domains[lo]);
 	return NULL;
 }
 
+xenstat_domain *xenstat_node_domain_prev(xenstat_node * prev,
+					 xenstat_domain * domain)
+{
+	xenstat_domain *old = xenstat_node_domain(prev, domain->id);
+
+	if (old == NULL ||
+	    memcmp(old->uuid, domain->uuid, sizeof(old->uuid)) != 0)
+		return NULL;
+	return old;
+}
+
 xenstat_domain *xenstat_node_domain_by_index(xenstat_node * node,
 					     unsigned int index)
 {
@@ -763,15 +959,6 @@ unsigned long long xenstat_tmem_succ_pers_gets(xenstat_tmem *tmem)
 }
 
 
-static char *xenstat_get_domain_name(xenstat_handle *handle, unsigned int domain_id)
-{
-	char path[80];
-
-	snprintf(path, sizeof(path),"/local/domain/%i/name", domain_id);
-
-	return xs_read(handle->xshandle, XBT_NULL, path, NULL);
-}
-
 /* Remove specified entry from list of domains */
 static void xenstat_prune_domain(xenstat_node *node, unsigned int entry)
 {
@@ -57,6 +57,12 @@ void xenstat_free_node(xenstat_node * node);
 xenstat_domain *xenstat_node_domain(xenstat_node * node,
 				    unsigned int domid);
 
+/* Get the entry of a domain in an earlier node obtained from the same
+ * handle, to compute the change of its counters between the two samples.
+ * Returns NULL if the domain did not exist yet, even if its ID did. */
+xenstat_domain *xenstat_node_domain_prev(xenstat_node * prev,
+					 xenstat_domain * domain);
+
 /* Get the domain with the given index; used to loop over all domains. */
 xenstat_domain *xenstat_node_domain_by_index(xenstat_node * node,
 					     unsigned index);
@@ -34,9 +34,25 @@
 
 #define SYSFS_VBD_PATH "/sys/bus/xen-backend/devices"
 
+/* What is known about an interface listed in /proc/net/dev */
+struct iface_info {
+	char name[16];
+	unsigned int domid;
+	unsigned int netid;
+	int is_vif;
+	unsigned int seen;	/* Position in this pass, 0 if not (yet) seen */
+};
+
 struct priv_data {
 	FILE *procnetdev;
 	DIR *sysfsvbd;
+	regex_t netdev_regex;
+	int have_netdev_regex;
+	struct iface_info *ifaces;	/* Interfaces from the last pass */
+	unsigned int num_ifaces;
+	unsigned int max_ifaces;
+	char bridge[16];
+	int rescan_bridge;
 };
 
 static struct priv_data *
@@ -45,12 +61,11 @@ get_priv_data(xenstat_handle *handle)
 	if (handle->priv != NULL)
 		return handle->priv;
 
-	handle->priv = malloc(sizeof(struct priv_data));
+	handle->priv = calloc(1, sizeof(struct priv_data));
 	if (handle->priv == NULL)
 		return (NULL);
 
-	((struct priv_data *)handle->priv)->procnetdev = NULL;
-	((struct priv_data *)handle->priv)->sysfsvbd = NULL;
+	((struct priv_data *)handle->priv)->rescan_bridge = 1;
 
 	return handle->priv;
 }
@@ -72,6 +87,8 @@ void getBridge(char *excludeName, char *result, size_t resultLen)
 	char tmp[256] = { 0 };
 
 	d = opendir("/sys/class/net");
+	if (d == NULL)
+		return;
 	while ((de = readdir(d)) != NULL) {
 		if ((strlen(de->d_name) > 0) && (de->d_name[0] != '.')
 			&& (strstr(de->d_name, excludeName) == NULL)) {
@@ -89,7 +106,7 @@ void getBridge(char *excludeName, char *result, size_t resultLen)
 
 /* parseNetLine provides regular expression based parsing for lines from /proc/net/dev, all the */
 /* information are parsed but not all are used in our case, ie. for xenstat */
-int parseNetDevLine(char *line, char *iface, unsigned long long *rxBytes, unsigned long long *rxPackets,
+int parseNetDevLine(regex_t *r, char *line, char *iface, unsigned long long *rxBytes, unsigned long long *rxPackets,
 		unsigned long long *rxErrs, unsigned long long *rxDrops, unsigned long long *rxFifo,
 		unsigned long long *rxFrames, unsigned long long *rxComp, unsigned long long *rxMcast,
 		unsigned long long *txBytes, unsigned long long *txPackets, unsigned long long *txErrs,
@@ -97,18 +114,11 @@ int parseNetDevLine(char *line, char *iface, unsigned long long *rxBytes, unsign
 		unsigned long long *txCarrier, unsigned long long *txComp)
 {
 	/* Temporary/helper variables */
-	int ret;
 	char *tmp;
 	int i = 0, x = 0, col = 0;
-	regex_t r;
 	regmatch_t matches[19];
 	int num = 19;
 
-	/* Regular exception to parse all the information from /proc/net/dev line */
-	char *regex = "([^:]*):([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)"
-			"[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*"
-			"([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)";
-
 	/* Initialize all variables called has passed as non-NULL to zeros */
 	if (iface != NULL)
 		memset(iface, 0, sizeof(*iface));
@@ -145,13 +155,8 @@ int parseNetDevLine(char *line, char *iface, unsigned long long *rxBytes, unsign
 	if (txComp != NULL)
 		*txComp = 0;
 
-	if ((ret = regcomp(&r, regex, REG_EXTENDED))) {
-		regfree(&r);
-		return ret;
-	}
-
 	tmp = (char *)malloc( sizeof(char) );
-	if (regexec (&r, line, num, matches, REG_EXTENDED) == 0){
+	if (regexec (r, line, num, matches, REG_EXTENDED) == 0){
 		for (i = 1; i < num; i++) {
 			/* The expression matches are empty sometimes so we need to check it first */
 			if (matches[i].rm_eo - matches[i].rm_so > 0) {
@@ -231,7 +236,6 @@ int parseNetDevLine(char *line, char *iface, unsigned long long *rxBytes, unsign
 	}
 
 	free(tmp);
-	regfree(&r);
 
 	return 0;
 }
@@ -259,13 +263,86 @@ static int get_iface_domid_network(const char *iface, unsigned int *domid_p, uns
 	return 0;
 }
 
+/* Find out what an interface is, from the result of an earlier pass over
+ * /proc/net/dev if there is one.  The interfaces are listed in the same
+ * order every time, so the entry following the previous one is tried
+ * first.  Returns NULL on allocation failure. */
+static struct iface_info *get_iface_info(struct priv_data *priv,
+					 const char *iface, unsigned int pos,
+					 unsigned int *hint, int *changed)
+{
+	struct iface_info *info, *tmp;
+	unsigned int i;
+
+	if (*hint < priv->num_ifaces &&
+	    strcmp(priv->ifaces[*hint].name, iface) == 0)
+		i = *hint;
+	else
+		for (i = 0; i < priv->num_ifaces; i++)
+			if (strcmp(priv->ifaces[i].name, iface) == 0)
+				break;
+
+	if (i == priv->num_ifaces) {
+		if (priv->num_ifaces == priv->max_ifaces) {
+			priv->max_ifaces = priv->max_ifaces
+				? 2 * priv->max_ifaces : 32;
+			tmp = realloc(priv->ifaces, priv->max_ifaces *
+				      sizeof(*priv->ifaces));
+			if (tmp == NULL)
+				return NULL;
+			priv->ifaces = tmp;
+		}
+		info = &priv->ifaces[priv->num_ifaces++];
+		strncpy(info->name, iface, sizeof(info->name) - 1);
+		info->name[sizeof(info->name) - 1] = '\0';
+		info->is_vif = get_iface_domid_network(iface, &info->domid,
+						       &info->netid);
+		*changed = 1;
+	} else
+		info = &priv->ifaces[i];
+
+	/* Out of order, so the array needs sorting at the end of the pass. */
+	if (i != *hint)
+		*changed = 1;
+	info->seen = pos;
+	*hint = i + 1;
+
+	return info;
+}
+
+static int compare_iface_seen(const void *a, const void *b)
+{
+	const struct iface_info *ia = a, *ib = b;
+
+	/* Entries not seen in this pass go last. */
+	if (ia->seen == ib->seen)
+		return 0;
+	if (ia->seen == 0)
+		return 1;
+	if (ib->seen == 0)
+		return -1;
+	return ia->seen < ib->seen ? -1 : 1;
+}
+
+/* Put the interfaces into the order of the last pass and forget those
+ * which have gone away. */
+static void sort_ifaces(struct priv_data *priv)
+{
+	qsort(priv->ifaces, priv->num_ifaces, sizeof(*priv->ifaces),
+	      compare_iface_seen);
+	while (priv->num_ifaces && priv->ifaces[priv->num_ifaces - 1].seen == 0)
+		priv->num_ifaces--;
+}
+
 /* Collect information about networks */
 int xenstat_collect_networks(xenstat_node * node)
 {
 	/* Helper variables for parseNetDevLine() function defined above */
 	int i;
-	char line[512] = { 0 }, iface[16] = { 0 }, devBridge[16] = { 0 }, devNoBridge[16] = { 0 };
+	char line[512] = { 0 }, iface[16] = { 0 }, devNoBridge[17] = { 0 };
 	unsigned long long rxBytes, rxPackets, rxErrs, rxDrops, txBytes, txPackets, txErrs, txDrops;
+	unsigned int pos = 0, hint = 0;
+	int changed = 0, bridge_scanned = 0;
 
 	struct priv_data *priv = get_priv_data(node->handle);
 
@@ -297,26 +374,59 @@ int xenstat_collect_networks(xenstat_node * node)
 		}
 	}
 
+	/* Regular expression to parse all the information from a /proc/net/dev line */
+	if (!priv->have_netdev_regex) {
+		if (regcomp(&priv->netdev_regex,
+			    "([^:]*):([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)"
+			    "[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*"
+			    "([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)",
+			    REG_EXTENDED)) {
+			fprintf(stderr, "Error compiling /proc/net/dev regex\n");
+			return 0;
+		}
+		priv->have_netdev_regex = 1;
+	}
+
 	/* Fill in networks */
-	/* FIXME: optimize this */
 	fseek(priv->procnetdev, sizeof(PROCNETDEV_HEADER) - 1,
 	      SEEK_SET);
 
-	/* We get the bridge devices for use with bonding interface to get bonding interface stats */
-	getBridge("vir", devBridge, sizeof(devBridge));
-	snprintf(devNoBridge, 16, "p%s", devBridge);
+	/* We get the bridge devices for use with bonding interface to get bonding interface stats.
+	 * They only need to be looked for again when the set of interfaces changes. */
+	if (priv->rescan_bridge) {
+		priv->bridge[0] = '\0';
+		getBridge("vir", priv->bridge, sizeof(priv->bridge));
+		bridge_scanned = 1;
+	}
+	snprintf(devNoBridge, sizeof(devNoBridge), "p%s", priv->bridge);
 
 	while (fgets(line, 512, priv->procnetdev)) {
 		xenstat_domain *domain;
 		xenstat_network net;
+		struct iface_info *info;
 		unsigned int domid;
 
-		parseNetDevLine(line, iface, &rxBytes, &rxPackets, &rxErrs, &rxDrops, NULL, NULL, NULL,
-				NULL, &txBytes, &txPackets, &txErrs, &txDrops, NULL, NULL, NULL, NULL);
+		parseNetDevLine(&priv->netdev_regex, line, iface, &rxBytes, &rxPackets, &rxErrs, &rxDrops,
+				NULL, NULL, NULL, NULL, &txBytes, &txPackets, &txErrs, &txDrops, NULL, NULL,
+				NULL, NULL);
+
+		info = get_iface_info(priv, iface, ++pos, &hint, &changed);
+		if (info == NULL) {
+			perror("Allocation error");
+			return 0;
+		}
+
+		/* A new interface may be a new bridge */
+		if (changed && !bridge_scanned) {
+			priv->bridge[0] = '\0';
+			getBridge("vir", priv->bridge, sizeof(priv->bridge));
+			snprintf(devNoBridge, sizeof(devNoBridge), "p%s", priv->bridge);
+			bridge_scanned = 1;
+		}
 
 		/* If the device parsed is network bridge and both tx & rx packets are zero, we are most */
 		/* likely using bonding so we alter the configuration for dom0 to have bridge stats */
-		if ((strstr(iface, devBridge) != NULL) &&
+		if ((strstr(iface, priv->bridge) != NULL) &&
 		    (strstr(iface, devNoBridge) == NULL) &&
 		    ((domain = xenstat_node_domain(node, 0)) != NULL)) {
 			for (i = 0; i < domain->num_networks; i++) {
@@ -335,7 +445,9 @@ int xenstat_collect_networks(xenstat_node * node)
 			}
 		}
 		else /* Otherwise we need to preserve old behaviour */
-		if (get_iface_domid_network(iface, &domid, &net.id)) {
+		if (info->is_vif) {
+			domid = info->domid;
+			net.id = info->netid;
 
 			net.tbytes = txBytes;
 			net.tpackets = txPackets;
@@ -346,13 +458,15 @@ int xenstat_collect_networks(xenstat_node * node)
 			net.rerrs = rxErrs;
 			net.rdrop = rxDrops;
 
-		/* FIXME: this does a search for the domid */
 		  domain = xenstat_node_domain(node, domid);
 		  if (domain == NULL) {
 			fprintf(stderr,
 				"Found interface vif%u.%u but domain %u"
 				" does not exist.\n", domid, net.id,
 				domid);
+			/* Look at the interface again next time */
+			info->seen = 0;
+			changed = 1;
 			continue;
 		  }
 		  if (domain->networks == NULL) {
@@ -374,6 +488,13 @@ int xenstat_collect_networks(xenstat_node * node)
           }
         }
 
+	/* Interfaces may also have gone away, bridges among them. */
+	if (pos != priv->num_ifaces)
+		changed = 1;
+	if (changed)
+		sort_ifaces(priv);
+	priv->rescan_bridge = changed;
+
 	return 1;
 }
 
@@ -383,6 +504,10 @@ void xenstat_uninit_networks(xenstat_handle * handle)
 	struct priv_data *priv = get_priv_data(handle);
 	if (priv != NULL && priv->procnetdev != NULL)
 		fclose(priv->procnetdev);
+	if (priv != NULL && priv->have_netdev_regex)
+		regfree(&priv->netdev_regex);
+	if (priv != NULL)
+		free(priv->ifaces);
 }
 
 static int read_attributes_vbd(const char *vbd_directory, const char *what, char *ret, int cap)
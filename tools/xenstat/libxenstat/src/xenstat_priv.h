@@ -32,12 +32,24 @@
 #define SHORT_ASC_LEN 5                 /* length of 65535 */
 #define VERSION_SIZE (2 * SHORT_ASC_LEN + 1 + sizeof(xen_extraversion_t) + 1)
 
+/* Domain name, kept in the handle between samples */
+struct xenstat_name_cache {
+	unsigned int domid;
+	xen_domain_handle_t uuid;	/* To notice reuse of the domain ID */
+	char *name;
+	int watched;			/* A watch on the name is registered */
+	int stale;			/* Name written since it was read */
+};
+
 struct xenstat_handle {
 	xc_interface *xc_handle;
 	struct xs_handle *xshandle; /* xenstore handle */
 	int page_size;
 	void *priv;
 	char xen_version[VERSION_SIZE]; /* xen version running on this node */
+	struct xenstat_name_cache *names; /* Array sorted by domain ID */
+	unsigned int num_names;
+	int no_tmem;			/* Hypervisor built without tmem */
 };
 
 struct xenstat_node {
@@ -61,6 +73,7 @@ struct xenstat_tmem {
 
 struct xenstat_domain {
 	unsigned int id;
+	xen_domain_handle_t uuid;
 	char *name;
 	unsigned int state;
 	unsigned long long cpu_ns;
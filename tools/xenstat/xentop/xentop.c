@@ -510,7 +510,7 @@ static double get_cpu_pct(xenstat_domain *domain)
 	if(prev_node == NULL)
 		return 0.0;
 
-	old_domain = xenstat_node_domain(prev_node, xenstat_domain_id(domain));
+	old_domain = xenstat_node_domain_prev(prev_node, domain);
 	if(old_domain == NULL)
 		return 0.0;
 
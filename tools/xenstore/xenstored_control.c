@@ -127,6 +127,22 @@ static int do_control_print(void *ctx, struct connection *conn,
 	return 0;
 }
 
+static int do_control_snapshot(void *ctx, struct connection *conn,
+			       char **vec, int num)
+{
+	int ret;
+
+	if (num > 1)
+		return EINVAL;
+
+	ret = snapshot_store(num ? vec[0] : NULL);
+	if (ret)
+		return ret;
+
+	send_ack(conn, XS_CONTROL);
+	return 0;
+}
+
 static int do_control_help(void *, struct connection *, char **, int);
 
 static struct cmd_s cmds[] = {
@@ -135,6 +151,7 @@ static struct cmd_s cmds[] = {
 	{ "logfile", do_control_logfile, "<file>" },
 	{ "memreport", do_control_memreport, "[<file>]" },
 	{ "print", do_control_print, "<string>" },
+	{ "snapshot", do_control_snapshot, "[<file>]" },
 	{ "help", do_control_help, "" },
 };
 
@@ -52,6 +52,7 @@
 #include "xenstored_transaction.h"
 #include "xenstored_domain.h"
 #include "xenstored_control.h"
+#include "xenstored_db.h"
 #include "tdb.h"
 
 #include "hashtable.h"
@@ -81,9 +82,10 @@ static bool recovery = true;
 static int reopen_log_pipe[2];
 static int reopen_log_pipe0_pollfd_idx = -1;
 char *tracefile = NULL;
-static TDB_CONTEXT *tdb_ctx = NULL;
+static char *snapshot_file;
+static unsigned int snapshot_interval;
+static time_t last_snapshot;
 
-static void corrupt(struct connection *conn, const char *fmt, ...);
 static const char *sockmsg_string(enum xsd_sockmsg_type type);
 
 #define log(...)							\
@@ -105,24 +107,6 @@ int quota_nb_watch_per_domain = 128;
 int quota_max_entry_size = 2048; /* 2K */
 int quota_max_transaction = 10;
 
-TDB_CONTEXT *tdb_context(struct connection *conn)
-{
-	/* conn = NULL used in manual_node at setup. */
-	if (!conn || !conn->transaction)
-		return tdb_ctx;
-	return tdb_transaction_context(conn->transaction);
-}
-
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb)
-{
-	if (!(tdb_ctx->flags & TDB_INTERNAL))
-		if (rename(newname, xs_daemon_tdb()) != 0)
-			return false;
-	tdb_close(tdb_ctx);
-	tdb_ctx = talloc_steal(talloc_autofree_context(), newtdb);
-	return true;
-}
-
 void trace(const char *fmt, ...)
 {
 	va_list arglist;
@@ -380,19 +364,14 @@ static struct node *read_node(struct connection *conn, const void *ctx,
 	TDB_DATA key, data;
 	struct xs_tdb_record_hdr *hdr;
 	struct node *node;
-	TDB_CONTEXT * context = tdb_context(conn);
 
-	key.dptr = (void *)name;
-	key.dsize = strlen(name);
-	data = tdb_fetch(context, key);
+	if (transaction_node_key(conn, ctx, name, NODE_ACCESS_READ, &key))
+		return NULL;
+	data = db_lookup(key.dptr);
 
 	if (data.dptr == NULL) {
-		if (tdb_error(context) == TDB_ERR_NOEXIST)
-			errno = ENOENT;
-		else {
-			log("TDB error on read: %s", tdb_errorstr(context));
-			errno = EIO;
-		}
+		transaction_node_read(conn, name, NO_GENERATION, data);
+		errno = ENOENT;
 		return NULL;
 	}
 
@@ -402,14 +381,15 @@ static struct node *read_node(struct connection *conn, const void *ctx,
 		return NULL;
 	}
 	node->name = talloc_strdup(node, name);
-	if (!node->name) {
+	/* The stored record changes with the next write: take a copy. */
+	data.dptr = talloc_memdup(node, data.dptr, data.dsize);
+	if (!node->name || !data.dptr) {
 		talloc_free(node);
 		errno = ENOMEM;
 		return NULL;
 	}
 	node->parent = NULL;
-	node->tdb = tdb_context(conn);
-	talloc_steal(node, data.dptr);
+	node->db_key = NULL;
 
 	/* Datalen, childlen, number of permissions */
 	hdr = (void *)data.dptr;
@@ -425,6 +405,8 @@ static struct node *read_node(struct connection *conn, const void *ctx,
 	/* Children is strings, nul separated. */
 	node->children = node->data + node->datalen;
 
+	transaction_node_read(conn, name, node->generation, data);
+
 	return node;
 }
 
@@ -432,16 +414,13 @@ static bool write_node(struct connection *conn, struct node *node)
 {
 	/*
 	 * conn will be null when this is called from manual_node.
-	 * tdb_context copes with this.
+	 * transaction_node_key copes with this.
 	 */
 
 	TDB_DATA key, data;
 	void *p;
 	struct xs_tdb_record_hdr *hdr;
 
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
-
 	data.dsize = sizeof(*hdr)
 		+ node->num_perms*sizeof(node->perms[0])
 		+ node->datalen + node->childlen;
@@ -449,6 +428,11 @@ static bool write_node(struct connection *conn, struct node *node)
 	if (domain_is_unprivileged(conn) && data.dsize >= quota_max_entry_size)
 		goto error;
 
+	if (transaction_node_key(conn, node, node->name, NODE_ACCESS_WRITE,
+				 &key))
+		return false;
+	node->db_key = key.dptr;
+
 	add_change_node(conn, node, false);
 
 	data.dptr = talloc_size(node, data.dsize);
@@ -464,8 +448,8 @@ static bool write_node(struct connection *conn, struct node *node)
 	p += node->datalen;
 	memcpy(p, node->children, node->childlen);
 
-	/* TDB should set errno, but doesn't even set ecode AFAICT. */
-	if (tdb_store(tdb_context(conn), key, data, TDB_REPLACE) != 0) {
+	/* The store takes over data.dptr, even on failure. */
+	if (db_store(key.dptr, data) != 0) {
 		corrupt(conn, "Write of %s failed", key.dptr);
 		goto error;
 	}
@@ -898,11 +882,17 @@ static void delete_node_single(struct connection *conn, struct node *node,
 			       bool changed)
 {
 	TDB_DATA key;
+	int ret;
 
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
+	ret = transaction_node_key(conn, node, node->name, NODE_ACCESS_DELETE,
+				   &key);
+	if (ret < 0) {
+		corrupt(conn, "Could not delete '%s'", node->name);
+		return;
+	}
 
-	if (tdb_delete(tdb_context(conn), key) != 0) {
+	/* Within a transaction, there may be no copy of the node to delete. */
+	if (ret == 0 && db_delete(key.dptr) != 0) {
 		corrupt(conn, "Could not delete '%s'", node->name);
 		return;
 	}
@@ -951,7 +941,7 @@ static struct node *construct_node(struct connection *conn, const void *ctx,
 
 	/* Allocate node */
 	node = talloc(ctx, struct node);
-	node->tdb = tdb_context(conn);
+	node->db_key = NULL;
 	node->name = talloc_strdup(node, name);
 
 	/* Inherit permissions, except unprivileged domains own what they create */
@@ -972,15 +962,12 @@ static struct node *construct_node(struct connection *conn, const void *ctx,
 static int destroy_node(void *_node)
 {
 	struct node *node = _node;
-	TDB_DATA key;
 
 	if (streq(node->name, "/"))
 		corrupt(NULL, "Destroying root node!");
 
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
-
-	tdb_delete(node->tdb, key);
+	/* Delete the node from wherever write_node() put it. */
+	db_delete(node->db_key);
 	return 0;
 }
 
@@ -1497,8 +1484,6 @@ static void accept_connection(int sock, bool canwrite)
 }
 #endif
 
-static int tdb_flags;
-
 /* We create initial nodes manually. */
 static void manual_node(const char *name, const char *child)
 {
@@ -1521,7 +1506,7 @@ static void manual_node(const char *name, const char *child)
 	talloc_free(node);
 }
 
-static void tdb_logger(TDB_CONTEXT *tdb, int level, const char * fmt, ...)
+void tdb_logger(TDB_CONTEXT *tdb, int level, const char * fmt, ...)
 {
 	va_list ap;
 	char *s;
@@ -1542,30 +1527,68 @@ static void tdb_logger(TDB_CONTEXT *tdb, int level, const char * fmt, ...)
 	}
 }
 
-static void setup_structure(void)
+/*
+ * Write the store to a tdb file.  Without a file name, use the default
+ * one (unless running with --internal-db).
+ */
+int snapshot_store(const char *filename)
 {
-	char *tdbname;
-	tdbname = talloc_strdup(talloc_autofree_context(), xs_daemon_tdb());
-	if (!tdbname)
-		barf_perror("Could not create tdbname");
+	if (!filename)
+		filename = snapshot_file;
+	if (!filename)
+		return EINVAL;
+
+	if (db_snapshot(filename) != 0) {
+		log("Could not write snapshot %s: %s", filename,
+		    strerror(errno));
+		return errno;
+	}
+
+	if (filename == snapshot_file)
+		last_snapshot = time(NULL);
+
+	return 0;
+}
+
+/* Write periodic snapshots, returns the poll timeout until the next one. */
+static int snapshot_timeout(int timeout)
+{
+	time_t now, next;
+
+	if (!snapshot_file || !snapshot_interval || !db_modified())
+		return timeout;
+
+	now = time(NULL);
+	next = last_snapshot + snapshot_interval;
+	if (now >= next) {
+		snapshot_store(NULL);
+		return timeout;
+	}
+
+	if (timeout < 0 || timeout > (next - now) * 1000)
+		timeout = (next - now) * 1000;
 
-	if (!(tdb_flags & TDB_INTERNAL))
-		unlink(tdbname);
+	return timeout;
+}
 
-	tdb_ctx = tdb_open_ex(tdbname, 7919, tdb_flags, O_RDWR|O_CREAT|O_EXCL,
-			      0640, &tdb_logger, NULL);
-	if (!tdb_ctx)
-		barf_perror("Could not create tdb file %s", tdbname);
+static void setup_structure(void)
+{
+	db_init();
 
 	manual_node("/", "tool");
 	manual_node("/tool", "xenstored");
 	manual_node("/tool/xenstored", NULL);
 
 	check_store();
+
+	if (snapshot_file) {
+		unlink(snapshot_file);
+		snapshot_store(NULL);
+	}
 }
 
 
-static unsigned int hash_from_key_fn(void *k)
+unsigned int hash_from_key_fn(void *k)
 {
 	char *str = k;
 	unsigned int hash = 5381;
@@ -1578,7 +1601,7 @@ static unsigned int hash_from_key_fn(void *k)
 }
 
 
-static int keys_equal_fn(void *key1, void *key2)
+int keys_equal_fn(void *key1, void *key2)
 {
 	return 0 == strcmp((char *)key1, (char *)key2);
 }
@@ -1711,26 +1734,21 @@ static int check_store_(const char *name, struct hashtable *reachable)
 /**
  * Helper to clean_store below.
  */
-static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
-			void *private)
+static int clean_store_(const char *name, TDB_DATA val, void *private)
 {
 	struct hashtable *reachable = private;
-	char * name = talloc_strndup(NULL, key.dptr, key.dsize);
 
-	if (!name) {
-		log("clean_store: ENOMEM");
-		return 1;
-	}
+	/* Nodes private to open transactions aren't reachable from "/". */
+	if (name[0] != '/')
+		return 0;
 
-	if (!hashtable_search(reachable, name)) {
+	if (!hashtable_search(reachable, (void *)name)) {
 		log("clean_store: '%s' is orphaned!", name);
 		if (recovery) {
-			tdb_delete(tdb, key);
+			db_delete(name);
 		}
 	}
 
-	talloc_free(name);
-
 	return 0;
 }
 
@@ -1741,7 +1759,7 @@ static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
  */
 static void clean_store(struct hashtable *reachable)
 {
-	tdb_traverse(tdb_ctx, &clean_store_, reachable);
+	db_traverse(&clean_store_, reachable);
 }
 
 
@@ -1768,7 +1786,7 @@ void check_store(void)
 
 
 /* Something is horribly wrong: check the store. */
-static void corrupt(struct connection *conn, const char *fmt, ...)
+void corrupt(struct connection *conn, const char *fmt, ...)
 {
 	va_list arglist;
 	char *str;
@@ -1873,7 +1891,10 @@ static void usage(void)
 "  -t, --transaction <nb>  limit the number of transaction allowed per domain,\n"
 "  -R, --no-recovery       to request that no recovery should be attempted when\n"
 "                          the store is corrupted (debug only),\n"
-"  -I, --internal-db       store database in memory, not on disk\n"
+"  -I, --internal-db       don't write snapshots of the database to disk,\n"
+"  -s, --snapshot-interval <secs>\n"
+"                          write modified database to disk every <secs>\n"
+"                          seconds (default is on request only),\n"
 "  -V, --verbose           to request verbose execution.\n");
 }
 
@@ -1893,6 +1914,7 @@ static struct option options[] = {
 	{ "transaction", 1, NULL, 't' },
 	{ "no-recovery", 0, NULL, 'R' },
 	{ "internal-db", 0, NULL, 'I' },
+	{ "snapshot-interval", 1, NULL, 's' },
 	{ "verbose", 0, NULL, 'V' },
 	{ "watch-nb", 1, NULL, 'W' },
 	{ NULL, 0, NULL, 0 } };
@@ -1911,9 +1933,10 @@ int main(int argc, char *argv[])
 	bool no_domain_init = false;
 	const char *pidfile = NULL;
 	int timeout;
+	bool internal_db = false;
 
 
-	while ((opt = getopt_long(argc, argv, "DE:F:HNPS:t:T:RVW:", options,
+	while ((opt = getopt_long(argc, argv, "DE:F:HINPS:s:t:T:RVW:", options,
 				  NULL)) != -1) {
 		switch (opt) {
 		case 'D':
@@ -1947,7 +1970,10 @@ int main(int argc, char *argv[])
 			tracefile = optarg;
 			break;
 		case 'I':
-			tdb_flags = TDB_INTERNAL|TDB_NOLOCK;
+			internal_db = true;
+			break;
+		case 's':
+			snapshot_interval = strtoul(optarg, NULL, 10);
 			break;
 		case 'V':
 			verbose = true;
@@ -1997,6 +2023,9 @@ int main(int argc, char *argv[])
 	init_pipe(reopen_log_pipe);
 
 	/* Setup the database */
+	if (!internal_db)
+		snapshot_file = talloc_strdup(talloc_autofree_context(),
+					      xs_daemon_tdb());
 	setup_structure();
 
 	/* Listen to hypervisor. */
@@ -2035,6 +2064,7 @@ int main(int argc, char *argv[])
 	for (;;) {
 		struct connection *conn, *next;
 
+		timeout = snapshot_timeout(timeout);
 		if (poll(fds, nr_fds, timeout) < 0) {
 			if (errno == EINTR)
 				continue;
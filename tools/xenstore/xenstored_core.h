@@ -107,8 +107,8 @@ extern struct list_head connections;
 struct node {
 	const char *name;
 
-	/* Database I came from */
-	TDB_CONTEXT *tdb;
+	/* Key I was last written under (differs within a transaction). */
+	char *db_key;
 
 	/* Parent (optional) */
 	struct node *parent;
@@ -151,18 +151,25 @@ struct node *get_node(struct connection *conn,
 		      const char *name,
 		      enum xs_perm_type perm);
 
-/* Get TDB context for this connection */
-TDB_CONTEXT *tdb_context(struct connection *conn);
+/* Logging function for tdb files written by xenstored. */
+void tdb_logger(TDB_CONTEXT *tdb, int level, const char *fmt, ...);
 
-/* Replace the tdb: required for transaction code */
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb);
+/* Something is horribly wrong: log it and check the store. */
+void corrupt(struct connection *conn, const char *fmt, ...);
 
 struct connection *new_connection(connwritefn_t *write, connreadfn_t *read);
 void check_store(void);
 
+/* Write the store to filename, or the default snapshot file if NULL. */
+int snapshot_store(const char *filename);
+
 /* Is this a valid node name? */
 bool is_valid_nodename(const char *node);
 
+/* Hash and compare functions for hashtables keyed by node names. */
+unsigned int hash_from_key_fn(void *k);
+int keys_equal_fn(void *key1, void *key2);
+
 /* Tracing infrastructure. */
 void trace_create(const void *data, const char *type);
 void trace_destroy(const void *data, const char *type);
@@ -0,0 +1,217 @@
+/*
+    In-memory node store for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "talloc.h"
+#include "list.h"
+#include "hashtable.h"
+#include "utils.h"
+#include "xenstored_core.h"
+#include "xenstored_db.h"
+
+/*
+ * The whole store used to live in a tdb, which is rebuilt on every start
+ * of xenstored anyway.  Each access had to go through tdb's locking and
+ * hashing and copy the record in or out.  Now records are held in a
+ * hashtable, and tdb is only used to write out snapshots of the store.
+ */
+struct db_entry {
+	/* All entries, for traversal and snapshots. */
+	struct list_head list;
+
+	/* Owned by the hashtable. */
+	char *key;
+
+	/* talloc child of the entry. */
+	TDB_DATA data;
+};
+
+static void *db_ctx;
+static struct hashtable *db_hash;
+static LIST_HEAD(db_entries);
+static bool modified;
+
+void db_init(void)
+{
+	db_ctx = talloc_init("node store");
+	db_hash = create_hashtable(7919, hash_from_key_fn, keys_equal_fn);
+	if (!db_ctx || !db_hash)
+		barf_perror("Could not create node store");
+}
+
+static struct db_entry *db_find(const char *key)
+{
+	return hashtable_search(db_hash, (void *)key);
+}
+
+TDB_DATA db_lookup(const char *key)
+{
+	struct db_entry *entry = db_find(key);
+	TDB_DATA data = { NULL, 0 };
+
+	if (!entry) {
+		errno = ENOENT;
+		return data;
+	}
+
+	return entry->data;
+}
+
+int db_store(const char *key, TDB_DATA data)
+{
+	struct db_entry *entry = db_find(key);
+
+	if (!entry) {
+		entry = talloc(db_ctx, struct db_entry);
+		if (!entry)
+			goto nomem;
+		entry->key = strdup(key);
+		if (!entry->key ||
+		    !hashtable_insert(db_hash, entry->key, entry)) {
+			free(entry->key);
+			talloc_free(entry);
+			goto nomem;
+		}
+		list_add_tail(&entry->list, &db_entries);
+	} else
+		talloc_free(entry->data.dptr);
+
+	entry->data.dptr = talloc_steal(entry, data.dptr);
+	entry->data.dsize = data.dsize;
+	if (key[0] == '/')
+		modified = true;
+
+	return 0;
+
+ nomem:
+	talloc_free(data.dptr);
+	errno = ENOMEM;
+	return -1;
+}
+
+static void db_remove(struct db_entry *entry)
+{
+	if (entry->key[0] == '/')
+		modified = true;
+	list_del(&entry->list);
+	/* Frees entry->key. */
+	hashtable_remove(db_hash, entry->key);
+	talloc_free(entry);
+}
+
+int db_delete(const char *key)
+{
+	struct db_entry *entry = db_find(key);
+
+	if (!entry) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	db_remove(entry);
+	return 0;
+}
+
+int db_traverse(int (*fn)(const char *key, TDB_DATA data, void *priv),
+		void *priv)
+{
+	struct db_entry *entry, *next;
+	int ret;
+
+	list_for_each_entry_safe(entry, next, &db_entries, list) {
+		ret = fn(entry->key, entry->data, priv);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+bool db_modified(void)
+{
+	return modified;
+}
+
+int db_snapshot(const char *filename)
+{
+	struct db_entry *entry;
+	TDB_CONTEXT *tdb;
+	TDB_DATA key;
+	char *tmpname;
+	int ret = -1, saved_errno;
+
+	tmpname = talloc_asprintf(NULL, "%s.new", filename);
+	if (!tmpname) {
+		errno = ENOMEM;
+		return -1;
+	}
+	unlink(tmpname);
+
+	tdb = tdb_open_ex(tmpname, 7919, TDB_NOLOCK, O_RDWR|O_CREAT|O_EXCL,
+			  0640, &tdb_logger, NULL);
+	if (!tdb)
+		goto out;
+
+	/* Only the nodes themselves, not private copies of transactions. */
+	list_for_each_entry(entry, &db_entries, list) {
+		if (entry->key[0] != '/')
+			continue;
+		key.dptr = entry->key;
+		key.dsize = strlen(entry->key);
+		if (tdb_store(tdb, key, entry->data, TDB_INSERT) != 0) {
+			errno = EIO;
+			goto close;
+		}
+	}
+
+	ret = 0;
+
+ close:
+	saved_errno = errno;
+	if (tdb_close(tdb) != 0 && !ret) {
+		saved_errno = EIO;
+		ret = -1;
+	}
+	if (!ret && rename(tmpname, filename) != 0) {
+		saved_errno = errno;
+		ret = -1;
+	}
+	if (ret)
+		unlink(tmpname);
+	else
+		modified = false;
+	errno = saved_errno;
+
+ out:
+	talloc_free(tmpname);
+	return ret;
+}
+
+/*
+ * Local variables:
+ *  c-file-style: "linux"
+ *  indent-tabs-mode: t
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ * End:
+ */
@@ -0,0 +1,57 @@
+/*
+    In-memory node store for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _XENSTORED_DB_H
+#define _XENSTORED_DB_H
+
+#include <stdbool.h>
+#include "tdb.h"
+
+/*
+ * Records are kept in memory in the same format as they used to be stored
+ * in tdb (struct xs_tdb_record_hdr followed by perms, data and children),
+ * keyed by the nul terminated node name.
+ */
+void db_init(void);
+
+/*
+ * Find a record.  The returned data is not a copy: it is only valid until
+ * the key is next stored or deleted.  If there is no such record, dptr is
+ * NULL and errno is ENOENT.
+ */
+TDB_DATA db_lookup(const char *key);
+
+/* Store a record, taking over data.dptr (which must be from talloc). */
+int db_store(const char *key, TDB_DATA data);
+
+/* Returns -1 and sets errno to ENOENT if there is no such record. */
+int db_delete(const char *key);
+
+/*
+ * Call fn for every record until it returns non-zero.  fn may delete the
+ * record it was called for, but no other one.
+ */
+int db_traverse(int (*fn)(const char *key, TDB_DATA data, void *priv),
+		void *priv);
+
+/* Have nodes been modified since the last snapshot? */
+bool db_modified(void);
+
+/* Write all nodes to a tdb file, e.g. for xs_tdb_dump. */
+int db_snapshot(const char *filename);
+
+#endif /* _XENSTORED_DB_H */
@@ -25,6 +25,7 @@
 #include <assert.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <inttypes.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include "talloc.h"
@@ -32,9 +33,46 @@
 #include "xenstored_transaction.h"
 #include "xenstored_watch.h"
 #include "xenstored_domain.h"
+#include "xenstored_db.h"
 #include "xenstore_lib.h"
 #include "utils.h"
 
+/*
+ * Transactions don't copy the database.  A node accessed by a transaction
+ * is copied, when first read or written, into the main tdb under a key
+ * private to the transaction: the node's name with the transaction's
+ * generation prepended.  Further accesses use the copy, so the transaction
+ * sees its own changes and is unaffected by others'.  Nodes it hasn't
+ * accessed are read from the main database.
+ *
+ * On commit, every node read is checked to still have the generation it had
+ * when read (or to still not exist).  If any has changed the transaction
+ * fails with EAGAIN, otherwise its changes are moved into place, each
+ * getting a new generation.  Transactions touching disjoint nodes thus
+ * commit independently.
+ */
+
+struct accessed_node
+{
+	/* List of all nodes accessed in the context of this transaction. */
+	struct list_head list;
+
+	/* The name of the node. */
+	char *node;
+
+	/* Generation when first read, NO_GENERATION if it didn't exist. */
+	uint64_t generation;
+
+	/* Was the node read before the transaction modified it? */
+	bool check_gen;
+
+	/* Has the transaction written or deleted the node? */
+	bool modified;
+
+	/* Is there a private copy of the node? */
+	bool ta_node;
+};
+
 struct changed_node
 {
 	/* List of all changed nodes in the context of this transaction. */
@@ -67,30 +105,156 @@ struct transaction
 	/* Connection-local identifier for this transaction. */
 	uint32_t id;
 
-	/* Generation when transaction started. */
+	/* Generation when transaction started, unique to the transaction. */
 	uint64_t generation;
 
 	/* Transaction internal generation. */
 	uint64_t trans_gen;
 
-	/* TDB to work on, and filename */
-	TDB_CONTEXT *tdb;
-	char *tdb_name;
+	/* List of accessed nodes. */
+	struct list_head accessed;
 
 	/* List of changed nodes. */
 	struct list_head changes;
 
 	/* List of changed domains - to record the changed domain entry number */
 	struct list_head changed_domains;
+
+	/* Something went wrong, so the transaction must fail. */
+	bool fail;
 };
 
 extern int quota_max_transaction;
 static uint64_t generation;
 
-/* Return tdb context to use for this connection. */
-TDB_CONTEXT *tdb_transaction_context(struct transaction *trans)
+static struct accessed_node *find_accessed_node(struct transaction *trans,
+						const char *name)
+{
+	struct accessed_node *i;
+
+	list_for_each_entry(i, &trans->accessed, list)
+		if (streq(i->node, name))
+			return i;
+
+	return NULL;
+}
+
+static struct accessed_node *add_accessed_node(struct transaction *trans,
+					       const char *name)
+{
+	struct accessed_node *i;
+
+	i = talloc_zero(trans, struct accessed_node);
+	if (!i)
+		return NULL;
+	i->node = talloc_strdup(i, name);
+	if (!i->node) {
+		talloc_free(i);
+		return NULL;
+	}
+	list_add_tail(&i->list, &trans->accessed);
+
+	return i;
+}
+
+/* Name of the transaction's private copy of a node. */
+static char *transaction_node_name(const void *ctx, struct transaction *trans,
+				   const char *name)
+{
+	return talloc_asprintf(ctx, "%"PRIu64"%s", trans->generation, name);
+}
+
+static void set_tdb_key(const char *name, TDB_DATA *key)
+{
+	key->dptr = (char *)name;
+	key->dsize = strlen(name);
+}
+
+int transaction_node_key(struct connection *conn, const void *ctx,
+			 const char *name, enum node_access_type type,
+			 TDB_DATA *key)
+{
+	struct transaction *trans;
+	struct accessed_node *i;
+	char *trans_name;
+	int ret = 0;
+
+	set_tdb_key(name, key);
+
+	if (!conn || !conn->transaction)
+		return 0;
+
+	trans = conn->transaction;
+	i = find_accessed_node(trans, name);
+
+	if (type == NODE_ACCESS_READ) {
+		/* Nodes not yet accessed are read from the main database. */
+		if (!i)
+			return 0;
+	} else {
+		if (!i) {
+			i = add_accessed_node(trans, name);
+			if (!i)
+				goto nomem;
+		}
+		if (type == NODE_ACCESS_DELETE && !i->ta_node)
+			ret = 1;
+		i->ta_node = (type == NODE_ACCESS_WRITE);
+		i->modified = true;
+	}
+
+	trans_name = transaction_node_name(ctx, trans, name);
+	if (!trans_name)
+		goto nomem;
+	set_tdb_key(trans_name, key);
+
+	return ret;
+
+ nomem:
+	/* All we can do is let the transaction fail. */
+	trans->fail = true;
+	errno = ENOMEM;
+	return -1;
+}
+
+void transaction_node_read(struct connection *conn, const char *name,
+			   uint64_t gen, TDB_DATA data)
 {
-	return trans->tdb;
+	struct transaction *trans;
+	struct accessed_node *i;
+	char *trans_name;
+
+	if (!conn || !conn->transaction)
+		return;
+
+	trans = conn->transaction;
+	if (find_accessed_node(trans, name))
+		return;
+
+	i = add_accessed_node(trans, name);
+	if (!i)
+		goto fail;
+	i->generation = gen;
+	i->check_gen = true;
+
+	if (gen == NO_GENERATION)
+		return;
+
+	trans_name = transaction_node_name(i, trans, name);
+	if (!trans_name)
+		goto fail;
+	/* The store takes over the copy. */
+	data.dptr = talloc_memdup(trans_name, data.dptr, data.dsize);
+	if (!data.dptr || db_store(trans_name, data) != 0)
+		goto fail;
+	i->ta_node = true;
+	talloc_free(trans_name);
+
+	return;
+
+ fail:
+	/* All we can do is let the transaction fail. */
+	trans->fail = true;
 }
 
 /* Callers get a change node (which can fail) and only commit after they've
@@ -121,13 +285,13 @@ void add_change_node(struct connection *conn, struct node *node, bool recurse)
 	i = talloc(trans, struct changed_node);
 	if (!i) {
 		/* All we can do is let the transaction fail. */
-		generation++;
+		trans->fail = true;
 		return;
 	}
 	i->node = talloc_strdup(i, node->name);
 	if (!i->node) {
 		/* All we can do is let the transaction fail. */
-		generation++;
+		trans->fail = true;
 		talloc_free(i);
 		return;
 	}
@@ -135,14 +299,85 @@ void add_change_node(struct connection *conn, struct node *node, bool recurse)
 	list_add_tail(&i->list, &trans->changes);
 }
 
+/*
+ * Check nothing the transaction read has changed since, then move its
+ * changes into the main database.
+ */
+static int finalize_transaction(struct connection *conn,
+				struct transaction *trans)
+{
+	struct accessed_node *i;
+	struct xs_tdb_record_hdr *hdr;
+	TDB_DATA data;
+	char *trans_name;
+	uint64_t gen;
+
+	list_for_each_entry(i, &trans->accessed, list) {
+		if (!i->check_gen)
+			continue;
+
+		data = db_lookup(i->node);
+		if (data.dptr) {
+			hdr = (void *)data.dptr;
+			gen = hdr->generation;
+		} else
+			gen = NO_GENERATION;
+
+		if (gen != i->generation)
+			return EAGAIN;
+	}
+
+	list_for_each_entry(i, &trans->accessed, list) {
+		if (!i->modified)
+			continue;
+
+		if (!i->ta_node) {
+			db_delete(i->node);
+			continue;
+		}
+
+		trans_name = transaction_node_name(i, trans, i->node);
+		if (!trans_name)
+			return ENOMEM;
+
+		/* Move the private copy into place. */
+		data = db_lookup(trans_name);
+		if (!data.dptr) {
+			corrupt(conn, "Lost transaction copy of '%s'", i->node);
+			continue;
+		}
+		data.dptr = talloc_steal(NULL, data.dptr);
+		db_delete(trans_name);
+		i->ta_node = false;
+		hdr = (void *)data.dptr;
+		hdr->generation = generation++;
+		if (db_store(i->node, data) != 0)
+			corrupt(conn, "Could not commit '%s'", i->node);
+		talloc_free(trans_name);
+	}
+
+	return 0;
+}
+
 static int destroy_transaction(void *_transaction)
 {
 	struct transaction *trans = _transaction;
+	struct accessed_node *i;
+	char *trans_name;
 
 	trace_destroy(trans, "transaction");
-	if (trans->tdb)
-		tdb_close(trans->tdb);
-	unlink(trans->tdb_name);
+
+	/* Drop the private copies of the nodes. */
+	list_for_each_entry(i, &trans->accessed, list) {
+		if (!i->ta_node)
+			continue;
+		trans_name = transaction_node_name(i, trans, i->node);
+		if (!trans_name)
+			continue;
+		db_delete(trans_name);
+		talloc_free(trans_name);
+	}
+
 	return 0;
 }
 
@@ -177,18 +412,11 @@ int do_transaction_start(struct connection *conn, struct buffered_data *in)
 	if (!trans)
 		return ENOMEM;
 
+	INIT_LIST_HEAD(&trans->accessed);
 	INIT_LIST_HEAD(&trans->changes);
 	INIT_LIST_HEAD(&trans->changed_domains);
-	trans->generation = generation;
-	trans->tdb_name = talloc_asprintf(trans, "%s.%p",
-					  xs_daemon_tdb(), trans);
-	if (!trans->tdb_name)
-		return ENOMEM;
-	trans->tdb = tdb_copy(tdb_context(conn), trans->tdb_name);
-	if (!trans->tdb)
-		return errno;
-	/* Make it close if we go away. */
-	talloc_steal(trans, trans->tdb);
+	trans->fail = false;
+	trans->generation = generation++;
 
 	/* Pick an unused transaction identifier. */
 	do {
@@ -214,6 +442,7 @@ int do_transaction_end(struct connection *conn, struct buffered_data *in)
 	struct changed_node *i;
 	struct changed_domain *d;
 	struct transaction *trans;
+	int ret;
 
 	if (!arg || (!streq(arg, "T") && !streq(arg, "F")))
 		return EINVAL;
@@ -229,13 +458,11 @@ int do_transaction_end(struct connection *conn, struct buffered_data *in)
 	talloc_steal(in, trans);
 
 	if (streq(arg, "T")) {
-		/* FIXME: Merge, rather failing on any change. */
-		if (trans->generation != generation)
+		if (trans->fail)
 			return EAGAIN;
-		if (!replace_tdb(trans->tdb_name, trans->tdb))
-			return errno;
-		/* Don't close this: we won! */
-		trans->tdb = NULL;
+		ret = finalize_transaction(conn, trans);
+		if (ret)
+			return ret;
 
 		/* fix domain entry for each changed domain */
 		list_for_each_entry(d, &trans->changed_domains, list)
@@ -244,7 +471,6 @@ int do_transaction_end(struct connection *conn, struct buffered_data *in)
 		/* Fire off the watches for everything that changed. */
 		list_for_each_entry(i, &trans->changes, list)
 			fire_watches(conn, in, i->node, i->recurse);
-		generation += trans->trans_gen;
 	}
 	send_ack(conn, XS_TRANSACTION_END);
 
@@ -264,7 +490,7 @@ void transaction_entry_inc(struct transaction *trans, unsigned int domid)
 	d = talloc(trans, struct changed_domain);
 	if (!d) {
 		/* Let the transaction fail. */
-		generation++;
+		trans->fail = true;
 		return;
 	}
 	d->domid = domid;
@@ -285,7 +511,7 @@ void transaction_entry_dec(struct transaction *trans, unsigned int domid)
 	d = talloc(trans, struct changed_domain);
 	if (!d) {
 		/* Let the transaction fail. */
-		generation++;
+		trans->fail = true;
 		return;
 	}
 	d->domid = domid;
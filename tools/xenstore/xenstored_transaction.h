@@ -19,6 +19,15 @@
 #define _XENSTORED_TRANSACTION_H
 #include "xenstored_core.h"
 
+/* Generation of a node which doesn't exist. */
+#define NO_GENERATION ~((uint64_t)0)
+
+enum node_access_type {
+	NODE_ACCESS_READ,
+	NODE_ACCESS_WRITE,
+	NODE_ACCESS_DELETE
+};
+
 struct transaction;
 
 int do_transaction_start(struct connection *conn, struct buffered_data *node);
@@ -34,8 +43,22 @@ void transaction_entry_dec(struct transaction *trans, unsigned int domid);
 void add_change_node(struct connection *conn, struct node *node,
                      bool recurse);
 
-/* Return tdb context to use for this connection. */
-TDB_CONTEXT *tdb_transaction_context(struct transaction *trans);
+/*
+ * Set the tdb key to access a node under, allocated from ctx if need be.
+ * Within a transaction, nodes it has accessed have a private key.
+ * Returns 1 for a delete if there's no record under the key to delete, or
+ * -1 with errno set on failure.
+ */
+int transaction_node_key(struct connection *conn, const void *ctx,
+			 const char *name, enum node_access_type type,
+			 TDB_DATA *key);
+
+/*
+ * A node was read, with this generation (NO_GENERATION if it doesn't exist)
+ * and contents.  Within a transaction, note them if first accessed.
+ */
+void transaction_node_read(struct connection *conn, const char *name,
+			   uint64_t gen, TDB_DATA data);
 
 void conn_delete_all_transactions(struct connection *conn);
 
@@ -29,14 +29,45 @@
 #include "xenstore_lib.h"
 #include "utils.h"
 #include "xenstored_domain.h"
+#include "hashtable.h"
 
 extern int quota_nb_watch_per_domain;
 
+/*
+ * Watched paths are kept in a tree mirroring the node hierarchy, with a
+ * hashtable to find the tree node for a given path.  A tree node exists
+ * for every watched path and for all of its ancestors, so firing a watch
+ * only has to look at the prefixes of the modified node (and, for
+ * recursive changes, the subtree below it) instead of every watch of
+ * every connection.  Special "@" paths hang off the root node "/", as a
+ * watch on "/" sees those events, too.
+ */
+struct watch_node
+{
+	/* Full path, also used as key in watch_index. */
+	char *path;
+
+	struct watch_node *parent;
+	struct list_head children;
+	struct list_head sibling;
+
+	/* Watches registered on exactly this path. */
+	struct list_head watches;
+};
+
+static struct hashtable *watch_index;
+
 struct watch
 {
 	/* Watches on this connection */
 	struct list_head list;
 
+	/* Watches on the same path (in struct watch_node). */
+	struct list_head index_list;
+	struct watch_node *index;
+
+	struct connection *conn;
+
 	/* Current outstanding events applying to this watch. */
 	struct list_head events;
 
@@ -74,6 +105,101 @@ static bool is_child(const char *child, const char *parent)
 	return child[len] == '/' || child[len] == '\0';
 }
 
+static char *watch_parent_path(const void *ctx, const char *path)
+{
+	const char *slash;
+
+	if (streq(path, "/"))
+		return NULL;
+
+	slash = strrchr(path, '/');
+	if (!slash || slash == path)
+		return talloc_strdup(ctx, "/");
+
+	return talloc_strndup(ctx, path, slash - path);
+}
+
+static struct watch_node *watch_node_lookup(const char *path)
+{
+	if (!watch_index)
+		return NULL;
+
+	return hashtable_search(watch_index, (void *)path);
+}
+
+static struct watch_node *watch_node_get(const char *path)
+{
+	struct watch_node *wn, *parent = NULL;
+	char *parent_path;
+
+	wn = watch_node_lookup(path);
+	if (wn)
+		return wn;
+
+	if (!watch_index) {
+		watch_index = create_hashtable(16, hash_from_key_fn,
+					       keys_equal_fn);
+		if (!watch_index)
+			return NULL;
+	}
+
+	parent_path = watch_parent_path(NULL, path);
+	if (parent_path) {
+		parent = watch_node_get(parent_path);
+		talloc_free(parent_path);
+		if (!parent)
+			return NULL;
+	}
+
+	wn = talloc_zero(NULL, struct watch_node);
+	if (!wn)
+		goto nomem;
+	/* The hashtable owns the key and releases it with free(). */
+	wn->path = strdup(path);
+	if (!wn->path || !hashtable_insert(watch_index, wn->path, wn)) {
+		free(wn->path);
+		talloc_free(wn);
+		goto nomem;
+	}
+
+	wn->parent = parent;
+	INIT_LIST_HEAD(&wn->children);
+	INIT_LIST_HEAD(&wn->watches);
+	if (parent)
+		list_add_tail(&wn->sibling, &parent->children);
+
+	return wn;
+
+ nomem:
+	/* Drop ancestors we may have just created. */
+	while (parent && list_empty(&parent->children) &&
+	       list_empty(&parent->watches)) {
+		wn = parent;
+		parent = wn->parent;
+		if (parent)
+			list_del(&wn->sibling);
+		hashtable_remove(watch_index, wn->path);
+		talloc_free(wn);
+	}
+	errno = ENOMEM;
+	return NULL;
+}
+
+/* Free a tree node and its ancestors as soon as they are no longer used. */
+static void watch_node_put(struct watch_node *wn)
+{
+	struct watch_node *parent;
+
+	while (wn && list_empty(&wn->children) && list_empty(&wn->watches)) {
+		parent = wn->parent;
+		if (parent)
+			list_del(&wn->sibling);
+		hashtable_remove(watch_index, wn->path);
+		talloc_free(wn);
+		wn = parent;
+	}
+}
+
 /*
  * Send a watch event.
  * Temporary memory allocations are done with ctx.
@@ -119,6 +245,34 @@ static void add_event(struct connection *conn,
 	talloc_free(data);
 }
 
+/*
+ * Check whether any watch events are to be sent.
+ * Temporary memory allocations are done with ctx.
+ */
+static void fire_watch_node(void *ctx, struct watch_node *wn,
+			    const char *name)
+{
+	struct watch *watch;
+
+	list_for_each_entry(watch, &wn->watches, index_list) {
+		assert(is_child(name, watch->node));
+		add_event(watch->conn, ctx, watch, name);
+	}
+}
+
+/* Fire the watches of all nodes below wn with their own path. */
+static void fire_watch_subtree(void *ctx, struct watch_node *wn)
+{
+	struct watch_node *child;
+	struct watch *watch;
+
+	list_for_each_entry(child, &wn->children, sibling) {
+		list_for_each_entry(watch, &child->watches, index_list)
+			add_event(watch->conn, ctx, watch, watch->node);
+		fire_watch_subtree(ctx, child);
+	}
+}
+
 /*
  * Check whether any watch events are to be sent.
  * Temporary memory allocations are done with ctx.
@@ -126,26 +280,53 @@ static void add_event(struct connection *conn,
 void fire_watches(struct connection *conn, void *ctx, const char *name,
 		  bool recurse)
 {
-	struct connection *i;
-	struct watch *watch;
+	struct watch_node *wn;
+	char *prefix, *slash;
 
 	/* During transactions, don't fire watches. */
 	if (conn && conn->transaction)
 		return;
 
-	/* Create an event for each watch. */
-	list_for_each_entry(i, &connections, list) {
-		list_for_each_entry(watch, &i->watches, list) {
-			if (is_child(name, watch->node))
-				add_event(i, ctx, watch, name);
-			else if (recurse && is_child(watch->node, name))
-				add_event(i, ctx, watch, watch->node);
-		}
+	wn = watch_node_lookup("/");
+	if (!wn)
+		return;
+	fire_watch_node(ctx, wn, name);
+	if (streq(name, "/"))
+		goto out;
+
+	/*
+	 * Walk down the path: every watch on a prefix of name fires.  Once
+	 * a prefix isn't watched, nothing below it can be either.
+	 */
+	prefix = talloc_strdup(ctx, name);
+	if (!prefix)
+		return;
+	for (slash = strchr(prefix + 1, '/'); wn; slash = strchr(slash + 1, '/')) {
+		if (slash)
+			*slash = '\0';
+		wn = watch_node_lookup(prefix);
+		if (wn)
+			fire_watch_node(ctx, wn, name);
+		if (!slash)
+			break;
+		*slash = '/';
 	}
+	talloc_free(prefix);
+
+ out:
+	/* Watches below a recursively changed node fire with their path. */
+	if (wn && recurse)
+		fire_watch_subtree(ctx, wn);
 }
 
 static int destroy_watch(void *_watch)
 {
+	struct watch *watch = _watch;
+
+	if (watch->index) {
+		list_del(&watch->index_list);
+		watch_node_put(watch->index);
+	}
 	trace_destroy(_watch, "watch");
 	return 0;
 }
@@ -199,6 +380,14 @@ int do_watch(struct connection *conn, struct buffered_data *in)
 
 	INIT_LIST_HEAD(&watch->events);
 
+	watch->conn = conn;
+	watch->index = watch_node_get(watch->node);
+	if (!watch->index) {
+		talloc_free(watch);
+		return ENOMEM;
+	}
+	list_add_tail(&watch->index_list, &watch->index->watches);
+
 	domain_watch_inc(conn);
 	list_add_tail(&watch->list, &conn->watches);
 	trace_create(watch, "watch");
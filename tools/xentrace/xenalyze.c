@@ -36,6 +36,7 @@
 #include <strings.h>
 #include <string.h>
 #include <assert.h>
+#include <limits.h>
 
 struct mread_ctrl;
 
@@ -62,6 +63,25 @@ struct array_struct {
         }                                         \
     } while(0)                                    \
 
+/*
+ * One entry of the window index: where a cpu_change record is and what
+ * follows it.  The index is stored in a sidecar file next to the trace, with
+ * a header identifying the trace it belongs to.
+ */
+struct window_index_entry {
+    uint64_t offset;          /* Of the cpu_change record */
+    uint32_t cpu, size;       /* Its cpu and window_size */
+    uint64_t first_tsc;       /* Of the first record with a tsc, or 0 */
+};
+
+#define WINDOW_INDEX_MAGIC "XENAIDX1"
+
+struct window_index_header {
+    char magic[8];
+    uint64_t trace_size, trace_mtime;
+    uint64_t count;
+};
+
 /* -- Global variables -- */
 struct {
     int fd;
@@ -71,12 +91,20 @@ struct {
     char * trace_file;
     int output_defined;
     off_t file_size;
+    time_t file_mtime;
     struct {
         off_t update_offset;
         int pipe[2];
         FILE* out;
         int pid;
     } progress;
+    struct {
+        struct window_index_entry *entries;
+        int count;
+    } index;
+    struct {
+        tsc_t origin, start_tsc, end_tsc;
+    } time_window;
 } G = {
     .fd=-1,
     .symbols = NULL,
@@ -179,6 +207,8 @@ struct {
         summary:1,
         report_pcpu:1,
         tsc_loop_fatal:1,
+        index:1,
+        time_window:1,
         summary_info;
     long long cpu_qhz, cpu_hz;
     int scatterplot_interrupt_vector;
@@ -190,6 +220,10 @@ struct {
     int default_guest_paging_levels;
     int sample_size, sample_max;
     enum error_level tolerance; /* Tolerate up to this level of error */
+    struct {
+        /* Seconds from the start of the trace; end 0 means no limit */
+        double start, end;
+    } window;
     struct {
         tsc_t cycles;
         /* Used if interval is specified in seconds to delay calculating
@@ -1815,12 +1849,20 @@ struct pcpu_info {
 
     /* Information related to scanning thru the file */
     tsc_t first_tsc, last_tsc, order_tsc;
+    int order_index;                 /* Position in record_order heap */
+    unsigned long long order_seq;    /* Tie breaker for equal order_tsc */
     off_t file_offset;
     off_t next_cpu_change_offset;
     struct record_info ri;
     int last_cpu_change_pid;
     int power_state;
 
+    /* Entries of the window index for this pcpu, in file order */
+    struct {
+        int *windows;
+        int count;
+    } index;
+
     /* Information related to tsc skew detection / correction */
     struct {
         tsc_t offset;
@@ -9025,6 +9067,44 @@ void deactivate_pcpu(struct pcpu_info *p)
 
 }
 
+/*
+ * With a window index, a pcpu which reaches a cpu_change record for another
+ * pcpu jumps straight to its own next window instead of walking through all
+ * the windows in between.
+ */
+void index_skip_to_own_window(struct pcpu_info *p)
+{
+    const struct window_index_entry *e;
+    int lo = 0, hi = p->index.count;
+
+    /* Find the first of our windows after the current offset. */
+    while ( lo < hi )
+    {
+        int mid = (lo + hi) / 2;
+
+        if ( G.index.entries[p->index.windows[mid]].offset <=
+             (uint64_t)p->file_offset )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if ( lo == p->index.count )
+    {
+        /* No more windows; the next read will deactivate the pcpu. */
+        p->file_offset = G.file_size;
+        p->next_cpu_change_offset = G.file_size;
+        return;
+    }
+
+    e = G.index.entries + p->index.windows[lo];
+    p->file_offset = e->offset;
+    p->next_cpu_change_offset = e->offset;
+
+    /* Get the window read in while the other pcpus are processed. */
+    posix_fadvise(G.fd, e->offset, e->size, POSIX_FADV_WILLNEED);
+}
+
 /* Helper function to process tsc-related record info */
 void process_record_tsc(tsc_t order_tsc, struct record_info *ri)
 {
@@ -9157,6 +9237,12 @@ void process_cpu_change(struct pcpu_info *p) {
         error(ERR_ASSERT, NULL);
     }
 
+    if ( opt.index && p->pid != r->cpu )
+    {
+        index_skip_to_own_window(p);
+        return;
+    }
+
     /* Detect beginning of new "epoch" while scanning thru file */
     if((p->last_cpu_change_pid > r->cpu)
        && (p->file_offset > P.last_epoch_offset)) {
@@ -9259,7 +9345,7 @@ void process_cpu_change(struct pcpu_info *p) {
 
         if(p->next_cpu_change_offset > G.file_size)
             activate_early_eof();
-        else if(p->pid == P.max_active_pcpu)
+        else if(p->pid == P.max_active_pcpu && !opt.index)
             scan_for_new_pcpu(p->next_cpu_change_offset);
 
     }
@@ -9341,6 +9427,9 @@ void process_record(struct pcpu_info *p) {
     if ( opt.dump_no_processing )
         goto out;
 
+    if ( opt.time_window && ri->tsc < G.time_window.start_tsc )
+        goto out;
+
     p->summary = 1;
 
     if( opt.dump_raw_process )
@@ -9653,99 +9742,123 @@ char * pcpu_string(int pcpu)
     return s;
 }
 
-/* Null terminated */
-struct pcpu_info *record_order[MAX_CPUS+1] = { 0 };
-
-/* In the case of identical tsc values, the old algorithm would favor the
+/*
+ * Active pcpus, as a binary min-heap ordered by the tsc of their next
+ * record, so that finding and re-inserting the next pcpu to process costs
+ * O(log n) rather than O(n) in the number of pcpus.
+ *
+ * Records are still processed one at a time, in tsc order across all
+ * pcpus.  vcpus migrate, and wakeups and runstate changes cross pcpus, so
+ * analysing each pcpu's records separately and merging the summaries
+ * afterwards would not give the same results.
+ *
+ * In the case of identical tsc values, the old algorithm would favor the
  * pcpu with the lowest number.  By default the new algorithm favors the
- * pcpu which has been processed most recently.
+ * pcpu which has been processed most recently (has the highest order_seq).
  *
  * I think the second way is better; but it's good to be able to use the
  * old ordering, at very lest to verify that there are no (other) ordering
- * differences.  Enabling the below flag will cause the insertion / bubble
- * routines to order by pcpu id as well as tsc, preserving the old order. */
+ * differences.  Enabling the below flag will cause the heap to order by pcpu
+ * id as well as tsc, preserving the old order. */
 //#define PRESERVE_PCPU_ORDERING
 
-/* Steady state:
- * + Entire list is in order, except (potentially) for the first entry
- * + last is pointing to the first entry.
- */
-void record_order_bubble(struct pcpu_info *last)
-{
-    int i;
-
-    /* Find the pcpu to "bubble".  This is usually the
-     * first one, but if other pcpus have been activated, it may
-     * not be. */
-    for(i=0; record_order[i] && record_order[i]!=last; i++);
-
-    assert(record_order[i]);
+struct {
+    struct pcpu_info *heap[MAX_CPUS];
+    int count;
+    unsigned long long seq;
+} record_order = { .count = 0 };
 
-    /* Now bubble it down */
-    for( ;
-        record_order[i+1]
-             && ( record_order[i+1]->order_tsc < last->order_tsc
+static inline int record_order_before(struct pcpu_info *a,
+                                      struct pcpu_info *b)
+{
+    if ( a->order_tsc != b->order_tsc )
+        return a->order_tsc < b->order_tsc;
 #ifdef PRESERVE_PCPU_ORDERING
-                  || ( record_order[i+1]->order_tsc == last->order_tsc
-                       && record_order[i+1]->pid < last->pid )
+    return a->pid < b->pid;
+#else
+    return a->order_seq > b->order_seq;
 #endif
-                 ) ;
-        i++)
-        record_order[i]=record_order[i+1];
-    record_order[i]=last;
 }
 
-void record_order_insert(struct pcpu_info *new)
+static inline void record_order_set(int i, struct pcpu_info *p)
 {
-    int i;
-    struct pcpu_info *p=NULL, *t=NULL;
+    record_order.heap[i] = p;
+    p->order_index = i;
+}
 
-    /* Sanity check: Make sure it's not already in there */
-    for(i=0; record_order[i]; i++)
-        assert(record_order[i]!=new);
+/* Move the pcpu at index i to its place in the heap. */
+static void record_order_sift(int i)
+{
+    struct pcpu_info *p = record_order.heap[i];
+    int c;
 
-    /* Find where to insert it */
-    for(i=0;
-        record_order[i]
-             && ( record_order[i]->order_tsc < new->order_tsc
-#ifdef PRESERVE_PCPU_ORDERING
-                  || ( record_order[i]->order_tsc == new->order_tsc
-                       && record_order[i]->pid < new->pid )
-#endif
-                 ) ;
-        i++)
-        ;
+    while ( i > 0 && record_order_before(p, record_order.heap[(i - 1) / 2]) )
+    {
+        record_order_set(i, record_order.heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
 
-    /* And insert it */
-    for( p=new; p ; i++)
+    while ( (c = 2 * i + 1) < record_order.count )
     {
-        t=record_order[i];
-        record_order[i]=p;
-        p=t;
+        if ( c + 1 < record_order.count
+             && record_order_before(record_order.heap[c + 1],
+                                    record_order.heap[c]) )
+            c++;
+        if ( !record_order_before(record_order.heap[c], p) )
+            break;
+        record_order_set(i, record_order.heap[c]);
+        i = c;
     }
+
+    record_order_set(i, p);
 }
 
-void record_order_remove(struct pcpu_info *rem)
+static inline int record_order_contains(struct pcpu_info *p)
 {
-    int i;
+    return p->order_index < record_order.count
+        && record_order.heap[p->order_index] == p;
+}
+
+/* Called after the next record of last has been read. */
+void record_order_bubble(struct pcpu_info *last)
+{
+    assert(record_order_contains(last));
 
-    /* Find where the record is */
-    for(i=0; record_order[i] && record_order[i]!=rem; i++)
-        ;
+    last->order_seq = ++record_order.seq;
+    record_order_sift(last->order_index);
+}
+
+void record_order_insert(struct pcpu_info *new)
+{
+    /* Sanity check: Make sure it's not already in there */
+    assert(!record_order_contains(new));
+    assert(record_order.count < MAX_CPUS);
+
+    new->order_seq = ++record_order.seq;
+    record_order_set(record_order.count++, new);
+    record_order_sift(new->order_index);
+}
+
+void record_order_remove(struct pcpu_info *rem)
+{
+    int i = rem->order_index;
 
     /* Sanity check: Make sure it's actually there! */
-    assert(record_order[i]);
+    assert(record_order_contains(rem));
 
-    /* And move everyone forward */
-    for(; (record_order[i]=record_order[i+1]); i++)
-        ;
+    /* Fill the hole with the last entry */
+    if ( i != --record_order.count )
+    {
+        record_order_set(i, record_order.heap[record_order.count]);
+        record_order_sift(i);
+    }
 }
 
 struct pcpu_info * choose_next_record(void)
 {
     struct pcpu_info *min_p=NULL;
 
-    min_p=record_order[0];
+    min_p = record_order.count ? record_order.heap[0] : NULL;
 
     if(opt.progress && min_p && min_p->file_offset >= G.progress.update_offset)
         progress_update(min_p->file_offset);
@@ -9756,6 +9869,14 @@ struct pcpu_info * choose_next_record(void)
     return min_p;
 }
 
+void time_window_set_origin(tsc_t origin)
+{
+    G.time_window.origin = origin;
+    G.time_window.start_tsc = origin + opt.window.start * opt.cpu_hz;
+    if ( opt.window.end )
+        G.time_window.end_tsc = origin + opt.window.end * opt.cpu_hz;
+}
+
 void process_records(void) {
     while(1) {
         struct pcpu_info *p = NULL;
@@ -9763,6 +9884,15 @@ void process_records(void) {
         if(!(p=choose_next_record()))
             return;
 
+        if ( opt.time_window )
+        {
+            /* The first record chosen has the lowest tsc in the trace. */
+            if ( !G.time_window.origin && p->order_tsc )
+                time_window_set_origin(p->order_tsc);
+            if ( G.time_window.end_tsc && p->order_tsc > G.time_window.end_tsc )
+                return;
+        }
+
         process_record(p);
 
         /* Lost records gets processed twice. */
@@ -9886,6 +10016,262 @@ void report_pcpu(void) {
 
 }
 
+/*
+ * Window index
+ *
+ * Without an index every pcpu reads through every cpu_change record in the
+ * file to find its own windows, which gets expensive with many pcpus.  The
+ * index lists all windows, so that a pcpu can jump straight to its next
+ * one, and the first tsc of each window, so that processing for a time
+ * window can start close to where it is in the file.
+ */
+
+/* Return the tsc of the first record in [offset, end) with one, or 0. */
+static tsc_t index_window_first_tsc(off_t offset, off_t end)
+{
+    struct trace_record rec;
+    ssize_t r;
+
+    while ( offset < end && (r = __read_record(&rec, offset)) )
+    {
+        if ( rec.cycle_flag )
+            return (((tsc_t)rec.u.tsc.tsc_hi) << 32) | rec.u.tsc.tsc_lo;
+        offset += r;
+    }
+
+    return 0;
+}
+
+static void index_scan(void)
+{
+    struct trace_record rec;
+    struct cpu_change_data *cd;
+    off_t offset = 0, epoch_offset = 0;
+    int last_cpu = -1, size = 0;
+    ssize_t r;
+
+    fprintf(warn, "%s: indexing %s\n", __func__, G.trace_file);
+
+    while ( (r = __read_record(&rec, offset)) )
+    {
+        struct window_index_entry *e;
+
+        if ( rec.event != TRC_TRACE_CPU_CHANGE || rec.cycle_flag )
+        {
+            fprintf(stderr, "%s: Unexpected record event %x at offset %llx!\n",
+                    __func__, rec.event, (unsigned long long)offset);
+            error(ERR_ASSERT, NULL);
+        }
+
+        cd = (typeof(cd))rec.u.notsc.data;
+
+        if ( cd->cpu < 0 || cd->cpu >= MAX_CPUS )
+        {
+            fprintf(stderr, "%s: cpu %d exceeds MAX_CPU %d!\n",
+                    __func__, cd->cpu, MAX_CPUS);
+            error(ERR_ASSERT, NULL);
+        }
+
+        /* Detect beginning of new "epoch", like process_cpu_change() */
+        if ( last_cpu > cd->cpu )
+            epoch_offset = offset;
+        last_cpu = cd->cpu;
+
+        /* Truncated file: leave out the last epoch, like early_eof does. */
+        if ( offset + r + cd->window_size > G.file_size )
+        {
+            fprintf(warn, "%s: short window at offset %llx, ignoring epoch at %llx\n",
+                    __func__, (unsigned long long)offset,
+                    (unsigned long long)epoch_offset);
+            while ( G.index.count
+                    && G.index.entries[G.index.count - 1].offset >= epoch_offset )
+                G.index.count--;
+            break;
+        }
+
+        if ( G.index.count == size )
+        {
+            size = size ? size * 2 : 1024;
+            G.index.entries = realloc(G.index.entries,
+                                      size * sizeof(*G.index.entries));
+            if ( !G.index.entries )
+            {
+                perror("realloc");
+                error(ERR_SYSTEM, NULL);
+            }
+        }
+
+        e = G.index.entries + G.index.count++;
+        e->offset = offset;
+        e->cpu = cd->cpu;
+        e->size = cd->window_size;
+        e->first_tsc = index_window_first_tsc(offset + r,
+                                              offset + r + cd->window_size);
+
+        offset += r + cd->window_size;
+    }
+}
+
+static int index_load(const char *path)
+{
+    struct window_index_header h;
+    FILE *f;
+    int i;
+
+    if ( (f = fopen(path, "r")) == NULL )
+        return -1;
+
+    if ( fread(&h, sizeof(h), 1, f) != 1
+         || memcmp(h.magic, WINDOW_INDEX_MAGIC, sizeof(h.magic))
+         || h.trace_size != G.file_size
+         || h.trace_mtime != G.file_mtime
+         || h.count == 0 || h.count > INT_MAX )
+        goto fail;
+
+    G.index.entries = malloc(h.count * sizeof(*G.index.entries));
+    if ( !G.index.entries
+         || fread(G.index.entries, sizeof(*G.index.entries), h.count, f)
+            != h.count )
+        goto fail;
+
+    for ( i = 0; i < h.count; i++ )
+        if ( G.index.entries[i].cpu >= MAX_CPUS )
+            goto fail;
+
+    G.index.count = h.count;
+    fclose(f);
+
+    return 0;
+
+fail:
+    fprintf(warn, "%s: %s is not a valid index for %s, rebuilding\n",
+            __func__, path, G.trace_file);
+    free(G.index.entries);
+    G.index.entries = NULL;
+    fclose(f);
+
+    return -1;
+}
+
+static void index_save(const char *path)
+{
+    struct window_index_header h = {
+        .trace_size = G.file_size,
+        .trace_mtime = G.file_mtime,
+        .count = G.index.count,
+    };
+    FILE *f;
+
+    memcpy(h.magic, WINDOW_INDEX_MAGIC, sizeof(h.magic));
+
+    if ( (f = fopen(path, "w")) == NULL )
+        goto fail;
+
+    if ( fwrite(&h, sizeof(h), 1, f) != 1
+         || fwrite(G.index.entries, sizeof(*G.index.entries), G.index.count,
+                   f) != G.index.count )
+    {
+        fclose(f);
+        unlink(path);
+        goto fail;
+    }
+
+    if ( fclose(f) )
+    {
+        unlink(path);
+        goto fail;
+    }
+
+    return;
+
+fail:
+    fprintf(warn, "%s: could not write %s: %s\n", __func__, path,
+            strerror(errno));
+}
+
+/* Load or build the index, and split it up by pcpu. */
+void index_init(void)
+{
+    size_t len = strlen(G.trace_file) + sizeof(".idx");
+    char *path = malloc(len);
+    struct pcpu_info *p;
+    int i;
+
+    if ( !path )
+    {
+        perror("malloc");
+        error(ERR_SYSTEM, NULL);
+    }
+    snprintf(path, len, "%s.idx", G.trace_file);
+
+    if ( index_load(path) )
+    {
+        index_scan();
+        if ( G.index.count )
+            index_save(path);
+    }
+    free(path);
+
+    for ( i = 0; i < G.index.count; i++ )
+        P.pcpu[G.index.entries[i].cpu].index.count++;
+
+    for ( i = 0; i < MAX_CPUS; i++ )
+    {
+        p = P.pcpu + i;
+        if ( !p->index.count )
+            continue;
+        p->index.windows = malloc(p->index.count * sizeof(int));
+        if ( !p->index.windows )
+        {
+            perror("malloc");
+            error(ERR_SYSTEM, NULL);
+        }
+        p->index.count = 0;
+    }
+
+    for ( i = 0; i < G.index.count; i++ )
+    {
+        const struct window_index_entry *e = G.index.entries + i;
+
+        p = P.pcpu + e->cpu;
+        p->index.windows[p->index.count++] = i;
+
+        if ( e->first_tsc
+             && (!G.time_window.origin || e->first_tsc < G.time_window.origin) )
+            G.time_window.origin = e->first_tsc;
+    }
+
+    if ( opt.time_window && G.time_window.origin )
+        time_window_set_origin(G.time_window.origin);
+}
+
+/*
+ * Activate every pcpu at its first window, or with a time window, at the
+ * last window starting before it.
+ */
+static void init_pcpus_from_index(void)
+{
+    int i, w;
+
+    for ( i = 0; i < MAX_CPUS; i++ )
+    {
+        struct pcpu_info *p = P.pcpu + i;
+
+        if ( !p->index.count )
+            continue;
+
+        for ( w = 0; opt.time_window && w + 1 < p->index.count; w++ )
+        {
+            tsc_t next = G.index.entries[p->index.windows[w + 1]].first_tsc;
+
+            if ( !next || next > G.time_window.start_tsc )
+                break;
+        }
+
+        scan_for_new_pcpu(G.index.entries[p->index.windows[w]].offset);
+    }
+}
+
 void init_pcpus(void) {
     int i=0;
     off_t offset = 0;
@@ -9901,6 +10287,13 @@ void init_pcpus(void) {
 
     sched_default_domain_init();
 
+    if ( opt.index )
+    {
+        index_init();
+        init_pcpus_from_index();
+        return;
+    }
+
     /* Scan through the cpu_change recs until we see a duplicate */
     do {
         offset = scan_for_new_pcpu(offset);
@@ -9966,6 +10359,8 @@ enum {
     OPT_PROGRESS,
     OPT_TOLERANCE,
     OPT_TSC_LOOP_FATAL,
+    OPT_INDEX,
+    OPT_TIME_WINDOW,
     /* Specific letters */
     OPT_DUMP_ALL='a',
     OPT_INTERVAL_LENGTH='i',
@@ -10446,6 +10841,33 @@ error_t cmd_parser(int key, char *arg, struct argp_state *state)
         opt.tsc_loop_fatal = 1;
         break;
 
+    case OPT_INDEX:
+        opt.index = 1;
+        break;
+
+    case OPT_TIME_WINDOW:
+    {
+        char * inval;
+
+        opt.window.start = strtod(arg, &inval);
+        if ( inval == arg || opt.window.start < 0 )
+            argp_usage(state);
+
+        if ( *inval == ':' )
+        {
+            arg = inval + 1;
+            opt.window.end = strtod(arg, &inval);
+            if ( inval == arg || opt.window.end <= opt.window.start )
+                argp_usage(state);
+        }
+
+        if ( *inval )
+            argp_usage(state);
+
+        opt.time_window = 1;
+        break;
+    }
+
     case ARGP_KEY_ARG:
     {
         /* FIXME - strcpy */
@@ -10735,6 +11157,15 @@ const struct argp_option cmd_opts[] =  {
       .key = OPT_TSC_LOOP_FATAL,
       .doc = "Stop processing and exit if tsc skew tracking detects a dependency loop.", },
 
+    { .name = "index",
+      .key = OPT_INDEX,
+      .doc = "Read the offsets of the per-cpu windows in the trace from [trace file].idx, writing that file first if it is missing or does not match the trace.  With --time-window, reading starts at the windows around the start time.", },
+
+    { .name = "time-window",
+      .key = OPT_TIME_WINDOW,
+      .arg = "start[:end]",
+      .doc = "Only process records from start to end seconds (floating point) after the beginning of the trace.", },
+
     { .name = "tolerance",
       .key = OPT_TOLERANCE,
       .arg = "errlevel",
@@ -10770,6 +11201,7 @@ int main(int argc, char *argv[]) {
         struct stat s;
         fstat(G.fd, &s);
         G.file_size = s.st_size;
+        G.file_mtime = s.st_mtime;
     }
 
     if ( (G.mh = mread_init(G.fd)) == NULL )
@@ -24,8 +24,10 @@
 #include <getopt.h>
 #include <assert.h>
 #include <ctype.h>
+#include <limits.h>
 #include <sys/poll.h>
 #include <sys/statvfs.h>
+#include <sys/uio.h>
 
 #include <xen/xen.h>
 #include <xen/trace.h>
@@ -48,6 +50,13 @@ do {                                                            \
 /* sleep for this long (milliseconds) between checking the trace buffers */
 #define POLL_SLEEP_MILLIS 100
 
+/* don't time out, wait for VIRQ_TBUF (or a signal) */
+#define POLL_FOREVER ((unsigned long)-1)
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 #define DEFAULT_TBUF_SIZE 32
 /***** The code **************************************************************/
 
@@ -62,7 +71,8 @@ typedef struct settings_st {
     unsigned long memory_buffer;
     uint8_t discard:1,
         disable_tracing:1,
-        start_disabled:1;
+        start_disabled:1,
+        stream:1;
 } settings_t;
 
 struct t_struct {
@@ -79,10 +89,14 @@ static xc_interface *xc_handle;
 static xenevtchn_handle *xce_handle = NULL;
 static int virq_port = -1;
 static int outfd = 1;
+static int wakeup_pipe[2] = { -1, -1 };
 
 static void close_handler(int signal)
 {
     interrupted = 1;
+    /* Wake up the main loop if it is waiting for VIRQ_TBUF. */
+    if ( wakeup_pipe[1] >= 0 && write(wakeup_pipe[1], "", 1) < 0 )
+        return;
 }
 
 static struct {
@@ -343,38 +357,37 @@ fail:
  * Outputs the trace buffer to a filestream, prepending the CPU and size
  * of the buffer write.
  */
-static void write_buffer(unsigned int cpu, unsigned char *start, int size,
-                         int total_size)
+static void check_disk_space(unsigned long size)
 {
     struct statvfs stat;
-    size_t written = 0;
-    
-    if ( opts.memory_buffer == 0 && opts.disk_rsvd != 0 )
-    {
-        unsigned long long freespace;
+    unsigned long long freespace;
 
-        /* Check that filesystem has enough space. */
-        if ( fstatvfs (outfd, &stat) )
-        {
-            fprintf(stderr, "Statfs failed!\n");
-            goto fail;
-        }
-
-        freespace = stat.f_frsize * (unsigned long long)stat.f_bfree;
-
-        if ( total_size )
-            freespace -= total_size;
-        else
-            freespace -= size;
+    /* Check that filesystem has enough space. */
+    if ( fstatvfs (outfd, &stat) )
+    {
+        fprintf(stderr, "Statfs failed!\n");
+        PERROR("Failed to write trace data");
+        exit(EXIT_FAILURE);
+    }
 
-        freespace >>= 20; /* Convert to MB */
+    freespace = stat.f_frsize * (unsigned long long)stat.f_bfree;
+    freespace -= size;
+    freespace >>= 20; /* Convert to MB */
 
-        if ( freespace <= opts.disk_rsvd )
-        {
-            fprintf(stderr, "Disk space limit reached (free space: %lluMB, limit: %luMB).\n", freespace, opts.disk_rsvd);
-            exit (EXIT_FAILURE);
-        }
+    if ( freespace <= opts.disk_rsvd )
+    {
+        fprintf(stderr, "Disk space limit reached (free space: %lluMB, limit: %luMB).\n", freespace, opts.disk_rsvd);
+        exit (EXIT_FAILURE);
     }
+}
+
+static void write_buffer(unsigned int cpu, unsigned char *start, int size,
+                         int total_size)
+{
+    size_t written = 0;
+    
+    if ( opts.memory_buffer == 0 && opts.disk_rsvd != 0 )
+        check_disk_space(total_size ? total_size : size);
 
     /* Write a CPU_BUF record on each buffer "window" written.  Wrapped
      * windows may involve two writes, so only write the record on the
@@ -425,6 +438,117 @@ fail:
     exit(EXIT_FAILURE);
 }
 
+/*
+ * Streaming output: the windows found in one pass over all the trace
+ * buffers are written with a single writev(), straight out of the mapped
+ * trace buffer pages, and only then handed back to Xen.  Splicing the pages
+ * would avoid the copy into the page cache as well, but vmsplice() cannot
+ * take references to foreign mappings.
+ */
+static struct {
+    struct iovec *iov;                /* 3 per CPU: header and 2 chunks */
+    struct cpu_change_record *recs;
+    unsigned int *cpu;
+    unsigned long *prod;
+    unsigned int nr_iov, nr_cpus;
+    unsigned long bytes;
+} stream;
+
+static void stream_alloc(unsigned int num)
+{
+    stream.iov = calloc(3 * num, sizeof(*stream.iov));
+    stream.recs = calloc(num, sizeof(*stream.recs));
+    stream.cpu = calloc(num, sizeof(*stream.cpu));
+    stream.prod = calloc(num, sizeof(*stream.prod));
+    if ( !stream.iov || !stream.recs || !stream.cpu || !stream.prod )
+    {
+        PERROR("Failed to allocate memory for streaming");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void stream_add(unsigned char *start, unsigned long size)
+{
+    stream.iov[stream.nr_iov].iov_base = start;
+    stream.iov[stream.nr_iov].iov_len = size;
+    stream.nr_iov++;
+    stream.bytes += size;
+}
+
+/**
+ * stream_window - queue a window of a trace buffer for streaming
+ * @cpu      - source buffer CPU ID
+ * @start    - start of the window
+ * @size     - size of the window up to the end of the buffer
+ * @wrap_start - start of the buffer, for wrapped windows
+ * @wrap_size - size of the rest of a wrapped window (0 if not wrapped)
+ * @prod     - producer index to set cons to once the window is written
+ */
+static void stream_window(unsigned int cpu, unsigned char *start,
+                          unsigned long size, unsigned char *wrap_start,
+                          unsigned long wrap_size, unsigned long prod)
+{
+    struct cpu_change_record *rec = &stream.recs[stream.nr_cpus];
+
+    rec->header = CPU_CHANGE_HEADER;
+    rec->data.cpu = cpu;
+    rec->data.window_size = size + wrap_size;
+
+    stream_add((unsigned char *)rec, sizeof(*rec));
+    stream_add(start, size);
+    if ( wrap_size )
+        stream_add(wrap_start, wrap_size);
+
+    stream.cpu[stream.nr_cpus] = cpu;
+    stream.prod[stream.nr_cpus] = prod;
+    stream.nr_cpus++;
+}
+
+static void stream_flush(struct t_buf **meta)
+{
+    struct iovec *iov = stream.iov;
+    unsigned int nr = stream.nr_iov, i;
+    ssize_t written;
+
+    if ( !stream.nr_cpus )
+        return;
+
+    if ( opts.disk_rsvd != 0 )
+        check_disk_space(stream.bytes);
+
+    while ( nr )
+    {
+        written = writev(outfd, iov, nr < IOV_MAX ? nr : IOV_MAX);
+        if ( written <= 0 )
+        {
+            if ( written < 0 && errno == EINTR )
+                continue;
+            PERROR("Failed to write trace data");
+            exit(EXIT_FAILURE);
+        }
+
+        /* Skip what has been written, which may end within an iovec. */
+        while ( nr && written >= iov->iov_len )
+        {
+            written -= iov->iov_len;
+            iov++;
+            nr--;
+        }
+        if ( nr )
+        {
+            iov->iov_base = (unsigned char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+
+    xen_mb(); /* read buffers, then update cons. */
+    for ( i = 0; i < stream.nr_cpus; i++ )
+        meta[stream.cpu[i]]->cons = stream.prod[i];
+
+    stream.nr_iov = stream.nr_cpus = 0;
+    stream.bytes = 0;
+}
+
 static void disable_tbufs(void)
 {
     xc_interface *xc_handle = xc_interface_open(0,0,0);
@@ -625,11 +749,14 @@ static void event_init(void)
 static void wait_for_event_or_timeout(unsigned long milliseconds)
 {
     int rc;
-    struct pollfd fd = { .fd = xenevtchn_fd(xce_handle),
-                         .events = POLLIN | POLLERR };
+    struct pollfd fd[2] = {
+        { .fd = xenevtchn_fd(xce_handle), .events = POLLIN | POLLERR },
+        { .fd = wakeup_pipe[0], .events = POLLIN },
+    };
     int port;
 
-    rc = poll(&fd, 1, milliseconds);
+    rc = poll(fd, wakeup_pipe[0] >= 0 ? 2 : 1,
+              milliseconds == POLL_FOREVER ? -1 : milliseconds);
     if (rc == -1) {
         if (errno == EINTR)
             return;
@@ -637,7 +764,7 @@ static void wait_for_event_or_timeout(unsigned long milliseconds)
         exit(EXIT_FAILURE);
     }
 
-    if (rc == 1) {
+    if (fd[0].revents) {
         port = xenevtchn_pending(xce_handle);
         if (port == -1) {
             PERROR("failed to read port from evtchn");
@@ -704,6 +831,9 @@ static int monitor_tbufs(void)
         for ( i = 0; i < num; i++ )
             meta[i]->cons = meta[i]->prod;
 
+    if ( opts.stream )
+        stream_alloc(num);
+
     /* now, scan buffers for events */
     while ( 1 )
     {
@@ -734,6 +864,19 @@ static int monitor_tbufs(void)
             start_offset = cons % data_size;
             end_offset = prod % data_size;
 
+            if ( opts.stream )
+            {
+                /* cons is updated by stream_flush(). */
+                if ( end_offset > start_offset )
+                    stream_window(i, data[i] + start_offset, window_size,
+                                  NULL, 0, prod);
+                else
+                    stream_window(i, data[i] + start_offset,
+                                  data_size - start_offset,
+                                  data[i], end_offset, prod);
+                continue;
+            }
+
             if ( end_offset > start_offset )
             {
                 /* If window does not wrap, write in one big chunk */
@@ -760,6 +903,9 @@ static int monitor_tbufs(void)
 
         }
 
+        if ( opts.stream )
+            stream_flush(meta);
+
         if ( interrupted )
         {
             if ( last_read )
@@ -832,6 +978,9 @@ static void usage(void)
 "  -V, --version           Print program version\n" \
 "  -M, --memory-buffer=b   Copy trace records to a circular memory buffer.\n" \
 "                          Dump to file on exit.\n" \
+"  -w, --stream            Write all buffers with one system call per pass,\n" \
+"                          straight from the mapped trace buffers, and only\n" \
+"                          wake up on VIRQ_TBUF unless -s is also given.\n" \
 "  -r  --reserve-disk-space=n Before writing trace records to disk, check to see\n" \
 "                          that after the write there will be at least n space\n" \
 "                          left on the disk.\n" \
@@ -1080,6 +1229,7 @@ static void parse_args(int argc, char **argv)
         { "reserve-disk-space", required_argument, 0, 'r' },
         { "time-interval",  required_argument, 0, 'T' },
         { "memory-buffer",  required_argument, 0, 'M' },
+        { "stream",         no_argument,       0, 'w' },
         { "discard-buffers", no_argument,      0, 'D' },
         { "dont-disable-tracing", no_argument, 0, 'x' },
         { "start-disabled", no_argument,       0, 'X' },
@@ -1088,7 +1238,7 @@ static void parse_args(int argc, char **argv)
         { 0, 0, 0, 0 }
     };
 
-    while ( (option = getopt_long(argc, argv, "t:s:c:e:S:r:T:M:DxX?V",
+    while ( (option = getopt_long(argc, argv, "t:s:c:e:S:r:T:M:wDxX?V",
                     long_options, NULL)) != -1) 
     {
         switch ( option )
@@ -1137,6 +1287,10 @@ static void parse_args(int argc, char **argv)
             opts.memory_buffer = sargtol(optarg, 0);
             break;
 
+        case 'w':
+            opts.stream = 1;
+            break;
+
         default:
             usage();
         }
@@ -1146,6 +1300,16 @@ static void parse_args(int argc, char **argv)
     if (optind != (argc-1))
         usage();
 
+    if ( opts.stream && opts.memory_buffer )
+    {
+        fprintf(stderr, "--stream and --memory-buffer are exclusive\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Without a poll sleep, only the high water VIRQ wakes up streaming. */
+    if ( opts.poll_sleep == POLL_FOREVER && !opts.stream )
+        opts.poll_sleep = POLL_SLEEP_MILLIS;
+
     opts.outfile = argv[optind];
 }
 
@@ -1160,7 +1324,7 @@ int main(int argc, char **argv)
     struct sigaction act;
 
     opts.outfile = 0;
-    opts.poll_sleep = POLL_SLEEP_MILLIS;
+    opts.poll_sleep = POLL_FOREVER;
     opts.evt_mask = 0;
     opts.cpu_mask_str = NULL;
     opts.disk_rsvd = 0;
@@ -1209,6 +1373,13 @@ int main(int argc, char **argv)
     if ( opts.memory_buffer > 0 )
         membuf_alloc(opts.memory_buffer);
 
+    if ( pipe(wakeup_pipe) ||
+         fcntl(wakeup_pipe[1], F_SETFL, O_NONBLOCK) )
+    {
+        perror("Could not create wakeup pipe");
+        exit(EXIT_FAILURE);
+    }
+
     /* ensure that if we get a signal, we'll do cleanup, then exit */
     act.sa_handler = close_handler;
     act.sa_flags = 0;
@@ -151,7 +151,9 @@ struct cmd_spec cmd_table[] = {
       "[options] <Domain> <CheckpointFile> [<ConfigFile>]",
       "-h  Print this help.\n"
       "-c  Leave domain running after creating the snapshot.\n"
-      "-p  Leave domain paused after creating the snapshot."
+      "-p  Leave domain paused after creating the snapshot.\n"
+      "--parallel  Map and write the guest's memory from several threads.\n"
+      "--compress  Skip zero pages and compress the rest."
     },
     { "migrate",
       &main_migrate, 0, 1,
@@ -165,7 +167,15 @@ struct cmd_spec cmd_table[] = {
       "-e              Do not wait in the background (on <host>) for the death\n"
       "                of the domain.\n"
       "--debug         Print huge (!) amount of debug during the migration process.\n"
-      "-p              Do not unpause domain after migrating it."
+      "-p              Do not unpause domain after migrating it.\n"
+      "--max-downtime <ms> Iterate until the guest can be moved within <ms>\n"
+      "                milliseconds of downtime, instead of a fixed number of\n"
+      "                iterations.\n"
+      "--throttle      With --max-downtime, slow the guest's vcpus down if it\n"
+      "                dirties memory too quickly to converge.\n"
+      "--parallel      Map and send the guest's memory from several threads.\n"
+      "--compress      Skip zero pages and compress the rest.  <host> must\n"
+      "                run a version of Xen which supports this."
     },
     { "restore",
       &main_restore, 0, 1,
@@ -177,7 +177,8 @@ static void migrate_do_preamble(int send_fd, int recv_fd, pid_t child,
 }
 
 static void migrate_domain(uint32_t domid, const char *rune, int debug,
-                           const char *override_config_file)
+                           const char *override_config_file,
+                           const libxl_domain_suspend_params *params)
 {
     pid_t child = -1;
     int rc;
@@ -205,7 +206,7 @@ static void migrate_domain(uint32_t domid, const char *rune, int debug,
 
     if (debug)
         flags |= LIBXL_SUSPEND_DEBUG;
-    rc = libxl_domain_suspend(ctx, domid, send_fd, flags, NULL);
+    rc = libxl_domain_suspend(ctx, domid, send_fd, flags, params, NULL);
     if (rc) {
         fprintf(stderr, "migration sender: libxl_domain_suspend failed"
                 " (rc=%d)\n", rc);
@@ -537,12 +538,20 @@ int main_migrate(int argc, char **argv)
     char *rune = NULL;
     char *host;
     int opt, daemonize = 1, monitor = 1, debug = 0, pause_after_migration = 0;
+    libxl_domain_suspend_params params;
+    char *endptr;
     static struct option opts[] = {
         {"debug", 0, 0, 0x100},
         {"live", 0, 0, 0x200},
+        {"max-downtime", 1, 0, 0x300},
+        {"throttle", 0, 0, 0x400},
+        {"parallel", 0, 0, 0x500},
+        {"compress", 0, 0, 0x600},
         COMMON_LONG_OPTS
     };
 
+    libxl_domain_suspend_params_init(&params);
+
     SWITCH_FOREACH_OPT(opt, "FC:s:ep", opts, "migrate", 2) {
     case 'C':
         config_filename = optarg;
@@ -566,6 +575,22 @@ int main_migrate(int argc, char **argv)
     case 0x200: /* --live */
         /* ignored for compatibility with xm */
         break;
+    case 0x300: /* --max-downtime */
+        params.max_downtime_ms = strtoul(optarg, &endptr, 10);
+        if (*endptr != '\0' || !params.max_downtime_ms) {
+            fprintf(stderr, "Invalid downtime target '%s'\n", optarg);
+            return EXIT_FAILURE;
+        }
+        break;
+    case 0x400: /* --throttle */
+        libxl_defbool_set(&params.throttle, true);
+        break;
+    case 0x500: /* --parallel */
+        libxl_defbool_set(&params.parallel, true);
+        break;
+    case 0x600: /* --compress */
+        libxl_defbool_set(&params.compress, true);
+        break;
     }
 
     domid = find_domain(argv[optind]);
@@ -596,7 +621,8 @@ int main_migrate(int argc, char **argv)
                   pause_after_migration ? " -p" : "");
     }
 
-    migrate_domain(domid, rune, debug, config_filename);
+    migrate_domain(domid, rune, debug, config_filename, &params);
+    libxl_domain_suspend_params_dispose(&params);
     return EXIT_SUCCESS;
 }
 
@@ -120,7 +120,8 @@ void save_domain_core_writeconfig(int fd, const char *source,
 }
 
 static int save_domain(uint32_t domid, const char *filename, int checkpoint,
-                            int leavepaused, const char *override_config_file)
+                            int leavepaused, const char *override_config_file,
+                            const libxl_domain_suspend_params *params)
 {
     int fd;
     uint8_t *config_data;
@@ -141,7 +142,7 @@ static int save_domain(uint32_t domid, const char *filename, int checkpoint,
 
     save_domain_core_writeconfig(fd, filename, config_data, config_len);
 
-    int rc = libxl_domain_suspend(ctx, domid, fd, 0, NULL);
+    int rc = libxl_domain_suspend(ctx, domid, fd, 0, params, NULL);
     close(fd);
 
     if (rc < 0) {
@@ -236,14 +237,28 @@ int main_save(int argc, char **argv)
     int checkpoint = 0;
     int leavepaused = 0;
     int opt;
+    libxl_domain_suspend_params params;
+    static struct option opts[] = {
+        {"parallel", 0, 0, 0x100},
+        {"compress", 0, 0, 0x200},
+        COMMON_LONG_OPTS
+    };
 
-    SWITCH_FOREACH_OPT(opt, "cp", NULL, "save", 2) {
+    libxl_domain_suspend_params_init(&params);
+
+    SWITCH_FOREACH_OPT(opt, "cp", opts, "save", 2) {
     case 'c':
         checkpoint = 1;
         break;
     case 'p':
         leavepaused = 1;
         break;
+    case 0x100: /* --parallel */
+        libxl_defbool_set(&params.parallel, true);
+        break;
+    case 0x200: /* --compress */
+        libxl_defbool_set(&params.compress, true);
+        break;
     }
 
     if (argc-optind > 3) {
@@ -256,7 +271,8 @@ int main_save(int argc, char **argv)
     if ( argc - optind >= 3 )
         config_filename = argv[optind + 2];
 
-    save_domain(domid, filename, checkpoint, leavepaused, config_filename);
+    save_domain(domid, filename, checkpoint, leavepaused, config_filename,
+                &params);
     return EXIT_SUCCESS;
 }
 
@@ -3982,32 +3982,18 @@ static int hvm_allow_set_param(struct domain *d,
     return rc;
 }
 
-static int hvmop_set_param(
-    XEN_GUEST_HANDLE_PARAM(xen_hvm_param_t) arg)
+/*
+ * Set an HVM parameter of a domain, with the side effects the hypercall has.
+ * Permission checks are left to the caller.
+ */
+int hvm_set_param(struct domain *d, uint32_t index, uint64_t value)
 {
     struct domain *curr_d = current->domain;
-    struct xen_hvm_param a;
-    struct domain *d;
+    struct xen_hvm_param a = { .index = index, .value = value };
     struct vcpu *v;
-    int rc;
-
-    if ( copy_from_guest(&a, arg, 1) )
-        return -EFAULT;
-
-    if ( a.index >= HVM_NR_PARAMS )
-        return -EINVAL;
-
-    d = rcu_lock_domain_by_any_id(a.domid);
-    if ( d == NULL )
-        return -ESRCH;
-
-    rc = -EINVAL;
-    if ( !is_hvm_domain(d) )
-        goto out;
+    int rc = 0;
 
-    rc = hvm_allow_set_param(d, &a);
-    if ( rc )
-        goto out;
+    ASSERT(index < HVM_NR_PARAMS);
 
     switch ( a.index )
     {
@@ -4186,13 +4172,43 @@ static int hvmop_set_param(
     }
 
     if ( rc != 0 )
-        goto out;
+        return rc;
 
     d->arch.hvm_domain.params[a.index] = a.value;
 
     HVM_DBG_LOG(DBG_LEVEL_HCALL, "set param %u = %"PRIx64,
                 a.index, a.value);
 
+    return 0;
+}
+
+static int hvmop_set_param(
+    XEN_GUEST_HANDLE_PARAM(xen_hvm_param_t) arg)
+{
+    struct xen_hvm_param a;
+    struct domain *d;
+    int rc;
+
+    if ( copy_from_guest(&a, arg, 1) )
+        return -EFAULT;
+
+    if ( a.index >= HVM_NR_PARAMS )
+        return -EINVAL;
+
+    d = rcu_lock_domain_by_any_id(a.domid);
+    if ( d == NULL )
+        return -ESRCH;
+
+    rc = -EINVAL;
+    if ( !is_hvm_domain(d) )
+        goto out;
+
+    rc = hvm_allow_set_param(d, &a);
+    if ( rc )
+        goto out;
+
+    rc = hvm_set_param(d, a.index, a.value);
+
  out:
     rcu_unlock_domain(d);
     return rc;
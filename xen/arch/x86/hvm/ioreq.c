@@ -26,6 +26,8 @@
 #include <xen/domain.h>
 #include <xen/event.h>
 #include <xen/paging.h>
+#include <xen/perfc.h>
+#include <xen/sort.h>
 
 #include <asm/hvm/hvm.h>
 #include <asm/hvm/ioreq.h>
@@ -679,6 +681,503 @@ static ioservid_t next_ioservid(struct domain *d)
     return id;
 }
 
+struct ioreq_index_ctxt {
+    struct hvm_ioreq_range *ranges;
+    unsigned int nr, max;
+    struct hvm_ioreq_server *s;
+};
+
+static int count_range(unsigned long s, unsigned long e, void *arg)
+{
+    ++*(unsigned int *)arg;
+
+    return 0;
+}
+
+static int add_range(unsigned long s, unsigned long e, void *arg)
+{
+    struct ioreq_index_ctxt *ctxt = arg;
+
+    if ( ctxt->nr == ctxt->max )
+        return -ENOSPC;
+
+    ctxt->ranges[ctxt->nr].start = s;
+    ctxt->ranges[ctxt->nr].end = e;
+    ctxt->ranges[ctxt->nr].s = ctxt->s;
+    ctxt->nr++;
+
+    return 0;
+}
+
+static int cmp_range(const void *a, const void *b)
+{
+    const struct hvm_ioreq_range *l = a, *r = b;
+
+    return (l->start > r->start) - (l->start < r->start);
+}
+
+/* Return the number of entries in ranges[] starting at or below addr. */
+static unsigned int hvm_ioreq_index_bound(const struct hvm_ioreq_range *ranges,
+                                          unsigned int nr, uint64_t addr)
+{
+    unsigned int lo = 0, hi = nr, mid;
+
+    while ( lo < hi )
+    {
+        mid = lo + (hi - lo) / 2;
+        if ( ranges[mid].start <= addr )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+static void hvm_ioreq_index_invalidate(struct domain *d, unsigned int type)
+{
+    struct hvm_ioreq_range *old;
+
+    write_lock(&d->arch.hvm_domain.ioreq_server.index_lock);
+    old = d->arch.hvm_domain.ioreq_server.index[type];
+    d->arch.hvm_domain.ioreq_server.index[type] = NULL;
+    d->arch.hvm_domain.ioreq_server.index_nr[type] = 0;
+    d->arch.hvm_domain.ioreq_server.index_max[type] = 0;
+    d->arch.hvm_domain.ioreq_server.index_valid[type] = false;
+    write_unlock(&d->arch.hvm_domain.ioreq_server.index_lock);
+
+    xfree(old);
+}
+
+/*
+ * Merge the ranges of all enabled servers into one sorted array for type.
+ * Each server's rangeset coalesces adjacent ranges, so as long as servers
+ * don't overlap, an access is claimed by a server if and only if it lies
+ * within a single entry.  Overlapping servers are rare enough to leave to
+ * the scan, which picks whichever comes first in the list.
+ */
+static void hvm_ioreq_rebuild_type(struct domain *d, unsigned int type)
+{
+    struct hvm_ioreq_server *s;
+    struct ioreq_index_ctxt ctxt = { .nr = 0, .max = 0 };
+    struct hvm_ioreq_range *old;
+    bool valid = true;
+    unsigned int i;
+
+    ASSERT(spin_is_locked(&d->arch.hvm_domain.ioreq_server.lock));
+
+    list_for_each_entry ( s,
+                          &d->arch.hvm_domain.ioreq_server.list,
+                          list_entry )
+    {
+        if ( s == d->arch.hvm_domain.default_ioreq_server ||
+             !s->enabled )
+            continue;
+
+        rangeset_report_ranges(s->range[type], 0, ~0UL, count_range,
+                               &ctxt.max);
+    }
+
+    if ( ctxt.max )
+    {
+        ctxt.ranges = xmalloc_array(struct hvm_ioreq_range, ctxt.max);
+        valid = ctxt.ranges;
+    }
+
+    list_for_each_entry ( s,
+                          &d->arch.hvm_domain.ioreq_server.list,
+                          list_entry )
+    {
+        if ( !valid )
+            break;
+
+        if ( s == d->arch.hvm_domain.default_ioreq_server ||
+             !s->enabled )
+            continue;
+
+        ctxt.s = s;
+        if ( rangeset_report_ranges(s->range[type], 0, ~0UL, add_range,
+                                    &ctxt) )
+            valid = false;
+    }
+
+    if ( valid )
+    {
+        sort(ctxt.ranges, ctxt.nr, sizeof(*ctxt.ranges), cmp_range, NULL);
+
+        for ( i = 1; i < ctxt.nr; i++ )
+            if ( ctxt.ranges[i].start <= ctxt.ranges[i - 1].end )
+            {
+                valid = false;
+                break;
+            }
+    }
+
+    if ( !valid )
+    {
+        xfree(ctxt.ranges);
+        ctxt.ranges = NULL;
+        ctxt.nr = ctxt.max = 0;
+    }
+
+    write_lock(&d->arch.hvm_domain.ioreq_server.index_lock);
+    old = d->arch.hvm_domain.ioreq_server.index[type];
+    d->arch.hvm_domain.ioreq_server.index[type] = ctxt.ranges;
+    d->arch.hvm_domain.ioreq_server.index_nr[type] = ctxt.nr;
+    d->arch.hvm_domain.ioreq_server.index_max[type] = ctxt.max;
+    d->arch.hvm_domain.ioreq_server.index_valid[type] = valid;
+    write_unlock(&d->arch.hvm_domain.ioreq_server.index_lock);
+
+    xfree(old);
+
+    perfc_incr(ioreq_index_rebuilds);
+}
+
+static void hvm_ioreq_rebuild_index(struct domain *d)
+{
+    unsigned int type;
+
+    for ( type = 0; type < NR_IO_RANGE_TYPES; type++ )
+        hvm_ioreq_rebuild_type(d, type);
+}
+
+/*
+ * Make room for nr entries in the index for type.  Updates of the index
+ * are serialised by the server lock, so readers only need to be kept out
+ * while the array is swapped.
+ */
+static bool hvm_ioreq_index_reserve(struct domain *d, unsigned int type,
+                                    unsigned int nr)
+{
+    struct hvm_ioreq_range *ranges, *old;
+    unsigned int max = d->arch.hvm_domain.ioreq_server.index_max[type];
+
+    if ( nr <= max )
+        return true;
+
+    max = max(nr, max * 2);
+    ranges = xmalloc_array(struct hvm_ioreq_range, max);
+    if ( !ranges )
+        return false;
+
+    old = d->arch.hvm_domain.ioreq_server.index[type];
+    memcpy(ranges, old,
+           d->arch.hvm_domain.ioreq_server.index_nr[type] * sizeof(*ranges));
+
+    write_lock(&d->arch.hvm_domain.ioreq_server.index_lock);
+    d->arch.hvm_domain.ioreq_server.index[type] = ranges;
+    d->arch.hvm_domain.ioreq_server.index_max[type] = max;
+    write_unlock(&d->arch.hvm_domain.ioreq_server.index_lock);
+
+    xfree(old);
+
+    return true;
+}
+
+/*
+ * Replace entries [lo, hi) of the index for type with the nr_new entries in
+ * new[], which must leave the index sorted and free of overlaps.
+ */
+static void hvm_ioreq_index_splice(struct domain *d, unsigned int type,
+                                   unsigned int lo, unsigned int hi,
+                                   const struct hvm_ioreq_range *new,
+                                   unsigned int nr_new)
+{
+    struct hvm_ioreq_range *ranges;
+    unsigned int nr = d->arch.hvm_domain.ioreq_server.index_nr[type];
+
+    if ( !hvm_ioreq_index_reserve(d, type, nr - (hi - lo) + nr_new) )
+    {
+        hvm_ioreq_index_invalidate(d, type);
+        return;
+    }
+
+    write_lock(&d->arch.hvm_domain.ioreq_server.index_lock);
+    ranges = d->arch.hvm_domain.ioreq_server.index[type];
+    memmove(&ranges[lo + nr_new], &ranges[hi], (nr - hi) * sizeof(*ranges));
+    memcpy(&ranges[lo], new, nr_new * sizeof(*ranges));
+    d->arch.hvm_domain.ioreq_server.index_nr[type] = nr - (hi - lo) + nr_new;
+    write_unlock(&d->arch.hvm_domain.ioreq_server.index_lock);
+
+    perfc_incr(ioreq_index_updates);
+}
+
+static int get_range(unsigned long s, unsigned long e, void *arg)
+{
+    struct hvm_ioreq_range *range = arg;
+
+    range->start = s;
+    range->end = e;
+
+    return 0;
+}
+
+/* Find the (coalesced) range of r containing addr, if there is one. */
+static bool hvm_ioreq_find_range(struct rangeset *r, uint64_t addr,
+                                 struct hvm_ioreq_range *range)
+{
+    range->start = 1;
+    range->end = 0;
+    rangeset_report_ranges(r, addr, addr, get_range, range);
+
+    return range->start <= range->end;
+}
+
+/*
+ * Update the index after [start, end] has been added to s's rangeset for
+ * type.  The rangeset may have merged it with adjacent ranges of s, so the
+ * entries for those are replaced by one for the merged range.
+ */
+static void hvm_ioreq_index_add_range(struct domain *d,
+                                      struct hvm_ioreq_server *s,
+                                      unsigned int type, uint64_t start)
+{
+    const struct hvm_ioreq_range *ranges;
+    struct hvm_ioreq_range new;
+    unsigned int nr, lo, hi, i;
+
+    ASSERT(spin_is_locked(&d->arch.hvm_domain.ioreq_server.lock));
+
+    if ( !s->enabled )
+        return;
+
+    if ( !d->arch.hvm_domain.ioreq_server.index_valid[type] ||
+         !hvm_ioreq_find_range(s->range[type], start, &new) )
+    {
+        hvm_ioreq_rebuild_type(d, type);
+        return;
+    }
+
+    new.s = s;
+    ranges = d->arch.hvm_domain.ioreq_server.index[type];
+    nr = d->arch.hvm_domain.ioreq_server.index_nr[type];
+    lo = new.start ? hvm_ioreq_index_bound(ranges, nr, new.start - 1) : 0;
+    hi = hvm_ioreq_index_bound(ranges, nr, new.end);
+
+    /* Only s's own, now merged, entries may overlap the new one. */
+    if ( lo && ranges[lo - 1].end >= new.start )
+    {
+        hvm_ioreq_index_invalidate(d, type);
+        return;
+    }
+
+    for ( i = lo; i < hi; i++ )
+        if ( ranges[i].s != s )
+        {
+            hvm_ioreq_index_invalidate(d, type);
+            return;
+        }
+
+    hvm_ioreq_index_splice(d, type, lo, hi, &new, 1);
+}
+
+/*
+ * Update the index after [start, end] has been removed from s's rangeset
+ * for type.  The entry for the range which contained it is replaced by the
+ * pieces remaining on either side, if any.
+ */
+static void hvm_ioreq_index_remove_range(struct domain *d,
+                                         struct hvm_ioreq_server *s,
+                                         unsigned int type, uint64_t start,
+                                         uint64_t end)
+{
+    const struct hvm_ioreq_range *ranges;
+    struct hvm_ioreq_range new[2];
+    unsigned int nr_new = 0, pos;
+    uint64_t old_start = start;
+
+    ASSERT(spin_is_locked(&d->arch.hvm_domain.ioreq_server.lock));
+
+    if ( !s->enabled )
+        return;
+
+    if ( !d->arch.hvm_domain.ioreq_server.index_valid[type] )
+    {
+        hvm_ioreq_rebuild_type(d, type);
+        return;
+    }
+
+    if ( start && hvm_ioreq_find_range(s->range[type], start - 1, &new[0]) )
+    {
+        old_start = new[0].start;
+        new[nr_new++].s = s;
+    }
+
+    if ( end != ~0UL &&
+         hvm_ioreq_find_range(s->range[type], end + 1, &new[nr_new]) )
+        new[nr_new++].s = s;
+
+    ranges = d->arch.hvm_domain.ioreq_server.index[type];
+    pos = hvm_ioreq_index_bound(ranges,
+                                d->arch.hvm_domain.ioreq_server.index_nr[type],
+                                old_start);
+    if ( !pos || ranges[pos - 1].start != old_start ||
+         ranges[pos - 1].s != s )
+    {
+        ASSERT_UNREACHABLE();
+        hvm_ioreq_rebuild_type(d, type);
+        return;
+    }
+
+    hvm_ioreq_index_splice(d, type, pos - 1, pos, new, nr_new);
+}
+
+/*
+ * Merge the ranges of s for type into the index, in one pass over both.
+ * Returns false if they overlap another server's or memory runs out.
+ */
+static bool hvm_ioreq_index_merge(struct domain *d, struct hvm_ioreq_server *s,
+                                  unsigned int type)
+{
+    struct ioreq_index_ctxt ctxt = { .nr = 0, .max = 0, .s = s };
+    struct hvm_ioreq_range *old, *ranges, next;
+    unsigned int nr, i = 0, j = 0, n = 0;
+    bool ok = false;
+
+    rangeset_report_ranges(s->range[type], 0, ~0UL, count_range, &ctxt.max);
+    if ( !ctxt.max )
+        return true;
+
+    old = d->arch.hvm_domain.ioreq_server.index[type];
+    nr = d->arch.hvm_domain.ioreq_server.index_nr[type];
+    ranges = xmalloc_array(struct hvm_ioreq_range, nr + ctxt.max);
+    ctxt.ranges = xmalloc_array(struct hvm_ioreq_range, ctxt.max);
+    if ( !ranges || !ctxt.ranges ||
+         rangeset_report_ranges(s->range[type], 0, ~0UL, add_range, &ctxt) )
+        goto out;
+
+    while ( i < nr || j < ctxt.nr )
+    {
+        if ( j == ctxt.nr ||
+             (i < nr && old[i].start < ctxt.ranges[j].start) )
+            next = old[i++];
+        else
+            next = ctxt.ranges[j++];
+
+        if ( n && next.start <= ranges[n - 1].end )
+            goto out;
+
+        ranges[n++] = next;
+    }
+
+    write_lock(&d->arch.hvm_domain.ioreq_server.index_lock);
+    d->arch.hvm_domain.ioreq_server.index[type] = ranges;
+    d->arch.hvm_domain.ioreq_server.index_nr[type] = n;
+    d->arch.hvm_domain.ioreq_server.index_max[type] = nr + ctxt.max;
+    write_unlock(&d->arch.hvm_domain.ioreq_server.index_lock);
+
+    ranges = old;
+    ok = true;
+    perfc_incr(ioreq_index_updates);
+
+ out:
+    xfree(ranges);
+    xfree(ctxt.ranges);
+
+    return ok;
+}
+
+/* Add the ranges of a server which has just been enabled to the index. */
+static void hvm_ioreq_index_add_server(struct domain *d,
+                                       struct hvm_ioreq_server *s)
+{
+    unsigned int type;
+
+    ASSERT(spin_is_locked(&d->arch.hvm_domain.ioreq_server.lock));
+
+    for ( type = 0; type < NR_IO_RANGE_TYPES; type++ )
+    {
+        if ( !d->arch.hvm_domain.ioreq_server.index_valid[type] )
+            hvm_ioreq_rebuild_type(d, type);
+        else if ( !hvm_ioreq_index_merge(d, s, type) )
+            hvm_ioreq_index_invalidate(d, type);
+    }
+}
+
+/* Drop the entries of a server which has just been disabled. */
+static void hvm_ioreq_index_remove_server(struct domain *d,
+                                          struct hvm_ioreq_server *s)
+{
+    unsigned int type;
+
+    ASSERT(spin_is_locked(&d->arch.hvm_domain.ioreq_server.lock));
+
+    for ( type = 0; type < NR_IO_RANGE_TYPES; type++ )
+    {
+        struct hvm_ioreq_range *ranges;
+        unsigned int nr, i, n;
+
+        if ( !d->arch.hvm_domain.ioreq_server.index_valid[type] )
+        {
+            hvm_ioreq_rebuild_type(d, type);
+            continue;
+        }
+
+        write_lock(&d->arch.hvm_domain.ioreq_server.index_lock);
+        ranges = d->arch.hvm_domain.ioreq_server.index[type];
+        nr = d->arch.hvm_domain.ioreq_server.index_nr[type];
+        for ( i = n = 0; i < nr; i++ )
+            if ( ranges[i].s != s )
+                ranges[n++] = ranges[i];
+        d->arch.hvm_domain.ioreq_server.index_nr[type] = n;
+        write_unlock(&d->arch.hvm_domain.ioreq_server.index_lock);
+
+        perfc_incr(ioreq_index_updates);
+    }
+}
+
+/*
+ * Look up the server claiming [start, end] in the index.  Returns false if
+ * there is no valid index for the type; otherwise *ps is the server, or
+ * NULL if no server claims the whole access.
+ */
+static bool hvm_ioreq_index_lookup(struct domain *d, unsigned int type,
+                                   uint64_t start, uint64_t end,
+                                   struct hvm_ioreq_server **ps)
+{
+    const struct hvm_ioreq_range *ranges;
+    unsigned int pos;
+    bool found = false;
+
+    read_lock(&d->arch.hvm_domain.ioreq_server.index_lock);
+
+    if ( !d->arch.hvm_domain.ioreq_server.index_valid[type] )
+        goto out;
+
+    found = true;
+    *ps = NULL;
+
+    /* Find the last entry starting at or below start. */
+    ranges = d->arch.hvm_domain.ioreq_server.index[type];
+    pos = hvm_ioreq_index_bound(ranges,
+                                d->arch.hvm_domain.ioreq_server.index_nr[type],
+                                start);
+
+    if ( pos && end >= start && end <= ranges[pos - 1].end )
+        *ps = ranges[pos - 1].s;
+
+ out:
+    read_unlock(&d->arch.hvm_domain.ioreq_server.index_lock);
+
+    return found;
+}
+
+static void hvm_ioreq_free_index(struct domain *d)
+{
+    unsigned int type;
+
+    write_lock(&d->arch.hvm_domain.ioreq_server.index_lock);
+    for ( type = 0; type < NR_IO_RANGE_TYPES; type++ )
+    {
+        xfree(d->arch.hvm_domain.ioreq_server.index[type]);
+        d->arch.hvm_domain.ioreq_server.index[type] = NULL;
+        d->arch.hvm_domain.ioreq_server.index_nr[type] = 0;
+        d->arch.hvm_domain.ioreq_server.index_max[type] = 0;
+        d->arch.hvm_domain.ioreq_server.index_valid[type] = false;
+    }
+    write_unlock(&d->arch.hvm_domain.ioreq_server.index_lock);
+}
+
 int hvm_create_ioreq_server(struct domain *d, domid_t domid,
                             bool_t is_default, int bufioreq_handling,
                             ioservid_t *id)
@@ -757,6 +1256,8 @@ int hvm_destroy_ioreq_server(struct domain *d, ioservid_t id)
 
         list_del(&s->list_entry);
 
+        hvm_ioreq_rebuild_index(d);
+
         hvm_ioreq_server_deinit(s, 0);
 
         domain_unpause(d);
@@ -853,6 +1354,8 @@ int hvm_map_io_range_to_ioreq_server(struct domain *d, ioservid_t id,
                 break;
 
             rc = rangeset_add_range(r, start, end);
+            if ( !rc )
+                hvm_ioreq_index_add_range(d, s, type, start);
             break;
         }
     }
@@ -905,6 +1408,8 @@ int hvm_unmap_io_range_from_ioreq_server(struct domain *d, ioservid_t id,
                 break;
 
             rc = rangeset_remove_range(r, start, end);
+            if ( !rc )
+                hvm_ioreq_index_remove_range(d, s, type, start, end);
             break;
         }
     }
@@ -939,9 +1444,15 @@ int hvm_set_ioreq_server_state(struct domain *d, ioservid_t id,
         domain_pause(d);
 
         if ( enabled )
+        {
             hvm_ioreq_server_enable(s, 0);
+            hvm_ioreq_index_add_server(d, s);
+        }
         else
+        {
             hvm_ioreq_server_disable(s, 0);
+            hvm_ioreq_index_remove_server(d, s);
+        }
 
         domain_unpause(d);
 
@@ -1027,6 +1538,8 @@ void hvm_destroy_all_ioreq_servers(struct domain *d)
         xfree(s);
     }
 
+    hvm_ioreq_free_index(d);
+
     spin_unlock_recursive(&d->arch.hvm_domain.ioreq_server.lock);
 }
 
@@ -1110,7 +1623,7 @@ struct hvm_ioreq_server *hvm_select_ioreq_server(struct domain *d,
     struct hvm_ioreq_server *s;
     uint32_t cf8;
     uint8_t type;
-    uint64_t addr;
+    uint64_t addr, start, end;
 
     if ( list_empty(&d->arch.hvm_domain.ioreq_server.list) )
         return NULL;
@@ -1158,6 +1671,39 @@ struct hvm_ioreq_server *hvm_select_ioreq_server(struct domain *d,
         addr = p->addr;
     }
 
+    switch ( type )
+    {
+    case XEN_DMOP_IO_RANGE_PORT:
+        start = addr;
+        end = addr + p->size - 1;
+        break;
+    case XEN_DMOP_IO_RANGE_MEMORY:
+        start = addr;
+        end = addr + (p->size * p->count) - 1;
+        break;
+    default:
+        start = end = addr >> 32;
+        break;
+    }
+
+    if ( hvm_ioreq_index_lookup(d, type, start, end, &s) )
+    {
+        perfc_incr(ioreq_select_indexed);
+
+        if ( !s )
+            return d->arch.hvm_domain.default_ioreq_server;
+
+        if ( type == XEN_DMOP_IO_RANGE_PCI )
+        {
+            p->type = IOREQ_TYPE_PCI_CONFIG;
+            p->addr = addr;
+        }
+
+        return s;
+    }
+
+    perfc_incr(ioreq_select_scanned);
+
     list_for_each_entry ( s,
                           &d->arch.hvm_domain.ioreq_server.list,
                           list_entry )
@@ -1384,9 +1930,15 @@ static int hvm_access_cf8(
 
 void hvm_ioreq_init(struct domain *d)
 {
+    unsigned int type;
+
     spin_lock_init(&d->arch.hvm_domain.ioreq_server.lock);
     INIT_LIST_HEAD(&d->arch.hvm_domain.ioreq_server.list);
 
+    rwlock_init(&d->arch.hvm_domain.ioreq_server.index_lock);
+    for ( type = 0; type < NR_IO_RANGE_TYPES; type++ )
+        d->arch.hvm_domain.ioreq_server.index_valid[type] = true;
+
     register_portio_handler(d, 0xcf8, 4, hvm_access_cf8);
 }
 
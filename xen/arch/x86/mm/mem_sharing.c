@@ -30,12 +30,17 @@
 #include <xen/rcupdate.h>
 #include <xen/guest_access.h>
 #include <xen/vm_event.h>
+#include <xen/vmap.h>
+#include <xen/hvm/save.h>
 #include <asm/page.h>
 #include <asm/string.h>
 #include <asm/p2m.h>
 #include <asm/altp2m.h>
 #include <asm/atomic.h>
 #include <asm/event.h>
+#include <asm/time.h>
+#include <asm/hvm/hvm.h>
+#include <public/hvm/params.h>
 #include <xsm/xsm.h>
 
 #include "mm-locks.h"
@@ -1265,6 +1270,17 @@ int relinquish_shared_pages(struct domain *d)
     }
 
     p2m_unlock(p2m);
+
+    /* A fork no longer needs its parent once all of its pages are gone. */
+    if ( !rc && mem_sharing_is_fork(d) )
+    {
+        struct domain *parent = d->arch.hvm_domain.fork_parent;
+
+        d->arch.hvm_domain.fork_parent = NULL;
+        domain_unpause(parent);
+        put_domain(parent);
+    }
+
     return rc;
 }
 
@@ -1319,6 +1335,260 @@ static int range_share(struct domain *d, struct domain *cd,
     return rc;
 }
 
+/*
+ * A fork starts out with an empty p2m, and its memory is populated from its
+ * parent by mem_sharing_fork_page() as the fork touches it.  This is called
+ * from the p2m lookup after it dropped the fork's p2m lock, so that both
+ * p2m locks are only ever taken together in the order of get_two_gfns().
+ */
+int mem_sharing_fork_page(struct domain *d, gfn_t gfn, bool_t unsharing)
+{
+    struct domain *parent = d->arch.hvm_domain.fork_parent;
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    struct page_info *page, *new_page;
+    shr_handle_t handle;
+    p2m_type_t p2mt;
+    p2m_access_t a;
+    mfn_t new_mfn;
+    int rc;
+
+    ASSERT(!p2m_locked_by_me(p2m));
+
+    if ( !parent )
+        return -ENOENT;
+
+    /*
+     * Only RAM comes from the parent.  The parent is paused, so peeking at
+     * its p2m without the lock keeps emulated MMIO accesses cheap.
+     */
+    get_gfn_query_unlocked(parent, gfn_x(gfn), &p2mt);
+    if ( !p2m_is_ram(p2mt) )
+        return -ENOENT;
+
+    /* Reads share the parent's page, if it can be shared. */
+    if ( !unsharing &&
+         !nominate_page(parent, gfn, 0, &handle) &&
+         !mem_sharing_add_to_physmap(parent, gfn_x(gfn), handle,
+                                     d, gfn_x(gfn)) )
+        return 0;
+
+    /* Writes, and pages of the parent that cannot be shared, are copied. */
+    page = get_page_from_gfn(parent, gfn_x(gfn), &p2mt, P2M_ALLOC);
+    if ( !page )
+        return -ENOENT;
+    if ( !p2m_is_ram(p2mt) )
+    {
+        put_page(page);
+        return -ENOENT;
+    }
+
+    new_page = alloc_domheap_page(d, 0);
+    if ( !new_page )
+    {
+        put_page(page);
+        return -ENOMEM;
+    }
+
+    new_mfn = page_to_mfn(new_page);
+    copy_domain_page(new_mfn, page_to_mfn(page));
+    put_page(page);
+
+    /* Another vCPU may have populated the gfn while it was unlocked. */
+    gfn_lock(p2m, gfn_x(gfn), 0);
+    p2m->get_entry(p2m, gfn_x(gfn), &p2mt, &a, 0, NULL, NULL);
+    if ( p2mt == p2m_invalid || p2mt == p2m_mmio_dm )
+        rc = p2m_set_entry(p2m, gfn_x(gfn), new_mfn, PAGE_ORDER_4K,
+                           p2m_ram_rw, p2m->default_access);
+    else
+        rc = -EEXIST;
+    if ( !rc )
+        set_gpfn_from_mfn(mfn_x(new_mfn), gfn_x(gfn));
+    gfn_unlock(p2m, gfn_x(gfn), 0);
+
+    if ( rc )
+    {
+        if ( test_and_clear_bit(_PGC_allocated, &new_page->count_info) )
+            put_page(new_page);
+        return rc == -EEXIST ? 0 : rc;
+    }
+
+    return 0;
+}
+
+/* Copy the parameters, TSC settings and HVM context of d to the fork cd. */
+static int fork_hvm_state(struct domain *cd, struct domain *d)
+{
+    struct hvm_domain_context c = { 0 };
+    uint32_t tsc_mode, gtsc_khz, incarnation;
+    uint64_t elapsed_nsec;
+    unsigned int i;
+    int rc;
+
+    for ( i = 0; i < HVM_NR_PARAMS; i++ )
+    {
+        uint64_t value = d->arch.hvm_domain.params[i];
+
+        switch ( i )
+        {
+        /*
+         * Setting the identity map would take the domctl lock to update
+         * the vCPUs' CR3, which loading their context does anyway.
+         */
+        case HVM_PARAM_IDENT_PT:
+            cd->arch.hvm_domain.params[i] = value;
+            continue;
+        /*
+         * Event channels are not copied, and the fork has no ioreq server
+         * to own the ioreq pages.
+         */
+        case HVM_PARAM_STORE_EVTCHN:
+        case HVM_PARAM_CONSOLE_EVTCHN:
+        case HVM_PARAM_BUFIOREQ_EVTCHN:
+        case HVM_PARAM_IOREQ_PFN:
+        case HVM_PARAM_BUFIOREQ_PFN:
+        case HVM_PARAM_IOREQ_SERVER_PFN:
+        case HVM_PARAM_NR_IOREQ_SERVER_PAGES:
+            continue;
+        }
+
+        if ( !value )
+            continue;
+
+        rc = hvm_set_param(cd, i, value);
+        if ( rc )
+        {
+            gdprintk(XENLOG_WARNING, "d%d: cannot copy HVM param %u: %d\n",
+                     cd->domain_id, i, rc);
+            return rc;
+        }
+    }
+
+    tsc_get_info(d, &tsc_mode, &elapsed_nsec, &gtsc_khz, &incarnation);
+    tsc_set_info(cd, tsc_mode, elapsed_nsec, gtsc_khz, incarnation);
+
+    c.size = hvm_save_size(d);
+    if ( (c.data = vmalloc(c.size)) == NULL )
+        return -ENOMEM;
+
+    rc = hvm_save(d, &c);
+    if ( !rc )
+    {
+        c.size = c.cur;
+        c.cur = 0;
+        rc = hvm_load(cd, &c);
+    }
+
+    vfree(c.data);
+    return rc;
+}
+
+/*
+ * Map the fork's shared info and vCPU info where the parent has them, as
+ * these are per domain and vCPU pages rather than guest memory.
+ */
+static int fork_shared_pages(struct domain *cd, struct domain *d)
+{
+    union xen_add_to_physmap_batch_extra extra = { 0 };
+    unsigned long gfn;
+    struct vcpu *v;
+    int rc;
+
+    gfn = mfn_to_gmfn(d, virt_to_mfn(d->shared_info));
+    if ( VALID_M2P(gfn) )
+    {
+        rc = xenmem_add_to_physmap_one(cd, XENMAPSPACE_shared_info, extra,
+                                       0, _gfn(gfn));
+        if ( rc )
+            return rc;
+    }
+
+    for_each_vcpu ( d, v )
+    {
+        struct vcpu *cv = cd->vcpu[v->vcpu_id];
+        p2m_type_t p2mt;
+
+        if ( mfn_eq(v->vcpu_info_mfn, INVALID_MFN) )
+            continue;
+
+        /* The vCPU info page must be a private copy in the fork. */
+        gfn = mfn_to_gmfn(d, mfn_x(v->vcpu_info_mfn));
+        get_gfn_unshare(cd, gfn, &p2mt);
+        put_gfn(cd, gfn);
+
+        rc = map_vcpu_info(cv, gfn, (unsigned long)v->vcpu_info & ~PAGE_MASK);
+        if ( rc )
+            return rc;
+    }
+
+    return 0;
+}
+
+static int mem_sharing_fork(struct domain *cd, domid_t parent_domain)
+{
+    struct domain *d;
+    int rc;
+
+    rc = rcu_lock_live_remote_domain_by_id(parent_domain, &d);
+    if ( rc )
+        return rc;
+
+    /* A fork shares all of its parent's pages, as range sharing does. */
+    rc = xsm_mem_sharing_op(XSM_DM_PRIV, d, cd, XENMEM_sharing_op_share);
+    if ( rc )
+        goto out;
+
+    rc = -EINVAL;
+    if ( d == cd || !is_hvm_domain(d) || !hap_enabled(d) ||
+         d->max_vcpus != cd->max_vcpus ||
+         mem_sharing_is_fork(d) || mem_sharing_is_fork(cd) )
+        goto out;
+
+    rc = -EXDEV;
+    if ( need_iommu(d) || need_iommu(cd) )
+        goto out;
+
+    /*
+     * Both domains must be paused by the toolstack, and the fork must not
+     * have any memory yet.  Populate-on-demand and paged out pages of the
+     * parent cannot be forked.
+     */
+    rc = -EBUSY;
+    if ( !d->controller_pause_count || !cd->controller_pause_count ||
+         cd->tot_pages || p2m_get_hostp2m(d)->pod.entry_count ||
+         atomic_read(&d->paged_pages) )
+        goto out;
+
+    if ( !get_domain(d) )
+        goto out;
+
+    /*
+     * Keep the parent paused while it has forks, so that its memory does
+     * not change under them.  The fork holds this pause and its reference
+     * on the parent until relinquish_shared_pages().
+     */
+    domain_pause(d);
+    d->arch.hvm_domain.mem_sharing_enabled = 1;
+    cd->arch.hvm_domain.mem_sharing_enabled = 1;
+    cd->arch.hvm_domain.fork_parent = d;
+
+    spin_lock(&cd->page_alloc_lock);
+    cd->max_pages = d->max_pages;
+    spin_unlock(&cd->page_alloc_lock);
+
+    /*
+     * The vCPU info must be mapped while the fork's vCPUs are still down,
+     * before their context is loaded.  On failure the fork is left half
+     * set up, and should be destroyed.
+     */
+    rc = fork_shared_pages(cd, d);
+    if ( !rc )
+        rc = fork_hvm_state(cd, d);
+
+ out:
+    rcu_unlock_domain(d);
+    return rc;
+}
+
 int mem_sharing_memop(XEN_GUEST_HANDLE_PARAM(xen_mem_sharing_op_t) arg)
 {
     int rc;
@@ -1626,6 +1896,10 @@ int mem_sharing_domctl(struct domain *d, xen_domctl_mem_sharing_op_t *mec)
         }
         break;
 
+        case XEN_DOMCTL_MEM_SHARING_FORK:
+            rc = mem_sharing_fork(d, mec->u.fork.parent_domain);
+            break;
+
         default:
             rc = -ENOSYS;
     }
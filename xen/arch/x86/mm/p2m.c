@@ -372,6 +372,25 @@ mfn_t __get_gfn_type_access(struct p2m_domain *p2m, unsigned long gfn,
 
     mfn = p2m->get_entry(p2m, gfn, t, a, q, page_order, NULL);
 
+    /*
+     * Forks populate their memory from their parent on first access.  This
+     * takes the parent's p2m lock, so ours is dropped meanwhile to keep to
+     * the domain order of get_two_gfns(); it cannot be if a caller further
+     * up holds it as well, and the hole is left alone then.
+     */
+    if ( locked && (q & P2M_ALLOC) &&
+         (*t == p2m_invalid || *t == p2m_mmio_dm) &&
+         unlikely(mem_sharing_is_fork(p2m->domain)) &&
+         p2m_is_hostp2m(p2m) && p2m->lock.recurse_count == 1 )
+    {
+        gfn_unlock(p2m, gfn, 0);
+        /* Errors leave the hole, which the re-lookup below returns. */
+        (void)mem_sharing_fork_page(p2m->domain, _gfn(gfn),
+                                    !!(q & P2M_UNSHARE));
+        gfn_lock(p2m, gfn, 0);
+        mfn = p2m->get_entry(p2m, gfn, t, a, q, page_order, NULL);
+    }
+
     if ( (q & P2M_UNSHARE) && p2m_is_shared(*t) )
     {
         ASSERT(p2m_is_hostp2m(p2m));
@@ -638,20 +657,10 @@ p2m_remove_page(struct p2m_domain *p2m, unsigned long gfn, unsigned long mfn,
 
     if ( !paging_mode_translate(p2m->domain) )
     {
-        int rc = 0;
-
         if ( need_iommu(p2m->domain) )
-        {
-            for ( i = 0; i < (1 << page_order); i++ )
-            {
-                int ret = iommu_unmap_page(p2m->domain, mfn + i);
+            return iommu_unmap_pages(p2m->domain, mfn, page_order);
 
-                if ( !rc )
-                    rc = ret;
-            }
-        }
-
-        return rc;
+        return 0;
     }
 
     ASSERT(gfn_locked_by_me(p2m, gfn));
@@ -699,21 +708,10 @@ guest_physmap_add_entry(struct domain *d, gfn_t gfn, mfn_t mfn,
     {
         if ( need_iommu(d) && t == p2m_ram_rw )
         {
-            for ( i = 0; i < (1 << page_order); i++ )
-            {
-                rc = iommu_map_page(d, mfn_x(mfn_add(mfn, i)),
-                                    mfn_x(mfn_add(mfn, i)),
-                                    IOMMUF_readable|IOMMUF_writable);
-                if ( rc != 0 )
-                {
-                    while ( i-- > 0 )
-                        /* If statement to satisfy __must_check. */
-                        if ( iommu_unmap_page(d, mfn_x(mfn_add(mfn, i))) )
-                            continue;
-
-                    return rc;
-                }
-            }
+            rc = iommu_map_pages(d, mfn_x(mfn), mfn_x(mfn), page_order,
+                                 IOMMUF_readable|IOMMUF_writable);
+            if ( rc != 0 )
+                return rc;
         }
         return 0;
     }
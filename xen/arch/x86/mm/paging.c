@@ -28,6 +28,7 @@
 #include <asm/event.h>
 #include <asm/hvm/nestedhvm.h>
 #include <xen/numa.h>
+#include <xen/vmap.h>
 #include <xsm/xsm.h>
 #include <public/sched.h> /* SHUTDOWN_suspend */
 
@@ -238,6 +239,18 @@ int paging_log_dirty_enable(struct domain *d, bool_t log_global)
     return ret;
 }
 
+static void paging_free_log_dirty_list(struct domain *d)
+{
+    unsigned long *list;
+
+    paging_lock(d);
+    list = d->arch.paging.log_dirty.list;
+    d->arch.paging.log_dirty.list = NULL;
+    paging_unlock(d);
+
+    vfree(list);
+}
+
 static int paging_log_dirty_disable(struct domain *d, bool_t resuming)
 {
     int ret = 1;
@@ -251,6 +264,7 @@ static int paging_log_dirty_disable(struct domain *d, bool_t resuming)
             ret = d->arch.paging.log_dirty.ops->disable(d);
             ASSERT(ret <= 0);
         }
+        paging_free_log_dirty_list(d);
     }
 
     ret = paging_free_log_dirty_bitmap(d, ret);
@@ -262,6 +276,9 @@ static int paging_log_dirty_disable(struct domain *d, bool_t resuming)
     return ret;
 }
 
+/* Capacity of the list of dirty pfns kept for XEN_DOMCTL_SHADOW_OP_CLEAN_LIST */
+#define LOGDIRTY_LIST_ENTRIES (1U << 17)
+
 /* Mark a page as dirty, with taking guest pfn as parameter */
 void paging_mark_pfn_dirty(struct domain *d, pfn_t pfn)
 {
@@ -332,6 +349,19 @@ void paging_mark_pfn_dirty(struct domain *d, pfn_t pfn)
                      "d%d: marked mfn %" PRI_mfn " (pfn %" PRI_pfn ")\n",
                      d->domain_id, mfn_x(mfn), pfn_x(pfn));
         d->arch.paging.log_dirty.dirty_count++;
+
+        if ( d->arch.paging.log_dirty.list )
+        {
+            unsigned int idx = d->arch.paging.log_dirty.list_count;
+
+            if ( idx < LOGDIRTY_LIST_ENTRIES )
+            {
+                d->arch.paging.log_dirty.list[idx] = pfn_x(pfn);
+                d->arch.paging.log_dirty.list_count = idx + 1;
+            }
+            else
+                d->arch.paging.log_dirty.list_overflow = 1;
+        }
     }
 
 out:
@@ -436,9 +466,23 @@ static int paging_log_dirty_op(struct domain *d,
 
     paging_lock(d);
 
+    clean = (sc->op == XEN_DOMCTL_SHADOW_OP_CLEAN);
+
     if ( !d->arch.paging.preempt.dom )
+    {
         memset(&d->arch.paging.preempt.log_dirty, 0,
                sizeof(d->arch.paging.preempt.log_dirty));
+        /*
+         * Restart the list now rather than once the walk completes, so pfns
+         * dirtied behind a preempted walk stay listed.  Pfns dirtied ahead
+         * of it end up listed but already clean; CLEAN_LIST skips those.
+         */
+        if ( clean )
+        {
+            d->arch.paging.log_dirty.list_count = 0;
+            d->arch.paging.log_dirty.list_overflow = 0;
+        }
+    }
     else if ( d->arch.paging.preempt.dom != current->domain ||
               d->arch.paging.preempt.op != sc->op )
     {
@@ -448,8 +492,6 @@ static int paging_log_dirty_op(struct domain *d,
         return -EBUSY;
     }
 
-    clean = (sc->op == XEN_DOMCTL_SHADOW_OP_CLEAN);
-
     PAGING_DEBUG(LOGDIRTY, "log-dirty %s: dom %u faults=%u dirty=%u\n",
                  (clean) ? "clean" : "peek",
                  d->domain_id,
@@ -592,6 +634,158 @@ static int paging_log_dirty_op(struct domain *d,
     return rv;
 }
 
+/*
+ * Set or clear the bit of a single pfn in the log-dirty bitmap, without
+ * recording it in the list.  Returns the previous state of the bit.
+ */
+static bool paging_update_pfn_dirty(struct domain *d, pfn_t pfn, bool dirty)
+{
+    mfn_t mfn, *l4, *l3, *l2;
+    unsigned long *l1;
+    bool was_dirty;
+
+    ASSERT(paging_locked_by_me(d));
+
+    mfn = d->arch.paging.log_dirty.top;
+    if ( !mfn_valid(mfn) )
+        return false;
+
+    l4 = map_domain_page(mfn);
+    mfn = l4[L4_LOGDIRTY_IDX(pfn)];
+    unmap_domain_page(l4);
+    if ( !mfn_valid(mfn) )
+        return false;
+
+    l3 = map_domain_page(mfn);
+    mfn = l3[L3_LOGDIRTY_IDX(pfn)];
+    unmap_domain_page(l3);
+    if ( !mfn_valid(mfn) )
+        return false;
+
+    l2 = map_domain_page(mfn);
+    mfn = l2[L2_LOGDIRTY_IDX(pfn)];
+    unmap_domain_page(l2);
+    if ( !mfn_valid(mfn) )
+        return false;
+
+    l1 = map_domain_page(mfn);
+    was_dirty = dirty ? __test_and_set_bit(L1_LOGDIRTY_IDX(pfn), l1)
+                      : __test_and_clear_bit(L1_LOGDIRTY_IDX(pfn), l1);
+    unmap_domain_page(l1);
+
+    return was_dirty;
+}
+
+/*
+ * Return the list of pfns dirtied since the last clean, and clean them.
+ * The cost depends on the number of dirty pages rather than on the size of
+ * the guest.  The list is only maintained once a consumer asked for it, so
+ * the first call always fails with -ENOBUFS, as does any call after more
+ * pages were dirtied than the list can hold.  The caller is expected to do
+ * a full CLEAN in that case, which restarts the list.
+ */
+static int paging_log_dirty_list_op(struct domain *d,
+                                    struct xen_domctl_shadow_op *sc)
+{
+    unsigned long *list = NULL, *dirty;
+    unsigned int i, n, count;
+    int rv = 0;
+
+    if ( is_hvm_domain(d) && (sc->mode & XEN_DOMCTL_SHADOW_LOGDIRTY_FINAL) )
+        hvm_mapped_guest_frames_mark_dirty(d);
+
+    if ( !d->arch.paging.log_dirty.list )
+    {
+        list = vmalloc(LOGDIRTY_LIST_ENTRIES * sizeof(*list));
+        if ( !list )
+            return -ENOMEM;
+    }
+
+    domain_pause(d);
+
+    /* Flush dirty GFNs potentially cached by hardware (e.g. PML buffers). */
+    p2m_flush_hardware_cached_dirty(d);
+
+    paging_lock(d);
+
+    if ( d->arch.paging.preempt.dom )
+    {
+        paging_unlock(d);
+        domain_unpause(d);
+        vfree(list);
+        return -EBUSY;
+    }
+
+    sc->stats.fault_count = d->arch.paging.log_dirty.fault_count;
+    sc->stats.dirty_count = d->arch.paging.log_dirty.dirty_count;
+
+    if ( unlikely(d->arch.paging.log_dirty.failed_allocs) )
+    {
+        printk(XENLOG_WARNING
+               "%u failed page allocs while logging dirty pages of d%d\n",
+               d->arch.paging.log_dirty.failed_allocs, d->domain_id);
+        rv = -ENOMEM;
+        goto out;
+    }
+
+    if ( !d->arch.paging.log_dirty.list )
+    {
+        /* Pages dirtied so far were not recorded. */
+        d->arch.paging.log_dirty.list = list;
+        d->arch.paging.log_dirty.list_count = 0;
+        d->arch.paging.log_dirty.list_overflow = 1;
+        list = NULL;
+    }
+
+    count = d->arch.paging.log_dirty.list_count;
+    if ( d->arch.paging.log_dirty.list_overflow || count > sc->pages )
+    {
+        rv = -ENOBUFS;
+        goto out;
+    }
+
+    /*
+     * Clean the listed pfns, keeping only those which were still dirty: a
+     * pfn can be listed twice, or be clean already, if it was dirtied while
+     * a preempted CLEAN was walking the bitmap.
+     */
+    dirty = d->arch.paging.log_dirty.list;
+    for ( i = n = 0; i < count; i++ )
+        if ( paging_update_pfn_dirty(d, _pfn(dirty[i]), false) )
+            dirty[n++] = dirty[i];
+
+    if ( copy_to_guest(sc->dirty_bitmap, (uint8_t *)dirty,
+                       n * sizeof(*dirty)) )
+    {
+        /* Leave the pfns dirty, so the next round reports them. */
+        for ( i = 0; i < n; i++ )
+            paging_update_pfn_dirty(d, _pfn(dirty[i]), true);
+        d->arch.paging.log_dirty.list_count = n;
+        rv = -EFAULT;
+        goto out;
+    }
+
+    d->arch.paging.log_dirty.list_count = 0;
+    d->arch.paging.log_dirty.fault_count = 0;
+    d->arch.paging.log_dirty.dirty_count = 0;
+    sc->pages = n;
+
+    paging_unlock(d);
+
+    /* Safe because the domain is paused. */
+    d->arch.paging.log_dirty.ops->clean(d);
+    domain_unpause(d);
+
+    return 0;
+
+ out:
+    paging_unlock(d);
+    domain_unpause(d);
+    vfree(list);
+
+    return rv;
+}
+
 void paging_log_dirty_range(struct domain *d,
                            unsigned long begin_pfn,
                            unsigned long nr,
@@ -744,6 +938,13 @@ int paging_domctl(struct domain *d, xen_domctl_shadow_op_t *sc,
         if ( sc->mode & ~XEN_DOMCTL_SHADOW_LOGDIRTY_FINAL )
             return -EINVAL;
         return paging_log_dirty_op(d, sc, resuming);
+
+    case XEN_DOMCTL_SHADOW_OP_CLEAN_LIST:
+        if ( sc->mode & ~XEN_DOMCTL_SHADOW_LOGDIRTY_FINAL )
+            return -EINVAL;
+        if ( !paging_mode_log_dirty(d) )
+            return -EINVAL;
+        return paging_log_dirty_list_op(d, sc);
     }
 
     /* Here, dispatch domctl to the appropriate paging code */
@@ -810,6 +1011,7 @@ int paging_teardown(struct domain *d)
         return -ERESTART;
 
     /* clean up log dirty resources. */
+    paging_free_log_dirty_list(d);
     rc = paging_free_log_dirty_bitmap(d, 0);
     if ( rc == -ERESTART )
         return rc;
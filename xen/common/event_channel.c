@@ -156,27 +156,83 @@ static void free_evtchn_bucket(struct domain *d, struct evtchn *bucket)
     xfree(bucket);
 }
 
+/*
+ * Ports which are not ECS_FREE are tracked in d->evtchn_inuse, so that a
+ * free port can be found with a bitmap search rather than by looking at
+ * every struct evtchn.  All updates happen with d->event_lock held.
+ */
+static int grow_evtchn_inuse(struct domain *d, unsigned int nr)
+{
+    unsigned long *inuse;
+    unsigned int size = max(d->evtchn_inuse_size, (unsigned int)BITS_PER_LONG);
+
+    if ( nr <= d->evtchn_inuse_size )
+        return 0;
+
+    while ( size < nr )
+        size <<= 1;
+
+    inuse = xzalloc_array(unsigned long, BITS_TO_LONGS(size));
+    if ( !inuse )
+        return -ENOMEM;
+
+    if ( d->evtchn_inuse )
+        memcpy(inuse, d->evtchn_inuse,
+               BITS_TO_LONGS(d->evtchn_inuse_size) * sizeof(*inuse));
+    xfree(d->evtchn_inuse);
+    d->evtchn_inuse = inuse;
+    d->evtchn_inuse_size = size;
+
+    return 0;
+}
+
+static void evtchn_set_inuse(struct domain *d, const struct evtchn *chn)
+{
+    ASSERT(spin_is_locked(&d->event_lock));
+    __set_bit(chn->port, d->evtchn_inuse);
+}
+
+static void evtchn_clear_inuse(struct domain *d, const struct evtchn *chn)
+{
+    ASSERT(spin_is_locked(&d->event_lock));
+    __clear_bit(chn->port, d->evtchn_inuse);
+    if ( chn->port < d->evtchn_first_free )
+        d->evtchn_first_free = chn->port;
+}
+
 static int get_free_port(struct domain *d)
 {
     struct evtchn *chn;
     struct evtchn **grp;
+    unsigned int   valid = d->valid_evtchns;
     int            port;
 
     if ( d->is_dying )
         return -EINVAL;
 
-    for ( port = 0; port_is_valid(d, port); port++ )
+    port = find_next_zero_bit(d->evtchn_inuse, valid, d->evtchn_first_free);
+    d->evtchn_first_free = port;
+
+    /*
+     * A free port may still be linked on an event queue (FIFO ABI); it
+     * cannot be reused until it is unlinked, so skip over it.
+     */
+    for ( ; port < valid;
+          port = find_next_zero_bit(d->evtchn_inuse, valid, port + 1) )
     {
         if ( port > d->max_evtchn_port )
             return -ENOSPC;
-        if ( evtchn_from_port(d, port)->state == ECS_FREE
-             && !evtchn_port_is_busy(d, port) )
+        ASSERT(evtchn_from_port(d, port)->state == ECS_FREE);
+        if ( !evtchn_port_is_busy(d, port) )
             return port;
     }
 
     if ( port == d->max_evtchns || port > d->max_evtchn_port )
         return -ENOSPC;
 
+    if ( grow_evtchn_inuse(d, port + EVTCHNS_PER_BUCKET) )
+        return -ENOMEM;
+
     if ( !group_from_port(d, port) )
     {
         grp = xzalloc_array(struct evtchn *, BUCKETS_PER_GROUP);
@@ -204,6 +260,7 @@ static void free_evtchn(struct domain *d, struct evtchn *chn)
     chn->state          = ECS_FREE;
     chn->notify_vcpu_id = 0;
     chn->xen_consumer   = 0;
+    evtchn_clear_inuse(d, chn);
 
     xsm_evtchn_close_post(chn);
 }
@@ -233,6 +290,7 @@ static long evtchn_alloc_unbound(evtchn_alloc_unbound_t *alloc)
     spin_lock(&chn->lock);
 
     chn->state = ECS_UNBOUND;
+    evtchn_set_inuse(d, chn);
     if ( (chn->u.unbound.remote_domid = alloc->remote_dom) == DOMID_SELF )
         chn->u.unbound.remote_domid = current->domain->domain_id;
     evtchn_port_init(d, chn);
@@ -318,6 +376,7 @@ static long evtchn_bind_interdomain(evtchn_bind_interdomain_t *bind)
     lchn->u.interdomain.remote_dom  = rd;
     lchn->u.interdomain.remote_port = rport;
     lchn->state                     = ECS_INTERDOMAIN;
+    evtchn_set_inuse(ld, lchn);
     evtchn_port_init(ld, lchn);
     
     rchn->u.interdomain.remote_dom  = ld;
@@ -376,6 +435,7 @@ static long evtchn_bind_virq(evtchn_bind_virq_t *bind)
     spin_lock(&chn->lock);
 
     chn->state          = ECS_VIRQ;
+    evtchn_set_inuse(d, chn);
     chn->notify_vcpu_id = vcpu;
     chn->u.virq         = virq;
     evtchn_port_init(d, chn);
@@ -412,6 +472,7 @@ static long evtchn_bind_ipi(evtchn_bind_ipi_t *bind)
     spin_lock(&chn->lock);
 
     chn->state          = ECS_IPI;
+    evtchn_set_inuse(d, chn);
     chn->notify_vcpu_id = vcpu;
     evtchn_port_init(d, chn);
 
@@ -494,6 +555,7 @@ static long evtchn_bind_pirq(evtchn_bind_pirq_t *bind)
     spin_lock(&chn->lock);
 
     chn->state  = ECS_PIRQ;
+    evtchn_set_inuse(d, chn);
     chn->u.pirq.irq = pirq;
     link_pirq_port(port, chn, v);
     evtchn_port_init(d, chn);
@@ -1200,6 +1262,7 @@ int alloc_unbound_xen_event_channel(
     spin_lock(&chn->lock);
 
     chn->state = ECS_UNBOUND;
+    evtchn_set_inuse(ld, chn);
     chn->xen_consumer = get_xen_consumer(notification_fn);
     chn->notify_vcpu_id = lvcpu;
     chn->u.unbound.remote_domid = remote_domid;
@@ -1275,19 +1338,28 @@ int evtchn_init(struct domain *d)
         return -ENOMEM;
     d->valid_evtchns = EVTCHNS_PER_BUCKET;
 
+    if ( grow_evtchn_inuse(d, EVTCHNS_PER_BUCKET) )
+    {
+        free_evtchn_bucket(d, d->evtchn);
+        return -ENOMEM;
+    }
+
     spin_lock_init_prof(d, event_lock);
     if ( get_free_port(d) != 0 )
     {
+        xfree(d->evtchn_inuse);
         free_evtchn_bucket(d, d->evtchn);
         return -EINVAL;
     }
     evtchn_from_port(d, 0)->state = ECS_RESERVED;
+    __set_bit(0, d->evtchn_inuse);
 
 #if MAX_VIRT_CPUS > BITS_PER_LONG
     d->poll_mask = xzalloc_array(unsigned long,
                                  BITS_TO_LONGS(domain_max_vcpus(d)));
     if ( !d->poll_mask )
     {
+        xfree(d->evtchn_inuse);
         free_evtchn_bucket(d, d->evtchn);
         return -ENOMEM;
     }
@@ -1329,6 +1401,8 @@ void evtchn_destroy_final(struct domain *d)
         xfree(d->evtchn_group[i]);
     }
     free_evtchn_bucket(d, d->evtchn);
+    xfree(d->evtchn_inuse);
+    d->evtchn_inuse = NULL;
 
 #if MAX_VIRT_CPUS > BITS_PER_LONG
     xfree(d->poll_mask);
@@ -122,6 +122,7 @@
 
 #include <xen/init.h>
 #include <xen/types.h>
+#include <xen/cpu.h>
 #include <xen/lib.h>
 #include <xen/sched.h>
 #include <xen/spinlock.h>
@@ -134,6 +135,7 @@
 #include <xen/pfn.h>
 #include <xen/numa.h>
 #include <xen/nodemask.h>
+#include <xen/percpu.h>
 #include <xen/event.h>
 #include <xen/tmem.h>
 #include <xen/tmem_xen.h>
@@ -386,6 +388,21 @@ static heap_by_zone_and_order_t *_heap[MAX_NUMNODES];
 static unsigned long *avail[MAX_NUMNODES];
 static long total_avail_pages;
 
+/*
+ * Freed pages which may still hold data of their previous owner are marked
+ * PGC_need_scrub instead of being scrubbed right away.  They get scrubbed
+ * either by idle CPUs of their node (see scrub_free_pages()), or when they
+ * are handed out by alloc_heap_pages().  Free buddies with such pages are
+ * kept at the tail of the free lists, so clean memory is allocated first.
+ */
+static unsigned long node_need_scrub[MAX_NUMNODES];
+
+/* Largest chunk an idle CPU takes off the free lists for scrubbing. */
+#define SCRUB_CHUNK_ORDER 8
+
+/* Marks the head of a chunk which is being scrubbed, never merged. */
+#define SCRUBBING_ORDER   (MAX_ORDER + 1)
+
 /* TMEM: Reserve a fraction of memory for mid-size (0<order<9) allocations.*/
 static long midsize_alloc_zone_pages;
 #define MIDSIZE_ALLOC_FRAC 128
@@ -393,6 +410,88 @@ static long midsize_alloc_zone_pages;
 static DEFINE_SPINLOCK(heap_lock);
 static long outstanding_claims; /* total outstanding claims by all domains */
 
+/*
+ * Per-CPU caches of free pages of the CPU's node, with one list per order
+ * below PAGE_CACHE_ORDERS.  Most small allocations and frees are served by
+ * them without taking heap_lock, which is only needed to move batches of
+ * PAGE_CACHE_BATCH pages between a cache and the heap.  Cached pages are
+ * in use (PGC_state_inuse without owner) as far as the heap is concerned,
+ * but their u.free.need_tlbflush and tlbflush_timestamp fields are valid,
+ * and they are reported as free memory, see page_cache_pages().
+ */
+#define PAGE_CACHE_ORDERS      4
+#define PAGE_CACHE_BATCH_ORDER 5
+#define PAGE_CACHE_BATCH       (1U << PAGE_CACHE_BATCH_ORDER)
+/* Pages in one list above which a batch goes back to the heap. */
+#define PAGE_CACHE_HIGH        (2 * PAGE_CACHE_BATCH)
+
+struct page_cache {
+    spinlock_t lock;
+    unsigned int count[PAGE_CACHE_ORDERS];  /* Chunks in each list. */
+    struct page_list_head list[PAGE_CACHE_ORDERS];
+};
+
+static DEFINE_PER_CPU(struct page_cache, page_cache);
+static bool_t __read_mostly page_cache_enabled;
+
+static bool_t __initdata opt_page_cache = 1;
+boolean_param("page_cache", opt_page_cache);
+
+static struct page_info *page_cache_get(
+    unsigned int zone_lo, unsigned int zone_hi, unsigned int order,
+    unsigned int memflags);
+static bool_t page_cache_put(
+    struct page_info *pg, unsigned int order, bool_t need_scrub);
+static unsigned long page_cache_flush_all(void);
+static unsigned long page_cache_pages(unsigned int node);
+
+static void page_list_add_scrub(struct page_info *pg, unsigned int node,
+                                unsigned int zone, unsigned int order,
+                                unsigned int first_dirty)
+{
+    PFN_ORDER(pg) = order;
+    pg->u.free.first_dirty = first_dirty;
+
+    if ( first_dirty != INVALID_DIRTY_IDX )
+        page_list_add_tail(pg, &heap(node, zone, order));
+    else
+        page_list_add(pg, &heap(node, zone, order));
+}
+
+/* Split a chunk off a free buddy, putting back the other half. */
+static struct page_info *split_free_buddy(
+    struct page_info *pg, unsigned int node, unsigned int zone,
+    unsigned int order, unsigned int *first_dirty)
+{
+    unsigned int half = 1U << --order;
+
+    /* Keep the lower half on the free list, carry on with the upper one. */
+    page_list_add_scrub(pg, node, zone, order,
+                        (*first_dirty < half) ? *first_dirty
+                                              : INVALID_DIRTY_IDX);
+
+    /*
+     * If the lower half was dirty, we don't know about the upper one
+     * without looking at every page: assume it is dirty as well.
+     */
+    if ( *first_dirty != INVALID_DIRTY_IDX )
+        *first_dirty = (*first_dirty >= half) ? *first_dirty - half : 0;
+
+    return pg + half;
+}
+
+static unsigned int find_first_dirty(const struct page_info *pg,
+                                     unsigned int order)
+{
+    unsigned int i;
+
+    for ( i = 0; i < (1U << order); i++ )
+        if ( test_bit(_PGC_need_scrub, &pg[i].count_info) )
+            return i;
+
+    return INVALID_DIRTY_IDX;
+}
+
 unsigned long domain_adjust_tot_pages(struct domain *d, long pages)
 {
     long dom_before, dom_after, dom_claimed, sys_before, sys_after;
@@ -431,6 +530,10 @@ int domain_set_outstanding_pages(struct domain *d, unsigned long pages)
     int ret = -ENOMEM;
     unsigned long claim, avail_pages;
 
+    /* Pages held in the per-CPU caches don't count as available below. */
+    if ( pages )
+        page_cache_flush_all();
+
     /*
      * take the domain's page_alloc_lock, else all d->tot_page adjustments
      * must always take the global heap_lock rather than only in the much
@@ -649,11 +752,31 @@ static void __init setup_low_mem_virq(void)
             low_mem_virq_th);
 }
 
+/*
+ * Whether the free memory not in the page caches is low enough for
+ * check_low_mem_virq() to have anything to do.  This is cheap, and used
+ * locklessly by allocations from the page caches.
+ */
+static bool_t low_mem_virq_near(void)
+{
+    unsigned long avail_pages = total_avail_pages +
+        tmem_freeable_pages() - outstanding_claims;
+
+    return avail_pages <= low_mem_virq_th ||
+           (low_mem_virq_high != -1UL && avail_pages < low_mem_virq_high);
+}
+
 static void check_low_mem_virq(void)
 {
     unsigned long avail_pages = total_avail_pages +
         tmem_freeable_pages() - outstanding_claims;
 
+    ASSERT(spin_is_locked(&heap_lock));
+
+    /* Counting the cached pages walks all CPUs: only do so when needed. */
+    if ( unlikely(low_mem_virq_near()) )
+        avail_pages += page_cache_pages(-1);
+
     if ( unlikely(avail_pages <= low_mem_virq_th) )
     {
         send_global_virq(VIRQ_ENOMEM);
@@ -683,15 +806,15 @@ static void check_low_mem_virq(void)
     }
 }
 
-/* Allocate 2^@order contiguous pages. */
-static struct page_info *alloc_heap_pages(
+/* Allocate 2^@order contiguous pages, from the page cache if possible. */
+static struct page_info *__alloc_heap_pages(
     unsigned int zone_lo, unsigned int zone_hi,
     unsigned int order, unsigned int memflags,
     struct domain *d)
 {
-    unsigned int i, j, zone = 0, nodemask_retry = 0;
+    unsigned int i, j, zone = 0, nodemask_retry = 0, first_dirty;
     nodeid_t first_node, node = MEMF_get_node(memflags), req_node = node;
-    unsigned long request = 1UL << order;
+    unsigned long request = 1UL << order, dirty = 0;
     struct page_info *pg;
     nodemask_t nodemask = (d != NULL ) ? d->node_affinity : node_online_map;
     bool_t need_tlbflush = 0;
@@ -720,6 +843,22 @@ static struct page_info *alloc_heap_pages(
     if ( unlikely(order > MAX_ORDER) )
         return NULL;
 
+    if ( page_cache_enabled && order < PAGE_CACHE_ORDERS &&
+         node == cpu_to_node(smp_processor_id()) &&
+         (pg = page_cache_get(zone_lo, zone_hi, order, memflags)) != NULL )
+    {
+        if ( unlikely(low_mem_virq_near()) )
+        {
+            spin_lock(&heap_lock);
+            check_low_mem_virq();
+            spin_unlock(&heap_lock);
+        }
+
+        if ( d != NULL )
+            d->last_alloc_node = node;
+        return pg;
+    }
+
     spin_lock(&heap_lock);
 
     /*
@@ -804,12 +943,9 @@ static struct page_info *alloc_heap_pages(
 
  found: 
     /* We may have to halve the chunk a number of times. */
+    first_dirty = pg->u.free.first_dirty;
     while ( j != order )
-    {
-        PFN_ORDER(pg) = --j;
-        page_list_add_tail(pg, &heap(node, zone, j));
-        pg += 1 << j;
-    }
+        pg = split_free_buddy(pg, node, zone, j--, &first_dirty);
 
     ASSERT(avail[node][zone] >= request);
     avail[node][zone] -= request;
@@ -824,8 +960,12 @@ static struct page_info *alloc_heap_pages(
     for ( i = 0; i < (1 << order); i++ )
     {
         /* Reference count must continuously be zero for free pages. */
-        BUG_ON(pg[i].count_info != PGC_state_free);
-        pg[i].count_info = PGC_state_inuse;
+        BUG_ON((pg[i].count_info & ~PGC_need_scrub) != PGC_state_free);
+
+        /* Keep PGC_need_scrub until the page got scrubbed below. */
+        if ( pg[i].count_info & PGC_need_scrub )
+            dirty++;
+        pg[i].count_info = PGC_state_inuse | (pg[i].count_info & PGC_need_scrub);
 
         if ( !(memflags & MEMF_no_tlbflush) )
             accumulate_tlbflush(&need_tlbflush, &pg[i],
@@ -841,14 +981,47 @@ static struct page_info *alloc_heap_pages(
         flush_page_to_ram(page_to_mfn(&pg[i]));
     }
 
+    node_need_scrub[node] -= dirty;
+    perfc_add(pages_scrubbed_alloc, dirty);
+
     spin_unlock(&heap_lock);
 
+    if ( dirty )
+    {
+        for ( i = 0; i < (1 << order); i++ )
+            if ( test_bit(_PGC_need_scrub, &pg[i].count_info) )
+                scrub_one_page(&pg[i]);
+
+        /* mark_page_offline() may update count_info under the lock. */
+        spin_lock(&heap_lock);
+        for ( i = 0; i < (1 << order); i++ )
+            pg[i].count_info &= ~PGC_need_scrub;
+        spin_unlock(&heap_lock);
+    }
+
     if ( need_tlbflush )
         filtered_flush_tlb_mask(tlbflush_timestamp);
 
     return pg;
 }
 
+/* Allocate 2^@order contiguous pages. */
+static struct page_info *alloc_heap_pages(
+    unsigned int zone_lo, unsigned int zone_hi,
+    unsigned int order, unsigned int memflags,
+    struct domain *d)
+{
+    struct page_info *pg;
+
+    pg = __alloc_heap_pages(zone_lo, zone_hi, order, memflags, d);
+
+    /* Free memory may be sitting in the per-CPU caches. */
+    if ( !pg && page_cache_flush_all() )
+        pg = __alloc_heap_pages(zone_lo, zone_hi, order, memflags, d);
+
+    return pg;
+}
+
 /* Remove any offlined page in the buddy pointed to by head. */
 static int reserve_offlined_page(struct page_info *head)
 {
@@ -897,8 +1070,8 @@ static int reserve_offlined_page(struct page_info *head)
             {
             merge:
                 /* We don't consider merging outside the head_order. */
-                page_list_add_tail(cur_head, &heap(node, zone, cur_order));
-                PFN_ORDER(cur_head) = cur_order;
+                page_list_add_scrub(cur_head, node, zone, cur_order,
+                                    find_first_dirty(cur_head, cur_order));
                 cur_head += (1 << cur_order);
                 break;
             }
@@ -914,6 +1087,10 @@ static int reserve_offlined_page(struct page_info *head)
         total_avail_pages--;
         ASSERT(total_avail_pages >= 0);
 
+        /* Accounted again should the page get onlined and freed. */
+        if ( cur_head->count_info & PGC_need_scrub )
+            node_need_scrub[node]--;
+
         page_list_add_tail(cur_head,
                            test_bit(_PGC_broken, &cur_head->count_info) ?
                            &page_broken_list : &page_offlined_list);
@@ -924,18 +1101,75 @@ static int reserve_offlined_page(struct page_info *head)
     return count;
 }
 
-/* Free 2^@order set of pages. */
-static void free_heap_pages(
-    struct page_info *pg, unsigned int order)
+/*
+ * Put a free chunk on the free lists, merging it with its buddies as far as
+ * possible.  Returns the head of the resulting buddy.
+ */
+static struct page_info *merge_free_chunk(
+    struct page_info *pg, unsigned int node, unsigned int zone,
+    unsigned int order, unsigned int first_dirty)
 {
-    unsigned long mask, mfn = page_to_mfn(pg);
-    unsigned int i, node = phys_to_nid(page_to_maddr(pg)), tainted = 0;
-    unsigned int zone = page_to_zone(pg);
+    unsigned long mask;
 
-    ASSERT(order <= MAX_ORDER);
-    ASSERT(node >= 0);
+    while ( order < MAX_ORDER )
+    {
+        mask = 1UL << order;
 
-    spin_lock(&heap_lock);
+        if ( (page_to_mfn(pg) & mask) )
+        {
+            struct page_info *pred = pg - mask;
+
+            /* Merge with predecessor block? */
+            if ( !mfn_valid(_mfn(page_to_mfn(pred))) ||
+                 !page_state_is(pred, free) ||
+                 (PFN_ORDER(pred) != order) ||
+                 (phys_to_nid(page_to_maddr(pred)) != node) )
+                break;
+
+            page_list_del(pred, &heap(node, zone, order));
+            if ( pred->u.free.first_dirty != INVALID_DIRTY_IDX )
+                first_dirty = pred->u.free.first_dirty;
+            else if ( first_dirty != INVALID_DIRTY_IDX )
+                first_dirty += mask;
+            pg = pred;
+        }
+        else
+        {
+            struct page_info *succ = pg + mask;
+
+            /* Merge with successor block? */
+            if ( !mfn_valid(_mfn(page_to_mfn(succ))) ||
+                 !page_state_is(succ, free) ||
+                 (PFN_ORDER(succ) != order) ||
+                 (phys_to_nid(page_to_maddr(succ)) != node) )
+                break;
+
+            page_list_del(succ, &heap(node, zone, order));
+            if ( first_dirty == INVALID_DIRTY_IDX &&
+                 succ->u.free.first_dirty != INVALID_DIRTY_IDX )
+                first_dirty = mask + succ->u.free.first_dirty;
+        }
+
+        order++;
+    }
+
+    page_list_add_scrub(pg, node, zone, order, first_dirty);
+
+    return pg;
+}
+
+/*
+ * Put 2^@order pages released by free_heap_pages() back on the free lists,
+ * to be scrubbed later if need_scrub is set.  Requires heap_lock.
+ */
+static void free_heap_chunk(
+    struct page_info *pg, unsigned int order, bool_t need_scrub)
+{
+    unsigned int i, node = phys_to_nid(page_to_maddr(pg)), tainted = 0;
+    unsigned int zone = page_to_zone(pg), first_dirty = INVALID_DIRTY_IDX;
+    bool_t dirty;
+
+    ASSERT(spin_is_locked(&heap_lock));
 
     for ( i = 0; i < (1 << order); i++ )
     {
@@ -951,13 +1185,53 @@ static void free_heap_pages(
          * In all the above cases there can be no guest mappings of this page.
          */
         ASSERT(!page_state_is(&pg[i], offlined));
+
+        /*
+         * A page offlined while awaiting its scrub keeps PGC_need_scrub,
+         * even when it comes back here through online_page().  Otherwise
+         * the bit is PGC_allocated, and being conservative doesn't hurt.
+         */
+        dirty = need_scrub || (pg[i].count_info & PGC_need_scrub);
+        if ( dirty )
+        {
+            if ( first_dirty == INVALID_DIRTY_IDX )
+                first_dirty = i;
+            node_need_scrub[node]++;
+        }
+
         pg[i].count_info =
             ((pg[i].count_info & PGC_broken) |
              (page_state_is(&pg[i], offlining)
-              ? PGC_state_offlined : PGC_state_free));
+              ? PGC_state_offlined : PGC_state_free) |
+             (dirty ? PGC_need_scrub : 0));
         if ( page_state_is(&pg[i], offlined) )
             tainted = 1;
+    }
+
+    avail[node][zone] += 1 << order;
+    total_avail_pages += 1 << order;
+
+    if ( tmem_enabled() )
+        midsize_alloc_zone_pages = max(
+            midsize_alloc_zone_pages, total_avail_pages / MIDSIZE_ALLOC_FRAC);
+
+    pg = merge_free_chunk(pg, node, zone, order, first_dirty);
 
+    if ( tainted )
+        reserve_offlined_page(pg);
+}
+
+/* Free 2^@order set of pages, scrubbing them later if need_scrub is set. */
+static void free_heap_pages(
+    struct page_info *pg, unsigned int order, bool_t need_scrub)
+{
+    unsigned long mfn = page_to_mfn(pg);
+    unsigned int i;
+
+    ASSERT(order <= MAX_ORDER);
+
+    for ( i = 0; i < (1 << order); i++ )
+    {
         /* If a page has no owner it will need no safety TLB flush. */
         pg[i].u.free.need_tlbflush = (page_get_owner(&pg[i]) != NULL);
         if ( pg[i].u.free.need_tlbflush )
@@ -968,52 +1242,405 @@ static void free_heap_pages(
         set_gpfn_from_mfn(mfn + i, INVALID_M2P_ENTRY);
     }
 
-    avail[node][zone] += 1 << order;
-    total_avail_pages += 1 << order;
+    if ( page_cache_put(pg, order, need_scrub) )
+        return;
 
-    if ( tmem_enabled() )
-        midsize_alloc_zone_pages = max(
-            midsize_alloc_zone_pages, total_avail_pages / MIDSIZE_ALLOC_FRAC);
+    spin_lock(&heap_lock);
+    free_heap_chunk(pg, order, need_scrub);
+    spin_unlock(&heap_lock);
+}
 
-    /* Merge chunks as far as possible. */
-    while ( order < MAX_ORDER )
+/* Take a chunk of a dirty free buddy off the free lists for scrubbing. */
+static struct page_info *get_dirty_chunk(unsigned int node, unsigned int *zone,
+                                         unsigned int *order)
+{
+    struct page_info *pg;
+    unsigned int z, j, first_dirty;
+
+    ASSERT(spin_is_locked(&heap_lock));
+
+    for ( z = 0; z < NR_ZONES; z++ )
     {
-        mask = 1UL << order;
+        for ( j = MAX_ORDER + 1; j-- > 0; )
+        {
+            /* Dirty buddies are at the tail of the lists. */
+            pg = page_list_last(&heap(node, z, j));
+            if ( !pg || pg->u.free.first_dirty == INVALID_DIRTY_IDX )
+                continue;
 
-        if ( (page_to_mfn(pg) & mask) )
+            page_list_del(pg, &heap(node, z, j));
+            first_dirty = pg->u.free.first_dirty;
+
+            while ( j > SCRUB_CHUNK_ORDER )
+            {
+                if ( first_dirty >= (1U << (j - 1)) )
+                    pg = split_free_buddy(pg, node, z, j--, &first_dirty);
+                else
+                {
+                    /* Dirty pages in the lower half: keep that one. */
+                    struct page_info *upper = pg + (1U << --j);
+
+                    page_list_add_scrub(upper, node, z, j, 0);
+                }
+            }
+
+            /* Nothing must merge with the chunk while it is being scrubbed. */
+            PFN_ORDER(pg) = SCRUBBING_ORDER;
+            avail[node][z] -= 1UL << j;
+            total_avail_pages -= 1UL << j;
+
+            *zone = z;
+            *order = j;
+            return pg;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Scrub free memory of the local node from the idle loop, until there is
+ * other work to do.  Returns whether dirty pages are left.
+ */
+bool_t scrub_free_pages(void)
+{
+    unsigned int cpu = smp_processor_id(), node = cpu_to_node(cpu);
+    unsigned int i, zone, order;
+    unsigned long dirty;
+    struct page_info *pg;
+    bool_t tainted;
+
+    if ( node >= MAX_NUMNODES || !node_need_scrub[node] )
+        return 0;
+
+    do {
+        spin_lock(&heap_lock);
+        pg = get_dirty_chunk(node, &zone, &order);
+        spin_unlock(&heap_lock);
+
+        if ( !pg )
+            break;
+
+        for ( i = 0; i < (1U << order); i++ )
+            if ( test_bit(_PGC_need_scrub, &pg[i].count_info) )
+                scrub_one_page(&pg[i]);
+
+        dirty = 0;
+        tainted = 0;
+
+        spin_lock(&heap_lock);
+
+        for ( i = 0; i < (1U << order); i++ )
         {
-            /* Merge with predecessor block? */
-            if ( !mfn_valid(_mfn(page_to_mfn(pg-mask))) ||
-                 !page_state_is(pg-mask, free) ||
-                 (PFN_ORDER(pg-mask) != order) ||
-                 (phys_to_nid(page_to_maddr(pg-mask)) != node) )
-                break;
-            pg -= mask;
-            page_list_del(pg, &heap(node, zone, order));
+            if ( pg[i].count_info & PGC_need_scrub )
+            {
+                pg[i].count_info &= ~PGC_need_scrub;
+                dirty++;
+            }
+            /* Pages may have been offlined while off the free lists. */
+            if ( page_state_is(&pg[i], offlined) )
+                tainted = 1;
         }
-        else
+        node_need_scrub[node] -= dirty;
+        perfc_add(pages_scrubbed_idle, dirty);
+
+        avail[node][zone] += 1UL << order;
+        total_avail_pages += 1UL << order;
+        pg = merge_free_chunk(pg, node, zone, order, INVALID_DIRTY_IDX);
+        if ( tainted )
+            reserve_offlined_page(pg);
+
+        spin_unlock(&heap_lock);
+    } while ( !softirq_pending(cpu) );
+
+    return node_need_scrub[node] != 0;
+}
+
+/* Give up to nr chunks of a page cache list back to the heap. */
+static unsigned int page_cache_drain(struct page_cache *pc, unsigned int order,
+                                     unsigned int nr)
+{
+    struct page_info *pg;
+    unsigned int done = 0;
+
+    ASSERT(spin_is_locked(&pc->lock));
+
+    if ( !nr || !pc->count[order] )
+        return 0;
+
+    spin_lock(&heap_lock);
+
+    /* The least recently freed pages are at the tail. */
+    while ( done < nr && (pg = page_list_last(&pc->list[order])) != NULL )
+    {
+        page_list_del(pg, &pc->list[order]);
+        pc->count[order]--;
+        free_heap_chunk(pg, order, 0);
+        done++;
+    }
+
+    spin_unlock(&heap_lock);
+
+    perfc_add(page_cache_drained, done << order);
+
+    return done;
+}
+
+/* Move a batch of pages from the heap into a page cache list. */
+static bool_t page_cache_refill(struct page_cache *pc, unsigned int node,
+                                unsigned int zone_lo, unsigned int zone_hi,
+                                unsigned int order)
+{
+    struct page_info *pg;
+    unsigned int i;
+
+    ASSERT(spin_is_locked(&pc->lock));
+    BUILD_BUG_ON(PAGE_CACHE_BATCH_ORDER < PAGE_CACHE_ORDERS);
+
+    /* Not served by the page cache itself, due to its order. */
+    pg = __alloc_heap_pages(zone_lo, zone_hi, PAGE_CACHE_BATCH_ORDER,
+                            MEMF_node(node) | MEMF_exact_node, NULL);
+    if ( !pg )
+        return 0;
+
+    /* The allocation flushed TLBs as needed. */
+    for ( i = 0; i < PAGE_CACHE_BATCH; i++ )
+        pg[i].u.free.need_tlbflush = 0;
+
+    for ( i = 0; i < PAGE_CACHE_BATCH; i += 1U << order )
+    {
+        page_list_add_tail(&pg[i], &pc->list[order]);
+        pc->count[order]++;
+    }
+
+    perfc_incr(page_cache_refills);
+
+    return 1;
+}
+
+/*
+ * Allocate 2^@order pages of the local node from the CPU's page cache,
+ * refilling it from the heap if it is empty.
+ */
+static struct page_info *page_cache_get(
+    unsigned int zone_lo, unsigned int zone_hi, unsigned int order,
+    unsigned int memflags)
+{
+    unsigned int cpu = smp_processor_id(), node = cpu_to_node(cpu);
+    struct page_cache *pc = &per_cpu(page_cache, cpu);
+    struct page_info *pg;
+    unsigned int i, zone;
+    bool_t need_tlbflush = 0;
+    uint32_t tlbflush_timestamp = 0;
+
+    /* Leave claims and tmem's allocation policy to the heap. */
+    if ( zone_hi <= MEMZONE_XEN || outstanding_claims || tmem_enabled() )
+        return NULL;
+
+    spin_lock(&pc->lock);
+
+    for ( ; ; )
+    {
+        pg = page_list_first(&pc->list[order]);
+        if ( !pg )
         {
-            /* Merge with successor block? */
-            if ( !mfn_valid(_mfn(page_to_mfn(pg+mask))) ||
-                 !page_state_is(pg+mask, free) ||
-                 (PFN_ORDER(pg+mask) != order) ||
-                 (phys_to_nid(page_to_maddr(pg+mask)) != node) )
+            if ( !page_cache_refill(pc, node, zone_lo, zone_hi, order) )
                 break;
-            page_list_del(pg + mask, &heap(node, zone, order));
+            continue;
         }
 
-        order++;
+        zone = page_to_zone(pg);
+        if ( zone < zone_lo || zone > zone_hi )
+        {
+            pg = NULL;
+            break;
+        }
+
+        page_list_del(pg, &pc->list[order]);
+        pc->count[order]--;
+
+        /* Pages offlined while cached go back to the heap, to be reserved. */
+        for ( i = 0; i < (1U << order); i++ )
+            if ( !page_state_is(&pg[i], inuse) )
+                break;
+        if ( i == (1U << order) )
+            break;
+
+        spin_lock(&heap_lock);
+        free_heap_chunk(pg, order, 0);
+        spin_unlock(&heap_lock);
     }
 
-    PFN_ORDER(pg) = order;
-    page_list_add_tail(pg, &heap(node, zone, order));
+    spin_unlock(&pc->lock);
 
-    if ( tainted )
-        reserve_offlined_page(pg);
+    if ( !pg )
+    {
+        perfc_incr(page_cache_misses);
+        return NULL;
+    }
 
-    spin_unlock(&heap_lock);
+    for ( i = 0; i < (1U << order); i++ )
+    {
+        if ( !(memflags & MEMF_no_tlbflush) )
+            accumulate_tlbflush(&need_tlbflush, &pg[i],
+                                &tlbflush_timestamp);
+
+        /* Initialise fields which have other uses for free pages. */
+        pg[i].u.inuse.type_info = 0;
+
+        flush_page_to_ram(page_to_mfn(&pg[i]));
+    }
+
+    if ( need_tlbflush )
+        filtered_flush_tlb_mask(tlbflush_timestamp);
+
+    perfc_incr(page_cache_allocs);
+
+    return pg;
+}
+
+/*
+ * Put 2^@order pages released by free_heap_pages() into the CPU's page
+ * cache, if they are clean pages of the local node which aren't being
+ * offlined.  Returns whether the pages were taken.
+ */
+static bool_t page_cache_put(
+    struct page_info *pg, unsigned int order, bool_t need_scrub)
+{
+    unsigned int cpu = smp_processor_id();
+    struct page_cache *pc;
+    unsigned long x;
+    unsigned int i;
+
+    if ( !page_cache_enabled || order >= PAGE_CACHE_ORDERS || need_scrub ||
+         tmem_enabled() || page_to_zone(pg) <= MEMZONE_XEN ||
+         phys_to_nid(page_to_maddr(pg)) != cpu_to_node(cpu) )
+        return 0;
+
+    /*
+     * Cached pages stay PGC_state_inuse.  mark_page_offline() may change
+     * the state concurrently, so only drop the other flags atomically.
+     */
+    for ( i = 0; i < (1U << order); i++ )
+    {
+        x = pg[i].count_info;
+        if ( (x & (PGC_state | PGC_broken | PGC_need_scrub)) !=
+             PGC_state_inuse ||
+             cmpxchg(&pg[i].count_info, x, PGC_state_inuse) != x )
+            return 0;
+    }
+
+    pc = &per_cpu(page_cache, cpu);
+    spin_lock(&pc->lock);
+
+    page_list_add(pg, &pc->list[order]);
+    if ( (++pc->count[order] << order) > PAGE_CACHE_HIGH )
+        page_cache_drain(pc, order, PAGE_CACHE_BATCH >> order);
+
+    spin_unlock(&pc->lock);
+
+    perfc_incr(page_cache_frees);
+
+    return 1;
+}
+
+/*
+ * Number of pages held in the page caches of node, or of all nodes for -1.
+ * A cache only holds pages of its CPU's node.  The counts are read without
+ * the cache locks, which is good enough for reporting.
+ */
+static unsigned long page_cache_pages(unsigned int node)
+{
+    unsigned int cpu, order;
+    unsigned long pages = 0;
+
+    if ( !page_cache_enabled )
+        return 0;
+
+    for_each_online_cpu ( cpu )
+    {
+        const struct page_cache *pc = &per_cpu(page_cache, cpu);
+
+        if ( node != -1 && cpu_to_node(cpu) != node )
+            continue;
+
+        for ( order = 0; order < PAGE_CACHE_ORDERS; order++ )
+            pages += (unsigned long)read_atomic(&pc->count[order]) << order;
+    }
+
+    return pages;
 }
 
+/* Give the contents of all page caches back to the heap. */
+static unsigned long page_cache_flush_all(void)
+{
+    unsigned int cpu, order;
+    unsigned long pages = 0;
+
+    if ( !page_cache_enabled )
+        return 0;
+
+    for_each_online_cpu ( cpu )
+    {
+        struct page_cache *pc = &per_cpu(page_cache, cpu);
+
+        spin_lock(&pc->lock);
+        for ( order = 0; order < PAGE_CACHE_ORDERS; order++ )
+            pages += page_cache_drain(pc, order, pc->count[order]) << order;
+        spin_unlock(&pc->lock);
+    }
+
+    return pages;
+}
+
+static int cpu_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu, order;
+    struct page_cache *pc = &per_cpu(page_cache, cpu);
+
+    switch ( action )
+    {
+    case CPU_UP_PREPARE:
+        spin_lock_init(&pc->lock);
+        for ( order = 0; order < PAGE_CACHE_ORDERS; order++ )
+        {
+            pc->count[order] = 0;
+            INIT_PAGE_LIST_HEAD(&pc->list[order]);
+        }
+        break;
+    case CPU_DEAD:
+        spin_lock(&pc->lock);
+        for ( order = 0; order < PAGE_CACHE_ORDERS; order++ )
+            page_cache_drain(pc, order, pc->count[order]);
+        spin_unlock(&pc->lock);
+        break;
+    default:
+        break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block cpu_nfb = {
+    .notifier_call = cpu_callback
+};
+
+static int __init page_cache_init(void)
+{
+    void *cpu = (void *)(long)smp_processor_id();
+
+    if ( !opt_page_cache )
+        return 0;
+
+    cpu_callback(&cpu_nfb, CPU_UP_PREPARE, cpu);
+    register_cpu_notifier(&cpu_nfb);
+    page_cache_enabled = 1;
+
+    return 0;
+}
+presmp_initcall(page_cache_init);
+
 
 /*
  * Following rules applied for page offline:
@@ -1231,7 +1858,7 @@ unsigned int online_page(unsigned long mfn, uint32_t *status)
     spin_unlock(&heap_lock);
 
     if ( (y & PGC_state) == PGC_state_offlined )
-        free_heap_pages(pg, 0);
+        free_heap_pages(pg, 0, 0);
 
     return ret;
 }
@@ -1300,7 +1927,7 @@ static void init_heap_pages(
             nr_pages -= n;
         }
 
-        free_heap_pages(pg+i, 0);
+        free_heap_pages(pg+i, 0, 0);
     }
 }
 
@@ -1322,12 +1949,20 @@ static unsigned long avail_heap_pages(
                 free_pages += avail[i][zone];
     }
 
+    /*
+     * The page caches only hold domain heap pages, but don't track their
+     * zones: count them when all of the domain heap is asked for.
+     */
+    if ( zone_lo <= MEMZONE_XEN + 1 && zone_hi == NR_ZONES - 1 )
+        free_pages += page_cache_pages(node);
+
     return free_pages;
 }
 
 unsigned long total_free_pages(void)
 {
-    return total_avail_pages - midsize_alloc_zone_pages;
+    return total_avail_pages + page_cache_pages(-1) -
+           midsize_alloc_zone_pages;
 }
 
 void __init end_boot_allocator(void)
@@ -1627,7 +2262,7 @@ void free_xenheap_pages(void *v, unsigned int order)
 
     memguard_guard_range(v, 1 << (order + PAGE_SHIFT));
 
-    free_heap_pages(virt_to_page(v), order);
+    free_heap_pages(virt_to_page(v), order, 0);
 }
 
 #else
@@ -1686,7 +2321,7 @@ void free_xenheap_pages(void *v, unsigned int order)
         pg[i].count_info &= ~PGC_xen_heap;
     }
 
-    free_heap_pages(pg, order);
+    free_heap_pages(pg, order, 0);
 }
 
 #endif
@@ -1795,7 +2430,7 @@ struct page_info *alloc_domheap_pages(
     if ( d && !(memflags & MEMF_no_owner) &&
          assign_pages(d, pg, order, memflags) )
     {
-        free_heap_pages(pg, order);
+        free_heap_pages(pg, order, 0);
         return NULL;
     }
     
@@ -1845,7 +2480,8 @@ void free_domheap_pages(struct page_info *pg, unsigned int order)
             /*
              * Normally we expect a domain to clear pages before freeing them,
              * if it cares about the secrecy of their contents. However, after
-             * a domain has died we assume responsibility for erasure.
+             * a domain has died we assume responsibility for erasure. This
+             * is done lazily, see scrub_free_pages().
              */
             scrub = !!d->is_dying;
         }
@@ -1863,11 +2499,7 @@ void free_domheap_pages(struct page_info *pg, unsigned int order)
             scrub = 1;
         }
 
-        if ( unlikely(scrub) )
-            for ( i = 0; i < (1 << order); i++ )
-                scrub_one_page(&pg[i]);
-
-        free_heap_pages(pg, order);
+        free_heap_pages(pg, order, scrub);
     }
 
     if ( drop_dom_ref )
@@ -1965,6 +2597,20 @@ static void dump_heap(unsigned char key)
         for ( j = 0; j < NR_ZONES; j++ )
             printk("heap[node=%d][zone=%d] -> %lu pages\n",
                    i, j, avail[i][j]);
+        printk("heap[node=%d] -> %lu pages to scrub\n", i, node_need_scrub[i]);
+    }
+
+    if ( !page_cache_enabled )
+        return;
+
+    for_each_online_cpu ( i )
+    {
+        const struct page_cache *pc = &per_cpu(page_cache, i);
+        unsigned long pages = 0;
+
+        for ( j = 0; j < PAGE_CACHE_ORDERS; j++ )
+            pages += (unsigned long)pc->count[j] << j;
+        printk("page_cache[cpu=%d] -> %lu pages\n", i, pages);
     }
 }
 
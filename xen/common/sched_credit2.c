@@ -25,6 +25,7 @@
 #include <xen/trace.h>
 #include <xen/cpu.h>
 #include <xen/keyhandler.h>
+#include <xen/rbtree.h>
 
 /* Meant only for helping developers during debugging. */
 /* #define d2printk printk */
@@ -360,7 +361,8 @@ struct csched2_runqueue_data {
     spinlock_t lock;      /* Lock for this runqueue. */
     cpumask_t active;      /* CPUs enabled for this runqueue */
 
-    struct list_head runq; /* Ordered list of runnable vms */
+    struct rb_root runq;   /* Runnable vcpus, ordered by credit */
+    struct rb_node *runq_first; /* The one with most credit, for quick access */
     struct list_head svc;  /* List of all vcpus assigned to this runqueue */
     unsigned int max_weight;
 
@@ -396,7 +398,7 @@ struct csched2_private {
  */
 struct csched2_vcpu {
     struct list_head rqd_elem;         /* On the runqueue data list  */
-    struct list_head runq_elem;        /* On the runqueue            */
+    struct rb_node runq_elem;          /* On the runqueue            */
     struct csched2_runqueue_data *rqd; /* Up-pointer to the runqueue */
 
     /* Up-pointers */
@@ -596,12 +598,31 @@ static s_time_t c2t(struct csched2_runqueue_data *rqd, s_time_t credit, struct c
 
 static inline int vcpu_on_runq(struct csched2_vcpu *svc)
 {
-    return !list_empty(&svc->runq_elem);
+    return !RB_EMPTY_NODE(&svc->runq_elem);
 }
 
-static inline struct csched2_vcpu * runq_elem(struct list_head *elem)
+static inline struct csched2_vcpu * runq_elem(struct rb_node *elem)
 {
-    return list_entry(elem, struct csched2_vcpu, runq_elem);
+    return rb_entry(elem, struct csched2_vcpu, runq_elem);
+}
+
+/*
+ * The runqueue is an rbtree, so that inserting a vcpu takes logarithmic
+ * time in the number of runnable vcpus.  Walking it with runq_first() and
+ * runq_next() yields them by decreasing credit, and in insertion order for
+ * equal credit.
+ */
+static inline struct csched2_vcpu *
+runq_first(const struct csched2_runqueue_data *rqd)
+{
+    return rqd->runq_first ? runq_elem(rqd->runq_first) : NULL;
+}
+
+static inline struct csched2_vcpu *runq_next(struct csched2_vcpu *svc)
+{
+    struct rb_node *next = rb_next(&svc->runq_elem);
+
+    return next ? runq_elem(next) : NULL;
 }
 
 static void activate_runqueue(struct csched2_private *prv, int rqi)
@@ -615,7 +636,8 @@ static void activate_runqueue(struct csched2_private *prv, int rqi)
     rqd->max_weight = 1;
     rqd->id = rqi;
     INIT_LIST_HEAD(&rqd->svc);
-    INIT_LIST_HEAD(&rqd->runq);
+    rqd->runq = RB_ROOT;
+    rqd->runq_first = NULL;
     spin_lock_init(&rqd->lock);
 
     __cpumask_set_cpu(rqi, &prv->active_queues);
@@ -1073,31 +1095,37 @@ update_load(const struct scheduler *ops,
 static void
 runq_insert(const struct scheduler *ops, struct csched2_vcpu *svc)
 {
-    struct list_head *iter;
     unsigned int cpu = svc->vcpu->processor;
-    struct list_head * runq = &c2rqd(ops, cpu)->runq;
-    int pos = 0;
+    struct csched2_runqueue_data *rqd = c2rqd(ops, cpu);
+    struct rb_node **link = &rqd->runq.rb_node, *parent = NULL;
+    bool_t first = 1;
 
     ASSERT(spin_is_locked(per_cpu(schedule_data, cpu).schedule_lock));
 
     ASSERT(!vcpu_on_runq(svc));
     ASSERT(c2r(ops, cpu) == c2r(ops, svc->vcpu->processor));
 
-    ASSERT(&svc->rqd->runq == runq);
+    ASSERT(svc->rqd == rqd);
     ASSERT(!is_idle_vcpu(svc->vcpu));
     ASSERT(!svc->vcpu->is_running);
     ASSERT(!(svc->flags & CSFLAG_scheduled));
 
-    list_for_each( iter, runq )
+    /* Go after all the vcpus with at least as much credit as svc. */
+    while ( *link )
     {
-        struct csched2_vcpu * iter_svc = runq_elem(iter);
-
-        if ( svc->credit > iter_svc->credit )
-            break;
-
-        pos++;
+        parent = *link;
+        if ( svc->credit > runq_elem(parent)->credit )
+            link = &parent->rb_left;
+        else
+        {
+            link = &parent->rb_right;
+            first = 0;
+        }
     }
-    list_add_tail(&svc->runq_elem, iter);
+    rb_link_node(&svc->runq_elem, parent, link);
+    rb_insert_color(&svc->runq_elem, &rqd->runq);
+    if ( first )
+        rqd->runq_first = &svc->runq_elem;
 
     if ( unlikely(tb_init_done) )
     {
@@ -1105,9 +1133,12 @@ runq_insert(const struct scheduler *ops, struct csched2_vcpu *svc)
             unsigned vcpu:16, dom:16;
             unsigned pos;
         } d;
+        struct rb_node *iter = &svc->runq_elem;
+
         d.dom = svc->vcpu->domain->domain_id;
         d.vcpu = svc->vcpu->vcpu_id;
-        d.pos = pos;
+        for ( d.pos = 0; (iter = rb_prev(iter)) != NULL; d.pos++ )
+            continue;
         __trace_var(TRC_CSCHED2_RUNQ_POS, 1,
                     sizeof(d),
                     (unsigned char *)&d);
@@ -1116,8 +1147,14 @@ runq_insert(const struct scheduler *ops, struct csched2_vcpu *svc)
 
 static inline void runq_remove(struct csched2_vcpu *svc)
 {
+    struct csched2_runqueue_data *rqd = svc->rqd;
+
     ASSERT(vcpu_on_runq(svc));
-    list_del_init(&svc->runq_elem);
+
+    if ( rqd->runq_first == &svc->runq_elem )
+        rqd->runq_first = rb_next(&svc->runq_elem);
+    rb_erase(&svc->runq_elem, &rqd->runq);
+    RB_CLEAR_NODE(&svc->runq_elem);
 }
 
 void burn_credits(struct csched2_runqueue_data *rqd, struct csched2_vcpu *, s_time_t);
@@ -1391,7 +1428,10 @@ static void reset_credit(const struct scheduler *ops, int cpu, s_time_t now,
 
     SCHED_STAT_CRANK(credit_reset);
 
-    /* No need to resort runqueue, as everyone's order should be the same. */
+    /*
+     * No need to resort runqueue, as everyone's order should be the same:
+     * adding the same amount to all, and clipping, keeps the tree valid.
+     */
 }
 
 void burn_credits(struct csched2_runqueue_data *rqd,
@@ -1473,7 +1513,7 @@ csched2_alloc_vdata(const struct scheduler *ops, struct vcpu *vc, void *dd)
         return NULL;
 
     INIT_LIST_HEAD(&svc->rqd_elem);
-    INIT_LIST_HEAD(&svc->runq_elem);
+    RB_CLEAR_NODE(&svc->runq_elem);
 
     svc->sdom = dd;
     svc->vcpu = vc;
@@ -2300,7 +2340,7 @@ csched2_vcpu_insert(const struct scheduler *ops, struct vcpu *vc)
     spinlock_t *lock;
 
     ASSERT(!is_idle_vcpu(vc));
-    ASSERT(list_empty(&svc->runq_elem));
+    ASSERT(!vcpu_on_runq(svc));
 
     /* csched2_cpu_pick() expects the pcpu lock to be held */
     lock = vcpu_schedule_lock_irq(vc);
@@ -2338,7 +2378,7 @@ csched2_vcpu_remove(const struct scheduler *ops, struct vcpu *vc)
     spinlock_t *lock;
 
     ASSERT(!is_idle_vcpu(vc));
-    ASSERT(list_empty(&svc->runq_elem));
+    ASSERT(!vcpu_on_runq(svc));
 
     SCHED_STAT_CRANK(vcpu_remove);
 
@@ -2360,7 +2400,7 @@ csched2_runtime(const struct scheduler *ops, int cpu,
     s_time_t time, min_time;
     int rt_credit; /* Proposed runtime measured in credits */
     struct csched2_runqueue_data *rqd = c2rqd(ops, cpu);
-    struct list_head *runq = &rqd->runq;
+    struct csched2_vcpu *swait = runq_first(rqd);
     struct csched2_private *prv = csched2_priv(ops);
 
     /*
@@ -2395,15 +2435,10 @@ csched2_runtime(const struct scheduler *ops, int cpu,
 
     /* 2) If there's someone waiting whose credit is positive,
      * run until your credit ~= his */
-    if ( ! list_empty(runq) )
+    if ( swait != NULL && ! is_idle_vcpu(swait->vcpu)
+         && swait->credit > 0 )
     {
-        struct csched2_vcpu *swait = runq_elem(runq->next);
-
-        if ( ! is_idle_vcpu(swait->vcpu)
-             && swait->credit > 0 )
-        {
-            rt_credit = snext->credit - swait->credit;
-        }
+        rt_credit = snext->credit - swait->credit;
     }
 
     /*
@@ -2446,8 +2481,7 @@ runq_candidate(struct csched2_runqueue_data *rqd,
                int cpu, s_time_t now,
                unsigned int *skipped)
 {
-    struct list_head *iter;
-    struct csched2_vcpu *snext = NULL;
+    struct csched2_vcpu *snext = NULL, *svc;
     struct csched2_private *prv = csched2_priv(per_cpu(scheduler, cpu));
     bool yield = __test_and_clear_bit(__CSFLAG_vcpu_yield, &scurr->flags);
 
@@ -2489,10 +2523,8 @@ runq_candidate(struct csched2_runqueue_data *rqd,
     else
         snext = csched2_vcpu(idle_vcpu[cpu]);
 
-    list_for_each( iter, &rqd->runq )
+    for ( svc = runq_first(rqd); svc != NULL; svc = runq_next(svc) )
     {
-        struct csched2_vcpu * svc = list_entry(iter, struct csched2_vcpu, runq_elem);
-
         if ( unlikely(tb_init_done) )
         {
             struct {
@@ -2869,7 +2901,7 @@ csched2_dump(const struct scheduler *ops)
     for_each_cpu(i, &prv->active_queues)
     {
         struct csched2_runqueue_data *rqd = prv->rqd + i;
-        struct list_head *iter, *runq = &rqd->runq;
+        struct csched2_vcpu *svc;
         int loop = 0;
 
         /* We need the lock to scan the runqueue. */
@@ -2881,15 +2913,10 @@ csched2_dump(const struct scheduler *ops)
             dump_pcpu(ops, j);
 
         printk("RUNQ:\n");
-        list_for_each( iter, runq )
+        for ( svc = runq_first(rqd); svc != NULL; svc = runq_next(svc) )
         {
-            struct csched2_vcpu *svc = runq_elem(iter);
-
-            if ( svc )
-            {
-                printk("\t%3d: ", loop++);
-                csched2_dump_vcpu(prv, svc);
-            }
+            printk("\t%3d: ", loop++);
+            csched2_dump_vcpu(prv, svc);
         }
         spin_unlock(&rqd->lock);
     }
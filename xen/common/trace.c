@@ -29,7 +29,6 @@
 #include <xen/mm.h>
 #include <xen/percpu.h>
 #include <xen/pfn.h>
-#include <xen/cpu.h>
 #include <asm/atomic.h>
 #include <public/sysctl.h>
 
@@ -53,7 +52,6 @@ static struct t_info *t_info;
 static unsigned int t_info_pages;
 
 static DEFINE_PER_CPU_READ_MOSTLY(struct t_buf *, t_bufs);
-static DEFINE_PER_CPU_READ_MOSTLY(spinlock_t, t_lock);
 static u32 data_size __read_mostly;
 
 /* High water mark for trace buffers; */
@@ -78,21 +76,6 @@ static u32 tb_event_mask = TRC_ALL;
  * i.e., sizeof(_type) * ans >= _x. */
 #define fit_to_type(_type, _x) (((_x)+sizeof(_type)-1) / sizeof(_type))
 
-static int cpu_callback(
-    struct notifier_block *nfb, unsigned long action, void *hcpu)
-{
-    unsigned int cpu = (unsigned long)hcpu;
-
-    if ( action == CPU_UP_PREPARE )
-        spin_lock_init(&per_cpu(t_lock, cpu));
-
-    return NOTIFY_DONE;
-}
-
-static struct notifier_block cpu_nfb = {
-    .notifier_call = cpu_callback
-};
-
 static uint32_t calc_tinfo_first_offset(void)
 {
     int offset_in_bytes = offsetof(struct t_info, mfn_offset[NR_CPUS]);
@@ -229,8 +212,6 @@ static int alloc_trace_bufs(unsigned int pages)
         struct t_buf *buf;
         struct page_info *pg;
 
-        spin_lock_init(&per_cpu(t_lock, cpu));
-
         offset = t_info->mfn_offset[cpu];
 
         /* Initialize the buffer metadata */
@@ -345,7 +326,6 @@ int trace_will_trace_event(u32 event)
 void __init init_trace_bufs(void)
 {
     cpumask_setall(&tb_cpu_mask);
-    register_cpu_notifier(&cpu_nfb);
 
     if ( opt_tbuf_size )
     {
@@ -365,6 +345,11 @@ void __init init_trace_bufs(void)
     }
 }
 
+static void reset_lost_records(void *unused)
+{
+    this_cpu(lost_records) = 0;
+}
+
 /**
  * tb_control - sysctl operations on trace buffers.
  * @tbc: a pointer to a xen_sysctl_tbuf_op_t to be filled out
@@ -414,20 +399,16 @@ int tb_control(xen_sysctl_tbuf_op_t *tbc)
          * Disable trace buffers. Just stops new records from being written,
          * does not deallocate any memory.
          */
-        int i;
-
         tb_init_done = 0;
         smp_wmb();
-        /* Clear any lost-record info so we don't get phantom lost records next time we
-         * start tracing.  Grab the lock to make sure we're not racing anyone.  After this
-         * hypercall returns, no more records should be placed into the buffers. */
-        for_each_online_cpu(i)
-        {
-            unsigned long flags;
-            spin_lock_irqsave(&per_cpu(t_lock, i), flags);
-            per_cpu(lost_records, i)=0;
-            spin_unlock_irqrestore(&per_cpu(t_lock, i), flags);
-        }
+        /*
+         * Clear any lost-record info so we don't get phantom lost records
+         * next time we start tracing.  Records are written with interrupts
+         * disabled, so running the reset as an IPI on each CPU guarantees
+         * no record is in progress there.  After this hypercall returns, no
+         * more records should be placed into the buffers.
+         */
+        on_selected_cpus(&cpu_online_map, reset_lost_records, NULL, 1);
     }
         break;
     default:
@@ -723,12 +704,20 @@ void __trace_var(u32 event, bool_t cycles, unsigned int extra,
     /* Read tb_init_done /before/ t_bufs. */
     smp_rmb();
 
-    spin_lock_irqsave(&this_cpu(t_lock), flags);
+    /*
+     * Only this CPU ever produces into its buffer, and the consumer only
+     * moves cons forward, so no lock is needed: disabling interrupts keeps
+     * records from interrupt handlers from being interleaved with this one.
+     * Check tb_init_done again to not race with XEN_SYSCTL_TBUFOP_disable,
+     * which resets the lost record counts with an IPI.
+     */
+    local_irq_save(flags);
 
     buf = this_cpu(t_bufs);
 
-    if ( unlikely(!buf) )
+    if ( unlikely(!buf) || unlikely(!tb_init_done) )
     {
+        buf = NULL;
         /* Make gcc happy */
         started_below_highwater = 0;
         goto unlock;
@@ -810,7 +799,7 @@ void __trace_var(u32 event, bool_t cycles, unsigned int extra,
     __insert_record(buf, event, extra, cycles, rec_size, extra_data);
 
 unlock:
-    spin_unlock_irqrestore(&this_cpu(t_lock), flags);
+    local_irq_restore(flags);
 
     /* Notify trace buffer consumer that we've crossed the high water mark. */
     if ( likely(buf!=NULL)
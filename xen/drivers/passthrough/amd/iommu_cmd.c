@@ -372,6 +372,29 @@ void amd_iommu_flush_pages(struct domain *d,
     _amd_iommu_flush_pages(d, (uint64_t) gfn << PAGE_SHIFT, order);
 }
 
+/*
+ * Flush the nr pages at gfn with a single command, covering them with a 4k,
+ * 2M or 1G page or else the whole domain.
+ */
+void amd_iommu_flush_range(struct domain *d,
+                           unsigned long gfn, unsigned long nr)
+{
+    unsigned int order = nr > 1 ? flsl(gfn ^ (gfn + nr - 1)) : 0;
+
+    atomic_inc(&dom_iommu(d)->stats.flushes);
+
+    if ( order == 0 )
+        amd_iommu_flush_pages(d, gfn, 0);
+    else if ( order <= PAGE_ORDER_2M )
+        amd_iommu_flush_pages(d, gfn & ~((1UL << PAGE_ORDER_2M) - 1),
+                              PAGE_ORDER_2M);
+    else if ( order <= PAGE_ORDER_1G )
+        amd_iommu_flush_pages(d, gfn & ~((1UL << PAGE_ORDER_1G) - 1),
+                              PAGE_ORDER_1G);
+    else
+        amd_iommu_flush_all_pages(d);
+}
+
 void amd_iommu_flush_device(struct amd_iommu *iommu, uint16_t bdf)
 {
     ASSERT( spin_is_locked(&iommu->lock) );
@@ -432,12 +432,12 @@ static int iommu_merge_pages(struct domain *d, unsigned long pt_mfn,
     return 0;
 }
 
-/* Walk io page tables and build level page tables if necessary
- * {Re, un}mapping super page frames causes re-allocation of io
- * page tables.
+/* Walk io page tables down to the target level and build level page
+ * tables if necessary. {Re, un}mapping super page frames causes
+ * re-allocation of io page tables.
  */
 static int iommu_pde_from_gfn(struct domain *d, unsigned long pfn, 
-                              unsigned long pt_mfn[])
+                              unsigned long pt_mfn[], unsigned int target)
 {
     u64 *pde, *next_table_vaddr;
     unsigned long  next_table_mfn;
@@ -459,7 +459,7 @@ static int iommu_pde_from_gfn(struct domain *d, unsigned long pfn,
         return 0;
     }
 
-    while ( level > IOMMU_PAGING_MODE_LEVEL_1 )
+    while ( level > target )
     {
         unsigned int next_level = level - 1;
         pt_mfn[level] = next_table_mfn;
@@ -535,7 +535,7 @@ static int iommu_pde_from_gfn(struct domain *d, unsigned long pfn,
         level--;
     }
 
-    /* mfn of level 1 page table */
+    /* mfn of the page table at the target level */
     pt_mfn[level] = next_table_mfn;
     return 0;
 }
@@ -661,7 +661,8 @@ int amd_iommu_map_page(struct domain *d, unsigned long gfn, unsigned long mfn,
         }
     }
 
-    if ( iommu_pde_from_gfn(d, gfn, pt_mfn) || (pt_mfn[1] == 0) )
+    if ( iommu_pde_from_gfn(d, gfn, pt_mfn, IOMMU_PAGING_MODE_LEVEL_1) ||
+         (pt_mfn[1] == 0) )
     {
         spin_unlock(&hd->arch.mapping_lock);
         AMD_IOMMU_DEBUG("Invalid IO pagetable entry gfn = %lx\n", gfn);
@@ -682,7 +683,7 @@ int amd_iommu_map_page(struct domain *d, unsigned long gfn, unsigned long mfn,
     /* 4K mapping for PV guests never changes, 
      * no need to flush if we trust non-present bits */
     if ( is_hvm_domain(d) )
-        amd_iommu_flush_pages(d, gfn, 0);
+        amd_iommu_flush_range(d, gfn, 1);
 
     for ( merge_level = IOMMU_PAGING_MODE_LEVEL_2;
           merge_level <= hd->arch.paging_mode; merge_level++ )
@@ -742,7 +743,8 @@ int amd_iommu_unmap_page(struct domain *d, unsigned long gfn)
         }
     }
 
-    if ( iommu_pde_from_gfn(d, gfn, pt_mfn) || (pt_mfn[1] == 0) )
+    if ( iommu_pde_from_gfn(d, gfn, pt_mfn, IOMMU_PAGING_MODE_LEVEL_1) ||
+         (pt_mfn[1] == 0) )
     {
         spin_unlock(&hd->arch.mapping_lock);
         AMD_IOMMU_DEBUG("Invalid IO pagetable entry gfn = %lx\n", gfn);
@@ -754,11 +756,184 @@ int amd_iommu_unmap_page(struct domain *d, unsigned long gfn)
     clear_iommu_pte_present(pt_mfn[1], gfn);
     spin_unlock(&hd->arch.mapping_lock);
 
-    amd_iommu_flush_pages(d, gfn, 0);
+    amd_iommu_flush_range(d, gfn, 1);
 
     return 0;
 }
 
+/*
+ * The highest level, up to max_level, at which the nr pages at gfn can be
+ * mapped by a single entry.
+ */
+static unsigned int iommu_range_level(const struct domain *d,
+                                      unsigned long gfn, unsigned long mfn,
+                                      unsigned long nr, unsigned int max_level)
+{
+    unsigned int level = IOMMU_PAGING_MODE_LEVEL_1;
+
+    max_level = min_t(unsigned int, max_level, dom_iommu(d)->arch.paging_mode);
+    while ( level < max_level )
+    {
+        unsigned long mask = (1UL << (PTE_PER_TABLE_SHIFT * level)) - 1;
+
+        if ( ((gfn | mfn) & mask) || nr <= mask )
+            break;
+        level++;
+    }
+
+    return level;
+}
+
+/* Queue the page table a level > 1 pde points to for freeing. */
+static void iommu_unhook_pde_table(u32 *pde, unsigned int level,
+                                   struct page_list_head *free_list)
+{
+    struct page_info *pg;
+
+    if ( level == IOMMU_PAGING_MODE_LEVEL_1 || !iommu_is_pte_present(pde) ||
+         !iommu_next_level(pde) )
+        return;
+
+    pg = maddr_to_page(amd_iommu_get_next_table_from_pte(pde));
+    PFN_ORDER(pg) = iommu_next_level(pde);
+    page_list_add_tail(pg, free_list);
+}
+
+int amd_iommu_map_pages(struct domain *d, unsigned long gfn,
+                        unsigned long mfn, unsigned int order,
+                        unsigned int flags, unsigned long *done)
+{
+    bool_t need_flush = 0;
+    struct domain_iommu *hd = dom_iommu(d);
+    unsigned long pt_mfn[7], i, nr = 1UL << order;
+    unsigned int level, max_level;
+    PAGE_LIST_HEAD(free_list);
+    u64 *table;
+    u32 *pde;
+    int rc = 0;
+
+    BUG_ON( !hd->arch.root_table );
+
+    *done = 0;
+    if ( iommu_use_hap_pt(d) )
+        return 0;
+
+    max_level = iommu_superpages ? IOMMU_PAGING_MODE_LEVEL_3
+                                 : IOMMU_PAGING_MODE_LEVEL_1;
+
+    spin_lock(&hd->arch.mapping_lock);
+
+    /* Grow the page table once, for the last gfn of the range */
+    if ( is_hvm_domain(d) && update_paging_mode(d, gfn + nr - 1) )
+    {
+        spin_unlock(&hd->arch.mapping_lock);
+        AMD_IOMMU_DEBUG("Update page mode failed gfn = %lx\n", gfn + nr - 1);
+        domain_crash(d);
+        return -EFAULT;
+    }
+
+    for ( i = 0; i < nr; i += 1UL << (PTE_PER_TABLE_SHIFT * (level - 1)) )
+    {
+        level = iommu_range_level(d, gfn + i, mfn + i, nr - i, max_level);
+
+        memset(pt_mfn, 0, sizeof(pt_mfn));
+        if ( iommu_pde_from_gfn(d, gfn + i, pt_mfn, level) ||
+             (pt_mfn[level] == 0) )
+        {
+            AMD_IOMMU_DEBUG("Invalid IO pagetable entry gfn = %lx\n", gfn + i);
+            domain_crash(d);
+            rc = -EFAULT;
+            break;
+        }
+
+        /* Install a 4k page or a superpage, replacing any table below */
+        table = map_domain_page(_mfn(pt_mfn[level]));
+        pde = (u32 *)(table + pfn_to_pde_idx(gfn + i, level));
+        iommu_unhook_pde_table(pde, level, &free_list);
+        if ( set_iommu_pde_present(pde, mfn + i, IOMMU_PAGING_MODE_LEVEL_0,
+                                   !!(flags & IOMMUF_writable),
+                                   !!(flags & IOMMUF_readable)) )
+        {
+            need_flush = 1;
+            if ( level > IOMMU_PAGING_MODE_LEVEL_1 )
+                atomic_inc(&hd->stats.superpages);
+        }
+        unmap_domain_page(table);
+    }
+
+    *done = i;
+    spin_unlock(&hd->arch.mapping_lock);
+
+    /* As for single pages, trust non-present bits for PV guests */
+    if ( (need_flush && is_hvm_domain(d)) || !page_list_empty(&free_list) )
+        amd_iommu_flush_range(d, gfn, nr);
+    iommu_queue_free_pgtables(&free_list);
+
+    return rc;
+}
+
+int amd_iommu_unmap_pages(struct domain *d, unsigned long gfn,
+                          unsigned int order)
+{
+    struct domain_iommu *hd = dom_iommu(d);
+    unsigned long pt_mfn[7], i, nr = 1UL << order;
+    unsigned int level;
+    PAGE_LIST_HEAD(free_list);
+    u64 *table, *pde;
+    int rc = 0;
+
+    BUG_ON( !hd->arch.root_table );
+
+    if ( iommu_use_hap_pt(d) )
+        return 0;
+
+    spin_lock(&hd->arch.mapping_lock);
+
+    if ( is_hvm_domain(d) )
+    {
+        rc = update_paging_mode(d, gfn + nr - 1);
+        if ( rc )
+        {
+            spin_unlock(&hd->arch.mapping_lock);
+            AMD_IOMMU_DEBUG("Update page mode failed gfn = %lx\n",
+                            gfn + nr - 1);
+            if ( rc != -EADDRNOTAVAIL )
+                domain_crash(d);
+            return rc;
+        }
+    }
+
+    for ( i = 0; i < nr; i += 1UL << (PTE_PER_TABLE_SHIFT * (level - 1)) )
+    {
+        /* Clearing an entry at any level unmaps everything below it */
+        level = iommu_range_level(d, gfn + i, 0, nr - i,
+                                  hd->arch.paging_mode);
+
+        memset(pt_mfn, 0, sizeof(pt_mfn));
+        if ( iommu_pde_from_gfn(d, gfn + i, pt_mfn, level) ||
+             (pt_mfn[level] == 0) )
+        {
+            AMD_IOMMU_DEBUG("Invalid IO pagetable entry gfn = %lx\n", gfn + i);
+            domain_crash(d);
+            rc = -EFAULT;
+            break;
+        }
+
+        table = map_domain_page(_mfn(pt_mfn[level]));
+        pde = table + pfn_to_pde_idx(gfn + i, level);
+        iommu_unhook_pde_table((u32 *)pde, level, &free_list);
+        *pde = 0;
+        unmap_domain_page(table);
+    }
+
+    spin_unlock(&hd->arch.mapping_lock);
+
+    amd_iommu_flush_range(d, gfn, nr);
+    iommu_queue_free_pgtables(&free_list);
+
+    return rc;
+}
+
 int amd_iommu_reserve_domain_unity_map(struct domain *domain,
                                        u64 phys_addr,
                                        unsigned long size, int iw, int ir)
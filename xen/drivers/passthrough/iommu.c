@@ -23,6 +23,7 @@
 
 static void parse_iommu_param(char *s);
 static void iommu_dump_p2m_table(unsigned char key);
+static void iommu_dump_stats(const struct domain *d);
 
 unsigned int __read_mostly iommu_dev_iotlb_timeout = 1000;
 integer_param("iommu_dev_iotlb_timeout", iommu_dev_iotlb_timeout);
@@ -42,6 +43,7 @@ integer_param("iommu_dev_iotlb_timeout", iommu_dev_iotlb_timeout);
  *   dom0-passthrough           No DMA translation at all for Dom0
  *   dom0-strict                No 1:1 memory mapping for Dom0
  *   no-sharept                 Don't share VT-d and EPT page tables
+ *   no-superpages              Don't use superpages in IOMMU page tables
  *   no-snoop                   Disable VT-d Snoop Control
  *   no-qinval                  Disable VT-d Queued Invalidation
  *   no-igfx                    Disable VT-d for IGD devices (insecure)
@@ -69,6 +71,7 @@ bool_t __read_mostly iommu_intremap = 1;
  */
 bool_t __read_mostly iommu_intpost;
 bool_t __read_mostly iommu_hap_pt_share = 1;
+bool_t __read_mostly iommu_superpages = 1;
 bool_t __read_mostly iommu_debug;
 bool_t __read_mostly amd_iommu_perdev_intremap = 1;
 
@@ -116,6 +119,8 @@ static void __init parse_iommu_param(char *s)
             if ( val )
                 iommu_verbose = 1;
         }
+        else if ( !strcmp(s, "superpages") )
+            iommu_superpages = val;
         else if ( !strcmp(s, "amd-iommu-perdev-intremap") )
             amd_iommu_perdev_intremap = val;
         else if ( !strcmp(s, "dom0-passthrough") )
@@ -244,6 +249,9 @@ void iommu_domain_destroy(struct domain *d)
     if ( !iommu_enabled || !dom_iommu(d)->platform_ops )
         return;
 
+    if ( iommu_verbose )
+        iommu_dump_stats(d);
+
     iommu_teardown(d);
 
     arch_iommu_domain_destroy(d);
@@ -251,43 +259,172 @@ void iommu_domain_destroy(struct domain *d)
 
 int iommu_map_page(struct domain *d, unsigned long gfn, unsigned long mfn,
                    unsigned int flags)
+{
+    return iommu_map_pages(d, gfn, mfn, 0, flags);
+}
+
+int iommu_unmap_page(struct domain *d, unsigned long gfn)
+{
+    return iommu_unmap_pages(d, gfn, 0);
+}
+
+/* Map the range, setting *done to the number of pages mapped from gfn. */
+static int __must_check iommu_do_map(struct domain *d, unsigned long gfn,
+                                     unsigned long mfn, unsigned int order,
+                                     unsigned int flags, unsigned long *done)
 {
     const struct domain_iommu *hd = dom_iommu(d);
+    bool_t dont_flush;
+    unsigned long i;
+    int rc = 0, err;
+
+    if ( order && hd->platform_ops->map_pages )
+        return hd->platform_ops->map_pages(d, gfn, mfn, order, flags, done);
+
+    if ( !order )
+    {
+        rc = hd->platform_ops->map_page(d, gfn, mfn, flags);
+        *done = !rc;
+        return rc;
+    }
+
+    dont_flush = this_cpu(iommu_dont_flush_iotlb);
+    this_cpu(iommu_dont_flush_iotlb) = 1;
+    for ( i = 0; i < (1UL << order); i++ )
+    {
+        rc = hd->platform_ops->map_page(d, gfn + i, mfn + i, flags);
+        if ( rc )
+            break;
+    }
+    this_cpu(iommu_dont_flush_iotlb) = dont_flush;
+    *done = i;
+
+    if ( !dont_flush && i )
+    {
+        err = iommu_iotlb_flush(d, gfn, i);
+        if ( !rc )
+            rc = err;
+    }
+
+    return rc;
+}
+
+static int __must_check iommu_do_unmap(struct domain *d, unsigned long gfn,
+                                       unsigned int order)
+{
+    const struct domain_iommu *hd = dom_iommu(d);
+    bool_t dont_flush;
+    unsigned long i;
+    int rc = 0, err;
+
+    if ( order && hd->platform_ops->unmap_pages )
+        return hd->platform_ops->unmap_pages(d, gfn, order);
+
+    if ( !order )
+        return hd->platform_ops->unmap_page(d, gfn);
+
+    /* Unmap as much as possible, as the per page callers used to. */
+    dont_flush = this_cpu(iommu_dont_flush_iotlb);
+    this_cpu(iommu_dont_flush_iotlb) = 1;
+    for ( i = 0; i < (1UL << order); i++ )
+    {
+        err = hd->platform_ops->unmap_page(d, gfn + i);
+        if ( !rc )
+            rc = err;
+    }
+    this_cpu(iommu_dont_flush_iotlb) = dont_flush;
+
+    if ( !dont_flush )
+    {
+        err = iommu_iotlb_flush(d, gfn, 1u << order);
+        if ( !rc )
+            rc = err;
+    }
+
+    return rc;
+}
+
+/*
+ * Undo a partially failed iommu_map_pages(): unmap the nr pages at gfn it
+ * mapped, in naturally aligned chunks so superpages are not split.
+ */
+static void iommu_unmap_partial(struct domain *d, unsigned long gfn,
+                                unsigned long nr)
+{
+    while ( nr )
+    {
+        unsigned int order = 0;
+        int rc;
+
+        while ( !((gfn >> order) & 1) && (2UL << order) <= nr )
+            order++;
+
+        rc = iommu_do_unmap(d, gfn, order);
+        if ( rc && !d->is_shutting_down && printk_ratelimit() )
+            printk(XENLOG_ERR
+                   "d%d: IOMMU unmapping gfn %#lx order %u after map failure failed: %d\n",
+                   d->domain_id, gfn, order, rc);
+
+        gfn += 1UL << order;
+        nr -= 1UL << order;
+    }
+}
+
+int iommu_map_pages(struct domain *d, unsigned long gfn, unsigned long mfn,
+                    unsigned int order, unsigned int flags)
+{
+    struct domain_iommu *hd = dom_iommu(d);
+    unsigned long done = 0;
+    s_time_t start;
     int rc;
 
     if ( !iommu_enabled || !hd->platform_ops )
         return 0;
 
-    rc = hd->platform_ops->map_page(d, gfn, mfn, flags);
+    start = NOW();
+    rc = iommu_do_map(d, gfn, mfn, order, flags, &done);
+
     if ( unlikely(rc) )
     {
         if ( !d->is_shutting_down && printk_ratelimit() )
             printk(XENLOG_ERR
-                   "d%d: IOMMU mapping gfn %#lx to mfn %#lx failed: %d\n",
-                   d->domain_id, gfn, mfn, rc);
+                   "d%d: IOMMU mapping gfn %#lx to mfn %#lx order %u failed: %d\n",
+                   d->domain_id, gfn, mfn, order, rc);
+
+        iommu_unmap_partial(d, gfn, done);
 
         if ( !is_hardware_domain(d) )
             domain_crash(d);
     }
+    else
+        atomic_add(1 << order, &hd->stats.mapped);
+
+    arch_fetch_and_add(&hd->stats.map_ns, NOW() - start);
 
     return rc;
 }
 
-int iommu_unmap_page(struct domain *d, unsigned long gfn)
+int iommu_unmap_pages(struct domain *d, unsigned long gfn, unsigned int order)
 {
-    const struct domain_iommu *hd = dom_iommu(d);
+    struct domain_iommu *hd = dom_iommu(d);
+    s_time_t start;
     int rc;
 
     if ( !iommu_enabled || !hd->platform_ops )
         return 0;
 
-    rc = hd->platform_ops->unmap_page(d, gfn);
+    start = NOW();
+    rc = iommu_do_unmap(d, gfn, order);
+
+    atomic_add(1 << order, &hd->stats.unmapped);
+    arch_fetch_and_add(&hd->stats.unmap_ns, NOW() - start);
+
     if ( unlikely(rc) )
     {
         if ( !d->is_shutting_down && printk_ratelimit() )
             printk(XENLOG_ERR
-                   "d%d: IOMMU unmapping gfn %#lx failed: %d\n",
-                   d->domain_id, gfn, rc);
+                   "d%d: IOMMU unmapping gfn %#lx order %u failed: %d\n",
+                   d->domain_id, gfn, order, rc);
 
         if ( !is_hardware_domain(d) )
             domain_crash(d);
@@ -313,6 +450,17 @@ static void iommu_free_pagetables(unsigned long unused)
                             cpumask_cycle(smp_processor_id(), &cpu_online_map));
 }
 
+void iommu_queue_free_pgtables(struct page_list_head *tables)
+{
+    if ( page_list_empty(tables) )
+        return;
+
+    spin_lock(&iommu_pt_cleanup_lock);
+    page_list_splice(tables, &iommu_pt_cleanup_list);
+    spin_unlock(&iommu_pt_cleanup_lock);
+    tasklet_schedule(&iommu_pt_cleanup_tasklet);
+}
+
 int iommu_iotlb_flush(struct domain *d, unsigned long gfn,
                       unsigned int page_count)
 {
@@ -473,6 +621,20 @@ bool_t iommu_has_feature(struct domain *d, enum iommu_feature feature)
     return test_bit(feature, dom_iommu(d)->features);
 }
 
+static void iommu_dump_stats(const struct domain *d)
+{
+    const struct domain_iommu *hd = dom_iommu(d);
+
+    printk("d%d: IOMMU mapped %u pages in %"PRIu64"us, "
+           "unmapped %u pages in %"PRIu64"us, "
+           "%u superpages, %u IOTLB flushes\n",
+           d->domain_id, atomic_read(&hd->stats.mapped),
+           ACCESS_ONCE(hd->stats.map_ns) / MICROSECS(1),
+           atomic_read(&hd->stats.unmapped),
+           ACCESS_ONCE(hd->stats.unmap_ns) / MICROSECS(1),
+           atomic_read(&hd->stats.superpages), atomic_read(&hd->stats.flushes));
+}
+
 static void iommu_dump_p2m_table(unsigned char key)
 {
     struct domain *d;
@@ -487,7 +649,12 @@ static void iommu_dump_p2m_table(unsigned char key)
     ops = iommu_get_ops();
     for_each_domain(d)
     {
-        if ( is_hardware_domain(d) || need_iommu(d) <= 0 )
+        if ( need_iommu(d) <= 0 )
+            continue;
+
+        iommu_dump_stats(d);
+
+        if ( is_hardware_domain(d) )
             continue;
 
         if ( iommu_use_hap_pt(d) )
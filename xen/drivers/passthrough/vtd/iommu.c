@@ -158,6 +158,10 @@ static void __init free_intel_iommu(struct intel_iommu *intel)
 }
 
 static int iommus_incoherent;
+
+/* Levels at which all IOMMUs support superpages, as (1 << level) bits */
+static unsigned int __read_mostly vtd_sp_levels;
+
 static void __iommu_flush_cache(void *addr, unsigned int size)
 {
     int i;
@@ -249,71 +253,137 @@ static u64 bus_to_context_maddr(struct iommu *iommu, u8 bus)
     return maddr;
 }
 
-static u64 addr_to_dma_page_maddr(struct domain *domain, u64 addr, int alloc)
+/* Replace the superpage mapped by @pte with a table of smaller pages */
+static int dma_pte_split(struct domain *domain, struct dma_pte *pte,
+                         unsigned int level)
+{
+    struct acpi_drhd_unit *drhd;
+    struct pci_dev *pdev;
+    struct dma_pte *table, old = *pte, new = { 0 };
+    u64 maddr;
+    unsigned int i;
+
+    pdev = pci_get_pdev_by_domain(domain, -1, -1, -1);
+    drhd = acpi_find_matched_drhd_unit(pdev);
+    maddr = alloc_pgtable_maddr(drhd, 1);
+    if ( !maddr )
+        return -ENOMEM;
+
+    table = map_vtd_domain_page(maddr);
+    for ( i = 0; i < PTE_NUM; i++ )
+    {
+        table[i].val = old.val + offset_level_address(i, level - 1);
+        if ( level == 2 )
+            table[i].val &= ~DMA_PTE_SP;
+    }
+    iommu_flush_cache_page(table, 1);
+    unmap_vtd_domain_page(table);
+
+    dma_set_pte_addr(new, maddr);
+    dma_set_pte_readable(new);
+    dma_set_pte_writable(new);
+    *pte = new;
+    iommu_flush_cache_entry(pte, sizeof(struct dma_pte));
+
+    return 0;
+}
+
+/*
+ * Find the page table holding the level *@level entry for @addr, splitting
+ * superpages which map @addr at a higher level.  Missing tables are only
+ * allocated if @alloc is set; otherwise *@maddr is set to 0 and *@level
+ * to the level of the non-present entry covering @addr.
+ */
+static int addr_to_dma_table_maddr(struct domain *domain, u64 addr,
+                                   unsigned int *level, int alloc,
+                                   u64 *maddr)
 {
     struct acpi_drhd_unit *drhd;
     struct pci_dev *pdev;
     struct domain_iommu *hd = dom_iommu(domain);
     int addr_width = agaw_to_width(hd->arch.agaw);
-    struct dma_pte *parent, *pte = NULL;
-    int level = agaw_to_level(hd->arch.agaw);
-    int offset;
-    u64 pte_maddr = 0;
+    struct dma_pte *parent, *pte;
+    unsigned int target = *level, cur = agaw_to_level(hd->arch.agaw);
+    u64 pte_maddr;
+    int rc = 0;
 
     addr &= (((u64)1) << addr_width) - 1;
     ASSERT(spin_is_locked(&hd->arch.mapping_lock));
+    ASSERT(target >= 1 && target <= cur);
+    *maddr = 0;
     if ( hd->arch.pgd_maddr == 0 )
     {
+        *level = cur;
+        if ( !alloc )
+            return 0;
+
         /*
          * just get any passthrough device in the domainr - assume user
          * assigns only devices from same node to a given guest.
          */
         pdev = pci_get_pdev_by_domain(domain, -1, -1, -1);
         drhd = acpi_find_matched_drhd_unit(pdev);
-        if ( !alloc || ((hd->arch.pgd_maddr = alloc_pgtable_maddr(drhd, 1)) == 0) )
-            goto out;
+        if ( (hd->arch.pgd_maddr = alloc_pgtable_maddr(drhd, 1)) == 0 )
+            return -ENOMEM;
     }
 
-    parent = (struct dma_pte *)map_vtd_domain_page(hd->arch.pgd_maddr);
-    while ( level > 1 )
+    pte_maddr = hd->arch.pgd_maddr;
+    while ( cur > target )
     {
-        offset = address_level_offset(addr, level);
-        pte = &parent[offset];
+        parent = map_vtd_domain_page(pte_maddr);
+        pte = &parent[address_level_offset(addr, cur)];
 
-        pte_maddr = dma_pte_addr(*pte);
-        if ( !pte_maddr )
+        if ( dma_pte_superpage(*pte) )
+            rc = dma_pte_split(domain, pte, cur);
+        else if ( !dma_pte_present(*pte) )
         {
             if ( !alloc )
-                break;
+            {
+                unmap_vtd_domain_page(parent);
+                *level = cur;
+                return 0;
+            }
 
             pdev = pci_get_pdev_by_domain(domain, -1, -1, -1);
             drhd = acpi_find_matched_drhd_unit(pdev);
             pte_maddr = alloc_pgtable_maddr(drhd, 1);
             if ( !pte_maddr )
-                break;
-
-            dma_set_pte_addr(*pte, pte_maddr);
+                rc = -ENOMEM;
+            else
+            {
+                dma_set_pte_addr(*pte, pte_maddr);
 
-            /*
-             * high level table always sets r/w, last level
-             * page table control read/write
-             */
-            dma_set_pte_readable(*pte);
-            dma_set_pte_writable(*pte);
-            iommu_flush_cache_entry(pte, sizeof(struct dma_pte));
+                /*
+                 * high level table always sets r/w, last level
+                 * page table control read/write
+                 */
+                dma_set_pte_readable(*pte);
+                dma_set_pte_writable(*pte);
+                iommu_flush_cache_entry(pte, sizeof(struct dma_pte));
+            }
         }
 
-        if ( level == 2 )
-            break;
-
+        pte_maddr = dma_pte_addr(*pte);
         unmap_vtd_domain_page(parent);
-        parent = map_vtd_domain_page(pte_maddr);
-        level--;
+        if ( rc )
+            return rc;
+        cur--;
     }
 
-    unmap_vtd_domain_page(parent);
- out:
-    return pte_maddr;
+    *maddr = pte_maddr;
+    return 0;
+}
+
+/* Return the machine address of the last level table for @addr, or 0. */
+static u64 addr_to_dma_page_maddr(struct domain *domain, u64 addr, int alloc)
+{
+    unsigned int level = 1;
+    u64 maddr;
+
+    if ( addr_to_dma_table_maddr(domain, addr, &level, alloc, &maddr) )
+        return 0;
+
+    return maddr;
 }
 
 static void iommu_flush_write_buffer(struct iommu *iommu)
@@ -594,8 +664,19 @@ static int __must_check iommu_flush_iotlb(struct domain *d,
     struct iommu *iommu;
     bool_t flush_dev_iotlb;
     int iommu_domid;
+    unsigned int order = 0;
     int rc = 0;
 
+    /*
+     * A page selective flush covers a naturally aligned range: use the
+     * smallest one containing all pages, iommu_flush_iotlb_psi() falls
+     * back to a domain selective flush if it is too big.
+     */
+    if ( page_count > 1 && gfn != gfn_x(INVALID_GFN) )
+        order = flsl(gfn ^ (gfn + page_count - 1));
+
+    atomic_inc(&hd->stats.flushes);
+
     /*
      * No need pcideves_lock here because we have flush
      * when assign/deassign device
@@ -612,14 +693,13 @@ static int __must_check iommu_flush_iotlb(struct domain *d,
         if ( iommu_domid == -1 )
             continue;
 
-        if ( page_count != 1 || gfn == gfn_x(INVALID_GFN) )
+        if ( page_count == 0 || gfn == gfn_x(INVALID_GFN) )
             rc = iommu_flush_iotlb_dsi(iommu, iommu_domid,
                                        0, flush_dev_iotlb);
         else
             rc = iommu_flush_iotlb_psi(iommu, iommu_domid,
                                        (paddr_t)gfn << PAGE_SHIFT_4K,
-                                       PAGE_ORDER_4K,
-                                       !dma_old_pte_present,
+                                       order, !dma_old_pte_present,
                                        flush_dev_iotlb);
 
         if ( rc > 0 )
@@ -644,45 +724,6 @@ static int __must_check iommu_flush_iotlb_all(struct domain *d)
     return iommu_flush_iotlb(d, gfn_x(INVALID_GFN), 0, 0);
 }
 
-/* clear one page's page table */
-static int __must_check dma_pte_clear_one(struct domain *domain, u64 addr)
-{
-    struct domain_iommu *hd = dom_iommu(domain);
-    struct dma_pte *page = NULL, *pte = NULL;
-    u64 pg_maddr;
-    int rc = 0;
-
-    spin_lock(&hd->arch.mapping_lock);
-    /* get last level pte */
-    pg_maddr = addr_to_dma_page_maddr(domain, addr, 0);
-    if ( pg_maddr == 0 )
-    {
-        spin_unlock(&hd->arch.mapping_lock);
-        return 0;
-    }
-
-    page = (struct dma_pte *)map_vtd_domain_page(pg_maddr);
-    pte = page + address_level_offset(addr, 1);
-
-    if ( !dma_pte_present(*pte) )
-    {
-        spin_unlock(&hd->arch.mapping_lock);
-        unmap_vtd_domain_page(page);
-        return 0;
-    }
-
-    dma_clear_pte(*pte);
-    spin_unlock(&hd->arch.mapping_lock);
-    iommu_flush_cache_entry(pte, sizeof(struct dma_pte));
-
-    if ( !this_cpu(iommu_dont_flush_iotlb) )
-        rc = iommu_flush_iotlb_pages(domain, addr >> PAGE_SHIFT_4K, 1);
-
-    unmap_vtd_domain_page(page);
-
-    return rc;
-}
-
 static void iommu_free_pagetable(u64 pt_maddr, int level)
 {
     struct page_info *pg = maddr_to_page(pt_maddr);
@@ -711,7 +752,7 @@ static void iommu_free_page_table(struct page_info *pg)
         if ( !dma_pte_present(*pte) )
             continue;
 
-        if ( next_level >= 1 )
+        if ( next_level >= 1 && !dma_pte_superpage(*pte) )
             iommu_free_pagetable(dma_pte_addr(*pte), next_level);
 
         dma_clear_pte(*pte);
@@ -1750,15 +1791,66 @@ static void iommu_domain_teardown(struct domain *d)
     spin_unlock(&hd->arch.mapping_lock);
 }
 
-static int __must_check intel_iommu_map_page(struct domain *d,
-                                             unsigned long gfn,
-                                             unsigned long mfn,
-                                             unsigned int flags)
+/*
+ * The highest level at which the @nr pages at @gfn can be mapped by a single
+ * entry, out of 1 and the superpage levels in @levels.
+ */
+static unsigned int dma_range_level(const struct domain *d,
+                                    unsigned long gfn, unsigned long mfn,
+                                    unsigned long nr, unsigned int levels)
+{
+    unsigned int level = 1, top = agaw_to_level(dom_iommu(d)->arch.agaw);
+
+    while ( level < top && (levels & (1u << (level + 1))) )
+    {
+        unsigned long mask = (1UL << (level * LEVEL_STRIDE)) - 1;
+
+        if ( ((gfn | mfn) & mask) || nr <= mask )
+            break;
+        level++;
+    }
+
+    return level;
+}
+
+/*
+ * Flush the IOTLBs after changing the entries for @nr pages at @gfn, then
+ * free the page tables which were unhooked.  The flush can be left to the
+ * caller through iommu_dont_flush_iotlb, but not when tables need freeing.
+ */
+static int __must_check dma_range_flush(struct domain *d, unsigned long gfn,
+                                        unsigned long nr, bool_t present,
+                                        struct page_list_head *free_list)
+{
+    int rc = 0;
+
+    if ( !this_cpu(iommu_dont_flush_iotlb) || !page_list_empty(free_list) )
+        rc = iommu_flush_iotlb(d, gfn, present, nr);
+
+    /* If the flush failed the IOMMUs may still walk them: leak them. */
+    if ( !rc )
+        iommu_queue_free_pgtables(free_list);
+
+    return rc;
+}
+
+static int __must_check intel_iommu_map_pages(struct domain *d,
+                                              unsigned long gfn,
+                                              unsigned long mfn,
+                                              unsigned int order,
+                                              unsigned int flags,
+                                              unsigned long *done)
 {
     struct domain_iommu *hd = dom_iommu(d);
-    struct dma_pte *page = NULL, *pte = NULL, old, new = { 0 };
+    struct dma_pte *page, *pte, old, new;
+    unsigned long i, nr = 1UL << order;
+    unsigned int level;
+    bool_t changed = 0, present = 0;
+    PAGE_LIST_HEAD(free_list);
     u64 pg_maddr;
-    int rc = 0;
+    int rc = 0, err;
+
+    *done = 0;
 
     /* Do nothing if VT-d shares EPT page table */
     if ( iommu_use_hap_pt(d) )
@@ -1770,50 +1862,160 @@ static int __must_check intel_iommu_map_page(struct domain *d,
 
     spin_lock(&hd->arch.mapping_lock);
 
-    pg_maddr = addr_to_dma_page_maddr(d, (paddr_t)gfn << PAGE_SHIFT_4K, 1);
-    if ( pg_maddr == 0 )
+    for ( i = 0; i < nr; i += 1UL << ((level - 1) * LEVEL_STRIDE) )
     {
-        spin_unlock(&hd->arch.mapping_lock);
-        return -ENOMEM;
-    }
-    page = (struct dma_pte *)map_vtd_domain_page(pg_maddr);
-    pte = page + (gfn & LEVEL_MASK);
-    old = *pte;
-    dma_set_pte_addr(new, (paddr_t)mfn << PAGE_SHIFT_4K);
-    dma_set_pte_prot(new,
-                     ((flags & IOMMUF_readable) ? DMA_PTE_READ  : 0) |
-                     ((flags & IOMMUF_writable) ? DMA_PTE_WRITE : 0));
+        paddr_t addr = (paddr_t)(gfn + i) << PAGE_SHIFT_4K;
+
+        level = dma_range_level(d, gfn + i, mfn + i, nr - i, vtd_sp_levels);
+        rc = addr_to_dma_table_maddr(d, addr, &level, 1, &pg_maddr);
+        if ( rc )
+            break;
 
-    /* Set the SNP on leaf page table if Snoop Control available */
-    if ( iommu_snoop )
-        dma_set_pte_snp(new);
+        page = (struct dma_pte *)map_vtd_domain_page(pg_maddr);
+        pte = page + address_level_offset(addr, level);
+        old = *pte;
+        new.val = 0;
+        dma_set_pte_addr(new, (paddr_t)(mfn + i) << PAGE_SHIFT_4K);
+        dma_set_pte_prot(new,
+                         ((flags & IOMMUF_readable) ? DMA_PTE_READ  : 0) |
+                         ((flags & IOMMUF_writable) ? DMA_PTE_WRITE : 0));
+        if ( level > 1 )
+            dma_set_pte_superpage(new);
+
+        /* Set the SNP on leaf page table if Snoop Control available */
+        if ( iommu_snoop )
+            dma_set_pte_snp(new);
+
+        if ( old.val != new.val )
+        {
+            *pte = new;
+            iommu_flush_cache_entry(pte, sizeof(struct dma_pte));
+            changed = 1;
+
+            if ( dma_pte_present(old) )
+            {
+                present = 1;
+
+                /* A superpage replaced a table, which is now unused. */
+                if ( level > 1 && !dma_pte_superpage(old) )
+                {
+                    struct page_info *pg = maddr_to_page(dma_pte_addr(old));
+
+                    PFN_ORDER(pg) = level - 1;
+                    page_list_add_tail(pg, &free_list);
+                }
+            }
+
+            if ( level > 1 )
+                atomic_inc(&hd->stats.superpages);
+        }
 
-    if ( old.val == new.val )
-    {
-        spin_unlock(&hd->arch.mapping_lock);
         unmap_vtd_domain_page(page);
-        return 0;
     }
-    *pte = new;
 
-    iommu_flush_cache_entry(pte, sizeof(struct dma_pte));
+    *done = i;
     spin_unlock(&hd->arch.mapping_lock);
-    unmap_vtd_domain_page(page);
 
-    if ( !this_cpu(iommu_dont_flush_iotlb) )
-        rc = iommu_flush_iotlb(d, gfn, dma_pte_present(old), 1);
+    if ( changed )
+    {
+        err = dma_range_flush(d, gfn, nr, present, &free_list);
+        if ( !rc )
+            rc = err;
+    }
 
     return rc;
 }
 
-static int __must_check intel_iommu_unmap_page(struct domain *d,
-                                               unsigned long gfn)
+static int __must_check intel_iommu_unmap_pages(struct domain *d,
+                                                unsigned long gfn,
+                                                unsigned int order)
 {
+    struct domain_iommu *hd = dom_iommu(d);
+    struct dma_pte *page, *pte, old;
+    unsigned long i = 0, nr = 1UL << order;
+    unsigned int level;
+    bool_t changed = 0;
+    PAGE_LIST_HEAD(free_list);
+    u64 pg_maddr;
+    int rc = 0, err;
+
+    /* Do nothing if VT-d shares EPT page table */
+    if ( iommu_use_hap_pt(d) )
+        return 0;
+
     /* Do nothing if hardware domain and iommu supports pass thru. */
     if ( iommu_passthrough && is_hardware_domain(d) )
         return 0;
 
-    return dma_pte_clear_one(d, (paddr_t)gfn << PAGE_SHIFT_4K);
+    spin_lock(&hd->arch.mapping_lock);
+
+    while ( i < nr )
+    {
+        paddr_t addr = (paddr_t)(gfn + i) << PAGE_SHIFT_4K;
+
+        /* Clearing an entry at any level unmaps everything below it. */
+        level = dma_range_level(d, gfn + i, 0, nr - i, ~0u);
+        rc = addr_to_dma_table_maddr(d, addr, &level, 0, &pg_maddr);
+        if ( rc )
+            break;
+
+        /* Skip ranges which have no tables at all. */
+        if ( pg_maddr == 0 )
+        {
+            i = ((gfn + i) | ((1UL << ((level - 1) * LEVEL_STRIDE)) - 1)) +
+                1 - gfn;
+            continue;
+        }
+
+        page = (struct dma_pte *)map_vtd_domain_page(pg_maddr);
+        pte = page + address_level_offset(addr, level);
+        old = *pte;
+
+        if ( dma_pte_present(old) )
+        {
+            dma_clear_pte(*pte);
+            iommu_flush_cache_entry(pte, sizeof(struct dma_pte));
+            changed = 1;
+
+            if ( level > 1 && !dma_pte_superpage(old) )
+            {
+                struct page_info *pg = maddr_to_page(dma_pte_addr(old));
+
+                PFN_ORDER(pg) = level - 1;
+                page_list_add_tail(pg, &free_list);
+            }
+        }
+
+        unmap_vtd_domain_page(page);
+        i += 1UL << ((level - 1) * LEVEL_STRIDE);
+    }
+
+    spin_unlock(&hd->arch.mapping_lock);
+
+    if ( changed )
+    {
+        err = dma_range_flush(d, gfn, nr, 1, &free_list);
+        if ( !rc )
+            rc = err;
+    }
+
+    return rc;
+}
+
+static int __must_check intel_iommu_map_page(struct domain *d,
+                                             unsigned long gfn,
+                                             unsigned long mfn,
+                                             unsigned int flags)
+{
+    unsigned long done;
+
+    return intel_iommu_map_pages(d, gfn, mfn, 0, flags, &done);
+}
+
+static int __must_check intel_iommu_unmap_page(struct domain *d,
+                                               unsigned long gfn)
+{
+    return intel_iommu_unmap_pages(d, gfn, 0);
 }
 
 int iommu_pte_flush(struct domain *d, u64 gfn, u64 *pte,
@@ -2232,9 +2434,12 @@ int __init intel_vtd_setup(void)
         goto error;
     }
 
+    if ( iommu_superpages )
+        vtd_sp_levels = (1u << 2) | (1u << 3);
+
     /* We enable the following features only if they are supported by all VT-d
      * engines: Snoop Control, DMA passthrough, Queued Invalidation, Interrupt
-     * Remapping, and Posted Interrupt
+     * Remapping, Posted Interrupt and superpages.
      */
     for_each_drhd_unit ( drhd )
     {
@@ -2244,9 +2449,13 @@ int __init intel_vtd_setup(void)
                iommu->index);
         if (cap_sps_2mb(iommu->cap))
             printk(", 2MB");
+        else
+            vtd_sp_levels &= ~(1u << 2);
 
         if (cap_sps_1gb(iommu->cap))
             printk(", 1GB");
+        else
+            vtd_sp_levels &= ~(1u << 3);
 
         printk(".\n");
 
@@ -2297,6 +2506,7 @@ int __init intel_vtd_setup(void)
     P(iommu_intremap, "Interrupt Remapping");
     P(iommu_intpost, "Posted Interrupt");
     P(iommu_hap_pt_share, "Shared EPT tables");
+    P(vtd_sp_levels, "Superpages");
 #undef P
 
     ret = scan_pci_devices();
@@ -2606,14 +2816,15 @@ static void vtd_dump_p2m_table_level(paddr_t pt_maddr, int level, paddr_t gpa,
             continue;
 
         address = gpa + offset_level_address(i, level);
-        if ( next_level >= 1 ) 
+        if ( next_level >= 1 && !dma_pte_superpage(*pte) )
             vtd_dump_p2m_table_level(dma_pte_addr(*pte), next_level, 
                                      address, indent + 1);
         else
-            printk("%*sgfn: %08lx mfn: %08lx\n",
+            printk("%*sgfn: %08lx mfn: %08lx order: %u\n",
                    indent, "",
                    (unsigned long)(address >> PAGE_SHIFT_4K),
-                   (unsigned long)(dma_pte_addr(*pte) >> PAGE_SHIFT_4K));
+                   (unsigned long)(dma_pte_addr(*pte) >> PAGE_SHIFT_4K),
+                   next_level * LEVEL_STRIDE);
     }
 
     unmap_vtd_domain_page(pt_vaddr);
@@ -2641,6 +2852,8 @@ const struct iommu_ops intel_iommu_ops = {
     .teardown = iommu_domain_teardown,
     .map_page = intel_iommu_map_page,
     .unmap_page = intel_iommu_unmap_page,
+    .map_pages = intel_iommu_map_pages,
+    .unmap_pages = intel_iommu_unmap_pages,
     .free_page_table = iommu_free_page_table,
     .reassign_device = reassign_device_ownership,
     .get_device_group_id = intel_iommu_group_id,
@@ -173,6 +173,11 @@ struct log_dirty_domain {
     unsigned int   fault_count;
     unsigned int   dirty_count;
 
+    /* pfns newly marked dirty, for XEN_DOMCTL_SHADOW_OP_CLEAN_LIST */
+    unsigned long *list;
+    unsigned int   list_count;
+    bool           list_overflow;
+
     /* functions which are paging mode specific */
     const struct log_dirty_ops {
         int        (*enable  )(struct domain *d, bool log_global);
@@ -73,6 +73,15 @@ struct hvm_ioreq_server {
     bool_t                 bufioreq_atomic;
 };
 
+/*
+ * An entry in the per-domain index of the ranges claimed by enabled ioreq
+ * servers, sorted by start and without overlaps.
+ */
+struct hvm_ioreq_range {
+    uint64_t start, end;
+    struct hvm_ioreq_server *s;
+};
+
 /*
  * This structure defines function hooks to support hardware-assisted
  * virtual interrupt delivery to guest. (e.g. VMX PI and SVM AVIC).
@@ -112,6 +121,19 @@ struct hvm_domain {
         spinlock_t       lock;
         ioservid_t       id;
         struct list_head list;
+
+        /*
+         * Index of the ranges of all servers, for hvm_select_ioreq_server().
+         * Updated in place when a range is mapped or unmapped or a server
+         * is enabled or disabled, and rebuilt when a server is destroyed.
+         * A type without a valid index (e.g. because ranges of two servers
+         * overlap) is looked up by scanning the list.
+         */
+        rwlock_t         index_lock;
+        struct hvm_ioreq_range *index[NR_IO_RANGE_TYPES];
+        unsigned int     index_nr[NR_IO_RANGE_TYPES];
+        unsigned int     index_max[NR_IO_RANGE_TYPES];
+        bool             index_valid[NR_IO_RANGE_TYPES];
     } ioreq_server;
     struct hvm_ioreq_server *default_ioreq_server;
 
@@ -170,6 +192,9 @@ struct hvm_domain {
     bool_t                 qemu_mapcache_invalidate;
     bool_t                 is_s3_suspended;
 
+    /* Domain this one was forked from, populating its memory on demand. */
+    struct domain         *fork_parent;
+
     /*
      * TSC value that VCPUs use to calculate their tsc_offset value.
      * Used during initialization and save/restore.
@@ -54,6 +54,9 @@ struct page_sharing_info
 #define sharing_supported(_d) \
     (is_hvm_domain(_d) && paging_mode_hap(_d)) 
 
+#define mem_sharing_is_fork(_d) \
+    (is_hvm_domain(_d) && (_d)->arch.hvm_domain.fork_parent != NULL)
+
 unsigned int mem_sharing_get_nr_saved_mfns(void);
 unsigned int mem_sharing_get_nr_shared_mfns(void);
 
@@ -85,13 +88,19 @@ static inline int mem_sharing_unshare_page(struct domain *d,
  */
 int mem_sharing_notify_enomem(struct domain *d, unsigned long gfn,
                                 bool_t allow_sleep);
+/* Populates a hole in the p2m of a fork from its parent: with a page shared
+ * with the parent, or with a private copy of it if unsharing is set or the
+ * parent's page cannot be shared.  The fork's p2m must not be locked.
+ * Returns -ENOENT if the parent has no RAM at that gfn. */
+int mem_sharing_fork_page(struct domain *d, gfn_t gfn, bool_t unsharing);
 int mem_sharing_memop(XEN_GUEST_HANDLE_PARAM(xen_mem_sharing_op_t) arg);
 int mem_sharing_domctl(struct domain *d, 
                        xen_domctl_mem_sharing_op_t *mec);
 void mem_sharing_init(void);
 
 /* Scans the p2m and relinquishes any shared pages, destroying 
- * those for which this domain holds the final reference.
+ * those for which this domain holds the final reference, and
+ * releases the parent of a fork.
  * Preemptible.
  */
 int relinquish_shared_pages(struct domain *d);
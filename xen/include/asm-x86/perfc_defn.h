@@ -142,4 +142,9 @@ PERFCOUNTER(realmode_exits,      "vmexits from realmode")
 
 PERFCOUNTER(pauseloop_exits, "vmexits from Pause-Loop Detection")
 
+PERFCOUNTER(ioreq_select_indexed, "ioreq server selected by index")
+PERFCOUNTER(ioreq_select_scanned, "ioreq server selected by scan")
+PERFCOUNTER(ioreq_index_rebuilds, "ioreq server index rebuilds")
+PERFCOUNTER(ioreq_index_updates,  "ioreq server index updates")
+
 /*#endif*/ /* __XEN_PERFC_DEFN_H__ */
@@ -37,7 +37,7 @@
 #include "hvm/save.h"
 #include "memory.h"
 
-#define XEN_DOMCTL_INTERFACE_VERSION 0x0000000d
+#define XEN_DOMCTL_INTERFACE_VERSION 0x0000000e
 
 /*
  * NB. xen_domctl.domain is an IN/OUT parameter for this operation.
@@ -177,6 +177,16 @@ struct xen_domctl_getpageframeinfo3 {
 #define XEN_DOMCTL_SHADOW_OP_CLEAN       11
  /* Return the bitmap but do not modify internal copy. */
 #define XEN_DOMCTL_SHADOW_OP_PEEK        12
+ /*
+  * Return the pfns dirtied since the last CLEAN or CLEAN_LIST as a list,
+  * and clean them for the next round.  dirty_bitmap points at an array of
+  * 'pages' uint64_aligned_t entries, and 'pages' is updated with the number
+  * of pfns written.  Each pfn appears at most once.  Fails with -ENOBUFS, without modifying the internal
+  * state, if Xen could not keep track of all dirty pfns in its list (e.g.
+  * on the first call after enabling log-dirty mode) or if the array is too
+  * small; the caller should fall back to CLEAN for that round.
+  */
+#define XEN_DOMCTL_SHADOW_OP_CLEAN_LIST  13
 
 /* Memory allocation accessors. */
 #define XEN_DOMCTL_SHADOW_OP_GET_ALLOCATION   30
@@ -214,7 +224,7 @@ struct xen_domctl_getpageframeinfo3 {
   */
 #define XEN_DOMCTL_SHADOW_ENABLE_EXTERNAL  (1 << 4)
 
-/* Mode flags for XEN_DOMCTL_SHADOW_OP_{CLEAN,PEEK}. */
+/* Mode flags for XEN_DOMCTL_SHADOW_OP_{CLEAN,PEEK,CLEAN_LIST}. */
  /*
   * This is the final iteration: Requesting to include pages mapped
   * writably by the hypervisor in the dirty bitmap.
@@ -239,7 +249,7 @@ struct xen_domctl_shadow_op {
     /* OP_GET_ALLOCATION / OP_SET_ALLOCATION */
     uint32_t       mb;       /* Shadow memory allocation in MB */
 
-    /* OP_PEEK / OP_CLEAN */
+    /* OP_PEEK / OP_CLEAN / OP_CLEAN_LIST */
     XEN_GUEST_HANDLE_64(uint8) dirty_bitmap;
     uint64_aligned_t pages; /* Size of buffer. Updated with actual size. */
     struct xen_domctl_shadow_op_stats stats;
@@ -882,12 +892,28 @@ DEFINE_XEN_GUEST_HANDLE(xen_domctl_vm_event_op_t);
 /* XEN_DOMCTL_mem_sharing_op.
  * The CONTROL sub-domctl is used for bringup/teardown. */
 #define XEN_DOMCTL_MEM_SHARING_CONTROL          0
+/*
+ * The FORK sub-domctl turns the target domain, which must be a freshly
+ * created, paused HVM domain without memory and with as many vCPUs as the
+ * parent, into a fork of parent_domain.  The parent must be paused, and
+ * stays paused until all of its forks have been destroyed.
+ *
+ * The vCPU and HVM context, HVM parameters and TSC settings of the parent
+ * are copied.  Memory is not: the fork's p2m starts out empty, and each
+ * page is populated the first time the fork accesses it, sharing the
+ * parent's page copy-on-write on a read and copying it on a write.  Event
+ * channels, grant tables and device model state are not copied.
+ */
+#define XEN_DOMCTL_MEM_SHARING_FORK             1
 
 struct xen_domctl_mem_sharing_op {
     uint8_t op; /* XEN_DOMCTL_MEM_SHARING_* */
 
     union {
         uint8_t enable;                   /* CONTROL */
+        struct {
+            domid_t parent_domain;        /* IN: domain to fork from */
+        } fork;                           /* FORK */
     } u;
 };
 typedef struct xen_domctl_mem_sharing_op xen_domctl_mem_sharing_op_t;
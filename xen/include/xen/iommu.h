@@ -24,6 +24,7 @@
 #include <xen/pci.h>
 #include <public/hvm/ioreq.h>
 #include <public/domctl.h>
+#include <asm/atomic.h>
 #include <asm/device.h>
 #include <asm/iommu.h>
 
@@ -32,6 +33,7 @@ extern bool_t force_iommu, iommu_verbose;
 extern bool_t iommu_workaround_bios_bug, iommu_igfx, iommu_passthrough;
 extern bool_t iommu_snoop, iommu_qinval, iommu_intremap, iommu_intpost;
 extern bool_t iommu_hap_pt_share;
+extern bool_t iommu_superpages;
 extern bool_t iommu_debug;
 extern bool_t amd_iommu_perdev_intremap;
 
@@ -80,6 +82,19 @@ int __must_check iommu_map_page(struct domain *d, unsigned long gfn,
                                 unsigned long mfn, unsigned int flags);
 int __must_check iommu_unmap_page(struct domain *d, unsigned long gfn);
 
+/*
+ * Map or unmap the 2^order pages starting at gfn with a single IOTLB
+ * flush (unless iommu_dont_flush_iotlb is set), using superpages where
+ * the IOMMU supports them and the range is suitably aligned.  If mapping
+ * fails, the pages this call mapped are unmapped again; if unmapping fails,
+ * part of the range may have been unmapped already.
+ */
+int __must_check iommu_map_pages(struct domain *d, unsigned long gfn,
+                                 unsigned long mfn, unsigned int order,
+                                 unsigned int flags);
+int __must_check iommu_unmap_pages(struct domain *d, unsigned long gfn,
+                                   unsigned int order);
+
 enum iommu_feature
 {
     IOMMU_FEAT_COHERENT_WALK,
@@ -101,6 +116,14 @@ struct domain_iommu {
 
     /* Features supported by the IOMMU */
     DECLARE_BITMAP(features, IOMMU_FEAT_count);
+
+    /* Cost of building and tearing down the mappings, for diagnostics */
+    struct {
+        atomic_t mapped, unmapped;          /* 4k pages */
+        atomic_t superpages;                /* superpage entries written */
+        atomic_t flushes;                   /* IOTLB flushes issued */
+        uint64_t map_ns, unmap_ns;          /* in iommu_{,un}map_pages() */
+    } stats;
 };
 
 #define dom_iommu(d)              (&(d)->iommu)
@@ -171,6 +194,16 @@ struct iommu_ops {
     int __must_check (*map_page)(struct domain *d, unsigned long gfn,
                                  unsigned long mfn, unsigned int flags);
     int __must_check (*unmap_page)(struct domain *d, unsigned long gfn);
+    /*
+     * Optional, looping over map_page/unmap_page is used otherwise.
+     * map_pages sets *done to the number of pages mapped from gfn, which
+     * are unmapped again if it fails.
+     */
+    int __must_check (*map_pages)(struct domain *d, unsigned long gfn,
+                                  unsigned long mfn, unsigned int order,
+                                  unsigned int flags, unsigned long *done);
+    int __must_check (*unmap_pages)(struct domain *d, unsigned long gfn,
+                                    unsigned int order);
     void (*free_page_table)(struct page_info *);
 #ifdef CONFIG_X86
     void (*update_ire_from_apic)(unsigned int apic, unsigned int reg, unsigned int value);
@@ -224,4 +257,7 @@ DECLARE_PER_CPU(bool_t, iommu_dont_flush_iotlb);
 extern struct spinlock iommu_pt_cleanup_lock;
 extern struct page_list_head iommu_pt_cleanup_list;
 
+/* Hand page tables unhooked from a live domain to free_page_table(). */
+void iommu_queue_free_pgtables(struct page_list_head *tables);
+
 #endif /* _IOMMU_H_ */
@@ -542,6 +542,7 @@ static inline unsigned int get_order_from_pages(unsigned long nr_pages)
 }
 
 void scrub_one_page(struct page_info *);
+bool_t scrub_free_pages(void);
 
 #ifndef arch_free_heap_page
 #define arch_free_heap_page(d, pg)                      \
@@ -74,4 +74,12 @@ PERFCOUNTER(tickled_cpu_overridden, "csched2: tickled_cpu_overridden")
 
 PERFCOUNTER(need_flush_tlb_flush,   "PG_need_flush tlb flushes")
 
+PERFCOUNTER(pages_scrubbed_alloc,   "pages scrubbed on allocation")
+PERFCOUNTER(pages_scrubbed_idle,    "pages scrubbed when idle")
+PERFCOUNTER(page_cache_allocs,      "page cache allocations")
+PERFCOUNTER(page_cache_misses,      "page cache misses")
+PERFCOUNTER(page_cache_frees,       "page cache frees")
+PERFCOUNTER(page_cache_refills,     "page cache refills")
+PERFCOUNTER(page_cache_drained,     "pages drained from page caches")
+
 /*#endif*/ /* __XEN_PERFC_DEFN_H__ */
@@ -352,6 +352,9 @@ struct domain
     unsigned int     max_evtchns;     /* number supported by ABI */
     unsigned int     max_evtchn_port; /* max permitted port number */
     unsigned int     valid_evtchns;   /* number of allocated event channels */
+    unsigned long   *evtchn_inuse;    /* bitmap of ports not in ECS_FREE */
+    unsigned int     evtchn_inuse_size; /* bits in evtchn_inuse */
+    unsigned int     evtchn_first_free; /* no free ports below this one */
     spinlock_t       event_lock;
     const struct evtchn_port_ops *evtchn_port_ops;
     struct evtchn_fifo_domain *evtchn_fifo;